@@ -21,11 +21,15 @@
 //                CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
 //                INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES.
 
+#include <algorithm>
+#include <cmath>
 #include <cstring>
 #include <cstdlib>
 #include <string>
 #include <vector>
+#include <fstream>
 #include <iostream>
+#include <sstream>
 
 #include "ModuleInterface.h"
 #include "DeviceUtils.h"
@@ -35,6 +39,12 @@
 
 const char* g_PSUName = "BK9130B";
 
+const char* g_GroupName = "BK9130B Group";
+const char* g_GroupSupplyProperty = "Supply";	// "Supply 1", "Supply 2", ...
+const char* g_GroupSupply_None = "None";
+const char* g_GroupSkewProperty = "Inter-device skew (us)";
+const char* g_GroupDurationProperty = "Group write time (us)";
+
 const char* g_PSUDeviceIDProperty = "Device ID";
 
 const char* g_PSUTimeoutProperty = "Timeout (ms)";
@@ -44,6 +54,16 @@ const char* g_PSULock_None = "None";
 const char* g_PSULock_Shared = "Shared";
 const char* g_PSULock_Exclusive = "Exclusive";
 
+const char* g_PSUThreadCPUProperty = "I/O thread CPU";	// -1 = any
+const char* g_PSUThreadPriorityProperty = "I/O thread priority";	// 0 = normal
+const char* g_PSULockMemoryProperty = "Lock memory";
+const char* g_PSULockMemory_No = "No";
+const char* g_PSULockMemory_Yes = "Yes";
+
+const char* g_PSUClockProperty = "Clock";
+const char* g_PSUClock_System = "System";
+const char* g_PSUClock_Virtual = "Virtual";
+
 const char* g_PSUActiveChannelProperty = "Active Channel";
 const char* g_PSUActiveChannel_CH1 = "CH1";
 const char* g_PSUActiveChannel_CH2 = "CH2";
@@ -53,6 +73,314 @@ const char* g_PSUOutputVoltageProperty = "Output voltage (V)";
 
 const char* g_PSUOutputCurrentProperty = "Output current (A)";
 
+const char* g_PSUStateProperty = "State";
+
+const char* g_PSUPollIntervalProperty = "State poll interval (ms)";
+const char* g_PSUBurstIntervalProperty = "State poll burst interval (ms)";
+const char* g_PSUPollCountProperty = "State polls";
+const char* g_PSUPollSavedProperty = "State polls saved (%)";
+
+const char* g_PSUTelemetrySamplesProperty = "Telemetry samples";
+const char* g_PSUTelemetryRatioProperty = "Telemetry compression ratio";
+const char* g_PSUTelemetryFileProperty = "Telemetry file";
+const char* g_PSURippleWindowProperty = "Ripple window (polls)";
+
+const char* g_PSUScheduleProperty = "Schedule";
+const char* g_PSUScheduleStateProperty = "Schedule state";
+const char* g_PSUScheduleState_Stopped = "Stopped";
+const char* g_PSUScheduleState_Running = "Running";
+const char* g_PSUSchedulePendingProperty = "Schedule pending";
+const char* g_PSUScheduleErrorProperty = "Schedule mean timing error (us)";
+const char* g_PSUScheduleMaxErrorProperty = "Schedule max timing error (us)";
+const char* g_PSUScheduleLatencyProperty = "Schedule write latency (us)";
+
+const char* g_PSUExposureCalibrateProperty = "Exposure lock calibration cycles";
+const char* g_PSUExposureScheduleProperty = "Exposure schedule";
+const char* g_PSUExposureStatsProperties[] = {
+	"Exposure lock on delay (ms)", "Exposure lock off delay (ms)",
+	"Exposure lock delay jitter (ms)", "Exposure lock mean misalignment (us)",
+	"Exposure lock max misalignment (us)"
+};
+const long g_PSUExposureStatsCount = 5;
+
+const char* g_PSUFirePriorityProperty = "Fire thread priority";
+const char* g_PSUFireStatsProperties[] = {
+	"Fire pulses", "Fire failed pulses", "Fire mean width error (us)",
+	"Fire RMS width error (us)", "Fire max width error (us)",
+	"Fire write latency (us)"
+};
+const long g_PSUFireStatsCount = 6;
+
+const char* g_PSUInterleaveChannelsProperty = "Interleave channels";
+const char* g_PSUInterleaveDwellProperty = "Interleave dwell (ms)";
+const char* g_PSUInterleaveDeadProperty = "Interleave dead time (ms)";
+const char* g_PSUInterleaveCyclesProperty = "Interleave cycles";
+const char* g_PSUInterleaveStateProperty = "Interleave state";
+const char* g_PSUInterleaveRateProperties[] = {
+	"Interleave programmed rate (Hz)", "Interleave achieved rate (Hz)"
+};
+
+const char* g_PSUFaultProfileProperty = "Fault profile";
+const char* g_PSUIOStatsProperties[] = {
+	"I/O operations", "I/O faults injected", "I/O lost commands",
+	"I/O mean recovery time (ms)", "I/O max recovery time (ms)",
+	"I/O latency p50 (us)", "I/O latency p99 (us)", "I/O latency p99.9 (us)",
+	"I/O latency max (us)"
+};
+const long g_PSUIOStatsCount = 9;
+
+const char* g_PSUFlowControlProperty = "Flow control window (commands)";
+const char* g_PSUFlowStatsProperties[] = {
+	"Flow control current window", "Flow control syncs",
+	"Flow control overruns", "Flow control sustained rate (cmd/s)"
+};
+const long g_PSUFlowStatsCount = 4;
+
+// list mode (the SCPI LIST subsystem), every command applies to the channel
+// last selected with INST:SEL
+const char* g_PSUListSteps = "LIST:STEP";			// <count>
+const char* g_PSUListVoltage = "LIST:VOLT";			// <step>,<V>
+const char* g_PSUListCurrent = "LIST:CURR";			// <step>,<A>
+const char* g_PSUListDwell = "LIST:WID";			// <step>,<s>
+const char* g_PSUListCount = "LIST:COUN";			// <repeats>, 0 = forever
+const char* g_PSUListTrigger = "LIST:TRIG";			// STEP (a step per trigger) | LIST
+const char* g_PSUListState = "LIST:STAT";			// ON | OFF
+const char* g_PSUTriggerSource = "TRIG:SOUR";		// EXT | BUS
+
+// channel order used by the APPly? queries
+const char* g_PSUChannels[] = {
+	g_PSUActiveChannel_CH1, g_PSUActiveChannel_CH2, g_PSUActiveChannel_CH3
+};
+const std::size_t g_PSUChannelCount = BK9130B_CHANNEL_COUNT;
+
+// per-channel telemetry properties, prefixed with the channel name
+const char* g_PSUTelemetryProperties[] = {
+	"Output", "Measured voltage (V)", "Measured current (A)",
+	"Sample time (ms)", "Sample age (ms)"
+};
+const long g_PSUTelemetryCount = 5;
+
+// per-channel stability statistics over the ripple window, prefixed with the
+// channel name, voltage first then current
+const char* g_PSURippleProperties[] = {
+	"Voltage mean (V)", "Voltage noise (V RMS)", "Voltage ripple (V p-p)", "Voltage drift (V/s)",
+	"Current mean (A)", "Current noise (A RMS)", "Current ripple (A p-p)", "Current drift (A/s)"
+};
+const long g_PSURippleCount = 8;
+
+// per-channel status from service requests, prefixed with the channel name
+const char* g_PSUProtectionProperties[] = {"Regulation mode", "Protection tripped"};
+const long g_PSUProtectionCount = 2;
+
+/*----------------------------------------------------------------------------*/
+// name of telemetry property <field> of channel <channel>, e.g. "CH2 Output"
+static std::string telemetryName(std::size_t channel, long field)
+{
+	return std::string(g_PSUChannels[channel]) + " " + g_PSUTelemetryProperties[field];
+}
+/*----------------------------------------------------------------------------*/
+// "CV", "CC" or "Unknown" (before the first service request)
+static const char* regulationName(const BK9130BChannelState& st)
+{
+	return st.cv ? "CV" : (st.cc ? "CC" : "Unknown");
+}
+/*----------------------------------------------------------------------------*/
+// "None", "OVP", "OCP" or "OVP+OCP"
+static std::string protectionName(const BK9130BChannelState& st)
+{
+	if (st.ovp && st.ocp)
+	{
+		return "OVP+OCP";
+	}
+
+	return st.ovp ? "OVP" : (st.ocp ? "OCP" : "None");
+}
+/*----------------------------------------------------------------------------*/
+// index of <channel> in g_PSUChannels, -1 if unknown
+static int channelIndex(const std::string& channel)
+{
+	for (std::size_t k = 0; k < g_PSUChannelCount; ++k)
+	{
+		if (channel == g_PSUChannels[k])
+		{
+			return static_cast<int>(k);
+		}
+	}
+
+	return -1;
+}
+/*----------------------------------------------------------------------------*/
+// queries the range and OVP level of <channel> in one batch, any value that
+// can't be read keeps what <lim> had
+// NOTE: there is no OCP level to probe, the current setpoint *is* the limit
+// (the channel goes CC at it) and is already bounded by iMax; a query the
+// firmware doesn't know would also cost a full timeout per channel here
+static bool probeChannelLimits(VISADevice& dev, const std::string& channel, BK9130BLimits& lim)
+{
+	const char* fields[] = {
+		"SOUR:VOLT:LEV? MIN", "SOUR:VOLT:LEV? MAX",
+		"SOUR:CURR:LEV? MIN", "SOUR:CURR:LEV? MAX",
+		"SOUR:VOLT:PROT:LEV?"
+	};
+	const std::size_t nField = sizeof(fields) / sizeof(fields[0]);
+
+	// the channel select doesn't produce a reply, so it is written on its
+	// own and only the queries are batched
+	if (!dev.write("INST:SEL " + channel))
+	{
+		return false;
+	}
+
+	std::vector<std::string> replies = dev.queryBatch(std::vector<std::string>(fields, fields + nField));
+
+	double* dst[] = {&lim.vMin, &lim.vMax, &lim.iMin, &lim.iMax, &lim.ovp};
+
+	for (std::size_t k = 0; k < nField; ++k)
+	{
+		char* end = 0;
+		double val = strtod(replies[k].c_str(), &end);
+
+		if (end != replies[k].c_str())
+		{
+			*dst[k] = val;
+		}
+	}
+
+	return true;
+}
+/*----------------------------------------------------------------------------*/
+// checks a voltage ('V') or current ('A') request against <lim>
+static int checkRequest(const BK9130BLimits& lim, double value, char unit)
+{
+	if (unit == 'V')
+	{
+		if (value < lim.vMin || value > lim.vMax || (lim.ovp > 0 && value > lim.ovp))
+		{
+			return ERR_INVALID_VOLTAGE;
+		}
+	}
+	else if (value < lim.iMin || value > lim.iMax)
+	{
+		return ERR_INVALID_CURRENT;
+	}
+
+	return DEVICE_OK;
+}
+/*----------------------------------------------------------------------------*/
+// upper case short form of a SCPI header, e.g. ":SOURce:VOLTage:LEVel" ->
+// "VOLT:LEV", with the optional SOURce node dropped (only the nodes a
+// schedule is checked for are shortened, see BK9130B::checkScheduled())
+static std::string shortHeader(const std::string& header)
+{
+	const char* longForms[][2] = {
+		{"INSTRUMENT", "INST"}, {"SELECT", "SEL"}, {"NSELECT", "NSEL"},
+		{"SOURCE", "SOUR"}, {"VOLTAGE", "VOLT"}, {"CURRENT", "CURR"},
+		{"LEVEL", "LEV"}, {"IMMEDIATE", "IMM"}, {"APPLY", "APP"}
+	};
+	const std::size_t nForm = sizeof(longForms) / sizeof(longForms[0]);
+
+	std::string out;
+	std::istringstream in(header);
+	std::string node;
+
+	while (std::getline(in, node, ':'))
+	{
+		if (node.empty())
+		{
+			continue;
+		}
+
+		for (std::string::size_type k = 0; k < node.size(); ++k)
+		{
+			node[k] = static_cast<char>(toupper(static_cast<unsigned char>(node[k])));
+		}
+
+		for (std::size_t k = 0; k < nForm; ++k)
+		{
+			if (node == longForms[k][0])
+			{
+				node = longForms[k][1];
+				break;
+			}
+		}
+
+		if (out.empty() && node == "SOUR")
+		{
+			continue;
+		}
+
+		out += (out.empty() ? "" : ":") + node;
+	}
+
+	return out;
+}
+/*----------------------------------------------------------------------------*/
+// parses a SCPI numeric setpoint with an optional V / A suffix (or mV / mA),
+// false for anything else (MIN / MAX / DEF are left to the instrument and
+// reported as <keyword>)
+static bool parseSetpoint(const std::string& arg, double& value, bool& keyword)
+{
+	std::string::size_type first = arg.find_first_not_of(" \t");
+	std::string::size_type last = arg.find_last_not_of(" \t");
+
+	if (first == std::string::npos)
+	{
+		return false;
+	}
+
+	std::string str = arg.substr(first, last - first + 1);
+	std::string upper(str);
+
+	for (std::string::size_type k = 0; k < upper.size(); ++k)
+	{
+		upper[k] = static_cast<char>(toupper(static_cast<unsigned char>(upper[k])));
+	}
+
+	keyword = upper.compare(0, 3, "MIN") == 0 || upper.compare(0, 3, "MAX") == 0 ||
+		upper.compare(0, 3, "DEF") == 0;
+
+	if (keyword)
+	{
+		return true;
+	}
+
+	char* end = 0;
+	value = strtod(str.c_str(), &end);
+
+	if (end == str.c_str())
+	{
+		return false;
+	}
+
+	std::string suffix(upper.substr(end - str.c_str()));
+	suffix.erase(0, suffix.find_first_not_of(" \t"));
+
+	if (suffix == "MV" || suffix == "MA")
+	{
+		value *= 1e-3;
+	}
+	else if (!suffix.empty() && suffix != "V" && suffix != "A")
+	{
+		return false;
+	}
+
+	return true;
+}
+/*----------------------------------------------------------------------------*/
+// orders schedule entries by time, keeping the given order for equal times
+static bool scheduledEarlier(const std::pair<double, std::vector<std::string> >& a,
+	const std::pair<double, std::vector<std::string> >& b)
+{
+	return a.first < b.first;
+}
+/*----------------------------------------------------------------------------*/
+static std::string toString(double value)
+{
+	std::ostringstream out;
+	out << value;
+	return out.str();
+}
+
 /*------------------------------------------------------------------------------
   Exported MMDevice API
 ------------------------------------------------------------------------------*/
@@ -63,6 +391,7 @@ const char* g_PSUOutputCurrentProperty = "Output current (A)";
 MODULE_API void InitializeModuleData()
 {
    RegisterDevice(g_PSUName, BK9310B_DEVICE_TYPE, "BK Precision 9130B power supply");
+   RegisterDevice(g_GroupName, BK9310B_DEVICE_TYPE, "Group of BK Precision 9130B power supplies driven in sync");
 }
 /*----------------------------------------------------------------------------*/
 MODULE_API MM::Device* CreateDevice(const char* deviceName)
@@ -75,6 +404,10 @@ MODULE_API MM::Device* CreateDevice(const char* deviceName)
 		  // create BK9130B instance
 		  return new BK9130B();
 	   }
+	   else if (strcmp(deviceName, g_GroupName) == 0)
+	   {
+		  return new BK9130BGroup();
+	   }
    }
 
    // ...supplied name not recognized
@@ -94,27 +427,70 @@ BK9130B::BK9130B() :
 	initialized_(false),
 	busy_(false),
 	timeout_(2000),
+	registry_(VISARegistry::acquireShared(dev_, "?*")),
+	devID_(""),
+	lockMode_(VI_NO_LOCK),
+	connected_(false),
+	reconnectPending_(false),
+	presentChanged_(false),
+	watcher_(this),
+	stateGeneration_(0),
+	telemetry_(2 * BK9130B_CHANNEL_COUNT, 1024, BK9130B_TELEMETRY_BLOCKS),
+	history_(2 * BK9130B_CHANNEL_COUNT),
+	window_(2 * BK9130B_CHANNEL_COUNT, BK9130B_RIPPLE_WINDOW),
+	pollInterval_(1000),
+	burstInterval_(50),
+	monitor_(this),
+	scheduler_(dev_),
+	pulser_(dev_, BK9130B_CHANNEL_COUNT),
+	listRunning_(false),
+	interleaveStart_(0.0),
+	interleaveSwitches_(0.0),
+	interleaveRate_(0.0),
+	interleaveAchieved_(0.0),
+	dispatcher_(dev_),
+	pool_(0),
+	faultProfile_("None"),
 	activeChannel_(""),
 	activeChannelState_(false),
 	outputVoltage_(1.0),
 	outputCurrent_(0.0)
 {
+	for (std::size_t k = 0; k < g_PSUChannelCount; ++k)
+	{
+		listSteps_[k] = 0;
+		notifiedMeas_[2 * k] = notifiedMeas_[2 * k + 1] = 0.0;
+	}
+
 	// call the base class method to set-up default error codes/messages
 	InitializeDefaultErrorMessages();
 
-	SetErrorText(ERR_INVALID_CHANNEL, "Invalid channel given: MUST be 1 OR 2");
-	SetErrorText(ERR_INVALID_VOLTAGE, "Invalid voltage request: MUST be 0-30 V for CH1 & 2, *AND* 0-5 V for CH3");
-	SetErrorText(ERR_INVALID_CURRENT, "Invalid current request: MUST be 0-3 A");
+	SetErrorText(ERR_INVALID_CHANNEL, "Invalid channel given: MUST be CH1, CH2 OR CH3");
+	SetErrorText(ERR_INVALID_VOLTAGE, "Invalid voltage request: outside the active channel's range (or above its OVP level)");
+	SetErrorText(ERR_INVALID_CURRENT, "Invalid current request: outside the active channel's range");
 	SetErrorText(ERR_WRITE_FAILED, "Write operation failed!");
 	SetErrorText(ERR_READ_FAILED, "Read operation failed!");
 	SetErrorText(ERR_QUERY_FAILED, "Query operation failed!");
+	SetErrorText(ERR_DEVICE_TIMEOUT, "Device did not respond within the timeout set by \"Timeout (ms)\"");
+	SetErrorText(ERR_INVALID_SCHEDULE, "Invalid schedule: expected \"<time ms> <command>[;<command>...]\" entries separated by '|', with valid setpoints and no queries");
+	SetErrorText(ERR_TELEMETRY_FILE, "Failed to write the telemetry file");
+	SetErrorText(ERR_INVALID_EXPOSURE, "Invalid exposure schedule: expected \"<start ms>,<exposure ms>,<interval ms>,<count>\" with the interval no shorter than the exposure");
+	SetErrorText(ERR_CALIBRATION_FAILED, "Exposure lock calibration failed: the read back never changed with the output (is the output current / voltage set?)");
+	SetErrorText(ERR_CALIBRATION_UNRESOLVED, "Exposure lock calibration refused: the read back is slower than the output edge delay it would measure");
+	SetErrorText(ERR_CALIBRATION_TIMEOUT, "Exposure lock calibration took too long: use fewer cycles");
+	SetErrorText(ERR_PULSE_BUSY, "Fire failed: a pulse is already in progress (or the pulse thread is not running)");
+	SetErrorText(ERR_INVALID_SEQUENCE, "Invalid sequence: State values must be 0 or 1");
+	SetErrorText(ERR_INVALID_INTERLEAVE, "Invalid interleave: expected two or more distinct channels (e.g. \"CH1,CH2\") and no more list steps than the list memory holds");
+	SetErrorText(ERR_INVALID_FAULTS, "Invalid fault profile: expected a preset or \"<fault>=<probability>[:<ms>] ...\" (see VISAFaults.h)");
 
 	// Description property
 	int ret = CreateProperty(MM::g_Keyword_Description, "BK Precision 9130B power supply", MM::String, true);
 	assert(ret == DEVICE_OK);
 
-	// Device ID property
-	std::vector<std::string> devIDs = dev_.findInstruments("?*");
+	// Device ID property: the (shared) registry did one full scan when it was
+	// first acquired, after that it keeps the list current from hot-plug
+	// events (see onRegistryChange())
+	std::vector<std::string> devIDs = registry_.present();
 
 	std::string defID;
 
@@ -146,6 +522,8 @@ BK9130B::BK9130B() :
 		LogMessage("Failed to locate BK9130B!");
 	}
 
+	registry_.addListener(this);
+
 	// Timeout property
 	ret = CreateIntegerProperty(g_PSUTimeoutProperty, 2000, false, 0, true);
 	assert(ret == DEVICE_OK);
@@ -164,14 +542,68 @@ BK9130B::BK9130B() :
 
 	ret = SetAllowedValues(g_PSULockProperty, opts);
 	assert(ret == DEVICE_OK);
+
+	// real-time tuning of the watcher and scheduler threads, these usually
+	// need elevated privileges (failures are logged, the threads still run)
+	ret = CreateIntegerProperty(g_PSUThreadCPUProperty, -1, false, 0, true);
+	assert(ret == DEVICE_OK);
+
+	ret = SetPropertyLimits(g_PSUThreadCPUProperty, -1, 63);
+	assert(ret == DEVICE_OK);
+
+	ret = CreateIntegerProperty(g_PSUThreadPriorityProperty, 0, false, 0, true);
+	assert(ret == DEVICE_OK);
+
+	ret = SetPropertyLimits(g_PSUThreadPriorityProperty, 0, 99);
+	assert(ret == DEVICE_OK);
+
+	// Fire() pulses are timed by a thread of their own, on the same CPU as
+	// the others but (by default) at real-time priority
+	ret = CreateIntegerProperty(g_PSUFirePriorityProperty, 90, false, 0, true);
+	assert(ret == DEVICE_OK);
+
+	ret = SetPropertyLimits(g_PSUFirePriorityProperty, 0, 99);
+	assert(ret == DEVICE_OK);
+
+	ret = CreateProperty(g_PSULockMemoryProperty, g_PSULockMemory_No, MM::String, false, 0, true);
+	assert(ret == DEVICE_OK);
+
+	opts.clear();
+	opts.push_back(g_PSULockMemory_No);
+	opts.push_back(g_PSULockMemory_Yes);
+
+	ret = SetAllowedValues(g_PSULockMemoryProperty, opts);
+	assert(ret == DEVICE_OK);
+
+	// "Virtual" skips every sleep (query delay, scheduler and watcher waits,
+	// injected latency) instead of taking it, for faster than real time
+	// simulation, see VISAClock.h
+	ret = CreateProperty(g_PSUClockProperty, g_PSUClock_System, MM::String, false, 0, true);
+	assert(ret == DEVICE_OK);
+
+	opts.clear();
+	opts.push_back(g_PSUClock_System);
+	opts.push_back(g_PSUClock_Virtual);
+
+	ret = SetAllowedValues(g_PSUClockProperty, opts);
+	assert(ret == DEVICE_OK);
 }
 /*----------------------------------------------------------------------------*/
 BK9130B::~BK9130B()
 {
+	// make sure no registry callbacks arrive while we are being torn down
+	registry_.removeListener(this);
+
 	if (initialized_)
 	{
 		Shutdown();
 	}
+
+	// faults_ and virtualClock_ are destroyed before dev_
+	dev_.setIOHook(0);
+	dev_.setClock(0);
+
+	VISARegistry::releaseShared();
 }
 /*----------------------------------------------------------------------------*/
 int BK9130B::Initialize()
@@ -181,285 +613,3678 @@ int BK9130B::Initialize()
 		return DEVICE_OK;
 	}
 
-	// set up active channel property
-	CPropertyAction* pAct = new CPropertyAction(this, &BK9130B::OnActiveChannel);
-
-	int ret = CreateProperty(g_PSUActiveChannelProperty, g_PSUActiveChannel_CH1, MM::String, false, pAct, false);
-	assert(ret == DEVICE_OK);
+	// defaults until the instrument tells us otherwise, unlike CH1 and 2, CH3
+	// has a 5V limit...
+	limits_.clear();
+	limits_[g_PSUActiveChannel_CH1] = BK9130BLimits(30.0, 3.0);
+	limits_[g_PSUActiveChannel_CH2] = BK9130BLimits(30.0, 3.0);
+	limits_[g_PSUActiveChannel_CH3] = BK9130BLimits(5.0, 3.0);
 
+	int ret = DEVICE_OK;
 	std::vector<std::string> opts;
-	opts.push_back(g_PSUActiveChannel_CH1);
-	opts.push_back(g_PSUActiveChannel_CH2);
-	opts.push_back(g_PSUActiveChannel_CH3);
 
-	ret = SetAllowedValues(g_PSUActiveChannelProperty, opts);
-	assert(ret == DEVICE_OK);
+	// a failed Initialize can be retried (as can one after Shutdown), the
+	// properties are only created the first time around
+	if (!HasProperty(g_PSUActiveChannelProperty))
+	{
+		// set up active channel property
+		CPropertyAction* pAct = new CPropertyAction(this, &BK9130B::OnActiveChannel);
 
-	// set up output voltage property
-	pAct = new CPropertyAction(this, &BK9130B::OnOutputVoltage);
+		ret = CreateProperty(g_PSUActiveChannelProperty, g_PSUActiveChannel_CH1, MM::String, false, pAct, false);
+		assert(ret == DEVICE_OK);
 
-	ret = CreateFloatProperty(g_PSUOutputVoltageProperty, 1.0, false, pAct, false);
-	assert(ret == DEVICE_OK);
+		opts.push_back(g_PSUActiveChannel_CH1);
+		opts.push_back(g_PSUActiveChannel_CH2);
+		opts.push_back(g_PSUActiveChannel_CH3);
 
-	ret = SetPropertyLimits(g_PSUOutputVoltageProperty, 0.0, 30.0);
-	assert(ret == DEVICE_OK);
+		ret = SetAllowedValues(g_PSUActiveChannelProperty, opts);
+		assert(ret == DEVICE_OK);
 
-	// set up output current property
-	pAct = new CPropertyAction (this, &BK9130B::OnOutputCurrent);
+		// set up output voltage property
+		pAct = new CPropertyAction(this, &BK9130B::OnOutputVoltage);
 
-	ret = CreateFloatProperty(g_PSUOutputCurrentProperty, 0.0, false, pAct, false);
-	assert(ret == DEVICE_OK);
+		ret = CreateFloatProperty(g_PSUOutputVoltageProperty, 1.0, false, pAct, false);
+		assert(ret == DEVICE_OK);
 
-	ret = SetPropertyLimits(g_PSUOutputCurrentProperty, 0.0, 3.0);
-	assert(ret == DEVICE_OK);
+		ret = SetPropertyLimits(g_PSUOutputVoltageProperty, 0.0, 30.0);
+		assert(ret == DEVICE_OK);
 
-	// get device id
-	char idBuf[MM::MaxStrLength];
+		// set up output current property
+		pAct = new CPropertyAction (this, &BK9130B::OnOutputCurrent);
 
-	ret = GetProperty(g_PSUDeviceIDProperty, idBuf);
-	assert(ret == DEVICE_OK);
+		ret = CreateFloatProperty(g_PSUOutputCurrentProperty, 0.0, false, pAct, false);
+		assert(ret == DEVICE_OK);
 
-	idBuf[MM::MaxStrLength-1] = '\0';
+		ret = SetPropertyLimits(g_PSUOutputCurrentProperty, 0.0, 3.0);
+		assert(ret == DEVICE_OK);
 
-	std::string devID(idBuf);
+		// set up shutter state property (output state of the active channel)
+		pAct = new CPropertyAction(this, &BK9130B::OnState);
 
-	// get device timeout
-	ret = GetProperty(g_PSUDeviceIDProperty, timeout_);
+		ret = CreateIntegerProperty(g_PSUStateProperty, 0, false, pAct, false);
+		assert(ret == DEVICE_OK);
 
-	// get device lock mode
-	char lockBuf[MM::MaxStrLength];
-	ret = GetProperty(g_PSULockProperty, lockBuf);
-	assert(ret == DEVICE_OK);
+		ret = SetPropertyLimits(g_PSUStateProperty, 0, 1);
+		assert(ret == DEVICE_OK);
 
-	lockBuf[MM::MaxStrLength-1] = '\0';
+		// set up watcher poll interval property, 0 disables the watcher (and
+		// every property get goes to the instrument instead)
+		pAct = new CPropertyAction(this, &BK9130B::OnPollInterval);
 
-	std::string lockStr(lockBuf);
+		ret = CreateIntegerProperty(g_PSUPollIntervalProperty, pollInterval_, false, pAct, false);
+		assert(ret == DEVICE_OK);
 
-	ViAccessMode lockMode;
+		ret = SetPropertyLimits(g_PSUPollIntervalProperty, 0, 60000);
+		assert(ret == DEVICE_OK);
 
-	if (lockStr == "None")
-	{
-		lockMode = VI_NO_LOCK;
-	}
-	else if (lockStr == "Shared")
-	{
-		lockMode = VI_SHARED_LOCK;
-	}
-	else if (lockStr == "Exclusive")
-	{
-		lockMode = VI_EXCLUSIVE_LOCK;
-	}
+		// after a command or a detected change the watcher polls at the burst
+		// interval, backing off to the poll interval while things are stable
+		pAct = new CPropertyAction(this, &BK9130B::OnBurstInterval);
 
-	// open the device
-	initialized_ = dev_.open(devID, lockMode, static_cast<ViUInt32>(timeout_));
+		ret = CreateIntegerProperty(g_PSUBurstIntervalProperty, burstInterval_, false, pAct, false);
+		assert(ret == DEVICE_OK);
 
-	if (initialized_)
-	{
-		// register a clean up command that will be called on device close
-		opts.clear();
-		opts.push_back("INST:SEL CH1");
-		opts.push_back("SOUR:CHAN:OUTP:STAT OFF");
-		opts.push_back("INST:SEL CH2");
-		opts.push_back("SOUR:CHAN:OUTP:STAT OFF");
-		opts.push_back("INST:SEL CH3");
-		opts.push_back("SOUR:CHAN:OUTP:STAT OFF");
+		ret = SetPropertyLimits(g_PSUBurstIntervalProperty, 10, 60000);
+		assert(ret == DEVICE_OK);
 
-		dev_.onClose(opts);
+		const char* pollNames[] = {g_PSUPollCountProperty, g_PSUPollSavedProperty};
+
+		for (long k = 0; k < 2; ++k)
+		{
+			CPropertyActionEx* pActEx = new CPropertyActionEx(this, &BK9130B::OnPollStats, k);
+
+			ret = CreateFloatProperty(pollNames[k], 0.0, true, pActEx, false);
+			assert(ret == DEVICE_OK);
+		}
+
+		// measured voltage / current of every poll is kept in a compressed store,
+		// setting "Telemetry file" writes it out (see VISATelemetry.h)
+		const char* telemetryNames[] = {g_PSUTelemetrySamplesProperty, g_PSUTelemetryRatioProperty};
+
+		for (long k = 0; k < 2; ++k)
+		{
+			CPropertyActionEx* pActEx = new CPropertyActionEx(this, &BK9130B::OnTelemetryStats, k);
+
+			ret = CreateFloatProperty(telemetryNames[k], 0.0, true, pActEx, false);
+			assert(ret == DEVICE_OK);
+		}
+
+		pAct = new CPropertyAction(this, &BK9130B::OnTelemetryFile);
+
+		ret = CreateStringProperty(g_PSUTelemetryFileProperty, "", false, pAct, false);
+		assert(ret == DEVICE_OK);
+
+		// the last N polls are also kept raw for the per-channel ripple / noise
+		// statistics, changing N starts the window over
+		pAct = new CPropertyAction(this, &BK9130B::OnRippleWindow);
+
+		ret = CreateIntegerProperty(g_PSURippleWindowProperty, BK9130B_RIPPLE_WINDOW, false, pAct, false);
+		assert(ret == DEVICE_OK);
+
+		ret = SetPropertyLimits(g_PSURippleWindowProperty, 2, 65536);
+		assert(ret == DEVICE_OK);
+
+		// set up command schedule properties: entries are added by setting
+		// "Schedule", times are relative to when "Schedule state" was set to
+		// "Running"
+		pAct = new CPropertyAction(this, &BK9130B::OnSchedule);
+
+		ret = CreateStringProperty(g_PSUScheduleProperty, "", false, pAct, false);
+		assert(ret == DEVICE_OK);
+
+		pAct = new CPropertyAction(this, &BK9130B::OnScheduleState);
+
+		ret = CreateStringProperty(g_PSUScheduleStateProperty, g_PSUScheduleState_Stopped, false, pAct, false);
+		assert(ret == DEVICE_OK);
 
-		// setup default values
 		opts.clear();
-		opts.push_back("INST:SEL CH1");
-		opts.push_back("SOUR:CHAN:OUTP:STAT OFF");
-		opts.push_back("SOUR:VOLT 1.0 V");
-		opts.push_back("SOUR:CURR 0.0 A");
-		dev_.write(opts);
-	}
-	else
-	{
-		LogMessage(dev_.getLastError());
-	}
+		opts.push_back(g_PSUScheduleState_Stopped);
+		opts.push_back(g_PSUScheduleState_Running);
 
-	return initialized_ ? DEVICE_OK : DEVICE_ERR;
-}
-/*----------------------------------------------------------------------------*/
-int BK9130B::Shutdown()
-{
-	int ret = DEVICE_OK;
+		ret = SetAllowedValues(g_PSUScheduleStateProperty, opts);
+		assert(ret == DEVICE_OK);
 
-	if (initialized_)
-	{
-		if (!dev_.close())
+		const char* statNames[] = {
+			g_PSUSchedulePendingProperty, g_PSUScheduleErrorProperty,
+			g_PSUScheduleMaxErrorProperty, g_PSUScheduleLatencyProperty
+		};
+
+		for (long k = 0; k < 4; ++k)
 		{
-			LogMessage(dev_.getLastError());
-			ret = DEVICE_ERR;
+			CPropertyActionEx* pActEx = new CPropertyActionEx(this, &BK9130B::OnScheduleStats, k);
+
+			ret = CreateFloatProperty(statNames[k], 0.0, true, pActEx, false);
+			assert(ret == DEVICE_OK);
 		}
 
-		initialized_ = false;
-	}
+		// exposure lock: calibration learns the delay from each output write to
+		// the read back actually changing, an exposure schedule is then turned
+		// into on / off entries issued that much early (see VISAExposure.h)
+		pAct = new CPropertyAction(this, &BK9130B::OnExposureCalibrate);
 
-	return ret;
-}
-/*----------------------------------------------------------------------------*/
+		ret = CreateIntegerProperty(g_PSUExposureCalibrateProperty, 0, false, pAct, false);
+		assert(ret == DEVICE_OK);
+
+		ret = SetPropertyLimits(g_PSUExposureCalibrateProperty, 0, 100);
+		assert(ret == DEVICE_OK);
+
+		pAct = new CPropertyAction(this, &BK9130B::OnExposureSchedule);
+
+		ret = CreateStringProperty(g_PSUExposureScheduleProperty, "", false, pAct, false);
+		assert(ret == DEVICE_OK);
+
+		for (long k = 0; k < g_PSUExposureStatsCount; ++k)
+		{
+			CPropertyActionEx* pActEx = new CPropertyActionEx(this, &BK9130B::OnExposureStats, k);
+
+			ret = CreateFloatProperty(g_PSUExposureStatsProperties[k], 0.0, true, pActEx, false);
+			assert(ret == DEVICE_OK);
+		}
+
+		for (long k = 0; k < g_PSUFireStatsCount; ++k)
+		{
+			CPropertyActionEx* pActEx = new CPropertyActionEx(this, &BK9130B::OnFireStats, k);
+
+			ret = CreateFloatProperty(g_PSUFireStatsProperties[k], 0.0, true, pActEx, false);
+			assert(ret == DEVICE_OK);
+		}
+
+#ifdef BK9130B_LIST_SEQUENCING
+		// interleaved excitation: complementary lists on the given channels, each
+		// on for the dwell in turn with all off for the dead time in between,
+		// run on the instrument from a single trigger (uses the same unverified
+		// list commands as State sequencing, see BK9130B.h)
+		ret = CreateStringProperty(g_PSUInterleaveChannelsProperty, "CH1,CH2", false, 0, false);
+		assert(ret == DEVICE_OK);
+
+		ret = CreateFloatProperty(g_PSUInterleaveDwellProperty, 10.0, false, 0, false);
+		assert(ret == DEVICE_OK);
+
+		ret = SetPropertyLimits(g_PSUInterleaveDwellProperty, 1.0, 10000.0);
+		assert(ret == DEVICE_OK);
+
+		ret = CreateFloatProperty(g_PSUInterleaveDeadProperty, 0.0, false, 0, false);
+		assert(ret == DEVICE_OK);
+
+		ret = SetPropertyLimits(g_PSUInterleaveDeadProperty, 0.0, 10000.0);
+		assert(ret == DEVICE_OK);
+
+		ret = CreateIntegerProperty(g_PSUInterleaveCyclesProperty, 100, false, 0, false);
+		assert(ret == DEVICE_OK);
+
+		ret = SetPropertyLimits(g_PSUInterleaveCyclesProperty, 1, 65535);
+		assert(ret == DEVICE_OK);
+
+		pAct = new CPropertyAction(this, &BK9130B::OnInterleaveState);
+
+		ret = CreateStringProperty(g_PSUInterleaveStateProperty, g_PSUScheduleState_Stopped, false, pAct, false);
+		assert(ret == DEVICE_OK);
+
+		opts.clear();
+		opts.push_back(g_PSUScheduleState_Stopped);
+		opts.push_back(g_PSUScheduleState_Running);
+
+		ret = SetAllowedValues(g_PSUInterleaveStateProperty, opts);
+		assert(ret == DEVICE_OK);
+
+		for (long k = 0; k < 2; ++k)
+		{
+			CPropertyActionEx* pActEx = new CPropertyActionEx(this, &BK9130B::OnInterleaveRate, k);
+
+			ret = CreateFloatProperty(g_PSUInterleaveRateProperties[k], 0.0, true, pActEx, false);
+			assert(ret == DEVICE_OK);
+		}
+#endif
+
+		// set up fault injection: a preset name or an explicit profile (no allowed
+		// values, as those would reject the latter), applied at the VISA call
+		// boundary so that the real recovery paths run (see VISAFaults.h)
+		pAct = new CPropertyAction(this, &BK9130B::OnFaultProfile);
+
+		ret = CreateStringProperty(g_PSUFaultProfileProperty, "None", false, pAct, false);
+		assert(ret == DEVICE_OK);
+
+		for (long k = 0; k < g_PSUIOStatsCount; ++k)
+		{
+			CPropertyActionEx* pActEx = new CPropertyActionEx(this, &BK9130B::OnIOStats, k);
+
+			ret = CreateFloatProperty(g_PSUIOStatsProperties[k], 0.0, true, pActEx, false);
+			assert(ret == DEVICE_OK);
+		}
+
+		// flow control: at most N commands in flight before a *ESR? sync, the
+		// window adapts to what the supply sustains (0 keeps the fixed query
+		// delay, see VISADevice.h)
+		pAct = new CPropertyAction(this, &BK9130B::OnFlowControl);
+
+		ret = CreateIntegerProperty(g_PSUFlowControlProperty, 0, false, pAct, false);
+		assert(ret == DEVICE_OK);
+
+		ret = SetPropertyLimits(g_PSUFlowControlProperty, 0, 256);
+		assert(ret == DEVICE_OK);
+
+		for (long k = 0; k < g_PSUFlowStatsCount; ++k)
+		{
+			CPropertyActionEx* pActEx = new CPropertyActionEx(this, &BK9130B::OnFlowStats, k);
+
+			ret = CreateFloatProperty(g_PSUFlowStatsProperties[k], 0.0, true, pActEx, false);
+			assert(ret == DEVICE_OK);
+		}
+	}
+
+	faults_.setProfile(VISAFaultProfile());
+	faults_.resetStats();
+	dev_.setIOHook(&faults_);
+
+	// get device id
+	char idBuf[MM::MaxStrLength];
+
+	ret = GetProperty(g_PSUDeviceIDProperty, idBuf);
+	assert(ret == DEVICE_OK);
+
+	idBuf[MM::MaxStrLength-1] = '\0';
+
+	std::string devID(idBuf);
+
+	// get device timeout, this is used both to open the device and as the
+	// deadline for every read / write
+	ret = GetProperty(g_PSUTimeoutProperty, timeout_);
+	assert(ret == DEVICE_OK);
+
+	// get device lock mode
+	char lockBuf[MM::MaxStrLength];
+	ret = GetProperty(g_PSULockProperty, lockBuf);
+	assert(ret == DEVICE_OK);
+
+	lockBuf[MM::MaxStrLength-1] = '\0';
+
+	std::string lockStr(lockBuf);
+
+	ViAccessMode lockMode = VI_NO_LOCK;
+
+	if (lockStr == "None")
+	{
+		lockMode = VI_NO_LOCK;
+	}
+	else if (lockStr == "Shared")
+	{
+		lockMode = VI_SHARED_LOCK;
+	}
+	else if (lockStr == "Exclusive")
+	{
+		lockMode = VI_EXCLUSIVE_LOCK;
+	}
+
+	// get thread tuning
+	long cpu = -1, priority = 0;
+
+	ret = GetProperty(g_PSUThreadCPUProperty, cpu);
+	assert(ret == DEVICE_OK);
+
+	ret = GetProperty(g_PSUThreadPriorityProperty, priority);
+	assert(ret == DEVICE_OK);
+
+	threadConfig_.cpu = static_cast<int>(cpu);
+	threadConfig_.priority = static_cast<int>(priority);
+
+	long firePriority = 0;
+	ret = GetProperty(g_PSUFirePriorityProperty, firePriority);
+	assert(ret == DEVICE_OK);
+
+	char memBuf[MM::MaxStrLength];
+	ret = GetProperty(g_PSULockMemoryProperty, memBuf);
+	assert(ret == DEVICE_OK);
+
+	memBuf[MM::MaxStrLength-1] = '\0';
+
+	if (std::string(memBuf) == g_PSULockMemory_Yes)
+	{
+		std::string err;
+		if (!VISAWorker::lockMemory(err))
+		{
+			LogMessage(err);
+		}
+	}
+
+	// get the clock everything on the I/O path runs on
+	char clockBuf[MM::MaxStrLength];
+	ret = GetProperty(g_PSUClockProperty, clockBuf);
+	assert(ret == DEVICE_OK);
+
+	clockBuf[MM::MaxStrLength-1] = '\0';
+
+	VISAClock* clock = 0;
+	if (std::string(clockBuf) == g_PSUClock_Virtual)
+	{
+		clock = &virtualClock_;
+	}
+
+	dev_.setClock(clock);
+	faults_.setClock(clock);
+	watcher_.setClock(clock);
+	scheduler_.setClock(clock);
+	scheduler_.setListener(this);
+	pulser_.setClock(clock);
+
+	// open the device
+	initialized_ = dev_.open(devID, lockMode, static_cast<ViUInt32>(timeout_));
+
+	{
+		// remember how we opened the device so we can reopen it if it is
+		// unplugged and plugged back in
+		visa_compat::lock_guard<visa_compat::mutex> lock(registryMutex_);
+		devID_ = devID;
+		lockMode_ = lockMode;
+		connected_ = initialized_;
+		reconnectPending_ = false;
+	}
+
+	if (initialized_)
+	{
+		// register a clean up command that will be called on device close
+		opts.clear();
+		opts.push_back("INST:SEL CH1");
+		opts.push_back("SOUR:CHAN:OUTP:STAT OFF");
+		opts.push_back("INST:SEL CH2");
+		opts.push_back("SOUR:CHAN:OUTP:STAT OFF");
+		opts.push_back("INST:SEL CH3");
+		opts.push_back("SOUR:CHAN:OUTP:STAT OFF");
+
+		dev_.onClose(opts);
+
+		// no allocation (or page faults) on the I/O path for normal replies
+		dev_.reserveBuffers(0x00000400);
+
+		// find out what the instrument can actually do, so that requests
+		// can be validated without talking to it
+		probeLimits();
+
+		// setup default values
+		opts.clear();
+		opts.push_back("INST:SEL CH1");
+		opts.push_back("SOUR:CHAN:OUTP:STAT OFF");
+		opts.push_back("SOUR:VOLT 1.0 V");
+		opts.push_back("SOUR:CURR 0.0 A");
+		dev_.write(opts);
+
+		{
+			visa_compat::lock_guard<visa_compat::mutex> lock(stateMutex_);
+
+			activeChannel_ = g_PSUActiveChannel_CH1;
+			activeChannelState_ = false;
+			outputVoltage_ = 1.0;
+			outputCurrent_ = 0.0;
+
+			state_.clear();
+			state_[activeChannel_].voltage = outputVoltage_;
+			state_[activeChannel_].current = outputCurrent_;
+			state_[activeChannel_].updated = GetCurrentMMTime().getMsec();
+
+			publishSnapshot();
+		}
+
+		if (!HasProperty(telemetryName(0, 0).c_str()))
+		{
+			// per-channel telemetry, served from the snapshot
+			for (std::size_t k = 0; k < g_PSUChannelCount; ++k)
+			{
+				for (long j = 0; j < g_PSUTelemetryCount; ++j)
+				{
+					CPropertyActionEx* pActEx = new CPropertyActionEx(this, &BK9130B::OnTelemetry, static_cast<long>(k) * g_PSUTelemetryCount + j);
+
+					ret = CreateFloatProperty(telemetryName(k, j).c_str(), 0.0, true, pActEx, false);
+					assert(ret == DEVICE_OK);
+				}
+			}
+
+			// per-channel ripple / noise / drift, computed from the window
+			for (std::size_t k = 0; k < g_PSUChannelCount; ++k)
+			{
+				for (long j = 0; j < g_PSURippleCount; ++j)
+				{
+					CPropertyActionEx* pActEx = new CPropertyActionEx(this, &BK9130B::OnRipple, static_cast<long>(k) * g_PSURippleCount + j);
+
+					std::string name = std::string(g_PSUChannels[k]) + " " + g_PSURippleProperties[j];
+
+					ret = CreateFloatProperty(name.c_str(), 0.0, true, pActEx, false);
+					assert(ret == DEVICE_OK);
+				}
+			}
+
+			// per-channel CV / CC mode and protection trips, pushed by the
+			// protection monitor
+			for (std::size_t k = 0; k < g_PSUChannelCount; ++k)
+			{
+				for (long j = 0; j < g_PSUProtectionCount; ++j)
+				{
+					CPropertyActionEx* pActEx = new CPropertyActionEx(this, &BK9130B::OnProtection, static_cast<long>(k) * g_PSUProtectionCount + j);
+
+					std::string name = std::string(g_PSUChannels[k]) + " " + g_PSUProtectionProperties[j];
+
+					ret = CreateStringProperty(name.c_str(), j == 0 ? "Unknown" : "None", true, pActEx, false);
+					assert(ret == DEVICE_OK);
+				}
+			}
+		}
+
+		applyLimits();
+
+		// property handlers (on any core thread) queue their commands on
+		// the device's strand, run by the I/O pool every supply shares
+		if (pool_ == 0)
+		{
+			pool_ = &VISAIOPool::acquireShared(threadConfig_);
+
+			std::string err = pool_->getConfigError();
+			if (!err.empty())
+			{
+				LogMessage("I/O pool thread: " + err);
+			}
+		}
+
+		dispatcher_.attach(*pool_);
+
+		// the on / off command of every channel is rendered once, so a pulse
+		// copies nothing on its way out
+		for (std::size_t k = 0; k < g_PSUChannelCount; ++k)
+		{
+			std::string sel = "INST:SEL " + std::string(g_PSUChannels[k]) + dev_.getCmdSeperator();
+			pulser_.setCommands(k, sel + "SOUR:CHAN:OUTP:STAT ON", sel + "SOUR:CHAN:OUTP:STAT OFF");
+		}
+
+		VISAThreadConfig fireConfig = threadConfig_;
+		fireConfig.priority = static_cast<int>(firePriority);
+
+		pulser_.setConfig(fireConfig);
+		pulser_.start();
+
+		std::string fireErr = pulser_.getConfigError();
+		if (!fireErr.empty())
+		{
+			LogMessage("Fire thread: " + fireErr);
+		}
+
+		// protection trips and CV / CC changes arrive as service requests,
+		// so they are seen at once rather than at the next poll
+		if (enableServiceRequests())
+		{
+			startThread(monitor_, "Protection monitor");
+		}
+		else
+		{
+			LogMessage("Service requests unavailable, protection trips are only seen by polling: " + dev_.getLastError());
+		}
+
+		if (pollInterval_ > 0)
+		{
+			watcher_.setBurstInterval(burstInterval_);
+			watcher_.setInterval(pollInterval_);
+			startThread(watcher_, "State watcher");
+		}
+	}
+	else
+	{
+		LogMessage(dev_.getLastError());
+	}
+
+	return initialized_ ? DEVICE_OK : DEVICE_ERR;
+}
+/*----------------------------------------------------------------------------*/
+int BK9130B::Shutdown()
+{
+	int ret = DEVICE_OK;
+
+	// stop the background threads before the device goes away underneath them
+	// (a pulse in flight is ended at once)
+	pulser_.stop();
+	scheduler_.stop();
+	scheduler_.clear();
+	monitor_.stop();
+	watcher_.stop();
+	dispatcher_.detach();
+
+	if (pool_ != 0)
+	{
+		VISAIOPool::releaseShared();
+		pool_ = 0;
+	}
+
+	if (initialized_)
+	{
+		if (listRunning_)
+		{
+			stopLists();
+		}
+
+		for (std::size_t k = 0; k < g_PSUChannelCount; ++k)
+		{
+			listSteps_[k] = 0;
+		}
+
+		dev_.disableServiceRequest();
+
+		if (!dev_.close())
+		{
+			LogMessage(dev_.getLastError());
+			ret = DEVICE_ERR;
+		}
+
+		initialized_ = false;
+	}
+
+	return ret;
+}
+/*----------------------------------------------------------------------------*/
 bool BK9130B::Busy()
+{
+	return pulser_.isBusy();
+}
+/*----------------------------------------------------------------------------*/
+void BK9130B::GetName(char* name) const
+{
+   CDeviceUtils::CopyLimitedString(name, g_PSUName);
+}
+/*----------------------------------------------------------------------------*/
+MM::DeviceType BK9130B::GetType() const
+{
+	return BK9310B_DEVICE_TYPE;
+}
+/*----------------------------------------------------------------------------*/
+std::string BK9130B::doubleToStr(const double& val, const char& unit) const
+{
+	// 128 chars *SHOULD* be safe...
+	char buf[128];
+	sprintf(buf, "%f %c", val, unit);
+	buf[127] = '\0';
+	return std::string(buf);
+}
+/*----------------------------------------------------------------------------*/
+// logs the last device error and returns the error code to report: timeouts
+// get their own code (the device has already been cleared by VISADevice), all
+// other failures are reported as <code>
+int BK9130B::ioError(int code)
+{
+	if (dev_.timedOut())
+	{
+		code = ERR_DEVICE_TIMEOUT;
+	}
+
+	LogMessage(dev_.getLastError());
+
+	return code;
+}
+/*----------------------------------------------------------------------------*/
+// queries the range and OVP level of every channel (once, on Initialize),
+// any value that can't be read keeps its default
+void BK9130B::probeLimits()
+{
+	std::map<std::string, BK9130BLimits>::iterator it;
+	for (it = limits_.begin(); it != limits_.end(); ++it)
+	{
+		if (!probeChannelLimits(dev_, it->first, it->second))
+		{
+			LogMessage("Limit probe failed: " + dev_.getLastError());
+			return;
+		}
+
+		std::ostringstream msg;
+		msg << "Limits for " << it->first << ": " << it->second.vMin << "-"
+			<< it->second.vMax << " V, " << it->second.iMin << "-"
+			<< it->second.iMax << " A, OVP " << it->second.ovp << " V";
+		LogMessage(msg.str());
+	}
+}
+/*----------------------------------------------------------------------------*/
+// the watcher moves activeChannel_ to follow the front panel, so anything
+// that uses it outside stateMutex_ works on a copy
+std::string BK9130B::getActiveChannel() const
+{
+	visa_compat::lock_guard<visa_compat::mutex> lock(stateMutex_);
+	return activeChannel_;
+}
+/*----------------------------------------------------------------------------*/
+// sets the voltage / current property limits to those of the active channel
+int BK9130B::applyLimits()
+{
+	std::map<std::string, BK9130BLimits>::const_iterator it =
+		limits_.find(getActiveChannel());
+
+	if (it == limits_.end())
+	{
+		return ERR_INVALID_CHANNEL;
+	}
+
+	int ret = SetPropertyLimits(g_PSUOutputVoltageProperty, it->second.vMin, it->second.vMax);
+
+	if (ret == DEVICE_OK)
+	{
+		ret = SetPropertyLimits(g_PSUOutputCurrentProperty, it->second.iMin, it->second.iMax);
+	}
+
+	return ret;
+}
+/*----------------------------------------------------------------------------*/
+// checks a voltage ('V') or current ('A') request against the cached limits of
+// <channel>, no bus traffic involved
+int BK9130B::checkLimits(const std::string& channel, double value, const char& unit) const
+{
+	std::map<std::string, BK9130BLimits>::const_iterator it =
+		limits_.find(channel);
+
+	if (it == limits_.end())
+	{
+		return ERR_INVALID_CHANNEL;
+	}
+
+	return checkRequest(it->second, value, unit);
+}
+/*----------------------------------------------------------------------------*/
+// checks one raw schedule command: channel selects must name a channel (and
+// move <channel> along), voltage / current setpoints (SOUR:VOLT, APP:CURR,
+// ...) must be within the limits of the channel(s) they apply to, and
+// queries are refused as nothing would read their reply; anything else is
+// passed through as is
+int BK9130B::checkScheduled(const std::string& cmd, std::string& channel) const
+{
+	std::string::size_type sep = cmd.find_first_of(" \t");
+	std::string header = shortHeader(cmd.substr(0, sep));
+	std::string arg = sep == std::string::npos ? "" : cmd.substr(sep + 1);
+
+	if (cmd.find('?') != std::string::npos)
+	{
+		return ERR_INVALID_SCHEDULE;
+	}
+
+	if (header == "INST" || header == "INST:SEL" || header == "INST:NSEL")
+	{
+		std::string::size_type first = arg.find_first_not_of(" \t");
+		std::string::size_type last = arg.find_last_not_of(" \t");
+		std::string name = first == std::string::npos ? "" : arg.substr(first, last - first + 1);
+
+		if (header == "INST:NSEL")
+		{
+			name = "CH" + name;
+		}
+
+		for (std::string::size_type k = 0; k < name.size(); ++k)
+		{
+			name[k] = static_cast<char>(toupper(static_cast<unsigned char>(name[k])));
+		}
+
+		if (channelIndex(name) < 0)
+		{
+			return ERR_INVALID_CHANNEL;
+		}
+
+		channel = name;
+		return DEVICE_OK;
+	}
+
+	char unit = 0;
+	if (header == "VOLT" || header == "VOLT:LEV" || header == "VOLT:LEV:IMM" || header == "VOLT:IMM")
+	{
+		unit = 'V';
+	}
+	else if (header == "CURR" || header == "CURR:LEV" || header == "CURR:LEV:IMM" || header == "CURR:IMM")
+	{
+		unit = 'A';
+	}
+
+	if (unit != 0)
+	{
+		std::map<std::string, BK9130BLimits>::const_iterator it = limits_.find(channel);
+		double value = 0.0;
+		bool keyword = false;
+
+		if (it == limits_.end())
+		{
+			return ERR_INVALID_CHANNEL;
+		}
+
+		if (!parseSetpoint(arg, value, keyword))
+		{
+			return ERR_INVALID_SCHEDULE;
+		}
+
+		return keyword ? DEVICE_OK : checkRequest(it->second, value, unit);
+	}
+
+	if (header == "APP:VOLT" || header == "APP:CURR")
+	{
+		// one value per channel, in channel order
+		unit = header == "APP:VOLT" ? 'V' : 'A';
+
+		std::istringstream in(arg);
+		std::string field;
+		std::size_t k = 0;
+
+		for (; std::getline(in, field, ','); ++k)
+		{
+			double value = 0.0;
+			bool keyword = false;
+
+			if (k >= g_PSUChannelCount || !parseSetpoint(field, value, keyword))
+			{
+				return ERR_INVALID_SCHEDULE;
+			}
+
+			std::map<std::string, BK9130BLimits>::const_iterator it = limits_.find(g_PSUChannels[k]);
+			int ret = keyword || it == limits_.end() ? DEVICE_OK : checkRequest(it->second, value, unit);
+
+			if (ret != DEVICE_OK)
+			{
+				return ret;
+			}
+		}
+
+		return k == g_PSUChannelCount ? DEVICE_OK : ERR_INVALID_SCHEDULE;
+	}
+
+	return DEVICE_OK;
+}
+/*----------------------------------------------------------------------------*/
+// NOTE: called on the scheduler thread after each entry was written, the
+// commands bypassed the write-through cache so the watcher reads back now
+void BK9130B::onScheduleIssued(const VISAScheduler::Record&)
+{
+	watcher_.burst(-1);
+}
+/*----------------------------------------------------------------------------*/
+// reopens the device if it was unplugged and has since come back, returns
+// DEVICE_NOT_CONNECTED while it is absent
+int BK9130B::ensureConnected()
+{
+	bool reconnect = false;
+
+	{
+		visa_compat::lock_guard<visa_compat::mutex> lock(registryMutex_);
+
+		if (!connected_ && !reconnectPending_)
+		{
+			return DEVICE_NOT_CONNECTED;
+		}
+
+		reconnect = reconnectPending_;
+	}
+
+	if (reconnect)
+	{
+		// one reopen at a time, whoever comes second finds it done
+		VISADevice::IOLock io(dev_.ioMutex());
+
+		{
+			visa_compat::lock_guard<visa_compat::mutex> lock(registryMutex_);
+
+			if (!reconnectPending_)
+			{
+				return connected_ ? DEVICE_OK : DEVICE_NOT_CONNECTED;
+			}
+		}
+
+		// the old session is stale, its close command will fail (harmlessly)
+		dev_.close();
+		dev_.getLastError();
+
+		// reconnectPending_ stays set on failure, so the next operation
+		// tries again
+		if (!dev_.open(devID_, lockMode_, static_cast<ViUInt32>(timeout_)))
+		{
+			LogMessage("Failed to reopen " + devID_ + ": " + dev_.getLastError());
+			return DEVICE_NOT_CONNECTED;
+		}
+
+		// the supply comes back with all outputs off, restore the channel
+		// NOTE: the watcher and property gets read the state under
+		// stateMutex_, which (as everywhere) is not held across I/O
+		std::string channel;
+
+		{
+			visa_compat::lock_guard<visa_compat::mutex> lock(stateMutex_);
+
+			activeChannelState_ = false;
+			std::map<std::string, BK9130BChannelState>::iterator it;
+			for (it = state_.begin(); it != state_.end(); ++it)
+			{
+				it->second.output = false;
+			}
+
+			channel = activeChannel_;
+			publishSnapshot();
+		}
+
+		if (!channel.empty())
+		{
+			dev_.write("INST:SEL " + channel);
+		}
+
+		// a new session, and the supply forgot its status enables
+		if (monitor_.isRunning() && !enableServiceRequests())
+		{
+			LogMessage("Failed to re-enable service requests: " + dev_.getLastError());
+		}
+
+		visa_compat::lock_guard<visa_compat::mutex> lock(registryMutex_);
+		connected_ = true;
+		reconnectPending_ = false;
+
+		LogMessage("Reconnected to " + devID_);
+	}
+
+	return DEVICE_OK;
+}
+/*----------------------------------------------------------------------------*/
+// NOTE: called on the registry thread, which must not touch properties (the
+// device API isn't thread safe), the pre-init device list is only recorded
+// here and applied by GetNumberOfPropertyValues()
+void BK9130B::onRegistryChange(const VISARegistry::Event& evt, const std::vector<std::string>& present)
+{
+	visa_compat::lock_guard<visa_compat::mutex> lock(registryMutex_);
+
+	if (!initialized_)
+	{
+		presentIDs_ = present;
+		presentChanged_ = true;
+	}
+	else if (VISARegistry::key(evt.resource) == VISARegistry::key(devID_))
+	{
+		if (evt.type == VISARegistry::RSRC_REMOVED)
+		{
+			connected_ = false;
+			reconnectPending_ = false;
+			LogMessage("Device removed: " + evt.resource);
+		}
+		else
+		{
+			// reopen lazily on the next operation, from the caller's thread
+			reconnectPending_ = true;
+			LogMessage("Device arrived: " + evt.resource);
+		}
+	}
+}
+/*----------------------------------------------------------------------------*/
+// the core asks for the allowed values before listing them (e.g. in the
+// hardware configuration wizard), so this is where, on the core's thread,
+// the Device ID list catches up with the registry
+unsigned BK9130B::GetNumberOfPropertyValues(const char* name) const
+{
+	std::vector<std::string> present;
+	bool changed = false;
+	{
+		visa_compat::lock_guard<visa_compat::mutex> lock(registryMutex_);
+
+		if (presentChanged_ && !initialized_)
+		{
+			present.swap(presentIDs_);
+			presentChanged_ = false;
+			changed = true;
+		}
+	}
+
+	if (changed)
+	{
+		BK9130B* self = const_cast<BK9130B*>(this);
+
+		self->ClearAllowedValues(g_PSUDeviceIDProperty);
+		for (std::vector<std::string>::size_type k = 0; k < present.size(); ++k)
+		{
+			self->AddAllowedValue(g_PSUDeviceIDProperty, present[k].c_str());
+		}
+	}
+
+	return CShutterBase<BK9130B>::GetNumberOfPropertyValues(name);
+}
+/*----------------------------------------------------------------------------*/
+int BK9130B::SetOpen(bool open)
+{
+	int ret = ensureConnected();
+
+	if (ret != DEVICE_OK)
+	{
+		return ret;
+	}
+
+	bool current;
+	GetOpen(current);
+
+	if (open != current)
+	{
+		std::string stateStr = open ? "ON" : "OFF";
+		std::string channel = getActiveChannel();
+
+		// sending an channel select command (INST:SEL) souldn't be needed,
+		// but we'll leave it for now just to be safe
+		std::string cmd = "INST:SEL " + channel + dev_.getCmdSeperator() +
+			"SOUR:CHAN:OUTP:STAT " + stateStr;
+
+		if (dispatcher_.write(cmd))
+		{
+			visa_compat::lock_guard<visa_compat::mutex> lock(stateMutex_);
+
+			// the watcher may have followed the front panel meanwhile, the
+			// write went to <channel> regardless
+			if (activeChannel_ == channel)
+			{
+				activeChannelState_ = open;
+			}
+
+			BK9130BChannelState& st = state_[channel];
+			st.output = open;
+
+			if (open)
+			{
+				// turning the output back on re-arms the protection
+				st.ovp = false;
+				st.ocp = false;
+			}
+			st.updated = GetCurrentMMTime().getMsec();
+			publishSnapshot();
+			watcher_.burst(channelIndex(channel));
+		}
+		else
+		{
+			ret = ioError(ERR_WRITE_FAILED);
+		}
+	}
+
+	return ret;
+}
+/*----------------------------------------------------------------------------*/
+int BK9130B::GetOpen(bool& state)
+{
+	int ret = DEVICE_OK;
+
+	visa_compat::lock_guard<visa_compat::mutex> lock(stateMutex_);
+	state = activeChannelState_;
+
+	return ret;
+}
+/*----------------------------------------------------------------------------*/
+// turns the active channel on for <duration> ms, timed by the pulse thread
+// (see VISAPulse.h), Busy() until the output is off again
+int BK9130B::Fire(double duration)
+{
+	int ret = ensureConnected();
+
+	if (ret != DEVICE_OK)
+	{
+		return ret;
+	}
+
+	visa_compat::lock_guard<visa_compat::mutex> lock(stateMutex_);
+
+	int k = channelIndex(activeChannel_);
+
+	if (k < 0)
+	{
+		return ERR_INVALID_CHANNEL;
+	}
+
+	if (!pulser_.fire(static_cast<std::size_t>(k), duration))
+	{
+		return ERR_PULSE_BUSY;
+	}
+
+	// every pulse ends with the output off (still under stateMutex_, so
+	// activeChannel_ is the channel <k> was looked up from)
+	BK9130BChannelState& st = state_[g_PSUChannels[k]];
+	activeChannelState_ = false;
+	st.output = false;
+	st.updated = GetCurrentMMTime().getMsec();
+	publishSnapshot();
+	watcher_.burst(k);
+
+	return ret;
+}
+/*----------------------------------------------------------------------------*/
+// writes <steps> to the list memory of channel <k>, repeated <count> times
+// (0 = forever), an empty list just forgets the channel's
+int BK9130B::loadList(int k, const std::vector<BK9130BListStep>& steps, long count)
+{
+	if (k < 0 || k >= static_cast<int>(g_PSUChannelCount))
+	{
+		return ERR_INVALID_CHANNEL;
+	}
+
+	int ret = ensureConnected();
+
+	if (ret != DEVICE_OK)
+	{
+		return ret;
+	}
+
+	listSteps_[k] = 0;
+
+	if (steps.empty())
+	{
+		return ret;
+	}
+
+	// one write per step keeps every write well inside the input buffer
+	std::string sel = std::string("INST:SEL ") + g_PSUChannels[k] + dev_.getCmdSeperator();
+	std::ostringstream cmd;
+
+	cmd << sel << g_PSUListSteps << " " << steps.size() << dev_.getCmdSeperator() << g_PSUListCount << " " << count;
+
+	if (!dispatcher_.write(cmd.str()))
+	{
+		return ioError(ERR_WRITE_FAILED);
+	}
+
+	for (std::size_t j = 0; j < steps.size(); ++j)
+	{
+		cmd.str("");
+		cmd << sel
+			<< g_PSUListVoltage << " " << j + 1 << "," << doubleToStr(steps[j].voltage, 'V') << dev_.getCmdSeperator()
+			<< g_PSUListCurrent << " " << j + 1 << "," << doubleToStr(steps[j].current, 'A') << dev_.getCmdSeperator()
+			<< g_PSUListDwell << " " << j + 1 << "," << doubleToStr(steps[j].dwell, 'S');
+
+		if (!dispatcher_.write(cmd.str()))
+		{
+			return ioError(ERR_WRITE_FAILED);
+		}
+	}
+
+	// the setpoints to go back to, as the list overrides them (and the
+	// watcher picks that up)
+	{
+		visa_compat::lock_guard<visa_compat::mutex> lock(stateMutex_);
+		const BK9130BChannelState& st = state_[g_PSUChannels[k]];
+		listRestore_[k] = BK9130BListStep(st.voltage, st.current);
+	}
+
+	listSteps_[k] = static_cast<long>(steps.size());
+
+	return ret;
+}
+/*----------------------------------------------------------------------------*/
+// arms the list of every channel that has one, <perStep>: the external
+// trigger advances one step at a time (per frame), otherwise one bus trigger
+// runs the lists through on their dwell times, see OnState()
+int BK9130B::startLists(bool perStep)
+{
+	int ret = ensureConnected();
+
+	if (ret != DEVICE_OK)
+	{
+		return ret;
+	}
+
+	std::string sep = dev_.getCmdSeperator();
+	std::vector<int> started;
+
+	for (std::size_t k = 0; k < g_PSUChannelCount; ++k)
+	{
+		if (listSteps_[k] == 0)
+		{
+			continue;
+		}
+
+		std::string cmd = std::string("INST:SEL ") + g_PSUChannels[k] + sep +
+			g_PSUTriggerSource + (perStep ? " EXT" : " BUS") + sep +
+			g_PSUListTrigger + (perStep ? " STEP" : " LIST") + sep +
+			g_PSUListState + " ON" + sep +
+			"SOUR:CHAN:OUTP:STAT ON";
+
+		if (!dispatcher_.write(cmd))
+		{
+			ret = ioError(ERR_WRITE_FAILED);
+			break;
+		}
+
+		started.push_back(static_cast<int>(k));
+	}
+
+	listRunning_ = !started.empty();
+
+	if (ret != DEVICE_OK)
+	{
+		stopLists();
+		return ret;
+	}
+
+	// the outputs stay on for the whole list, the "off" steps are 0 V / 0 A
+	visa_compat::lock_guard<visa_compat::mutex> lock(stateMutex_);
+
+	for (std::size_t j = 0; j < started.size(); ++j)
+	{
+		BK9130BChannelState& st = state_[g_PSUChannels[started[j]]];
+		st.output = true;
+		st.updated = GetCurrentMMTime().getMsec();
+
+		if (activeChannel_ == g_PSUChannels[started[j]])
+		{
+			activeChannelState_ = true;
+		}
+	}
+
+	publishSnapshot();
+	watcher_.burst(-1);
+
+	return ret;
+}
+/*----------------------------------------------------------------------------*/
+// stops every list, turns the outputs off and puts the setpoints the lists
+// overrode back
+int BK9130B::stopLists()
+{
+	int ret = ensureConnected();
+
+	if (ret != DEVICE_OK)
+	{
+		return ret;
+	}
+
+	std::string sep = dev_.getCmdSeperator();
+
+	for (std::size_t k = 0; k < g_PSUChannelCount; ++k)
+	{
+		if (listSteps_[k] == 0)
+		{
+			continue;
+		}
+
+		const BK9130BListStep& st = listRestore_[k];
+
+		std::string cmd = std::string("INST:SEL ") + g_PSUChannels[k] + sep +
+			g_PSUListState + " OFF" + sep +
+			"SOUR:CHAN:OUTP:STAT OFF" + sep +
+			"SOUR:VOLT " + doubleToStr(st.voltage, 'V') + sep +
+			"SOUR:CURR " + doubleToStr(st.current, 'A');
+
+		if (!dispatcher_.write(cmd) && ret == DEVICE_OK)
+		{
+			ret = ioError(ERR_WRITE_FAILED);
+		}
+	}
+
+	listRunning_ = false;
+
+	visa_compat::lock_guard<visa_compat::mutex> lock(stateMutex_);
+
+	for (std::size_t k = 0; k < g_PSUChannelCount; ++k)
+	{
+		if (listSteps_[k] > 0)
+		{
+			BK9130BChannelState& st = state_[g_PSUChannels[k]];
+			st.output = false;
+			st.voltage = listRestore_[k].voltage;
+			st.current = listRestore_[k].current;
+			st.updated = GetCurrentMMTime().getMsec();
+
+			if (activeChannel_ == g_PSUChannels[k])
+			{
+				activeChannelState_ = false;
+			}
+		}
+	}
+
+	publishSnapshot();
+	watcher_.burst(-1);
+
+	return ret;
+}
+/*----------------------------------------------------------------------------*/
+// programs complementary lists on the "Interleave channels": in every cycle
+// each channel is on for the dwell in turn (at its own setpoints), with all
+// of them off for the dead time after each, so transitions never overlap.
+// One bus trigger starts all lists, the *OPC behind it raises a service
+// request when they are done (see serviceRequest())
+int BK9130B::startInterleave()
+{
+	char buf[MM::MaxStrLength];
+	double dwell, dead;
+	long cycles;
+
+	int ret = GetProperty(g_PSUInterleaveChannelsProperty, buf);
+	assert(ret == DEVICE_OK);
+
+	buf[MM::MaxStrLength-1] = '\0';
+
+	ret = GetProperty(g_PSUInterleaveDwellProperty, dwell);
+	assert(ret == DEVICE_OK);
+
+	ret = GetProperty(g_PSUInterleaveDeadProperty, dead);
+	assert(ret == DEVICE_OK);
+
+	ret = GetProperty(g_PSUInterleaveCyclesProperty, cycles);
+	assert(ret == DEVICE_OK);
+
+	std::vector<int> channels;
+	std::istringstream in(buf);
+	std::string name;
+
+	while (std::getline(in, name, ','))
+	{
+		std::string::size_type first = name.find_first_not_of(" \t");
+		std::string::size_type last = name.find_last_not_of(" \t");
+
+		int k = first == std::string::npos ? -1 : channelIndex(name.substr(first, last - first + 1));
+
+		if (k < 0 || std::find(channels.begin(), channels.end(), k) != channels.end())
+		{
+			return ERR_INVALID_INTERLEAVE;
+		}
+
+		channels.push_back(k);
+	}
+
+	std::size_t perSlot = dead > 0.0 ? 2 : 1;
+
+	if (channels.size() < 2 || channels.size() * perSlot > BK9130B_LIST_MAX)
+	{
+		return ERR_INVALID_INTERLEAVE;
+	}
+
+	if (listRunning_)
+	{
+		stopLists();
+	}
+
+	// one list per channel, every list steps in lockstep with the others
+	for (std::size_t k = 0; k < g_PSUChannelCount; ++k)
+	{
+		std::vector<BK9130BListStep> steps;
+
+		std::vector<int>::const_iterator it = std::find(channels.begin(), channels.end(), static_cast<int>(k));
+
+		if (it != channels.end())
+		{
+			BK9130BChannelState st;
+			{
+				visa_compat::lock_guard<visa_compat::mutex> lock(stateMutex_);
+				st = state_[g_PSUChannels[k]];
+			}
+
+			for (std::size_t j = 0; j < channels.size(); ++j)
+			{
+				bool on = channels[j] == static_cast<int>(k);
+				steps.push_back(on ? BK9130BListStep(st.voltage, st.current, dwell / 1000.0) : BK9130BListStep(0.0, 0.0, dwell / 1000.0));
+
+				if (dead > 0.0)
+				{
+					steps.push_back(BK9130BListStep(0.0, 0.0, dead / 1000.0));
+				}
+			}
+		}
+
+		ret = loadList(static_cast<int>(k), steps, cycles);
+
+		if (ret != DEVICE_OK)
+		{
+			return ret;
+		}
+	}
+
+	ret = startLists(false);
+
+	if (ret != DEVICE_OK)
+	{
+		return ret;
+	}
+
+	{
+		visa_compat::lock_guard<visa_compat::mutex> lock(stateMutex_);
+		interleaveSwitches_ = static_cast<double>(cycles) * channels.size();
+		interleaveRate_ = 1000.0 / (dwell + dead);
+		interleaveAchieved_ = 0.0;
+		interleaveStart_ = 0.0;
+	}
+
+	if (!dispatcher_.write("*TRG" + dev_.getCmdSeperator() + "*OPC"))
+	{
+		return ioError(ERR_WRITE_FAILED);
+	}
+
+	visa_compat::lock_guard<visa_compat::mutex> lock(stateMutex_);
+	interleaveStart_ = dev_.getClock().now();
+
+	return ret;
+}
+/*----------------------------------------------------------------------------*/
+// polls the setpoints and output state of all channels (called on the watcher
+// thread) and notifies Micro-Manager of any change to the active channel, so
+// that property gets can be served from the cache
+void BK9130B::pollState()
+{
+	if (ensureConnected() != DEVICE_OK)
+	{
+		return;
+	}
+
+	// the queries and their replies are kept between polls, so that a poll
+	// doesn't allocate (over days of polling that is a lot of heap churn)
+	if (pollQueries_.empty())
+	{
+		pollQueries_.push_back("APP:VOLT?");
+		pollQueries_.push_back("APP:CURR?");
+		pollQueries_.push_back("APP:OUT?");
+		pollQueries_.push_back("MEAS:VOLT:ALL?");
+		pollQueries_.push_back("MEAS:CURR:ALL?");
+
+		// the selection can also change on the front panel
+		pollQueries_.push_back("INST:SEL?");
+	}
+
+	// anything written through to state_ while the batch runs is newer than
+	// the setpoints / output state it reads back, see below
+	unsigned long generation;
+	{
+		visa_compat::lock_guard<visa_compat::mutex> lock(stateMutex_);
+		generation = stateGeneration_;
+	}
+
+	dev_.queryBatch(pollQueries_, pollReplies_);
+
+	double now = GetCurrentMMTime().getMsec();
+
+	// each reply but the last (INST:SEL?) is a comma separated list with one
+	// value per channel
+	const std::size_t nList = 5;
+	double values[nList][BK9130B_CHANNEL_COUNT];
+
+	for (std::size_t k = 0; k < nList; ++k)
+	{
+		const char* field = pollReplies_[k].c_str();
+		std::size_t count = 0;
+
+		while (*field != '\0')
+		{
+			if (count < g_PSUChannelCount)
+			{
+				values[k][count] = strtod(field, NULL);
+			}
+
+			++count;
+
+			const char* comma = strchr(field, ',');
+			field = comma != 0 ? comma + 1 : "";
+		}
+
+		if (count != g_PSUChannelCount)
+		{
+			LogMessage("State poll failed (" + pollQueries_[k] + "): " + dev_.getLastError(), true);
+			return;
+		}
+	}
+
+	// the reply carries the termination character, and anything that isn't
+	// one of our channels must not end up in activeChannel_
+	std::string& selected = pollReplies_[nList];
+
+	std::string::size_type last = selected.find_last_not_of(" \t\r\n");
+	selected.erase(last == std::string::npos ? 0 : last + 1);
+	selected.erase(0, selected.find_first_not_of(" \t\r\n"));
+
+	if (channelIndex(selected) < 0)
+	{
+		LogMessage("State poll failed (INST:SEL?): " + selected, true);
+		return;
+	}
+
+	std::vector<std::pair<std::string, std::string> > changes;
+	bool changed[BK9130B_CHANNEL_COUNT];
+
+	{
+		visa_compat::lock_guard<visa_compat::mutex> lock(stateMutex_);
+
+		// a write-through (or SRQ update) landed meanwhile: the setpoints
+		// and output state read back may predate it, keep the cached ones
+		bool stale = stateGeneration_ != generation;
+
+		// selected on the front panel, follow it (the limits catch up on
+		// the next get, on the core's thread)
+		if (!stale && activeChannel_ != selected)
+		{
+			activeChannel_ = selected;
+			changes.push_back(std::make_pair(std::string(g_PSUActiveChannelProperty), selected));
+
+			const BK9130BChannelState& st = state_[activeChannel_];
+			activeChannelState_ = st.output;
+			outputVoltage_ = st.voltage;
+			outputCurrent_ = st.current;
+
+			changes.push_back(std::make_pair(std::string(g_PSUStateProperty), std::string(st.output ? "1" : "0")));
+			changes.push_back(std::make_pair(std::string(g_PSUOutputVoltageProperty), toString(st.voltage)));
+			changes.push_back(std::make_pair(std::string(g_PSUOutputCurrentProperty), toString(st.current)));
+		}
+
+		for (std::size_t k = 0; k < g_PSUChannelCount; ++k)
+		{
+			BK9130BChannelState& st = state_[g_PSUChannels[k]];
+			bool active = activeChannel_ == g_PSUChannels[k];
+			bool output = stale ? st.output : values[2][k] != 0.0;
+
+			if (stale)
+			{
+				values[0][k] = st.voltage;
+				values[1][k] = st.current;
+			}
+
+			// drives the adaptive poll rate, measurements have to move by
+			// more than their noise
+			changed[k] = st.voltage != values[0][k] ||
+				st.current != values[1][k] || st.output != output ||
+				fabs(st.measVoltage - values[3][k]) > BK9130B_VOLTAGE_TOLERANCE ||
+				fabs(st.measCurrent - values[4][k]) > BK9130B_CURRENT_TOLERANCE;
+
+			if (st.voltage != values[0][k])
+			{
+				st.voltage = values[0][k];
+
+				if (active)
+				{
+					outputVoltage_ = st.voltage;
+					changes.push_back(std::make_pair(std::string(g_PSUOutputVoltageProperty), toString(st.voltage)));
+				}
+			}
+
+			if (st.current != values[1][k])
+			{
+				st.current = values[1][k];
+
+				if (active)
+				{
+					outputCurrent_ = st.current;
+					changes.push_back(std::make_pair(std::string(g_PSUOutputCurrentProperty), toString(st.current)));
+				}
+			}
+
+			// telemetry properties are pushed for every channel, so that the
+			// core's state cache (and hence image metadata) stays current
+			if (st.output != output)
+			{
+				st.output = output;
+				changes.push_back(std::make_pair(telemetryName(k, 0), toString(output ? 1.0 : 0.0)));
+
+				if (active)
+				{
+					activeChannelState_ = output;
+					changes.push_back(std::make_pair(std::string(g_PSUStateProperty), std::string(output ? "1" : "0")));
+				}
+			}
+
+			// the cache always has the latest reading, but the core is only
+			// told once it has moved by more than the noise from what it was
+			// last told, or every poll would be a notification
+			st.measVoltage = values[3][k];
+			st.measCurrent = values[4][k];
+
+			if (fabs(st.measVoltage - notifiedMeas_[2 * k]) > BK9130B_VOLTAGE_TOLERANCE)
+			{
+				notifiedMeas_[2 * k] = st.measVoltage;
+				changes.push_back(std::make_pair(telemetryName(k, 1), toString(st.measVoltage)));
+			}
+
+			if (fabs(st.measCurrent - notifiedMeas_[2 * k + 1]) > BK9130B_CURRENT_TOLERANCE)
+			{
+				notifiedMeas_[2 * k + 1] = st.measCurrent;
+				changes.push_back(std::make_pair(telemetryName(k, 2), toString(st.measCurrent)));
+			}
+
+			st.updated = now;
+		}
+
+		publishSnapshot();
+	}
+
+	watcher_.sampled(changed);
+
+	// every poll is recorded, columns are CH1 V, CH1 I, CH2 V, ...
+	double record[2 * BK9130B_CHANNEL_COUNT];
+	for (std::size_t k = 0; k < g_PSUChannelCount; ++k)
+	{
+		record[2 * k] = values[3][k];
+		record[2 * k + 1] = values[4][k];
+	}
+
+	telemetry_.append(static_cast<VISATelemetryStore::Time>(now * 1000.0), record);
+	history_.append(static_cast<VISATelemetryPyramid::Time>(now * 1000.0), record);
+	window_.append(static_cast<VISATelemetryWindow::Time>(now * 1000.0), record);
+
+	// notify without holding the state lock, the core may call back into us
+	for (std::size_t k = 0; k < changes.size(); ++k)
+	{
+		OnPropertyChanged(changes[k].first.c_str(), changes[k].second.c_str());
+	}
+}
+/*----------------------------------------------------------------------------*/
+// starts <worker> with the configured affinity / priority
+void BK9130B::startThread(VISAWorker& worker, const char* name)
+{
+	worker.setConfig(threadConfig_);
+	worker.start();
+
+	std::string err = worker.getConfigError();
+	if (!err.empty())
+	{
+		LogMessage(std::string(name) + " thread: " + err);
+	}
+}
+/*----------------------------------------------------------------------------*/
+// turns the active channel's output on and off <cycles> times, learning the
+// delay from each write to the output changing from the read back current
+// (or voltage, should the output be unloaded), the output is left off
+// NOTE: each edge holds the I/O lock (see sampleEdge()), it is released in
+// between so that the watcher and dispatcher get in, and the whole run gives
+// up after BK9130B_CALIBRATION_MAX ms
+int BK9130B::calibrateExposure(long cycles)
+{
+	int ret = ensureConnected();
+
+	if (ret != DEVICE_OK)
+	{
+		return ret;
+	}
+
+	std::string channel;
+	bool open;
+	{
+		visa_compat::lock_guard<visa_compat::mutex> lock(stateMutex_);
+		channel = activeChannel_;
+		open = activeChannelState_;
+	}
+
+	std::string cmd = "INST:SEL " + channel + dev_.getCmdSeperator() + "SOUR:CHAN:OUTP:STAT ";
+
+	const char* measure = "MEAS:CURR?";
+	double tolerance = BK9130B_CURRENT_TOLERANCE;
+
+	std::vector<VISAExposureLock::Reading> readings;
+	double tWrite = 0.0;
+
+	VISAClock& clock = dev_.getClock();
+	double tStart = clock.now();
+
+	exposure_.reset();
+
+	// start from a settled, off output
+	if (open && !sampleEdge(cmd + "OFF", measure, tolerance, tWrite, readings))
+	{
+		ret = ioError(ERR_QUERY_FAILED);
+	}
+
+	bool on = true;
+	long learned = 0;
+
+	for (long k = 0; ret == DEVICE_OK && k < 2 * cycles; ++k, on = !on)
+	{
+		// let whoever waited for the I/O lock during the last edge have it
+		visa_compat::this_thread::yield();
+
+		if (clock.now() - tStart > BK9130B_CALIBRATION_MAX * 1000.0)
+		{
+			ret = ERR_CALIBRATION_TIMEOUT;
+			exposure_.reset();
+		}
+		else if (!sampleEdge(cmd + (on ? "ON" : "OFF"), measure, tolerance, tWrite, readings))
+		{
+			ret = ioError(ERR_QUERY_FAILED);
+		}
+		else if (exposure_.learn(on, tWrite, readings, 5 * tolerance))
+		{
+			++learned;
+		}
+		else if (exposure_.getUnresolved() > 0)
+		{
+			// the readings are further apart than the delay, anything learned
+			// would just be the read back period
+			ret = ERR_CALIBRATION_UNRESOLVED;
+			exposure_.reset();
+		}
+		else if (learned == 0 && tolerance == BK9130B_CURRENT_TOLERANCE)
+		{
+			// no current flows, so follow the voltage from the next edge on
+			measure = "MEAS:VOLT?";
+			tolerance = BK9130B_VOLTAGE_TOLERANCE;
+		}
+	}
+
+	if (ret == DEVICE_OK && learned == 0)
+	{
+		ret = ERR_CALIBRATION_FAILED;
+	}
+
+	// whatever happened, the output should be off by now
+	if (ret != DEVICE_OK)
+	{
+		dispatcher_.write(cmd + "OFF");
+	}
+
+	{
+		visa_compat::lock_guard<visa_compat::mutex> lock(stateMutex_);
+		if (activeChannel_ == channel)
+		{
+			activeChannelState_ = false;
+		}
+		state_[channel].output = false;
+		state_[channel].updated = GetCurrentMMTime().getMsec();
+		publishSnapshot();
+		watcher_.burst(channelIndex(channel));
+	}
+
+	return ret;
+}
+/*----------------------------------------------------------------------------*/
+// reads <measure> once, writes <cmd> and keeps reading until the value has
+// moved and settled (or BK9130B_EXPOSURE_SETTLE ms pass), <tWrite> is when
+// the write completed, every reading is stamped with the middle of its query
+// NOTE: the readings go straight to the device and are read as soon as the
+// reply arrives (not after the query delay), with the I/O lock held for the
+// whole edge so that nothing else gets in between them
+bool BK9130B::sampleEdge(const std::string& cmd, const char* measure, double tolerance, double& tWrite, std::vector<VISAExposureLock::Reading>& readings)
+{
+	VISAClock& clock = dev_.getClock();
+	VISADevice::IOLock io(dev_.ioMutex());
+
+	std::vector<std::string> query(1, measure);
+	std::vector<std::string> reply;
+
+	readings.clear();
+
+	for (int k = 0; ; ++k)
+	{
+		if (k == 1)
+		{
+			if (!dev_.write(cmd))
+			{
+				return false;
+			}
+
+			tWrite = clock.now();
+		}
+
+		double t0 = clock.now();
+		dev_.queryBatch(query, reply);
+		double t1 = clock.now();
+
+		if (reply[0].empty())
+		{
+			return false;
+		}
+
+		readings.push_back(VISAExposureLock::Reading(0.5 * (t0 + t1), atof(reply[0].c_str())));
+
+		if (k < 1)
+		{
+			continue;
+		}
+
+		std::size_t n = readings.size();
+
+		// settled: the last three agree and are clear of the initial value
+		bool settled = n >= 4 &&
+			fabs(readings[n - 1].value - readings[n - 2].value) < tolerance &&
+			fabs(readings[n - 2].value - readings[n - 3].value) < tolerance &&
+			fabs(readings[n - 1].value - readings[0].value) >= 5 * tolerance;
+
+		if (settled || t1 - tWrite > BK9130B_EXPOSURE_SETTLE * 1000.0)
+		{
+			return true;
+		}
+	}
+}
+/*----------------------------------------------------------------------------*/
+// has the supply raise a service request whenever a channel's protection
+// trips or it changes between CV and CC (either way), false if the
+// interface cannot deliver service requests
+bool BK9130B::enableServiceRequests()
+{
+	unsigned mask = BK9130B_ISUM_CC | BK9130B_ISUM_CV | BK9130B_ISUM_OVP | BK9130B_ISUM_OCP;
+	unsigned modes = BK9130B_ISUM_CC | BK9130B_ISUM_CV;
+
+	std::vector<std::string> cmds;
+	cmds.push_back("*CLS");
+
+	for (std::size_t k = 0; k < g_PSUChannelCount; ++k)
+	{
+		std::ostringstream isum;
+		isum << "STAT:QUES:INST:ISUM" << (k + 1);
+
+		// trips on the rising edge, mode changes on both
+		std::ostringstream ptr, ntr, enable;
+		ptr << isum.str() << ":PTR " << mask;
+		ntr << isum.str() << ":NTR " << modes;
+		enable << isum.str() << ":ENAB " << mask;
+
+		cmds.push_back(ptr.str());
+		cmds.push_back(ntr.str());
+		cmds.push_back(enable.str());
+	}
+
+	// ISUM1-3 summarize into bits 1-3 of the instrument register, which
+	// summarizes into bit 13 of the questionable register, bit 3 of the
+	// status byte; operation complete (the end of an interleave run) is bit
+	// 0 of the standard event register, bit 5 of the status byte
+	cmds.push_back("STAT:QUES:INST:ENAB 14");
+	cmds.push_back("STAT:QUES:ENAB 8192");
+	cmds.push_back("*ESE 1");
+	cmds.push_back("*SRE 40");
+
+	for (std::size_t k = 0; k < cmds.size(); ++k)
+	{
+		if (!dev_.write(cmds[k]))
+		{
+			return false;
+		}
+	}
+
+	return dev_.enableServiceRequest();
+}
+/*----------------------------------------------------------------------------*/
+// reads (and so clears) every channel's event register and updates the
+// cached mode / protection state, a trip turns the cached output off
+// NOTE: called on the protection monitor thread
+void BK9130B::serviceRequest()
+{
+	ViUInt16 stb;
+	if (!dev_.readStatusByte(stb))
+	{
+		LogMessage(dev_.getLastError());
+		return;
+	}
+
+	double now = dev_.getClock().now();
+
+	// the event / condition register of every channel, kept between
+	// requests like the poll's
+	if (srqQueries_.empty())
+	{
+		for (std::size_t k = 0; k < g_PSUChannelCount; ++k)
+		{
+			std::ostringstream isum;
+			isum << "STAT:QUES:INST:ISUM" << (k + 1);
+
+			srqQueries_.push_back(isum.str() + ":EVEN?");
+			srqQueries_.push_back(isum.str() + ":COND?");
+		}
+	}
+
+	long esr = 0;
+
+	{
+		// every register is read back to back as soon as it answers (not
+		// after the query delay), and no other thread gets in between
+		VISADevice::IOLock io(dev_.ioMutex());
+
+		// *ESR? is also the flow control sync, and reading it clears it: a
+		// sync may already have taken the *OPC bit (and the ESB bit of the
+		// status byte with it), so it is read on every request, through the
+		// device, which hands over whatever the syncs saw
+		dev_.readSyncRegister(esr);
+		dev_.queryBatch(srqQueries_, srqReplies_);
+	}
+
+	std::vector<std::pair<std::string, std::string> > changes;
+
+	{
+		// the *OPC after an interleave trigger: the run is over
+		visa_compat::lock_guard<visa_compat::mutex> lock(stateMutex_);
+
+		if ((esr & 1) != 0 && interleaveStart_ > 0.0 && now > interleaveStart_)
+		{
+			interleaveAchieved_ = interleaveSwitches_ * 1e6 / (now - interleaveStart_);
+			interleaveStart_ = 0.0;
+
+			changes.push_back(std::make_pair(std::string(g_PSUInterleaveRateProperties[1]), toString(interleaveAchieved_)));
+		}
+	}
+
+	for (std::size_t k = 0; k < g_PSUChannelCount; ++k)
+	{
+		// the event register latches trips that may already have cleared,
+		// the condition register has the mode as of now
+		const std::string& evt = srqReplies_[2 * k];
+		const std::string& cond = srqReplies_[2 * k + 1];
+
+		if (evt.empty() || cond.empty())
+		{
+			ioError(ERR_QUERY_FAILED);
+			continue;
+		}
+
+		long events = strtol(evt.c_str(), NULL, 10);
+		long bits = strtol(cond.c_str(), NULL, 10);
+		long trips = (events | bits) & (BK9130B_ISUM_OVP | BK9130B_ISUM_OCP);
+
+		visa_compat::lock_guard<visa_compat::mutex> lock(stateMutex_);
+
+		BK9130BChannelState& st = state_[g_PSUChannels[k]];
+		BK9130BChannelState before = st;
+
+		st.cv = (bits & BK9130B_ISUM_CV) != 0;
+		st.cc = (bits & BK9130B_ISUM_CC) != 0;
+		st.ovp = st.ovp || (trips & BK9130B_ISUM_OVP) != 0;
+		st.ocp = st.ocp || (trips & BK9130B_ISUM_OCP) != 0;
+
+		if (trips != 0)
+		{
+			// the supply has turned the output off
+			st.output = false;
+
+			if (activeChannel_ == g_PSUChannels[k] && activeChannelState_)
+			{
+				activeChannelState_ = false;
+				changes.push_back(std::make_pair(std::string(g_PSUStateProperty), std::string("0")));
+			}
+
+			LogMessage(std::string(g_PSUChannels[k]) + " protection tripped: " + protectionName(st));
+		}
+
+		st.updated = GetCurrentMMTime().getMsec();
+
+		if (st.cv != before.cv || st.cc != before.cc)
+		{
+			changes.push_back(std::make_pair(std::string(g_PSUChannels[k]) + " " + g_PSUProtectionProperties[0], std::string(regulationName(st))));
+		}
+
+		if (st.ovp != before.ovp || st.ocp != before.ocp)
+		{
+			changes.push_back(std::make_pair(std::string(g_PSUChannels[k]) + " " + g_PSUProtectionProperties[1], protectionName(st)));
+		}
+
+		if (st.output != before.output)
+		{
+			changes.push_back(std::make_pair(telemetryName(k, 0), toString(st.output ? 1.0 : 0.0)));
+		}
+	}
+
+	{
+		visa_compat::lock_guard<visa_compat::mutex> lock(stateMutex_);
+		publishSnapshot();
+	}
+
+	watcher_.burst(-1);
+
+	// notify without holding the state lock, the core may call back into us
+	for (std::size_t k = 0; k < changes.size(); ++k)
+	{
+		OnPropertyChanged(changes[k].first.c_str(), changes[k].second.c_str());
+	}
+}
+/*----------------------------------------------------------------------------*/
+// copies state_ into the snapshot, must be called with stateMutex_ held
+void BK9130B::publishSnapshot()
+{
+	BK9130BSnapshot snap;
+
+	for (std::size_t k = 0; k < g_PSUChannelCount; ++k)
+	{
+		std::map<std::string, BK9130BChannelState>::const_iterator it =
+			state_.find(g_PSUChannels[k]);
+
+		if (it != state_.end())
+		{
+			snap.channel[k] = it->second;
+		}
+
+		if (activeChannel_ == g_PSUChannels[k])
+		{
+			snap.activeChannel = static_cast<int>(k);
+		}
+	}
+
+	snapshot_.store(snap);
+	++stateGeneration_;
+}
+/*----------------------------------------------------------------------------*/
+/**
+* Copies the latest cached state of every channel, including when each was
+* last refreshed. Never talks to the instrument and never blocks, so it is
+* cheap enough to call for every frame.
+*/
+void BK9130B::GetSnapshot(BK9130BSnapshot& snap) const
+{
+	snapshot_.load(snap);
+}
+/*----------------------------------------------------------------------------*/
+/**
+* Appends min / max / mean of the measured voltage (or <current>) of
+* <channel> between <t0> and <t1> (core time in ms) to <buckets>, at the
+* finest resolution (1 s, 1 min or 1 h) that fits in <maxBuckets>. Never talks
+* to the instrument; the cost depends on <maxBuckets>, not on the range.
+* @return - bucket width in us, 0 if <channel> is out of range
+*/
+VISATelemetryPyramid::Time BK9130B::GetTelemetry(int channel, bool current, double t0, double t1, std::size_t maxBuckets, std::vector<VISATelemetryPyramid::Bucket>& buckets) const
+{
+	if (channel < 0 || channel >= static_cast<int>(g_PSUChannelCount))
+	{
+		return 0;
+	}
+
+	return history_.query(2 * channel + (current ? 1 : 0),
+		static_cast<VISATelemetryPyramid::Time>(t0 * 1000.0),
+		static_cast<VISATelemetryPyramid::Time>(t1 * 1000.0),
+		maxBuckets, buckets);
+}
+/*----------------------------------------------------------------------------*/
+void BK9130BMonitor::run()
+{
+	// waitForServiceRequest() returns at least every 250 ms, so stop() is
+	// honored promptly
+	while (isRunning())
+	{
+		if (owner_->dev_.waitForServiceRequest(250))
+		{
+			owner_->serviceRequest();
+		}
+	}
+}
+/*----------------------------------------------------------------------------*/
+BK9130BWatcher::BK9130BWatcher(BK9130B* owner) :
+	owner_(owner),
+	interval_(1000),
+	burstInterval_(50),
+	start_(0.0),
+	polls_(0)
+{
+	for (std::size_t k = 0; k < g_PSUChannelCount; ++k)
+	{
+		period_[k] = 0.0;
+		due_[k] = 0.0;
+	}
+}
+/*----------------------------------------------------------------------------*/
+// slowest poll interval in ms (0 to pause), also resets the statistics
+void BK9130BWatcher::setInterval(long ms)
+{
+	{
+		visa_compat::lock_guard<visa_compat::mutex> lock(mutex_);
+		interval_ = ms;
+		start_ = clock().now();
+		polls_ = 0;
+	}
+
+	burst(-1);
+}
+/*----------------------------------------------------------------------------*/
+// fastest poll interval in ms, a value >= the poll interval means fixed rate
+void BK9130BWatcher::setBurstInterval(long ms)
+{
+	{
+		visa_compat::lock_guard<visa_compat::mutex> lock(mutex_);
+		burstInterval_ = ms;
+		start_ = clock().now();
+		polls_ = 0;
+	}
+
+	burst(-1);
+}
+/*----------------------------------------------------------------------------*/
+// samples <channel> (-1 for all) now and at the burst rate after that
+void BK9130BWatcher::burst(int channel)
+{
+	{
+		visa_compat::lock_guard<visa_compat::mutex> lock(mutex_);
+
+		double now = clock().now();
+
+		for (std::size_t k = 0; k < g_PSUChannelCount; ++k)
+		{
+			if (channel < 0 || static_cast<std::size_t>(channel) == k)
+			{
+				period_[k] = 0.0;
+				due_[k] = now;
+			}
+		}
+	}
+
+	wake();
+}
+/*----------------------------------------------------------------------------*/
+// called after every poll with which channels changed since the last one
+void BK9130BWatcher::sampled(const bool* changed)
+{
+	visa_compat::lock_guard<visa_compat::mutex> lock(mutex_);
+
+	double now = clock().now();
+	double fastest = burstInterval_ * 1000.0;
+	double slowest = interval_ * 1000.0;
+
+	for (std::size_t k = 0; k < g_PSUChannelCount; ++k)
+	{
+		if (changed[k] || period_[k] <= 0.0)
+		{
+			period_[k] = fastest;
+		}
+		else
+		{
+			period_[k] *= 2.0;
+		}
+
+		period_[k] = period_[k] < slowest ? period_[k] : slowest;
+		due_[k] = now + period_[k];
+	}
+
+	++polls_;
+}
+/*----------------------------------------------------------------------------*/
+BK9130BWatcher::Stats BK9130BWatcher::getStats() const
+{
+	visa_compat::lock_guard<visa_compat::mutex> lock(mutex_);
+
+	Stats stats;
+	stats.polls = polls_;
+
+	long fastest = burstInterval_ < interval_ ? burstInterval_ : interval_;
+	if (fastest > 0)
+	{
+		stats.baseline = (clock().now() - start_) / (fastest * 1000.0);
+	}
+
+	return stats;
+}
+/*----------------------------------------------------------------------------*/
+// ms until the first channel is due
+ViUInt32 BK9130BWatcher::nextWait() const
+{
+	visa_compat::lock_guard<visa_compat::mutex> lock(mutex_);
+
+	if (interval_ <= 0)
+	{
+		return 1000;
+	}
+
+	double due = due_[0];
+	for (std::size_t k = 1; k < g_PSUChannelCount; ++k)
+	{
+		due = due_[k] < due ? due_[k] : due;
+	}
+
+	double wait = (due - clock().now()) / 1000.0;
+
+	return wait > 0.0 ? static_cast<ViUInt32>(wait + 0.5) : 0;
+}
+/*----------------------------------------------------------------------------*/
+void BK9130BWatcher::run()
+{
+	while (isRunning())
+	{
+		ViUInt32 wait = nextWait();
+
+		if (wait > 0)
+		{
+			// re-evaluate when woken (burst / new interval)
+			if (!waitFor(wait))
+			{
+				break;
+			}
+
+			continue;
+		}
+
+		std::size_t polls;
+		{
+			visa_compat::lock_guard<visa_compat::mutex> lock(mutex_);
+			polls = polls_;
+		}
+
+		owner_->pollState();
+
+		visa_compat::lock_guard<visa_compat::mutex> lock(mutex_);
+
+		if (polls_ == polls)
+		{
+			// the poll failed (e.g. disconnected), retry at the slow rate
+			double due = clock().now() + interval_ * 1000.0;
+			for (std::size_t k = 0; k < g_PSUChannelCount; ++k)
+			{
+				due_[k] = due;
+			}
+		}
+	}
+}
+/*----------------------------------------------------------------------------*/
+// sets the currently active channel
+int BK9130B::OnActiveChannel(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+	int ret = ensureConnected();
+
+	if (ret != DEVICE_OK)
+	{
+		return ret;
+	}
+
+	if (eAct == MM::BeforeGet)
+	{
+		std::string tmp;
+
+		if (watcher_.isRunning())
+		{
+			// the watcher polls the selection (it can also change on the
+			// front panel) and pushes changes, so the cache is good enough
+			visa_compat::lock_guard<visa_compat::mutex> lock(stateMutex_);
+			tmp = activeChannel_;
+		}
+		else
+		{
+			tmp = dispatcher_.query("INST:SEL?");
+		}
+
+		// the reply carries the termination character, and anything that
+		// isn't one of our channels must not end up in activeChannel_ (every
+		// limits_ / state_ lookup is keyed on it)
+		std::string::size_type first = tmp.find_first_not_of(" \t\r\n");
+		std::string::size_type last = tmp.find_last_not_of(" \t\r\n");
+		tmp = first == std::string::npos ? "" : tmp.substr(first, last - first + 1);
+
+		if (tmp.empty())
+		{
+			ret = ioError(ERR_QUERY_FAILED);
+		}
+		else if (channelIndex(tmp) < 0)
+		{
+			LogMessage("Unexpected INST:SEL? reply: " + tmp);
+			ret = ERR_INVALID_CHANNEL;
+		}
+		else
+		{
+			// the limits still belong to whatever the property last held,
+			// the watcher only moves activeChannel_
+			std::string previous;
+			pProp->Get(previous);
+
+			pProp->Set(tmp.c_str());
+
+			bool moved;
+			bool relimit;
+			{
+				visa_compat::lock_guard<visa_compat::mutex> lock(stateMutex_);
+
+				moved = activeChannel_ != tmp;
+				relimit = moved || previous != tmp;
+				activeChannel_ = tmp;
+
+				if (moved)
+				{
+					// selected on the front panel, follow it
+					const BK9130BChannelState& st = state_[activeChannel_];
+					activeChannelState_ = st.output;
+					outputVoltage_ = st.voltage;
+					outputCurrent_ = st.current;
+					publishSnapshot();
+				}
+			}
+
+			if (relimit)
+			{
+				applyLimits();
+			}
+		}
+	}
+	else if (eAct == MM::AfterSet)
+	{
+		// user performed set operation
+		std::string channel;
+		pProp->Get(channel);
+
+		if (limits_.find(channel) == limits_.end())
+		{
+			pProp->Set(getActiveChannel().c_str());
+			return ERR_INVALID_CHANNEL;
+		}
+
+		{
+			visa_compat::lock_guard<visa_compat::mutex> lock(stateMutex_);
+			activeChannel_ = channel;
+		}
+
+		applyLimits();
+
+		if (!dispatcher_.write("INST:SEL " + channel))
+		{
+			ret = ioError(ERR_WRITE_FAILED);
+		}
+		else
+		{
+			// make sure our activeChannelState_ is up-to-date, the reply
+			// carries the termination character
+			std::string tmp = dispatcher_.query("SOUR:CHAN:OUTP:STAT?");
+
+			std::string::size_type last = tmp.find_last_not_of(" \t\r\n");
+			tmp.erase(last == std::string::npos ? 0 : last + 1);
+			tmp.erase(0, tmp.find_first_not_of(" \t\r\n"));
+
+			if (tmp != "0" && tmp != "1")
+			{
+				// keep the cached state rather than guess
+				ret = ioError(ERR_QUERY_FAILED);
+			}
+			else
+			{
+				bool output = tmp == "1";
+
+				visa_compat::lock_guard<visa_compat::mutex> lock(stateMutex_);
+				if (activeChannel_ == channel)
+				{
+					activeChannelState_ = output;
+				}
+				state_[channel].output = output;
+				state_[channel].updated = GetCurrentMMTime().getMsec();
+				publishSnapshot();
+			}
+		}
+	}
+
+	return ret;
+}
+/*----------------------------------------------------------------------------*/
+int BK9130B::OnOutputVoltage(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+	return OnOutputChange(pProp, eAct, outputVoltage_, 'V');
+}
+/*----------------------------------------------------------------------------*/
+int BK9130B::OnOutputCurrent(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+	return  OnOutputChange(pProp, eAct, outputCurrent_, 'A');
+}
+/*----------------------------------------------------------------------------*/
+int BK9130B::OnOutputChange(MM::PropertyBase* pProp, MM::ActionType eAct, double& value, const char& unit)
+{
+	int ret = ensureConnected();
+
+	if (ret != DEVICE_OK)
+	{
+		return ret;
+	}
+
+	std::string cmd = unit == 'A' ? "SOUR:CURR" : "SOUR:VOLT";
+
+	if (eAct == MM::BeforeGet)
+	{
+		if (watcher_.isRunning())
+		{
+			// the watcher pushes changes, so the cache is good enough
+			visa_compat::lock_guard<visa_compat::mutex> lock(stateMutex_);
+
+			std::map<std::string, BK9130BChannelState>::const_iterator it =
+				state_.find(activeChannel_);
+
+			if (it != state_.end())
+			{
+				value = unit == 'A' ? it->second.current : it->second.voltage;
+			}
+
+			pProp->Set(value);
+			return ret;
+		}
+
+		// user triggered get request
+		std::string tmp = dispatcher_.query(cmd + ":LEV?");
+
+		if (tmp.empty())
+		{
+			ret = ioError(ERR_QUERY_FAILED);
+		}
+		else
+		{
+			value = strtod(tmp.c_str(), NULL);
+			pProp->Set(value);
+		}
+	}
+	else if (eAct == MM::AfterSet)
+	{
+		// user triggered set request
+		double request;
+		pProp->Get(request);
+
+		// one copy for the check and the write-through, the watcher may
+		// move activeChannel_ in between
+		std::string channel = getActiveChannel();
+
+		// out of range requests are rejected here, without ever reaching
+		// the instrument
+		ret = checkLimits(channel, request, unit);
+
+		if (ret != DEVICE_OK)
+		{
+			pProp->Set(value);
+			return ret;
+		}
+
+		std::string valueStr = doubleToStr(request, unit);
+
+		if (!dispatcher_.write(cmd + " " + valueStr))
+		{
+			ret = ioError(ERR_WRITE_FAILED);
+		}
+		else
+		{
+			// write-through, so the watcher doesn't report our own change
+			visa_compat::lock_guard<visa_compat::mutex> lock(stateMutex_);
+
+			value = request;
+			BK9130BChannelState& st = state_[channel];
+			(unit == 'A' ? st.current : st.voltage) = value;
+			st.updated = GetCurrentMMTime().getMsec();
+			publishSnapshot();
+			watcher_.burst(channelIndex(channel));
+		}
+	}
+
+	return ret;
+}
+/*----------------------------------------------------------------------------*/
+int BK9130B::OnState(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+	int ret = DEVICE_OK;
+
+	if (eAct == MM::BeforeGet)
+	{
+		bool open;
+		GetOpen(open);
+		pProp->Set(open ? 1L : 0L);
+	}
+	else if (eAct == MM::AfterSet)
+	{
+		long state;
+		pProp->Get(state);
+		ret = SetOpen(state != 0);
+	}
+	else if (eAct == MM::IsSequenceable)
+	{
+#ifdef BK9130B_LIST_SEQUENCING
+		pProp->SetSequenceable(BK9130B_LIST_MAX);
+#else
+		pProp->SetSequenceable(0);
+#endif
+	}
+	else if (eAct == MM::AfterLoadSequence)
+	{
+		// the on steps hold the active channel's setpoints, the off steps
+		// 0 V / 0 A, so the output itself never has to be switched
+		std::vector<std::string> sequence = pProp->GetSequence();
+
+		std::string channel;
+		{
+			visa_compat::lock_guard<visa_compat::mutex> lock(stateMutex_);
+			channel = activeChannel_;
+		}
+
+		int k = channelIndex(channel);
+
+		if (k < 0)
+		{
+			return ERR_INVALID_CHANNEL;
+		}
+
+		// the cache only has setpoints that were written or polled, so they
+		// are read back first (without the query delay)
+		const char* fields[] = {"SOUR:VOLT:LEV?", "SOUR:CURR:LEV?"};
+		std::vector<std::string> replies;
+
+		{
+			VISADevice::IOLock io(dev_.ioMutex());
+
+			if (!dev_.write("INST:SEL " + channel))
+			{
+				return ioError(ERR_WRITE_FAILED);
+			}
+
+			replies = dev_.queryBatch(std::vector<std::string>(fields, fields + 2));
+		}
+
+		if (replies[0].empty() || replies[1].empty())
+		{
+			return ioError(ERR_QUERY_FAILED);
+		}
+
+		BK9130BChannelState st;
+		{
+			visa_compat::lock_guard<visa_compat::mutex> lock(stateMutex_);
+
+			BK9130BChannelState& cached = state_[channel];
+			cached.voltage = strtod(replies[0].c_str(), NULL);
+			cached.current = strtod(replies[1].c_str(), NULL);
+			cached.updated = GetCurrentMMTime().getMsec();
+
+			if (activeChannel_ == channel)
+			{
+				outputVoltage_ = cached.voltage;
+				outputCurrent_ = cached.current;
+			}
+
+			st = cached;
+			publishSnapshot();
+		}
+
+		std::vector<BK9130BListStep> steps;
+		steps.reserve(sequence.size());
+
+		for (std::size_t j = 0; j < sequence.size(); ++j)
+		{
+			if (sequence[j] != "0" && sequence[j] != "1")
+			{
+				return ERR_INVALID_SEQUENCE;
+			}
+
+			steps.push_back(sequence[j] == "1" ?
+				BK9130BListStep(st.voltage, st.current) : BK9130BListStep());
+		}
+
+		// repeated forever, as Micro-Manager wraps sequences around
+		ret = loadList(k, steps, 0);
+	}
+	else if (eAct == MM::StartSequence)
+	{
+		ret = startLists(true);
+	}
+	else if (eAct == MM::StopSequence)
+	{
+		ret = stopLists();
+	}
+
+	return ret;
+}
+/*----------------------------------------------------------------------------*/
+int BK9130B::OnRippleWindow(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+	if (eAct == MM::BeforeGet)
+	{
+		pProp->Set(static_cast<long>(window_.capacity()));
+	}
+	else if (eAct == MM::AfterSet)
+	{
+		long capacity;
+		pProp->Get(capacity);
+
+		if (static_cast<std::size_t>(capacity) != window_.capacity())
+		{
+			window_.setCapacity(static_cast<std::size_t>(capacity));
+		}
+	}
+
+	return DEVICE_OK;
+}
+/*----------------------------------------------------------------------------*/
+// statistics of one channel / quantity over the polls in the ripple window,
+// 0 until the first poll
+int BK9130B::OnRipple(MM::PropertyBase* pProp, MM::ActionType eAct, long index)
+{
+	if (eAct == MM::BeforeGet)
+	{
+		long field = index % g_PSURippleCount;
+		std::size_t column = 2 * (index / g_PSURippleCount) + field / 4;
+
+		VISATelemetryWindow::Stats stats;
+		window_.stats(column, stats);
+
+		switch (field % 4)
+		{
+			case 0:
+				pProp->Set(stats.mean);
+				break;
+			case 1:
+				pProp->Set(std::sqrt(stats.variance));
+				break;
+			case 2:
+				pProp->Set(stats.peakToPeak);
+				break;
+			case 3:
+				pProp->Set(stats.drift);
+				break;
+			default:
+				return DEVICE_INVALID_PROPERTY;
+		}
+	}
+
+	return DEVICE_OK;
+}
+/*----------------------------------------------------------------------------*/
+int BK9130B::OnProtection(MM::PropertyBase* pProp, MM::ActionType eAct, long index)
+{
+	if (eAct == MM::BeforeGet)
+	{
+		BK9130BSnapshot snap;
+		GetSnapshot(snap);
+
+		const BK9130BChannelState& st = snap.channel[index / g_PSUProtectionCount];
+
+		switch (index % g_PSUProtectionCount)
+		{
+			case 0:
+				pProp->Set(regulationName(st));
+				break;
+			case 1:
+				pProp->Set(protectionName(st).c_str());
+				break;
+			default:
+				return DEVICE_INVALID_PROPERTY;
+		}
+	}
+
+	return DEVICE_OK;
+}
+/*----------------------------------------------------------------------------*/
+int BK9130B::OnPollInterval(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+	if (eAct == MM::BeforeGet)
+	{
+		pProp->Set(pollInterval_);
+	}
+	else if (eAct == MM::AfterSet)
+	{
+		pProp->Get(pollInterval_);
+
+		if (pollInterval_ > 0)
+		{
+			watcher_.setInterval(pollInterval_);
+
+			if (initialized_)
+			{
+				startThread(watcher_, "State watcher");
+			}
+		}
+		else
+		{
+			// back to querying the instrument on every get
+			watcher_.stop();
+		}
+	}
+
+	return DEVICE_OK;
+}
+/*----------------------------------------------------------------------------*/
+int BK9130B::OnBurstInterval(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+	if (eAct == MM::BeforeGet)
+	{
+		pProp->Set(burstInterval_);
+	}
+	else if (eAct == MM::AfterSet)
+	{
+		pProp->Get(burstInterval_);
+		watcher_.setBurstInterval(burstInterval_);
+	}
+
+	return DEVICE_OK;
+}
+/*----------------------------------------------------------------------------*/
+// polls made, and the share of polls saved compared to polling every channel
+// at the burst interval all the time
+int BK9130B::OnPollStats(MM::PropertyBase* pProp, MM::ActionType eAct, long index)
+{
+	if (eAct == MM::BeforeGet)
+	{
+		BK9130BWatcher::Stats stats = watcher_.getStats();
+
+		switch (index)
+		{
+			case 0:
+				pProp->Set(static_cast<double>(stats.polls));
+				break;
+			case 1:
+				pProp->Set(stats.baseline > 0.0 ? 100.0 * (1.0 - stats.polls / stats.baseline) : 0.0);
+				break;
+			default:
+				return DEVICE_INVALID_PROPERTY;
+		}
+	}
+
+	return DEVICE_OK;
+}
+/*----------------------------------------------------------------------------*/
+int BK9130B::OnTelemetryStats(MM::PropertyBase* pProp, MM::ActionType eAct, long index)
+{
+	if (eAct == MM::BeforeGet)
+	{
+		switch (index)
+		{
+			case 0:
+				pProp->Set(static_cast<double>(telemetry_.samples()));
+				break;
+			case 1:
+			{
+				std::size_t compressed = telemetry_.compressedBytes();
+				pProp->Set(compressed > 0 ? static_cast<double>(telemetry_.rawBytes()) / compressed : 0.0);
+				break;
+			}
+			default:
+				return DEVICE_INVALID_PROPERTY;
+		}
+	}
+
+	return DEVICE_OK;
+}
+/*----------------------------------------------------------------------------*/
+// writes the telemetry recorded so far to the file the property is set to
+int BK9130B::OnTelemetryFile(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+	if (eAct == MM::AfterSet)
+	{
+		std::string path;
+		pProp->Get(path);
+
+		if (path.empty())
+		{
+			return DEVICE_OK;
+		}
+
+		std::ofstream out(path.c_str(), std::ios::binary);
+
+		if (!out || !telemetry_.save(out))
+		{
+			LogMessage("Failed to write telemetry to " + path);
+			return ERR_TELEMETRY_FILE;
+		}
+	}
+
+	return DEVICE_OK;
+}
+/*----------------------------------------------------------------------------*/
+// adds entries to the command schedule, see ERR_INVALID_SCHEDULE for the format
+int BK9130B::OnSchedule(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+	if (eAct == MM::AfterSet)
+	{
+		std::string schedule;
+		pProp->Get(schedule);
+
+		// parse everything first so that a bad entry doesn't leave the
+		// schedule half populated
+		std::vector<std::pair<double, std::vector<std::string> > > entries;
+
+		std::istringstream in(schedule);
+		std::string entry;
+
+		while (std::getline(in, entry, '|'))
+		{
+			const char* start = entry.c_str();
+			char* end = 0;
+			double t = strtod(start, &end);
+
+			std::string rest(end);
+			std::istringstream cmdIn(rest);
+			std::vector<std::string> cmds;
+			std::string cmd;
+
+			while (std::getline(cmdIn, cmd, ';'))
+			{
+				std::string::size_type first = cmd.find_first_not_of(" \t");
+				std::string::size_type last = cmd.find_last_not_of(" \t");
+
+				if (first != std::string::npos)
+				{
+					cmds.push_back(cmd.substr(first, last - first + 1));
+				}
+			}
+
+			if (end == start || cmds.empty())
+			{
+				return ERR_INVALID_SCHEDULE;
+			}
+
+			entries.push_back(std::make_pair(t, cmds));
+		}
+
+		// the commands go straight to the instrument, so they get the same
+		// limit checks a property write does: walk them in the order they
+		// will run, following any INST:SEL from the current channel on
+		std::stable_sort(entries.begin(), entries.end(), scheduledEarlier);
+
+		std::string channel;
+		{
+			visa_compat::lock_guard<visa_compat::mutex> lock(stateMutex_);
+			channel = activeChannel_;
+		}
+
+		for (std::size_t k = 0; k < entries.size(); ++k)
+		{
+			for (std::size_t j = 0; j < entries[k].second.size(); ++j)
+			{
+				int ret = checkScheduled(entries[k].second[j], channel);
+
+				if (ret != DEVICE_OK)
+				{
+					LogMessage("Rejected schedule entry: " + entries[k].second[j]);
+					return ret;
+				}
+			}
+		}
+
+		for (std::size_t k = 0; k < entries.size(); ++k)
+		{
+			scheduler_.schedule(entries[k].first, entries[k].second);
+		}
+
+		pProp->Set("");
+	}
+
+	return DEVICE_OK;
+}
+/*----------------------------------------------------------------------------*/
+int BK9130B::OnScheduleState(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+	if (eAct == MM::BeforeGet)
+	{
+		pProp->Set(scheduler_.isRunning() ? g_PSUScheduleState_Running : g_PSUScheduleState_Stopped);
+	}
+	else if (eAct == MM::AfterSet)
+	{
+		std::string state;
+		pProp->Get(state);
+
+		if (state == g_PSUScheduleState_Running)
+		{
+			// time 0 of the schedule is *now*
+			scheduler_.resetStats();
+			scheduler_.resetClock();
+			startThread(scheduler_, "Scheduler");
+		}
+		else
+		{
+			scheduler_.stop();
+			scheduler_.clear();
+		}
+	}
+
+	return DEVICE_OK;
+}
+/*----------------------------------------------------------------------------*/
+int BK9130B::OnScheduleStats(MM::PropertyBase* pProp, MM::ActionType eAct, long index)
+{
+	if (eAct == MM::BeforeGet)
+	{
+		VISAScheduler::Stats stats = scheduler_.getStats();
+
+		switch (index)
+		{
+			case 0:
+				pProp->Set(static_cast<double>(scheduler_.pending()));
+				break;
+			case 1:
+				pProp->Set(stats.meanError);
+				break;
+			case 2:
+				pProp->Set(stats.maxAbsError);
+				break;
+			case 3:
+				pProp->Set(stats.writeLatency);
+				break;
+			default:
+				return DEVICE_INVALID_PROPERTY;
+		}
+	}
+
+	return DEVICE_OK;
+}
+/*----------------------------------------------------------------------------*/
+int BK9130B::OnTelemetry(MM::PropertyBase* pProp, MM::ActionType eAct, long index)
+{
+	if (eAct == MM::BeforeGet)
+	{
+		BK9130BSnapshot snap;
+		GetSnapshot(snap);
+
+		const BK9130BChannelState& st = snap.channel[index / g_PSUTelemetryCount];
+
+		switch (index % g_PSUTelemetryCount)
+		{
+			case 0:
+				pProp->Set(st.output ? 1.0 : 0.0);
+				break;
+			case 1:
+				pProp->Set(st.measVoltage);
+				break;
+			case 2:
+				pProp->Set(st.measCurrent);
+				break;
+			case 3:
+				pProp->Set(st.updated);
+				break;
+			case 4:
+				pProp->Set(GetCurrentMMTime().getMsec() - st.updated);
+				break;
+			default:
+				return DEVICE_INVALID_PROPERTY;
+		}
+	}
+
+	return DEVICE_OK;
+}
+/*----------------------------------------------------------------------------*/
+int BK9130B::OnExposureCalibrate(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+	if (eAct == MM::AfterSet)
+	{
+		long cycles;
+		pProp->Get(cycles);
+
+		// runs to completion here, the property reads 0 again afterwards
+		pProp->Set(0L);
+
+		if (cycles > 0)
+		{
+			return calibrateExposure(cycles);
+		}
+	}
+
+	return DEVICE_OK;
+}
+/*----------------------------------------------------------------------------*/
+int BK9130B::OnExposureSchedule(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+	if (eAct == MM::AfterSet)
+	{
+		std::string schedule;
+		pProp->Get(schedule);
+		pProp->Set("");
+
+		if (schedule.empty())
+		{
+			return DEVICE_OK;
+		}
+
+		// <start>,<exposure>,<interval>,<count>
+		double values[4] = {0.0, 0.0, 0.0, 0.0};
+		const char* pos = schedule.c_str();
+
+		for (int k = 0; k < 4; ++k)
+		{
+			char* end = 0;
+			values[k] = strtod(pos, &end);
+
+			if (end == pos || (k < 3 && *end != ','))
+			{
+				return ERR_INVALID_EXPOSURE;
+			}
+
+			pos = end + 1;
+		}
+
+		long count = static_cast<long>(values[3]);
+
+		if (values[0] < 0.0 || values[1] <= 0.0 || values[2] < values[1] || count < 1)
+		{
+			return ERR_INVALID_EXPOSURE;
+		}
+
+		std::string channel;
+		{
+			visa_compat::lock_guard<visa_compat::mutex> lock(stateMutex_);
+			channel = activeChannel_;
+		}
+
+		std::vector<VISAExposureLock::Edge> edges = exposure_.compile(values[0], values[1], values[2], count);
+
+		std::vector<std::string> cmds(2);
+		cmds[0] = "INST:SEL " + channel;
+
+		for (std::size_t k = 0; k < edges.size(); ++k)
+		{
+			cmds[1] = edges[k].on ? "SOUR:CHAN:OUTP:STAT ON" : "SOUR:CHAN:OUTP:STAT OFF";
+			scheduler_.schedule(edges[k].t, cmds);
+		}
+
+		if (exposure_.getCount(true) == 0)
+		{
+			LogMessage("Exposure schedule queued without calibration, the output will lag the exposures");
+		}
+	}
+
+	return DEVICE_OK;
+}
+/*----------------------------------------------------------------------------*/
+int BK9130B::OnExposureStats(MM::PropertyBase* pProp, MM::ActionType eAct, long index)
+{
+	if (eAct == MM::BeforeGet)
+	{
+		VISAExposureLock::Residual res;
+		if (index >= 3)
+		{
+			res = exposure_.residual(scheduler_.getRecords());
+		}
+
+		switch (index)
+		{
+			case 0:
+				pProp->Set(exposure_.getDelay(true) / 1000.0);
+				break;
+			case 1:
+				pProp->Set(exposure_.getDelay(false) / 1000.0);
+				break;
+			case 2:
+			{
+				double on = exposure_.getJitter(true), off = exposure_.getJitter(false);
+				pProp->Set((on > off ? on : off) / 1000.0);
+				break;
+			}
+			case 3:
+				pProp->Set(res.mean);
+				break;
+			case 4:
+				pProp->Set(res.maxAbs);
+				break;
+			default:
+				return DEVICE_INVALID_PROPERTY;
+		}
+	}
+
+	return DEVICE_OK;
+}
+/*----------------------------------------------------------------------------*/
+int BK9130B::OnFireStats(MM::PropertyBase* pProp, MM::ActionType eAct, long index)
+{
+	if (eAct == MM::BeforeGet)
+	{
+		VISAPulser::Stats stats = pulser_.getStats();
+
+		switch (index)
+		{
+			case 0:
+				pProp->Set(static_cast<double>(stats.count));
+				break;
+			case 1:
+				pProp->Set(static_cast<double>(stats.failed));
+				break;
+			case 2:
+				pProp->Set(stats.meanError);
+				break;
+			case 3:
+				pProp->Set(stats.rmsError);
+				break;
+			case 4:
+				pProp->Set(stats.maxAbsError);
+				break;
+			case 5:
+				pProp->Set(stats.writeLatency);
+				break;
+			default:
+				return DEVICE_INVALID_PROPERTY;
+		}
+	}
+
+	return DEVICE_OK;
+}
+/*----------------------------------------------------------------------------*/
+int BK9130B::OnInterleaveState(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+	if (eAct == MM::BeforeGet)
+	{
+		pProp->Set(listRunning_ ? g_PSUScheduleState_Running : g_PSUScheduleState_Stopped);
+	}
+	else if (eAct == MM::AfterSet)
+	{
+		std::string state;
+		pProp->Get(state);
+
+		if (state == g_PSUScheduleState_Running)
+		{
+			return startInterleave();
+		}
+		else if (listRunning_)
+		{
+			return stopLists();
+		}
+	}
+
+	return DEVICE_OK;
+}
+/*----------------------------------------------------------------------------*/
+int BK9130B::OnInterleaveRate(MM::PropertyBase* pProp, MM::ActionType eAct, long index)
+{
+	if (eAct == MM::BeforeGet)
+	{
+		visa_compat::lock_guard<visa_compat::mutex> lock(stateMutex_);
+
+		switch (index)
+		{
+			case 0:
+				pProp->Set(interleaveRate_);
+				break;
+			case 1:
+				pProp->Set(interleaveAchieved_);
+				break;
+			default:
+				return DEVICE_INVALID_PROPERTY;
+		}
+	}
+
+	return DEVICE_OK;
+}
+/*----------------------------------------------------------------------------*/
+int BK9130B::OnFaultProfile(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+	if (eAct == MM::BeforeGet)
+	{
+		pProp->Set(faultProfile_.c_str());
+	}
+	else if (eAct == MM::AfterSet)
+	{
+		std::string spec;
+		pProp->Get(spec);
+
+		VISAFaultProfile profile;
+		std::string err;
+
+		if (!VISAFaultProfile::parse(spec, profile, err))
+		{
+			std::vector<std::string> presets = VISAFaultProfile::presets();
+			LogMessage(err + " (presets: " + join(presets.begin(), presets.end(), ", ") + ")");
+			pProp->Set(faultProfile_.c_str());
+			return ERR_INVALID_FAULTS;
+		}
+
+		// statistics are per profile
+		faults_.setProfile(profile);
+		faults_.resetStats();
+		faultProfile_ = spec;
+
+		LogMessage("Fault profile: " + spec);
+	}
+
+	return DEVICE_OK;
+}
+/*----------------------------------------------------------------------------*/
+int BK9130B::OnIOStats(MM::PropertyBase* pProp, MM::ActionType eAct, long index)
+{
+	if (eAct == MM::BeforeGet)
+	{
+		VISAFaultInjector::Stats stats = faults_.getStats();
+
+		switch (index)
+		{
+			case 0:
+				pProp->Set(static_cast<double>(stats.operations));
+				break;
+			case 1:
+				pProp->Set(static_cast<double>(stats.injected));
+				break;
+			case 2:
+				pProp->Set(static_cast<double>(stats.lostCommands));
+				break;
+			case 3:
+				pProp->Set(stats.meanRecovery);
+				break;
+			case 4:
+				pProp->Set(stats.maxRecovery);
+				break;
+			case 5:
+				pProp->Set(stats.latencyP50);
+				break;
+			case 6:
+				pProp->Set(stats.latencyP99);
+				break;
+			case 7:
+				pProp->Set(stats.latencyP999);
+				break;
+			case 8:
+				pProp->Set(stats.latencyMax);
+				break;
+			default:
+				return DEVICE_INVALID_PROPERTY;
+		}
+	}
+
+	return DEVICE_OK;
+}
+/*----------------------------------------------------------------------------*/
+int BK9130B::OnFlowControl(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+	if (eAct == MM::BeforeGet)
+	{
+		pProp->Set(static_cast<long>(dev_.getFlowControl()));
+	}
+	else if (eAct == MM::AfterSet)
+	{
+		long window;
+		pProp->Get(window);
+
+		if (static_cast<std::size_t>(window) != dev_.getFlowControl())
+		{
+			dev_.setFlowControl(static_cast<std::size_t>(window));
+			dev_.resetFlowStats();
+		}
+	}
+
+	return DEVICE_OK;
+}
+/*----------------------------------------------------------------------------*/
+int BK9130B::OnFlowStats(MM::PropertyBase* pProp, MM::ActionType eAct, long index)
+{
+	if (eAct == MM::BeforeGet)
+	{
+		VISADevice::FlowStats stats = dev_.getFlowStats();
+
+		switch (index)
+		{
+			case 0:
+				pProp->Set(static_cast<double>(stats.window));
+				break;
+			case 1:
+				pProp->Set(static_cast<double>(stats.syncs));
+				break;
+			case 2:
+				pProp->Set(static_cast<double>(stats.overruns));
+				break;
+			case 3:
+				pProp->Set(stats.rate);
+				break;
+			default:
+				return DEVICE_INVALID_PROPERTY;
+		}
+	}
+
+	return DEVICE_OK;
+}
+/*============================================================================*/
+/**
+* BK9130BGroup implementation
+*/
+BK9130BGroup::BK9130BGroup() :
+	group_(),
+	initialized_(false),
+	timeout_(2000),
+	activeChannel_(g_PSUActiveChannel_CH1),
+	open_(false),
+	outputVoltage_(1.0),
+	outputCurrent_(0.0)
+{
+	InitializeDefaultErrorMessages();
+
+	SetErrorText(ERR_WRITE_FAILED, "Write operation failed on one or more supplies!");
+	SetErrorText(ERR_DEVICE_TIMEOUT, "One or more supplies did not respond within the timeout set by \"Timeout (ms)\"");
+	SetErrorText(ERR_INVALID_CHANNEL, "Invalid channel given: MUST be CH1, CH2 OR CH3");
+	SetErrorText(ERR_INVALID_VOLTAGE, "Invalid voltage request: outside the range (or above the OVP level) of one or more supplies");
+	SetErrorText(ERR_INVALID_CURRENT, "Invalid current request: outside the range of one or more supplies");
+
+	int ret = CreateProperty(MM::g_Keyword_Description, "Group of BK Precision 9130B power supplies driven in sync", MM::String, true);
+	assert(ret == DEVICE_OK);
+
+	// one pre-init slot per supply, unused slots are left as "None" (the
+	// shared registry is held until we go away, so the scan is not repeated
+	// for every device created alongside us)
+	VISADevice dev;
+	std::vector<std::string> devIDs = VISARegistry::acquireShared(dev, "?*").present();
+
+	devIDs.insert(devIDs.begin(), g_GroupSupply_None);
+
+	for (int k = 1; k <= BK9130B_GROUP_MAX; ++k)
+	{
+		std::ostringstream name;
+		name << g_GroupSupplyProperty << " " << k;
+
+		ret = CreateProperty(name.str().c_str(), g_GroupSupply_None, MM::String, false, 0, true);
+		assert(ret == DEVICE_OK);
+
+		ret = SetAllowedValues(name.str().c_str(), devIDs);
+		assert(ret == DEVICE_OK);
+	}
+
+	ret = CreateIntegerProperty(g_PSUTimeoutProperty, timeout_, false, 0, true);
+	assert(ret == DEVICE_OK);
+
+	ret = SetPropertyLimits(g_PSUTimeoutProperty, 0, 1e6);
+	assert(ret == DEVICE_OK);
+
+	// the group's writes run on I/O threads of its own, one per supply
+	ret = CreateIntegerProperty(g_PSUThreadCPUProperty, -1, false, 0, true);
+	assert(ret == DEVICE_OK);
+
+	ret = SetPropertyLimits(g_PSUThreadCPUProperty, -1, 63);
+	assert(ret == DEVICE_OK);
+
+	ret = CreateIntegerProperty(g_PSUThreadPriorityProperty, 0, false, 0, true);
+	assert(ret == DEVICE_OK);
+
+	ret = SetPropertyLimits(g_PSUThreadPriorityProperty, 0, 99);
+	assert(ret == DEVICE_OK);
+}
+/*----------------------------------------------------------------------------*/
+BK9130BGroup::~BK9130BGroup()
+{
+	if (initialized_)
+	{
+		Shutdown();
+	}
+
+	VISARegistry::releaseShared();
+}
+/*----------------------------------------------------------------------------*/
+int BK9130BGroup::Initialize()
+{
+	if (initialized_)
+	{
+		return DEVICE_OK;
+	}
+
+	int ret = GetProperty(g_PSUTimeoutProperty, timeout_);
+	assert(ret == DEVICE_OK);
+
+	long cpu = -1, priority = 0;
+
+	ret = GetProperty(g_PSUThreadCPUProperty, cpu);
+	assert(ret == DEVICE_OK);
+
+	ret = GetProperty(g_PSUThreadPriorityProperty, priority);
+	assert(ret == DEVICE_OK);
+
+	VISAThreadConfig config;
+	config.cpu = static_cast<int>(cpu);
+	config.priority = static_cast<int>(priority);
+
+	group_.setConfig(config);
+
+	for (int k = 1; k <= BK9130B_GROUP_MAX; ++k)
+	{
+		std::ostringstream name;
+		name << g_GroupSupplyProperty << " " << k;
+
+		char idBuf[MM::MaxStrLength];
+		ret = GetProperty(name.str().c_str(), idBuf);
+		assert(ret == DEVICE_OK);
+
+		idBuf[MM::MaxStrLength-1] = '\0';
+
+		if (strcmp(idBuf, g_GroupSupply_None) != 0 &&
+			!group_.add(idBuf, VI_NO_LOCK, static_cast<ViUInt32>(timeout_)))
+		{
+			LogMessage(group_.getLastError());
+			group_.clear();
+			return DEVICE_NOT_CONNECTED;
+		}
+	}
+
+	if (group_.size() == 0)
+	{
+		LogMessage("No supplies selected for the group");
+		return DEVICE_ERR;
+	}
+
+	std::vector<std::string> opts;
+	opts.push_back("INST:SEL CH1");
+	opts.push_back("SOUR:CHAN:OUTP:STAT OFF");
+	opts.push_back("INST:SEL CH2");
+	opts.push_back("SOUR:CHAN:OUTP:STAT OFF");
+	opts.push_back("INST:SEL CH3");
+	opts.push_back("SOUR:CHAN:OUTP:STAT OFF");
+
+	for (std::size_t k = 0; k < group_.size(); ++k)
+	{
+		group_.device(k).onClose(opts);
+	}
+
+	probeLimits();
+
+	// a failed Initialize can be retried, the properties are only created
+	// the first time around
+	if (!HasProperty(g_PSUActiveChannelProperty))
+	{
+		// active channel
+		CPropertyAction* pAct = new CPropertyAction(this, &BK9130BGroup::OnActiveChannel);
+
+		ret = CreateProperty(g_PSUActiveChannelProperty, activeChannel_.c_str(), MM::String, false, pAct, false);
+		assert(ret == DEVICE_OK);
+
+		opts.clear();
+		opts.push_back(g_PSUActiveChannel_CH1);
+		opts.push_back(g_PSUActiveChannel_CH2);
+		opts.push_back(g_PSUActiveChannel_CH3);
+
+		ret = SetAllowedValues(g_PSUActiveChannelProperty, opts);
+		assert(ret == DEVICE_OK);
+
+		// output voltage / current, applied to every supply
+		pAct = new CPropertyAction(this, &BK9130BGroup::OnOutputVoltage);
+
+		ret = CreateFloatProperty(g_PSUOutputVoltageProperty, outputVoltage_, false, pAct, false);
+		assert(ret == DEVICE_OK);
+
+		pAct = new CPropertyAction(this, &BK9130BGroup::OnOutputCurrent);
+
+		ret = CreateFloatProperty(g_PSUOutputCurrentProperty, outputCurrent_, false, pAct, false);
+		assert(ret == DEVICE_OK);
+
+		// shutter state
+		pAct = new CPropertyAction(this, &BK9130BGroup::OnState);
+
+		ret = CreateIntegerProperty(g_PSUStateProperty, 0, false, pAct, false);
+		assert(ret == DEVICE_OK);
+
+		ret = SetPropertyLimits(g_PSUStateProperty, 0, 1);
+		assert(ret == DEVICE_OK);
+
+		// timing of the last group write
+		pAct = new CPropertyAction(this, &BK9130BGroup::OnSkew);
+
+		ret = CreateFloatProperty(g_GroupSkewProperty, 0.0, true, pAct, false);
+		assert(ret == DEVICE_OK);
+
+		pAct = new CPropertyAction(this, &BK9130BGroup::OnDuration);
+
+		ret = CreateFloatProperty(g_GroupDurationProperty, 0.0, true, pAct, false);
+		assert(ret == DEVICE_OK);
+	}
+
+	applyLimits();
+
+	// same defaults as a single supply
+	opts.clear();
+	opts.push_back("INST:SEL CH1");
+	opts.push_back("SOUR:CHAN:OUTP:STAT OFF");
+	opts.push_back("SOUR:VOLT 1.0 V");
+	opts.push_back("SOUR:CURR 0.0 A");
+
+	ret = writeAll(opts);
+
+	// the first write started the group's I/O threads
+	std::string err = group_.getConfigError();
+	if (!err.empty())
+	{
+		LogMessage("Group I/O thread: " + err);
+	}
+
+	initialized_ = ret == DEVICE_OK;
+
+	if (!initialized_)
+	{
+		group_.clear();
+	}
+
+	return ret;
+}
+/*----------------------------------------------------------------------------*/
+int BK9130BGroup::Shutdown()
+{
+	// closing each device sends its onClose commands
+	group_.clear();
+	initialized_ = false;
+
+	return DEVICE_OK;
+}
+/*----------------------------------------------------------------------------*/
+bool BK9130BGroup::Busy()
 {
 	return false;
 }
 /*----------------------------------------------------------------------------*/
-void BK9130B::GetName(char* name) const
+void BK9130BGroup::GetName(char* name) const
 {
-   CDeviceUtils::CopyLimitedString(name, g_PSUName);
+	CDeviceUtils::CopyLimitedString(name, g_GroupName);
 }
 /*----------------------------------------------------------------------------*/
-MM::DeviceType BK9130B::GetType() const
+MM::DeviceType BK9130BGroup::GetType() const
 {
 	return BK9310B_DEVICE_TYPE;
 }
 /*----------------------------------------------------------------------------*/
-std::string BK9130B::doubleToStr(const double& val, const char& unit) const
+std::string BK9130BGroup::doubleToStr(const double& val, const char& unit) const
 {
-	// 128 chars *SHOULD* be safe...
 	char buf[128];
-	sprintf(buf, "%f %c", val, unit);
-	buf[127] = '\0';
+	snprintf(buf, sizeof(buf), "%f %c", val, unit);
 	return std::string(buf);
 }
 /*----------------------------------------------------------------------------*/
-int BK9130B::SetOpen(bool open)
+// probes every supply as a single BK9130B does and keeps, per channel, the
+// range (and OVP level) that all of them can take
+void BK9130BGroup::probeLimits()
 {
-	int ret = DEVICE_OK;
+	limits_.clear();
 
-	if (open != activeChannelState_)
+	for (std::size_t c = 0; c < g_PSUChannelCount; ++c)
 	{
-		std::string stateStr = open ? "ON" : "OFF";
+		const std::string channel(g_PSUChannels[c]);
 
-		// sending an channel select command (INST:SEL) souldn't be needed,
-		// but we'll leave it for now just to be safe
-		std::vector<std::string> cmd;
-		cmd.push_back("INST:SEL " + activeChannel_);
-		cmd.push_back("SOUR:CHAN:OUTP:STAT " + stateStr);
+		// same defaults as a single supply, CH3 is the 5 V channel
+		BK9130BLimits merged = channel == g_PSUActiveChannel_CH3 ?
+			BK9130BLimits(5.0, 3.0) : BK9130BLimits();
+		merged.ovp = 0.0;
 
-		if (dev_.write(cmd))
+		for (std::size_t k = 0; k < group_.size(); ++k)
 		{
-			activeChannelState_ = open;
-		}
-		else
-		{
-			ret = ERR_WRITE_FAILED;
-			LogMessage(dev_.getLastError());
+			BK9130BLimits lim = channel == g_PSUActiveChannel_CH3 ?
+				BK9130BLimits(5.0, 3.0) : BK9130BLimits();
+
+			if (!probeChannelLimits(group_.device(k), channel, lim))
+			{
+				LogMessage("Limit probe failed: " + group_.device(k).getLastError());
+			}
+
+			merged.vMin = std::max(merged.vMin, lim.vMin);
+			merged.vMax = std::min(merged.vMax, lim.vMax);
+			merged.iMin = std::max(merged.iMin, lim.iMin);
+			merged.iMax = std::min(merged.iMax, lim.iMax);
+
+			if (lim.ovp > 0 && (merged.ovp <= 0 || lim.ovp < merged.ovp))
+			{
+				merged.ovp = lim.ovp;
+			}
 		}
+
+		limits_[channel] = merged;
+	}
+}
+/*----------------------------------------------------------------------------*/
+// sets the voltage / current property limits to those of the active channel
+int BK9130BGroup::applyLimits()
+{
+	std::map<std::string, BK9130BLimits>::const_iterator it =
+		limits_.find(activeChannel_);
+
+	if (it == limits_.end())
+	{
+		return ERR_INVALID_CHANNEL;
+	}
+
+	int ret = SetPropertyLimits(g_PSUOutputVoltageProperty, it->second.vMin, it->second.vMax);
+
+	if (ret == DEVICE_OK)
+	{
+		ret = SetPropertyLimits(g_PSUOutputCurrentProperty, it->second.iMin, it->second.iMax);
 	}
 
 	return ret;
 }
 /*----------------------------------------------------------------------------*/
-int BK9130B::GetOpen(bool& state)
+int BK9130BGroup::checkLimits(double value, const char& unit) const
 {
-	int ret = DEVICE_OK;
+	std::map<std::string, BK9130BLimits>::const_iterator it =
+		limits_.find(activeChannel_);
 
-	state = activeChannelState_;
+	if (it == limits_.end())
+	{
+		return ERR_INVALID_CHANNEL;
+	}
+
+	return checkRequest(it->second, value, unit);
+}
+/*----------------------------------------------------------------------------*/
+// writes <cmd> to every supply at once
+int BK9130BGroup::writeAll(const std::vector<std::string>& cmd)
+{
+	if (group_.writeAll(cmd))
+	{
+		return DEVICE_OK;
+	}
+
+	LogMessage(group_.getLastError());
+
+	bool timedOut = false;
+	for (std::size_t k = 0; k < group_.size(); ++k)
+	{
+		timedOut = timedOut || group_.device(k).timedOut();
+	}
+
+	return timedOut ? ERR_DEVICE_TIMEOUT : ERR_WRITE_FAILED;
+}
+/*----------------------------------------------------------------------------*/
+int BK9130BGroup::SetOpen(bool open)
+{
+	std::vector<std::string> cmd;
+	cmd.push_back("INST:SEL " + activeChannel_);
+	cmd.push_back(std::string("SOUR:CHAN:OUTP:STAT ") + (open ? "ON" : "OFF"));
+
+	int ret = writeAll(cmd);
+
+	if (ret == DEVICE_OK)
+	{
+		open_ = open;
+	}
 
 	return ret;
 }
 /*----------------------------------------------------------------------------*/
-int BK9130B::Fire(double duration)
+int BK9130BGroup::GetOpen(bool& state)
+{
+	state = open_;
+	return DEVICE_OK;
+}
+/*----------------------------------------------------------------------------*/
+int BK9130BGroup::Fire(double /*duration*/)
 {
 	return DEVICE_UNSUPPORTED_COMMAND;
 }
 /*----------------------------------------------------------------------------*/
-// sets the currently active channel
-int BK9130B::OnActiveChannel(MM::PropertyBase* pProp, MM::ActionType eAct)
+int BK9130BGroup::OnActiveChannel(MM::PropertyBase* pProp, MM::ActionType eAct)
 {
 	int ret = DEVICE_OK;
 
 	if (eAct == MM::BeforeGet)
 	{
-		// user performed get operation
-		std::string tmp = dev_.query("INST:SEL?");
-
-		if (tmp.empty())
-		{
-			ret = ERR_QUERY_FAILED;
-			LogMessage(dev_.getLastError());
-		}
-		else
-		{
-			pProp->Set(tmp.c_str());
-			activeChannel_ = tmp;
-		}
+		pProp->Set(activeChannel_.c_str());
 	}
 	else if (eAct == MM::AfterSet)
 	{
-		// user performed set operation
-		pProp->Get(activeChannel_);
-		if (!dev_.write("INST:SEL " + activeChannel_))
+		std::string channel;
+		pProp->Get(channel);
+
+		if (limits_.find(channel) == limits_.end())
 		{
-			ret = ERR_WRITE_FAILED;
-			LogMessage(dev_.getLastError());
+			pProp->Set(activeChannel_.c_str());
+			return ERR_INVALID_CHANNEL;
+		}
+
+		ret = writeAll(std::vector<std::string>(1, "INST:SEL " + channel));
+
+		if (ret == DEVICE_OK)
+		{
+			activeChannel_ = channel;
+			applyLimits();
 		}
 		else
 		{
-			// make sure our activeChannelState_ is up-to-date
-			// NOTE: we probably should check that the query was successful...
-			activeChannelState_ = dev_.query("SOUR:CHAN:OUTP:STAT?") == "1";
+			pProp->Set(activeChannel_.c_str());
 		}
 	}
 
 	return ret;
 }
 /*----------------------------------------------------------------------------*/
-int BK9130B::OnOutputVoltage(MM::PropertyBase* pProp, MM::ActionType eAct)
-{
-	return OnOutputChange(pProp, eAct, outputVoltage_, 'V');
-}
-/*----------------------------------------------------------------------------*/
-int BK9130B::OnOutputCurrent(MM::PropertyBase* pProp, MM::ActionType eAct)
-{
-	return  OnOutputChange(pProp, eAct, outputCurrent_, 'A');
-}
-/*----------------------------------------------------------------------------*/
-int BK9130B::OnOutputChange(MM::PropertyBase* pProp, MM::ActionType eAct, double& value, const char& unit)
+int BK9130BGroup::OnOutputVoltage(MM::PropertyBase* pProp, MM::ActionType eAct)
 {
 	int ret = DEVICE_OK;
 
-	std::string cmd = unit == 'A' ? "SOUR:CURR" : "SOUR:VOLT";
-
 	if (eAct == MM::BeforeGet)
 	{
-		// user triggered get request
-		std::string tmp = dev_.query(cmd + ":LEV?");
+		pProp->Set(outputVoltage_);
+	}
+	else if (eAct == MM::AfterSet)
+	{
+		double value;
+		pProp->Get(value);
 
-		if (tmp.empty())
+		// the same probed limits a single supply checks against
+		ret = checkLimits(value, 'V');
+
+		if (ret != DEVICE_OK)
 		{
-			ret = ERR_QUERY_FAILED;
-			LogMessage(dev_.getLastError());
+			pProp->Set(outputVoltage_);
+			return ret;
+		}
+
+		std::vector<std::string> cmd;
+		cmd.push_back("INST:SEL " + activeChannel_);
+		cmd.push_back("SOUR:VOLT " + doubleToStr(value, 'V'));
+
+		ret = writeAll(cmd);
+
+		if (ret == DEVICE_OK)
+		{
+			outputVoltage_ = value;
 		}
 		else
 		{
-			value = strtod(tmp.c_str(), NULL);
-			pProp->Set(value);
+			pProp->Set(outputVoltage_);
 		}
 	}
+
+	return ret;
+}
+/*----------------------------------------------------------------------------*/
+int BK9130BGroup::OnOutputCurrent(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+	int ret = DEVICE_OK;
+
+	if (eAct == MM::BeforeGet)
+	{
+		pProp->Set(outputCurrent_);
+	}
 	else if (eAct == MM::AfterSet)
 	{
-		// user triggered set request
+		double value;
 		pProp->Get(value);
 
-		// unlike CH1 and 2, CH3 has a 5V limit...
-		if ((activeChannel_ == "CH3") && (unit == 'V') && (value > 5.0))
+		ret = checkLimits(value, 'A');
+
+		if (ret != DEVICE_OK)
 		{
-			value = 5.0;
-			ret = ERR_INVALID_VOLTAGE;
+			pProp->Set(outputCurrent_);
+			return ret;
 		}
 
-		std::string valueStr = doubleToStr(value, unit);
+		std::vector<std::string> cmd;
+		cmd.push_back("INST:SEL " + activeChannel_);
+		cmd.push_back("SOUR:CURR " + doubleToStr(value, 'A'));
+
+		ret = writeAll(cmd);
 
-		if (!dev_.write(cmd + " " + valueStr))
+		if (ret == DEVICE_OK)
 		{
-			ret = ERR_WRITE_FAILED;
-			LogMessage(dev_.getLastError());
+			outputCurrent_ = value;
+		}
+		else
+		{
+			pProp->Set(outputCurrent_);
 		}
 	}
 
 	return ret;
 }
+/*----------------------------------------------------------------------------*/
+int BK9130BGroup::OnState(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+	int ret = DEVICE_OK;
+
+	if (eAct == MM::BeforeGet)
+	{
+		pProp->Set(open_ ? 1L : 0L);
+	}
+	else if (eAct == MM::AfterSet)
+	{
+		long state;
+		pProp->Get(state);
+		ret = SetOpen(state != 0);
+	}
+
+	return ret;
+}
+/*----------------------------------------------------------------------------*/
+int BK9130BGroup::OnSkew(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+	if (eAct == MM::BeforeGet)
+	{
+		pProp->Set(group_.getLastSkew());
+	}
+
+	return DEVICE_OK;
+}
+/*----------------------------------------------------------------------------*/
+int BK9130BGroup::OnDuration(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+	if (eAct == MM::BeforeGet)
+	{
+		pProp->Set(group_.getLastDuration());
+	}
+
+	return DEVICE_OK;
+}
 /*============================================================================*/
@@ -24,8 +24,21 @@
 #ifndef _BK9130B_H_
 #define _BK9130B_H_
 
+#include <map>
+#include <string>
+
 #include "DeviceBase.h"
 #include "VISADevice.h"
+#include "VISARegistry.h"
+#include "VISAThread.h"
+#include "VISAGroup.h"
+#include "VISAScheduler.h"
+#include "VISASnapshot.h"
+#include "VISAFaults.h"
+#include "VISATelemetry.h"
+#include "VISADispatch.h"
+#include "VISAExposure.h"
+#include "VISAPulse.h"
 
 /*------------------------------------------------------------------------------
   Error codes
@@ -36,14 +49,184 @@
 #define ERR_WRITE_FAILED		 105
 #define ERR_READ_FAILED 		 106
 #define ERR_QUERY_FAILED 		 107
+#define ERR_DEVICE_TIMEOUT 		 108
+#define ERR_INVALID_SCHEDULE 	 109
+#define ERR_INVALID_FAULTS 		 110
+#define ERR_TELEMETRY_FILE 		 111
+#define ERR_INVALID_EXPOSURE 	 112
+#define ERR_CALIBRATION_FAILED 	 113
+#define ERR_PULSE_BUSY 		 114
+#define ERR_INVALID_SEQUENCE 	 115
+#define ERR_INVALID_INTERLEAVE 	 116
+#define ERR_CALIBRATION_UNRESOLVED 117
+#define ERR_CALIBRATION_TIMEOUT  118
 
 /*----------------------------------------------------------------------------*/
 // device type as used by GetType() and InitializeModuleData()
 #define BK9310B_DEVICE_TYPE MM::ShutterDevice
 
+// maximum number of supplies in a BK9130BGroup: up to 16 a group write
+// takes ~1.4x a single supply's and the skew stays well under one write, at
+// 32 the worst skew is more than a whole write (test_console bench scale)
+#define BK9130B_GROUP_MAX 16
+
+// number of output channels (CH1 - CH3)
+#define BK9130B_CHANNEL_COUNT 3
+
+// measured values that move by less than this between polls count as stable,
+// and aren't pushed to the core (a couple of LSBs of the read back)
+#define BK9130B_VOLTAGE_TOLERANCE 0.002
+#define BK9130B_CURRENT_TOLERANCE 0.002
+
+// telemetry blocks (of 1024 samples) kept before the oldest are dropped
+#define BK9130B_TELEMETRY_BLOCKS 8192
+
+// default number of recent polls the ripple / noise statistics cover
+#define BK9130B_RIPPLE_WINDOW 256
+
+// longest the exposure lock calibration waits for the output to settle after
+// each on / off write (ms)
+#define BK9130B_EXPOSURE_SETTLE 1000
+
+// longest a whole exposure lock calibration may take (ms): the core thread
+// waits for it, and each edge holds the I/O lock while it is sampled
+#define BK9130B_CALIBRATION_MAX 30000
+
+// steps each channel's list memory holds (the longest State sequence)
+#define BK9130B_LIST_MAX 100
+
+// State only reports itself sequenceable, and the Interleave properties only
+// exist, when this is defined: the list and trigger commands (g_PSUList* in
+// BK9130B.cpp) follow the generic SCPI LIST subsystem and have not been
+// checked against a 9130B yet, define it once they have
+// #define BK9130B_LIST_SEQUENCING
+
+// bits of each channel's questionable instrument summary register
+// (STAT:QUES:INST:ISUM<n>), adjust here should a firmware differ
+#define BK9130B_ISUM_CC  0x0001
+#define BK9130B_ISUM_CV  0x0002
+#define BK9130B_ISUM_OVP 0x0004
+#define BK9130B_ISUM_OCP 0x0008
+
+/*============================================================================*/
+// per-channel limits, probed from the instrument on Initialize()
+struct BK9130BLimits
+{
+	BK9130BLimits(double vMax = 30.0, double iMax = 3.0) :
+		vMin(0.0), vMax(vMax), iMin(0.0), iMax(iMax), ovp(0.0) {}
+
+	double vMin;
+	double vMax;
+	double iMin;
+	double iMax;
+	double ovp;		// over-voltage protection level, 0 if unknown / off
+};
+/*============================================================================*/
+// last known setpoints / output state / measurements of a channel, kept
+// current by the watcher and by our own writes
+struct BK9130BChannelState
+{
+	BK9130BChannelState() : voltage(0.0), current(0.0), output(false),
+		measVoltage(0.0), measCurrent(0.0), cv(false), cc(false),
+		ovp(false), ocp(false), updated(0.0) {}
+
+	double voltage;
+	double current;
+	bool output;
+	double measVoltage;
+	double measCurrent;
+	bool cv;			// regulating voltage / current, from the last SRQ
+	bool cc;
+	bool ovp;			// protection tripped since the output was last turned on
+	bool ocp;
+	double updated;		// MM time (ms) any of the above was last refreshed
+};
+/*============================================================================*/
+// one step of a channel's list: the setpoints and how long they are held (s)
+struct BK9130BListStep
+{
+	BK9130BListStep(double voltage = 0.0, double current = 0.0, double dwell = 0.0) :
+		voltage(voltage), current(current), dwell(dwell) {}
+
+	double voltage;
+	double current;
+	double dwell;
+};
+/*============================================================================*/
+// state of every channel at one instant, see BK9130B::GetSnapshot()
+struct BK9130BSnapshot
+{
+	BK9130BSnapshot() : activeChannel(0) {}
+
+	int activeChannel;	// index into channel[]
+	BK9130BChannelState channel[BK9130B_CHANNEL_COUNT];
+};
+/*============================================================================*/
+class BK9130B;
+
+// background thread that polls the instrument state and pushes any change to
+// Micro-Manager (see BK9130B::pollState()), each channel's rate adapts: fast
+// (burst interval) right after a command or a detected change, doubling for
+// every stable sample up to the poll interval. Every poll reads all channels,
+// so the poll happens when the first channel is due.
+class BK9130BWatcher : public VISAWorker
+{
+public:
+	struct Stats
+	{
+		Stats() : polls(0), baseline(0.0) {}
+
+		std::size_t polls;	// polls actually made
+		double baseline;	// polls a fixed rate (at the burst interval) would have made
+	};
+
+public:
+	BK9130BWatcher(BK9130B* owner);
+	~BK9130BWatcher() { stop(); }
+
+	void setInterval(long);
+	void setBurstInterval(long);
+	void burst(int);
+	void sampled(const bool*);
+	Stats getStats(void) const;
+
+protected:
+	void run(void);
+
+private:
+	ViUInt32 nextWait(void) const;
+
+private:
+	BK9130B* owner_;
+
+	mutable visa_compat::mutex mutex_;
+	long interval_;			// slowest rate (ms), the back-off bound
+	long burstInterval_;	// fastest rate (ms), used right after a change
+	double period_[BK9130B_CHANNEL_COUNT];	// current per-channel period (us)
+	double due_[BK9130B_CHANNEL_COUNT];		// next per-channel sample (us)
+	double start_;			// us, when the statistics started
+	std::size_t polls_;
+};
+/*============================================================================*/
+// background thread that waits for service requests (protection trips, CV /
+// CC changes) and has the owner read the status registers, see
+// BK9130B::serviceRequest()
+class BK9130BMonitor : public VISAWorker
+{
+public:
+	BK9130BMonitor(BK9130B* owner) : owner_(owner) {}
+	~BK9130BMonitor() { stop(); }
+
+protected:
+	void run(void);
+
+private:
+	BK9130B* owner_;
+};
 /*============================================================================*/
 
-class BK9130B : public CShutterBase<BK9130B>
+class BK9130B : public CShutterBase<BK9130B>, public VISARegistry::Listener,
+	public VISAScheduler::Listener
 {
 public:
 	BK9130B(void);
@@ -58,6 +241,7 @@ public:
 
     void GetName(char* name) const;
 	MM::DeviceType GetType(void) const;
+	unsigned GetNumberOfPropertyValues(const char* name) const;
 
 	// Shutter API
 	// -----------
@@ -65,15 +249,75 @@ public:
     int GetOpen(bool&);
     int Fire(double);
 
+	// Cached state
+	// ------------
+	void GetSnapshot(BK9130BSnapshot&) const;
+
+	// Telemetry history
+	// -----------------
+	VISATelemetryPyramid::Time GetTelemetry(int channel, bool current, double t0, double t1, std::size_t maxBuckets, std::vector<VISATelemetryPyramid::Bucket>&) const;
+
 	// Action Interface
 	// ----------------
 	int OnActiveChannel(MM::PropertyBase*, MM::ActionType);
 	int OnOutputVoltage(MM::PropertyBase*, MM::ActionType);
 	int OnOutputCurrent(MM::PropertyBase*, MM::ActionType);
+	int OnState(MM::PropertyBase*, MM::ActionType);
+	int OnPollInterval(MM::PropertyBase*, MM::ActionType);
+	int OnBurstInterval(MM::PropertyBase*, MM::ActionType);
+	int OnPollStats(MM::PropertyBase*, MM::ActionType, long);
+	int OnTelemetryStats(MM::PropertyBase*, MM::ActionType, long);
+	int OnTelemetryFile(MM::PropertyBase*, MM::ActionType);
+	int OnSchedule(MM::PropertyBase*, MM::ActionType);
+	int OnScheduleState(MM::PropertyBase*, MM::ActionType);
+	int OnScheduleStats(MM::PropertyBase*, MM::ActionType, long);
+	int OnTelemetry(MM::PropertyBase*, MM::ActionType, long);
+	int OnRippleWindow(MM::PropertyBase*, MM::ActionType);
+	int OnRipple(MM::PropertyBase*, MM::ActionType, long);
+	int OnFaultProfile(MM::PropertyBase*, MM::ActionType);
+	int OnIOStats(MM::PropertyBase*, MM::ActionType, long);
+	int OnFlowControl(MM::PropertyBase*, MM::ActionType);
+	int OnFlowStats(MM::PropertyBase*, MM::ActionType, long);
+	int OnProtection(MM::PropertyBase*, MM::ActionType, long);
+	int OnExposureCalibrate(MM::PropertyBase*, MM::ActionType);
+	int OnExposureSchedule(MM::PropertyBase*, MM::ActionType);
+	int OnExposureStats(MM::PropertyBase*, MM::ActionType, long);
+	int OnFireStats(MM::PropertyBase*, MM::ActionType, long);
+	int OnInterleaveState(MM::PropertyBase*, MM::ActionType);
+	int OnInterleaveRate(MM::PropertyBase*, MM::ActionType, long);
+
+	// Registry Interface
+	// ------------------
+	void onRegistryChange(const VISARegistry::Event&, const std::vector<std::string>&);
+
+	// Scheduler Interface
+	// -------------------
+	void onScheduleIssued(const VISAScheduler::Record&);
 
 private:
 	int OnOutputChange(MM::PropertyBase*, MM::ActionType, double&, const char&);
 	std::string doubleToStr(const double&, const char&) const;
+	int ioError(int);
+	int ensureConnected(void);
+	void probeLimits(void);
+	std::string getActiveChannel(void) const;
+	int applyLimits(void);
+	int checkLimits(const std::string&, double, const char&) const;
+	int checkScheduled(const std::string&, std::string&) const;
+	void pollState(void);
+	void publishSnapshot(void);
+	void startThread(VISAWorker&, const char*);
+	bool enableServiceRequests(void);
+	void serviceRequest(void);
+	int calibrateExposure(long);
+	int loadList(int, const std::vector<BK9130BListStep>&, long);
+	int startLists(bool);
+	int stopLists(void);
+	int startInterleave(void);
+	bool sampleEdge(const std::string&, const char*, double, double&, std::vector<VISAExposureLock::Reading>&);
+
+	friend class BK9130BWatcher;
+	friend class BK9130BMonitor;
 
 private:
     VISADevice dev_;
@@ -81,6 +325,62 @@ private:
 	bool busy_;
 	long timeout_;
 
+private:
+	VISARegistry& registry_;
+	mutable visa_compat::mutex registryMutex_;
+	std::string devID_;
+	ViAccessMode lockMode_;
+	bool connected_;
+	bool reconnectPending_;
+
+	// pre-init device list as last reported by the registry thread, applied
+	// by GetNumberOfPropertyValues()
+	mutable std::vector<std::string> presentIDs_;
+	mutable bool presentChanged_;
+
+private:
+	std::map<std::string, BK9130BLimits> limits_;
+
+private:
+	BK9130BWatcher watcher_;
+	mutable visa_compat::mutex stateMutex_;
+	std::map<std::string, BK9130BChannelState> state_;
+	unsigned long stateGeneration_;	// bumped by every publishSnapshot()
+	double notifiedMeas_[2 * BK9130B_CHANNEL_COUNT];	// measured V / I last pushed to the core
+	VISASnapshot<BK9130BSnapshot> snapshot_;
+	VISATelemetryStore telemetry_;
+	VISATelemetryPyramid history_;
+	VISATelemetryWindow window_;
+	long pollInterval_;
+	long burstInterval_;
+	std::vector<std::string> pollQueries_;	// kept between polls (watcher thread only)
+	std::vector<std::string> pollReplies_;
+	std::vector<std::string> srqQueries_;	// likewise (protection monitor thread only)
+	std::vector<std::string> srqReplies_;
+	BK9130BMonitor monitor_;
+
+private:
+	VISAScheduler scheduler_;
+	VISAExposureLock exposure_;
+	VISAPulser pulser_;
+	long listSteps_[BK9130B_CHANNEL_COUNT];	// steps loaded per channel, 0 if none
+	BK9130BListStep listRestore_[BK9130B_CHANNEL_COUNT];	// setpoints before the list
+	bool listRunning_;
+	double interleaveStart_;	// us on the device clock, 0 once the run completed
+	double interleaveSwitches_;	// channel switches the run makes
+	double interleaveRate_;		// programmed / achieved switches per second
+	double interleaveAchieved_;
+	VISADispatcher dispatcher_;
+	VISAIOPool* pool_;
+
+private:
+	VISAThreadConfig threadConfig_;
+	VISAVirtualClock virtualClock_;
+
+private:
+	VISAFaultInjector faults_;
+	std::string faultProfile_;
+
 private:
 	std::string activeChannel_;
 	bool activeChannelState_;
@@ -88,4 +388,58 @@ private:
 	double outputCurrent_;
 };
 /*============================================================================*/
+// several supplies driven as one shutter: every change is written to all of
+// them concurrently (see VISAGroup)
+class BK9130BGroup : public CShutterBase<BK9130BGroup>
+{
+public:
+	BK9130BGroup(void);
+	~BK9130BGroup(void);
+
+	// MMDevice API
+	// ------------
+	int Initialize(void);
+	int Shutdown(void);
+
+	bool Busy(void);
+
+	void GetName(char* name) const;
+	MM::DeviceType GetType(void) const;
+
+	// Shutter API
+	// -----------
+	int SetOpen(bool open = true);
+	int GetOpen(bool&);
+	int Fire(double);
+
+	// Action Interface
+	// ----------------
+	int OnActiveChannel(MM::PropertyBase*, MM::ActionType);
+	int OnOutputVoltage(MM::PropertyBase*, MM::ActionType);
+	int OnOutputCurrent(MM::PropertyBase*, MM::ActionType);
+	int OnState(MM::PropertyBase*, MM::ActionType);
+	int OnSkew(MM::PropertyBase*, MM::ActionType);
+	int OnDuration(MM::PropertyBase*, MM::ActionType);
+
+private:
+	int writeAll(const std::vector<std::string>&);
+	std::string doubleToStr(const double&, const char&) const;
+	void probeLimits(void);
+	int applyLimits(void);
+	int checkLimits(double, const char&) const;
+
+private:
+	VISAGroup group_;
+	bool initialized_;
+	long timeout_;
+
+	// per channel, the range every supply in the group can take
+	std::map<std::string, BK9130BLimits> limits_;
+
+	std::string activeChannel_;
+	bool open_;
+	double outputVoltage_;
+	double outputCurrent_;
+};
+/*============================================================================*/
 #endif //_BK9130B_H_
@@ -0,0 +1,301 @@
+////////////////////////////////////////////////////////////////////////////////
+// FILE:          VISAClock.h
+// PROJECT:       Micro-Manager
+// SUBSYSTEM:     DeviceAdapters
+//-----------------------------------------------------------------------------
+// DESCRIPTION:   Injectable time source for VISA device timing (real / virtual)
+//
+// AUTHOR:        Scottie Alexander, scottiealexander11@gmail.com
+//
+// COPYRIGHT:     University of California, Davis, 2016
+//
+// LICENSE:       This file is distributed under the BSD license.
+//                License text is included with the source distribution.
+//
+//                This file is distributed in the hope that it will be useful,
+//                but WITHOUT ANY WARRANTY; without even the implied warranty
+//                of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+//
+//                IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+//                CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+//                INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES.
+
+/*GIST
+  Everything that sleeps or measures time on the I/O path (the query delay,
+  worker waits, the scheduler, injected faults) goes through a VISAClock.
+  Times are in us since an arbitrary epoch.
+
+  VISASystemClock is the default and simply wraps steady_clock.
+
+  VISAVirtualClock runs real time plus every sleep it skipped: sleepUntil()
+  returns immediately and moves the clock forward instead, so scenarios made
+  of long waits run as fast as the code allows while every duration measured
+  on the clock still includes both the real work and the (virtual) waits.
+  Concurrent sleepers to the same time only advance the clock once; a sleeper
+  whose time has already been passed by another returns at once, so wake-ups
+  can be late but never early. Idle waits (see VISAWorker::waitFor()) do
+  *not* advance the clock, they follow it. So that a worker polling on the
+  clock isn't skipped over by a sleeper that jumps further ahead, each wait
+  registers its deadline as a waiter, and the worker keeps its place (where
+  it woke up) registered while it works, until it waits or sleeps again.
+  Sleepers stop the clock at the first waiter of another thread and wait
+  for it to move on; one that takes more than 20 ms of real time (e.g. it
+  waits for a lock the sleeper holds) is passed.
+*/
+#pragma once
+#ifndef _VISACLOCK_H_
+#define _VISACLOCK_H_
+
+#include <map>
+
+#include "VISACompat.h"
+
+/*============================================================================*/
+class VISAClock
+{
+public:
+    virtual ~VISAClock() {}
+
+    // current time in us
+    virtual double now() const = 0;
+
+    // blocks (or pretends to) until now() >= <t>
+    virtual void sleepUntil(double t) = 0;
+
+    // true if sleeping does not take real time
+    virtual bool isVirtual() const = 0;
+
+    /*------------------------------------------------------------------------*/
+    void sleepFor(double us)
+    {
+        sleepUntil(now() + us);
+    }
+    /*------------------------------------------------------------------------*/
+    /**
+    * Registers / removes a deadline the calling thread waits for (or, once
+    * it woke up, where it works), see VISAWorker::waitFor(), only virtual
+    * clocks care
+    */
+    virtual void addWaiter(double /*deadline*/) {}
+    virtual void removeWaiter(double /*deadline*/) {}
+    /*------------------------------------------------------------------------*/
+    /**
+    * @return - the shared real-time clock, the default everywhere
+    */
+    static VISAClock& system();
+};
+/*============================================================================*/
+class VISASystemClock : public VISAClock
+{
+public:
+    /*------------------------------------------------------------------------*/
+    VISASystemClock() : epoch_(Clock::now()) {}
+    /*------------------------------------------------------------------------*/
+    double now() const
+    {
+        return toUs(Clock::now() - epoch_);
+    }
+    /*------------------------------------------------------------------------*/
+    void sleepUntil(double t)
+    {
+        visa_compat::this_thread::sleep_until(epoch_ +
+            visa_compat::chrono::duration_cast<Clock::duration>(
+            visa_compat::chrono::microseconds(static_cast<long long>(t))));
+    }
+    /*------------------------------------------------------------------------*/
+    bool isVirtual() const
+    {
+        return false;
+    }
+    /*------------------------------------------------------------------------*/
+
+private:
+    typedef visa_compat::chrono::steady_clock Clock;
+
+    static double toUs(const Clock::duration& d)
+    {
+        return visa_compat::chrono::duration_cast<
+            visa_compat::chrono::nanoseconds>(d).count() / 1000.0;
+    }
+
+    Clock::time_point epoch_;
+};
+/*============================================================================*/
+inline VISAClock& VISAClock::system()
+{
+    static VISASystemClock clock;
+    return clock;
+}
+/*============================================================================*/
+class VISAVirtualClock : public VISAClock
+{
+public:
+    /*------------------------------------------------------------------------*/
+    VISAVirtualClock() : skipped_(0.0) {}
+    /*------------------------------------------------------------------------*/
+    double now() const
+    {
+        visa_compat::lock_guard<visa_compat::mutex> lock(mutex_);
+        return real_.now() + skipped_;
+    }
+    /*------------------------------------------------------------------------*/
+    void sleepUntil(double t)
+    {
+        visa_compat::unique_lock<visa_compat::mutex> lock(mutex_);
+
+        // a worker that sleeps isn't working where it woke up any more
+        visa_compat::thread::id self = visa_compat::this_thread::get_id();
+        release(self);
+
+        double passed = -1.0;   // waiters up to here took too long
+
+        while (true)
+        {
+            double current = real_.now() + skipped_;
+            if (t <= current)
+            {
+                return;
+            }
+
+            // stop at the first other waiter due before <t> ...
+            double next = firstWaiter(self, passed, t);
+
+            if (next > current)
+            {
+                skipped_ += next - current;
+            }
+
+            if (next >= t)
+            {
+                return;
+            }
+
+            // ... and let it wake up (it checks the clock every ms) and work
+            // before going any further
+            visa_compat::chrono::steady_clock::time_point limit =
+                visa_compat::chrono::steady_clock::now() +
+                visa_compat::chrono::milliseconds(20);
+
+            while (firstWaiter(self, passed, t) <= next)
+            {
+                if (visa_compat::chrono::steady_clock::now() >= limit)
+                {
+                    passed = next;
+                    break;
+                }
+
+                cond_.wait_for(lock, visa_compat::chrono::milliseconds(1));
+            }
+        }
+    }
+    /*------------------------------------------------------------------------*/
+    bool isVirtual() const
+    {
+        return true;
+    }
+    /*------------------------------------------------------------------------*/
+    /**
+    * Moves the clock forward by <us> (e.g. to drive a scenario from outside)
+    */
+    void advance(double us)
+    {
+        visa_compat::lock_guard<visa_compat::mutex> lock(mutex_);
+        skipped_ += us > 0.0 ? us : 0.0;
+    }
+    /*------------------------------------------------------------------------*/
+    void addWaiter(double deadline)
+    {
+        visa_compat::lock_guard<visa_compat::mutex> lock(mutex_);
+        waiters_.insert(std::make_pair(deadline,
+            visa_compat::this_thread::get_id()));
+    }
+    /*------------------------------------------------------------------------*/
+    void removeWaiter(double deadline)
+    {
+        {
+            visa_compat::lock_guard<visa_compat::mutex> lock(mutex_);
+
+            visa_compat::thread::id self = visa_compat::this_thread::get_id();
+            Waiters::iterator it = waiters_.lower_bound(deadline);
+
+            while (it != waiters_.end() && it->first == deadline &&
+                it->second != self)
+            {
+                ++it;
+            }
+
+            if (it != waiters_.end() && it->first == deadline)
+            {
+                waiters_.erase(it);
+            }
+        }
+
+        cond_.notify_all();
+    }
+    /*------------------------------------------------------------------------*/
+    /**
+    * @return - total time (in us) skipped so far, i.e. how far the clock is
+    * ahead of real time
+    */
+    double skipped() const
+    {
+        visa_compat::lock_guard<visa_compat::mutex> lock(mutex_);
+        return skipped_;
+    }
+    /*------------------------------------------------------------------------*/
+
+private:
+    typedef std::multimap<double, visa_compat::thread::id> Waiters;
+
+    // NOTE: the caller holds mutex_
+    // earliest deadline after <passed> of a waiter other than <self>, <t> if
+    // there is none before <t>
+    double firstWaiter(visa_compat::thread::id self, double passed,
+        double t) const
+    {
+        for (Waiters::const_iterator it = waiters_.upper_bound(passed);
+            it != waiters_.end() && it->first < t; ++it)
+        {
+            if (it->second != self)
+            {
+                return it->first;
+            }
+        }
+
+        return t;
+    }
+    /*------------------------------------------------------------------------*/
+    // NOTE: the caller holds mutex_
+    void release(visa_compat::thread::id self)
+    {
+        bool released = false;
+
+        for (Waiters::iterator it = waiters_.begin(); it != waiters_.end();)
+        {
+            if (it->second == self)
+            {
+                waiters_.erase(it++);
+                released = true;
+            }
+            else
+            {
+                ++it;
+            }
+        }
+
+        if (released)
+        {
+            cond_.notify_all();
+        }
+    }
+    /*------------------------------------------------------------------------*/
+
+private:
+    mutable visa_compat::mutex mutex_;
+    visa_compat::condition_variable cond_;
+    VISASystemClock real_;
+    double skipped_;
+    Waiters waiters_;       // deadlines / places of idle workers (us)
+};
+/*============================================================================*/
+#endif //_VISACLOCK_H_
@@ -0,0 +1,90 @@
+////////////////////////////////////////////////////////////////////////////////
+// FILE:          VISACompat.h
+// PROJECT:       Micro-Manager
+// SUBSYSTEM:     DeviceAdapters
+//-----------------------------------------------------------------------------
+// DESCRIPTION:   C++11 / boost threading compatibility layer
+//
+// AUTHOR:        Scottie Alexander, scottiealexander11@gmail.com
+//
+// COPYRIGHT:     University of California, Davis, 2016
+//
+// LICENSE:       This file is distributed under the BSD license.
+//                License text is included with the source distribution.
+//
+//                This file is distributed in the hope that it will be useful,
+//                but WITHOUT ANY WARRANTY; without even the implied warranty
+//                of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+//
+//                IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+//                CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+//                INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES.
+
+/*GIST
+  The device adapter has to build both with C++11 and (via boost) with the
+  older compilers Micro-Manager is built with, everything threading related
+  goes through visa_compat so that the rest of the code does not care.
+*/
+#pragma once
+#ifndef _VISACOMPAT_H_
+#define _VISACOMPAT_H_
+
+/*use boost if c++11 is not supported (NOTE: compilers are known to lie so
+  if c++11 is not actually supported issues may arise, otherwise boost fallback
+  should work)
+*/
+#if defined(__MSC_VER) || !(__cplusplus > 199711L)
+    // building with Micro-Manager / require boost
+    #define BK9130B_USE_BOOST
+    #include <boost/type_traits/is_arithmetic.hpp>
+    #include <boost/static_assert.hpp>
+    #include <boost/thread.hpp>
+    #include <boost/chrono.hpp>
+    #include <boost/atomic.hpp>
+
+    namespace visa_compat
+    {
+        using boost::thread;
+        using boost::mutex;
+        using boost::recursive_mutex;
+        using boost::lock_guard;
+        using boost::unique_lock;
+        using boost::condition_variable;
+        using boost::atomic;
+        using boost::atomic_thread_fence;
+        using boost::memory_order_relaxed;
+        using boost::memory_order_acquire;
+        using boost::memory_order_release;
+        using boost::memory_order_seq_cst;
+        namespace chrono = boost::chrono;
+        namespace this_thread = boost::this_thread;
+    }
+#else
+    // with c++11 we don't need boost...
+    #include <type_traits>
+    #include <thread>
+    #include <mutex>
+    #include <condition_variable>
+    #include <chrono>
+    #include <atomic>
+
+    namespace visa_compat
+    {
+        using std::thread;
+        using std::mutex;
+        using std::recursive_mutex;
+        using std::lock_guard;
+        using std::unique_lock;
+        using std::condition_variable;
+        using std::atomic;
+        using std::atomic_thread_fence;
+        using std::memory_order_relaxed;
+        using std::memory_order_acquire;
+        using std::memory_order_release;
+        using std::memory_order_seq_cst;
+        namespace chrono = std::chrono;
+        namespace this_thread = std::this_thread;
+    }
+#endif
+
+#endif //_VISACOMPAT_H_
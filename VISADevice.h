@@ -23,32 +23,36 @@
 /*GIST
   VISADevice will not inherit from any MM devices so that subclasses can,
   we'll just have to be careful with our method names (or force composition)
+
+  Flow control (off by default, see setFlowControl()): every command written
+  takes a credit from a window, and when the window is used up the device
+  syncs by querying a status register (*ESR? by default) before writing
+  more. The instrument answers only once it has parsed everything before the
+  query, so a reply returns every credit. A reply with a command / query
+  error bit set, or no reply at all, means input was lost: the window is
+  halved. Clean syncs grow it again (doubling up to the last good size, one
+  at a time beyond it), so the window settles at what the instrument really
+  sustains. Any query reply also returns the credits, and with flow control
+  on query() reads as soon as the reply arrives instead of sleeping for the
+  query delay.
+
+  Reading the sync register clears it, so anyone else who needs it (e.g. the
+  *OPC bit of *ESR?) reads it through readSyncRegister(): that read counts as
+  a sync, and it returns every bit the flow control syncs read (and cleared)
+  since the last call, so neither side loses one.
 */
 #pragma once
 #ifndef _VISADEVICE_H_
 #define _VISADEVICE_H_
 
+#include <algorithm>
+#include <cstdlib>
 #include <sstream>
 #include <vector>
 #include <string>
 
-/*use boost if c++11 is not supported (NOTE: compilers are known to lie so
-  if c++11 is not actually supported issues may arise, otherwise boost fallback
-  should work)
-*/
-#if defined(__MSC_VER) || !(__cplusplus > 199711L)
-    // building with Micro-Manager / require boost
-    #define BK9130B_USE_BOOST
-    #include <boost/type_traits/is_arithmetic.hpp>
-    #include <boost/static_assert.hpp>
-    #include <boost/thread.hpp>
-    #include <boost/chrono.hpp>
-#else
-    // with c++11 we don't need boost...
-    #include <type_traits>
-    #include <thread>
-    #include <chrono>
-#endif
+#include "VISACompat.h"
+#include "VISAClock.h"
 
 #include "visa.h"
 
@@ -94,12 +98,62 @@ std::string join(Iterator first, Iterator last, const std::string& sep)
     return result.str();
 }
 /*============================================================================*/
+/**
+* Optional observer / interposer of every read and write (see VISAFaults.h),
+* called with the device's I/O lock held
+*/
+class VISAIOHook
+{
+public:
+    virtual ~VISAIOHook() {}
+
+    // called before the VISA call, anything other than VI_SUCCESS fails the
+    // operation with that status without touching the device
+    virtual ViStatus beforeIO(bool isRead) = 0;
+
+    // may alter the outcome of a completed read
+    virtual void afterRead(ViStatus& status, std::string& reply) = 0;
+
+    // called once per operation with its outcome and duration
+    virtual void completed(bool isRead, bool success, double us) = 0;
+};
+/*============================================================================*/
 class VISADevice
 {
 public:
+    typedef visa_compat::lock_guard<visa_compat::recursive_mutex> IOLock;
+
+    // a command rendered once (termination character included) and written
+    // as is any number of times, see prepare()
+    struct Prepared
+    {
+        Prepared() : commands(0) {}
+
+        std::vector<ViByte> bytes;
+        std::size_t commands;
+    };
+
     /*------------------------------------------------------------------------*/
-    VISADevice() : closeCmd_(""), lastError_("")
+    VISADevice() :
+        initialized_(false),
+        open_(false),
+        closeCmd_(""),
+        lastError_(""),
+        lastStatus_(VI_SUCCESS),
+        termChar_('\n'),
+        timeout_(2000),
+        ioTimeout_(0),
+        queryDelay_(2000),
+        hook_(0),
+        clock_(&VISAClock::system()),
+        flowMax_(0),
+        flowSync_("*ESR?"),
+        flowErrorMask_(0x24),
+        syncing_(false),
+        syncBits_(0)
     {
+        resetFlowStats();
+
         // NOTE: creating and destroying a session does not require
         // communication with a device (and is cheap), and we need to initialize
         // the session to be able to find instruments
@@ -137,9 +191,14 @@ public:
         ViAccessMode accessMode = VI_NO_LOCK,
         ViUInt32 timeout = 2000)
     {
+        IOLock lock(ioMutex_);
+
         bool success = false;
 
+        // the open timeout also becomes the default per-operation deadline
+        // and the default query delay (which is what query() always used)
         timeout_ = timeout;
+        queryDelay_ = timeout;
 
         if (initialized_)
         {
@@ -156,6 +215,11 @@ public:
                 success = processStatus(viGetAttribute(device_,
                     VI_ATTR_TERMCHAR, &termChar_));
 
+                // make sure the session I/O timeout matches our default
+                // deadline rather than whatever VISA defaults to
+                ioTimeout_ = 0;
+                success = success && applyDeadline(0);
+
                 // if we failed to get the termChar_, just close down as we
                 // can't safetly perform any write operations
                 if (!success)
@@ -170,6 +234,8 @@ public:
     /*------------------------------------------------------------------------*/
     bool close()
     {
+        IOLock lock(ioMutex_);
+
         if (open_)
         {
             if (!closeCmd_.empty())
@@ -199,6 +265,88 @@ public:
         return open_;
     }
     /*------------------------------------------------------------------------*/
+    /**
+    * Sets the default deadline (in ms) used by any I/O operation that is not
+    * given an explicit one
+    */
+    void setTimeout(ViUInt32 timeout)
+    {
+        timeout_ = timeout;
+    }
+    /*------------------------------------------------------------------------*/
+    ViUInt32 getTimeout() const
+    {
+        return timeout_;
+    }
+    /*------------------------------------------------------------------------*/
+    /**
+    * Sets the time (in ms) query() waits between writing the request and
+    * reading the reply
+    */
+    void setQueryDelay(ViUInt32 delay)
+    {
+        queryDelay_ = delay;
+    }
+    /*------------------------------------------------------------------------*/
+    /**
+    * @return - true if the most recent failed operation failed because its
+    * deadline expired (in which case the I/O has already been cancelled and
+    * the input buffer resynchronized)
+    */
+    bool timedOut() const
+    {
+        return lastStatus_ == VI_ERROR_TMO;
+    }
+    /*------------------------------------------------------------------------*/
+    /**
+    * Allocates (and touches) the read and write buffers up front so that
+    * messages of up to <bytes> never allocate or page fault on the I/O path
+    */
+    void reserveBuffers(ViUInt32 bytes)
+    {
+        IOLock lock(ioMutex_);
+
+        if (readBuf_.size() < bytes)
+        {
+            readBuf_.resize(bytes);
+        }
+
+        if (writeBuf_.size() < bytes)
+        {
+            writeBuf_.resize(bytes);
+        }
+
+        // resize() value-initializes, but be explicit about faulting the
+        // pages in
+        std::fill(readBuf_.begin(), readBuf_.end(), 0);
+        std::fill(writeBuf_.begin(), writeBuf_.end(), 0);
+    }
+    /*------------------------------------------------------------------------*/
+    /**
+    * Routes every read / write through <hook> (0 to remove), the hook is not
+    * owned and must outlive its use
+    */
+    void setIOHook(VISAIOHook* hook)
+    {
+        IOLock lock(ioMutex_);
+        hook_ = hook;
+    }
+    /*------------------------------------------------------------------------*/
+    /**
+    * Sets the clock used for the query delay and for I/O timing (0 for the
+    * system clock), the clock is not owned
+    */
+    void setClock(VISAClock* clock)
+    {
+        IOLock lock(ioMutex_);
+        clock_ = clock != 0 ? clock : &VISAClock::system();
+    }
+    /*------------------------------------------------------------------------*/
+    VISAClock& getClock() const
+    {
+        return *clock_;
+    }
+    /*------------------------------------------------------------------------*/
     void onClose(const std::string& cmd)
     {
         closeCmd_ = cmd;
@@ -211,12 +359,14 @@ public:
     /*------------------------------------------------------------------------*/
     std::vector<std::string> findInstruments(const std::string& expr)
     {
+        IOLock lock(ioMutex_);
+
         std::vector<std::string> instrList;
 
         // device communication not required, only check for valid session
         if (initialized_)
         {
-            ViFindList findList;
+            ViFindList findList = VI_NULL;
             ViUInt32 retSize;
 
             ViChar *buf = new ViChar[VI_FIND_BUFLEN];
@@ -229,7 +379,9 @@ public:
 
                 instrList.resize(retSize);
 
-                instrList[0] = std::string(buf, VI_FIND_BUFLEN);
+                // NOTE: as below, let the ctor truncate at the first null
+                buf[VI_FIND_BUFLEN-1] = '\0';
+                instrList[0] = std::string(buf);
 
                 for (std::vector<std::string>::size_type k = 1; k < retSize;
                     ++k)
@@ -248,6 +400,13 @@ public:
             }
 
             delete[] buf;
+
+            // the find list is a VISA object of its own, every call used to
+            // leak one
+            if (findList != VI_NULL)
+            {
+                viClose(findList);
+            }
         }
 
         return instrList;
@@ -255,6 +414,8 @@ public:
     /*------------------------------------------------------------------------*/
     bool setAttribute(ViAttr attribute, ViAttrState state)
     {
+        IOLock lock(ioMutex_);
+
         // NOTE: ViAttrState is either a ViUInt32 or ViUInt64 depending on the
         // system (i.e. only integer attributes can be set)
         bool success = false;
@@ -270,6 +431,8 @@ public:
     template <typename T>
     bool getScalarAttribute(ViAttr attribute, T* ptr)
     {
+        IOLock lock(ioMutex_);
+
 #ifdef BK9130B_USE_BOOST
         BOOST_STATIC_ASSERT_MSG(boost::is_arithmetic<T>::value,
             "Input/return type must be arithmetic");
@@ -289,6 +452,8 @@ public:
     /*------------------------------------------------------------------------*/
     std::string getStringAttribute(ViAttr attribute)
     {
+        IOLock lock(ioMutex_);
+
         std::string attr("");
 
         if (open_)
@@ -309,77 +474,238 @@ public:
         return attr;
     }
     /*------------------------------------------------------------------------*/
-    bool write(const std::string& msg)
+    /**
+    * Writes <msg> (plus the termination character) to the device
+    * @param msg - the message to write
+    * @param deadline - I/O timeout in ms for this write, 0 uses the default
+    * @return - true on success
+    */
+    bool write(const std::string& msg, ViUInt32 deadline = 0)
     {
-        // NOTE: we make room for only the characters we need (i.e. the chars
-        // in the msg string +1 for the termChar_, no null termination)
+        IOLock lock(ioMutex_);
+
+        // one credit per command, compound commands count each part
+        std::size_t commands = 1 + std::count(msg.begin(), msg.end(), ';');
+
+        if (!takeCredits(commands, deadline))
+        {
+            return false;
+        }
+
+        // NOTE: we use only the characters we need (i.e. the chars in the msg
+        // string +1 for the termChar_, no null termination), the buffer itself
+        // is kept between calls
         ViUInt32 bufSize = static_cast<ViUInt32>(msg.length() + 1);
 
-        ViByte *buf = new ViByte[bufSize];
+        if (writeBuf_.size() < bufSize)
+        {
+            writeBuf_.resize(bufSize);
+        }
 
-        std::copy(msg.begin(), msg.end(), buf);
+        std::copy(msg.begin(), msg.end(), writeBuf_.begin());
 
         // add the terminating character
-        buf[bufSize-1] = static_cast<ViByte>(termChar_);
+        writeBuf_[bufSize-1] = static_cast<ViByte>(termChar_);
 
-        bool success = write(buf, bufSize);
+        return written(write(&writeBuf_[0], bufSize, deadline), commands);
+    }
+    /*------------------------------------------------------------------------*/
+    /**
+    * Renders <msg> (plus the termination character) into <cmd> for
+    * writePrepared(), so that a time critical write copies nothing
+    * NOTE: render again should the termination character change (open())
+    */
+    void prepare(const std::string& msg, Prepared& cmd) const
+    {
+        cmd.bytes.assign(msg.begin(), msg.end());
+        cmd.bytes.push_back(static_cast<ViByte>(termChar_));
+        cmd.commands = 1 + std::count(msg.begin(), msg.end(), ';');
+    }
+    /*------------------------------------------------------------------------*/
+    /**
+    * Writes a command rendered by prepare(), as write() would
+    */
+    bool writePrepared(Prepared& cmd, ViUInt32 deadline = 0)
+    {
+        IOLock lock(ioMutex_);
 
-        delete[] buf;
+        if (cmd.bytes.empty() || !takeCredits(cmd.commands, deadline))
+        {
+            return false;
+        }
 
-        return success;
+        return written(write(&cmd.bytes[0],
+            static_cast<ViUInt32>(cmd.bytes.size()), deadline), cmd.commands);
     }
     /*------------------------------------------------------------------------*/
-    bool write(const std::vector<std::string>& list)
+    bool write(const std::vector<std::string>& list, ViUInt32 deadline = 0)
     {
-        return write(join(list.begin(), list.end(), getCmdSeperator()));
+        return write(join(list.begin(), list.end(), getCmdSeperator()),
+            deadline);
     }
     /*------------------------------------------------------------------------*/
     // NOTE: we are not overloading query with a vector of strings form as it
     // appears that the device only response to the last query if multiple
     // query commands are sent in a single write
-    std::string query(const std::string& msg)
+    // NOTE: <deadline> bounds the write and the read individually, the query
+    // delay is not counted against it
+    std::string query(const std::string& msg, ViUInt32 deadline = 0)
+    {
+        std::string reply;
+        query(msg, reply, deadline);
+
+        return reply;
+    }
+    /*------------------------------------------------------------------------*/
+    /**
+    * As query() above, but the reply goes into <reply> (emptied on failure),
+    * whose capacity is reused, so repeated queries don't churn the heap
+    * @return - true if a non-empty reply was read
+    */
+    bool query(const std::string& msg, std::string& reply,
+        ViUInt32 deadline = 0)
     {
-        std::string reply("");
+        IOLock lock(ioMutex_);
+
+        reply.clear();
 
-        bool success = write(msg);
+        bool success = write(msg, deadline);
 
         if (success)
         {
-#ifdef BK9130B_USE_BOOST
-            boost::this_thread::sleep_for(
-                boost::chrono::milliseconds(timeout_));
-#else
-            std::this_thread::sleep_for(std::chrono::milliseconds(timeout_));
-#endif
-            reply = read();
+            // with flow control the reply itself says the instrument is
+            // ready, no need to give it time
+            if (flowMax_ == 0)
+            {
+                clock_->sleepFor(queryDelay_ * 1000.0);
+            }
+
+            read(reply, 0x00000400, deadline);
+
+            if (!reply.empty())
+            {
+                acknowledged();
+            }
         }
 
+        return !reply.empty();
+    }
+    /*------------------------------------------------------------------------*/
+    /**
+    * Runs a list of queries back to back. Each query still needs its own
+    * write (see above), but every reply is read as soon as it arrives (bounded
+    * by <deadline>) rather than after the query delay, so a batch costs one
+    * round trip per query and nothing more.
+    * @param msgs - the queries to run, in order
+    * @param deadline - I/O timeout in ms for each write / read, 0 for default
+    * @return - one reply per query, empty for any query that failed
+    */
+    std::vector<std::string> queryBatch(const std::vector<std::string>& msgs,
+        ViUInt32 deadline = 0)
+    {
+        std::vector<std::string> replies;
+        queryBatch(msgs, replies, deadline);
+
+        return replies;
+    }
+    /*------------------------------------------------------------------------*/
+    /**
+    * As queryBatch() above, into <replies>, whose strings are reused, so a
+    * batch run periodically (e.g. a state poll) doesn't churn the heap
+    */
+    void queryBatch(const std::vector<std::string>& msgs,
+        std::vector<std::string>& replies, ViUInt32 deadline = 0)
+    {
+        IOLock lock(ioMutex_);
+
+        replies.resize(msgs.size());
+
+        for (std::vector<std::string>::size_type k = 0; k < msgs.size(); ++k)
+        {
+            replies[k].clear();
+
+            if (write(msgs[k], deadline) && read(replies[k], 0x00000400,
+                deadline) && !replies[k].empty())
+            {
+                acknowledged();
+            }
+        }
+    }
+    /*------------------------------------------------------------------------*/
+    std::string read(const ViUInt32 bufSize = 0x00000400,
+        ViUInt32 deadline = 0)
+    {
+        std::string reply;
+        read(reply, bufSize, deadline);
+
         return reply;
     }
     /*------------------------------------------------------------------------*/
-    std::string read(const ViUInt32 bufSize = 0x00000400)
+    /**
+    * As read() above, into <reply> (emptied on failure, capacity reused)
+    * @return - true on success
+    */
+    bool read(std::string& reply, const ViUInt32 bufSize = 0x00000400,
+        ViUInt32 deadline = 0)
     {
-        std::string reply("");
+        IOLock lock(ioMutex_);
+
+        bool success = false;
+        reply.clear();
 
-        if (initialized_ && open_)
+        if (initialized_ && open_ && applyDeadline(deadline))
         {
-            ViByte *buf = new ViByte[bufSize];
+            if (readBuf_.size() < bufSize)
+            {
+                readBuf_.resize(bufSize);
+            }
 
-            ViUInt32 retSize;
+            double t0 = 0.0;
+            ViStatus status = VI_SUCCESS;
+            ViUInt32 retSize = 0;
 
-            if (processStatus(viRead(device_, buf, bufSize, &retSize)))
+            if (hook_ != 0)
             {
-                reply = std::string(reinterpret_cast<char*>(buf), retSize);
+                t0 = clock_->now();
+                status = hook_->beforeIO(true);
             }
 
-            delete[] buf;
+            if (status == VI_SUCCESS)
+            {
+                status = viRead(device_, &readBuf_[0], bufSize, &retSize);
+
+                if (status >= VI_SUCCESS)
+                {
+                    reply.assign(reinterpret_cast<char*>(&readBuf_[0]), retSize);
+                }
+
+                if (hook_ != 0)
+                {
+                    hook_->afterRead(status, reply);
+                }
+            }
+
+            success = processStatus(status);
+
+            if (!success)
+            {
+                reply.clear();
+                cancelOnTimeout();
+            }
+
+            if (hook_ != 0)
+            {
+                hook_->completed(true, success, clock_->now() - t0);
+            }
         }
 
-        return reply;
+        return success;
     }
     /*------------------------------------------------------------------------*/
     std::string getDeviceDescription()
     {
+        IOLock lock(ioMutex_);
+
         std::string desc("");
 
         if (open_)
@@ -391,21 +717,229 @@ public:
 
         return desc;
     }
+    /*------------------------------------------------------------------------*/
+    /**
+    * Every operation locks this (recursively), holding it as well makes a
+    * sequence of operations atomic w.r.t. other threads using the device, e.g.:
+    *   VISADevice::IOLock lock(dev.ioMutex());
+    */
+    visa_compat::recursive_mutex& ioMutex()
+    {
+        return ioMutex_;
+    }
+    /*------------------------------------------------------------------------*/
+    /**
+    * Queues service requests (SRQ) from the device for
+    * waitForServiceRequest(), not every interface supports them (e.g.
+    * serial ports)
+    * @return - true on success
+    */
+    bool enableServiceRequest()
+    {
+        IOLock lock(ioMutex_);
+
+        return open_ && processStatus(viEnableEvent(device_,
+            VI_EVENT_SERVICE_REQ, VI_QUEUE, VI_NULL));
+    }
+    /*------------------------------------------------------------------------*/
+    void disableServiceRequest()
+    {
+        IOLock lock(ioMutex_);
+
+        if (open_)
+        {
+            viDisableEvent(device_, VI_EVENT_SERVICE_REQ, VI_QUEUE);
+            viDiscardEvents(device_, VI_EVENT_SERVICE_REQ, VI_QUEUE);
+        }
+    }
+    /*------------------------------------------------------------------------*/
+    /**
+    * Waits up to <ms> (on the device's clock) for a service request. Does
+    * *not* take the I/O lock, so other threads keep using the device
+    * meanwhile. Any failure (SRQ not enabled, device closed) is treated like
+    * a timeout, i.e. the call still takes <ms>, so a monitoring loop never
+    * spins. On a virtual clock the wait follows the clock in short real
+    * slices, like VISAWorker::waitFor(), rather than advancing it.
+    * @return - true if a service request arrived
+    */
+    bool waitForServiceRequest(ViUInt32 ms)
+    {
+        double deadline = clock_->now() + ms * 1000.0;
+        ViStatus status = VI_ERROR_TMO;
+
+        if (!clock_->isVirtual())
+        {
+            status = waitOnServiceRequest(ms);
+        }
+        else
+        {
+            do
+            {
+                status = waitOnServiceRequest(1);
+            }
+            while (status == VI_ERROR_TMO && clock_->now() < deadline);
+        }
+
+        if (status >= VI_SUCCESS)
+        {
+            return true;
+        }
+
+        if (status != VI_ERROR_TMO)
+        {
+            if (!clock_->isVirtual())
+            {
+                clock_->sleepUntil(deadline);
+            }
+
+            // a virtual clock is followed, not advanced
+            while (clock_->now() < deadline)
+            {
+                visa_compat::this_thread::sleep_for(
+                    visa_compat::chrono::milliseconds(1));
+            }
+        }
+
+        return false;
+    }
+    /*------------------------------------------------------------------------*/
+    /**
+    * Reads (and thereby clears the SRQ bit of) the status byte
+    */
+    bool readStatusByte(ViUInt16& stb)
+    {
+        IOLock lock(ioMutex_);
+
+        stb = 0;
+        return open_ && processStatus(viReadSTB(device_, &stb));
+    }
+    /*------------------------------------------------------------------------*/
+    /**
+    * Enables flow control (see GIST) with a window of at most <maxWindow>
+    * unacknowledged commands, 0 disables it
+    * @param sync - query whose reply acknowledges everything written before
+    * it, must reply with an integer
+    * @param errorMask - bits of the sync reply that flag lost / mangled
+    * input (*ESR? command and query error by default)
+    */
+    void setFlowControl(std::size_t maxWindow,
+        const std::string& sync = "*ESR?", long errorMask = 0x24)
+    {
+        IOLock lock(ioMutex_);
+
+        flowMax_ = maxWindow;
+        flowSync_ = sync;
+        flowErrorMask_ = errorMask;
+
+        // start small and let clean syncs open the window up
+        window_ = maxWindow < 4 ? maxWindow : 4;
+        threshold_ = maxWindow;
+        unacked_ = 0;
+    }
+    /*------------------------------------------------------------------------*/
+    /**
+    * Reads the sync register (*ESR? unless set otherwise by setFlowControl())
+    * without the query delay, on behalf of anything but flow control. The
+    * read is accounted as a sync (error bits shrink the window), and <bits>
+    * includes whatever flow control syncs read since the last call.
+    * @return - false if there was no reply (<bits> then only has the latter)
+    */
+    bool readSyncRegister(long& bits, ViUInt32 deadline = 0)
+    {
+        IOLock lock(ioMutex_);
+
+        bool success = sync(deadline);
+
+        bits = syncBits_;
+        syncBits_ = 0;
+
+        return success;
+    }
+    /*------------------------------------------------------------------------*/
+    std::size_t getFlowControl() const
+    {
+        IOLock lock(ioMutex_);
+        return flowMax_;
+    }
+    /*------------------------------------------------------------------------*/
+    struct FlowStats
+    {
+        FlowStats() : commands(0), syncs(0), overruns(0), window(0),
+            rate(0.0) {}
+
+        unsigned long commands; // written under flow control
+        unsigned long syncs;    // status queries inserted
+        unsigned long overruns; // syncs that found input lost / no reply
+        std::size_t window;     // current window (commands)
+        double rate;            // sustained commands / s over full windows
+    };
+    /*------------------------------------------------------------------------*/
+    FlowStats getFlowStats() const
+    {
+        IOLock lock(ioMutex_);
+
+        FlowStats stats = flowStats_;
+        stats.window = flowMax_ > 0 ? window_ : 0;
+
+        return stats;
+    }
+    /*------------------------------------------------------------------------*/
+    void resetFlowStats()
+    {
+        IOLock lock(ioMutex_);
+
+        flowStats_ = FlowStats();
+        window_ = flowMax_ < 4 ? flowMax_ : 4;
+        threshold_ = flowMax_;
+        unacked_ = 0;
+        windowStart_ = 0.0;
+    }
     /*------------------------------------------------------------------------*/
 	std::string getLastError()
 	{
+		IOLock lock(ioMutex_);
 		std::string tmp = lastError_;
 		lastError_ = "";
 		return tmp;
 	}
 	/*------------------------------------------------------------------------*/
+    /**
+    * @return - the separator for several commands in one write
+    */
+    std::string getCmdSeperator() const
+    {
+        std::string sep(";");
+        sep.append(1, static_cast<char>(termChar_));
+
+        return sep;
+    }
+    /*------------------------------------------------------------------------*/
 
 private:
+    /*------------------------------------------------------------------------*/
+    // one viWaitOnEvent() for a service request, see waitForServiceRequest()
+    ViStatus waitOnServiceRequest(ViUInt32 ms)
+    {
+        ViEventType type;
+        ViEvent context;
+
+        ViStatus status = viWaitOnEvent(device_, VI_EVENT_SERVICE_REQ, ms,
+            &type, &context);
+
+        if (status >= VI_SUCCESS)
+        {
+            viClose(context);
+        }
+
+        return status;
+    }
     /*------------------------------------------------------------------------*/
     bool processStatus(ViStatus status)
     {
         bool success = false;
 
+        lastStatus_ = status;
+
         if (status < VI_SUCCESS)
         {
 			ViSession tmp;
@@ -445,29 +979,186 @@ private:
         return success;
     }
     /*------------------------------------------------------------------------*/
-    bool write(ViByte* msg, ViUInt32 msgSize)
+    bool write(ViByte* msg, ViUInt32 msgSize, ViUInt32 deadline)
     {
         bool success = false;
 
-        if (initialized_ && open_)
+        if (initialized_ && open_ && applyDeadline(deadline))
         {
             // TODO: not sure if we should check nWritten agains msgSize, or if
             // the return status handles all issues that may arise...
             ViUInt32 nWritten;
 
-            success = processStatus(viWrite(device_, msg, msgSize,
-                &nWritten));
+            double t0 = 0.0;
+            ViStatus status = VI_SUCCESS;
+
+            if (hook_ != 0)
+            {
+                t0 = clock_->now();
+                status = hook_->beforeIO(false);
+            }
+
+            if (status == VI_SUCCESS)
+            {
+                status = viWrite(device_, msg, msgSize, &nWritten);
+            }
+
+            success = processStatus(status);
+
+            if (!success)
+            {
+                cancelOnTimeout();
+            }
+
+            if (hook_ != 0)
+            {
+                hook_->completed(false, success, clock_->now() - t0);
+            }
         }
 
         return success;
     }
     /*------------------------------------------------------------------------*/
-    std::string getCmdSeperator() const
+    // counts <commands> just written against the flow control window,
+    // returns <success>
+    bool written(bool success, std::size_t commands)
     {
-        std::string sep(";");
-        sep.append(1, static_cast<char>(termChar_));
+        if (success && flowMax_ > 0 && !syncing_)
+        {
+            if (unacked_ == 0)
+            {
+                windowStart_ = clock_->now();
+            }
 
-        return sep;
+            unacked_ += commands;
+            flowStats_.commands += commands;
+        }
+
+        return success;
+    }
+    /*------------------------------------------------------------------------*/
+    // makes room for <commands> more in the flow control window, syncing
+    // with the instrument if needed, false if the sync got no reply
+    bool takeCredits(std::size_t commands, ViUInt32 deadline)
+    {
+        if (flowMax_ == 0 || syncing_ || unacked_ == 0 ||
+            unacked_ + commands <= window_)
+        {
+            return true;
+        }
+
+        return sync(deadline);
+    }
+    /*------------------------------------------------------------------------*/
+    // queries the sync register, keeping its bits for readSyncRegister() and
+    // (with flow control on) adapting the window to the reply, false if
+    // there was none
+    bool sync(ViUInt32 deadline)
+    {
+        syncing_ = true;
+
+        std::string reply;
+        if (write(flowSync_, deadline))
+        {
+            reply = read(0x00000400, deadline);
+        }
+
+        syncing_ = false;
+
+        long bits = std::strtol(reply.c_str(), NULL, 10);
+        syncBits_ |= bits;
+
+        bool lost = reply.empty() || (bits & flowErrorMask_) != 0;
+
+        // a clean read with nothing in flight says nothing about the window
+        if (flowMax_ == 0 || (!lost && unacked_ == 0))
+        {
+            return !reply.empty();
+        }
+
+        ++flowStats_.syncs;
+
+        if (lost)
+        {
+            ++flowStats_.overruns;
+
+            threshold_ = window_ > 1 ? window_ / 2 : 1;
+            window_ = threshold_;
+        }
+        else
+        {
+            // a full window back to back: how fast the instrument went
+            double elapsed = clock_->now() - windowStart_;
+            if (elapsed > 0.0)
+            {
+                double rate = unacked_ * 1e6 / elapsed;
+                flowStats_.rate = flowStats_.rate > 0.0 ?
+                    0.75 * flowStats_.rate + 0.25 * rate : rate;
+            }
+
+            std::size_t grown = window_ < threshold_ ? 2 * window_ :
+                window_ + 1;
+            window_ = grown < flowMax_ ? grown : flowMax_;
+        }
+
+        unacked_ = 0;
+
+        return !reply.empty();
+    }
+    /*------------------------------------------------------------------------*/
+    // a reply arrived, so everything written before it has been parsed
+    void acknowledged()
+    {
+        if (!syncing_)
+        {
+            unacked_ = 0;
+        }
+    }
+    /*------------------------------------------------------------------------*/
+    // sets VI_ATTR_TMO_VALUE to <deadline> (or timeout_ if <deadline> is 0),
+    // the attribute is only touched when the value actually changes
+    bool applyDeadline(ViUInt32 deadline)
+    {
+        ViUInt32 tmo = deadline > 0 ? deadline : timeout_;
+
+        if (tmo == ioTimeout_)
+        {
+            return true;
+        }
+
+        bool success = processStatus(viSetAttribute(device_,
+            VI_ATTR_TMO_VALUE, tmo));
+
+        if (success)
+        {
+            ioTimeout_ = tmo;
+        }
+
+        return success;
+    }
+    /*------------------------------------------------------------------------*/
+    // if the last operation timed out, abort it on both ends with viClear and
+    // throw away anything left in the input buffer so that a late reply cannot
+    // be mistaken for the answer to the next query
+    void cancelOnTimeout()
+    {
+        if (lastStatus_ != VI_ERROR_TMO)
+        {
+            return;
+        }
+
+        std::string err = "[TIMEOUT]: " + lastError_;
+
+        if (!processStatus(viClear(device_)))
+        {
+            err += " (viClear failed: " + lastError_ + ")";
+        }
+
+        viFlush(device_, VI_READ_BUF_DISCARD | VI_IO_IN_BUF_DISCARD);
+
+        // report the timeout, not the outcome of the cleanup
+        lastError_ = err;
+        lastStatus_ = VI_ERROR_TMO;
     }
     /*------------------------------------------------------------------------*/
 
@@ -480,10 +1171,33 @@ private:
 	std::string closeCmd_;
 
 	std::string lastError_;
+    ViStatus lastStatus_;
 
 private:
     ViUInt8 termChar_;
-    ViUInt32 timeout_;
+    ViUInt32 timeout_;      // default per-operation deadline (ms)
+    ViUInt32 ioTimeout_;    // value currently applied as VI_ATTR_TMO_VALUE
+    ViUInt32 queryDelay_;   // sleep between query() write and read (ms)
+
+    std::vector<ViByte> readBuf_;   // reused by read() / write(), grows only
+    std::vector<ViByte> writeBuf_;
+
+    VISAIOHook* hook_;
+    VISAClock* clock_;
+
+    // flow control, see takeCredits()
+    std::size_t flowMax_;       // largest window, 0 when off
+    std::string flowSync_;
+    long flowErrorMask_;
+    std::size_t window_;        // commands allowed in flight
+    std::size_t threshold_;     // doubling stops here
+    std::size_t unacked_;       // written since the last reply
+    double windowStart_;        // first write since the last reply (us)
+    bool syncing_;
+    FlowStats flowStats_;
+    long syncBits_;             // read by syncs, not yet by readSyncRegister()
+
+    mutable visa_compat::recursive_mutex ioMutex_;
 };
 /*============================================================================*/
 #endif //_VISADEVICE_H_
@@ -0,0 +1,418 @@
+////////////////////////////////////////////////////////////////////////////////
+// FILE:          VISADispatch.h
+// PROJECT:       Micro-Manager
+// SUBSYSTEM:     DeviceAdapters
+//-----------------------------------------------------------------------------
+// DESCRIPTION:   Lock-free bounded command queue serializing a device's I/O
+//
+// AUTHOR:        Scottie Alexander, scottiealexander11@gmail.com
+//
+// COPYRIGHT:     University of California, Davis, 2016
+//
+// LICENSE:       This file is distributed under the BSD license.
+//                License text is included with the source distribution.
+//
+//                This file is distributed in the hope that it will be useful,
+//                but WITHOUT ANY WARRANTY; without even the implied warranty
+//                of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+//
+//                IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+//                CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+//                INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES.
+
+/*GIST
+  VISABoundedQueue is a fixed capacity ring of cells, each stamped with a
+  sequence number (D. Vyukov's bounded queue). A producer claims a slot with
+  one compare-and-swap on the enqueue position and publishes it by bumping
+  the cell's sequence, a consumer does the same on the dequeue side, so no
+  thread ever waits for another to finish a push or pop. Any number of
+  threads may push and pop.
+
+  VISADispatcher owns a pool of preallocated requests (command / reply
+  strings reserved up front) and two such queues of pool indices: free and
+  pending. write() / query() take a free request, fill it in, queue it and
+  wait for it to be run on the device, in the order the requests were
+  queued. Nothing is allocated per command and producers only contend on the
+  queue positions, never on the device lock. Each request has its own
+  condition for its caller to wait on, so a completion wakes that caller
+  only.
+
+  The dispatcher is the device's strand (see VISAPool.h): attached to a pool
+  its requests run on the pool's threads, one at a time; detached they run
+  on the thread of whichever caller found the queue idle.
+
+  Commands longer than CommandLength bypass the queue and go straight to the
+  device.
+*/
+#pragma once
+#ifndef _VISADISPATCH_H_
+#define _VISADISPATCH_H_
+
+#include <string>
+
+#include "VISAPool.h"
+
+/*============================================================================*/
+template <typename T>
+class VISABoundedQueue
+{
+public:
+    /*------------------------------------------------------------------------*/
+    /**
+    * @param capacity - rounded up to a power of two (at least 2)
+    */
+    explicit VISABoundedQueue(std::size_t capacity) :
+        cells_(0),
+        mask_(0)
+    {
+        std::size_t size = 2;
+        while (size < capacity)
+        {
+            size <<= 1;
+        }
+
+        cells_ = new Cell[size];
+        mask_ = size - 1;
+
+        for (std::size_t k = 0; k < size; ++k)
+        {
+            cells_[k].seq.store(k, visa_compat::memory_order_relaxed);
+        }
+
+        enqueue_.store(0, visa_compat::memory_order_relaxed);
+        dequeue_.store(0, visa_compat::memory_order_relaxed);
+    }
+    /*------------------------------------------------------------------------*/
+    ~VISABoundedQueue()
+    {
+        delete[] cells_;
+    }
+    /*------------------------------------------------------------------------*/
+    std::size_t capacity() const
+    {
+        return mask_ + 1;
+    }
+    /*------------------------------------------------------------------------*/
+    /**
+    * @return - false if the queue is full
+    */
+    bool push(const T& value)
+    {
+        std::size_t pos = enqueue_.load(visa_compat::memory_order_relaxed);
+        Cell* cell;
+
+        while (true)
+        {
+            cell = &cells_[pos & mask_];
+            std::size_t seq = cell->seq.load(visa_compat::memory_order_acquire);
+
+            // seq == pos: free for this lap, seq < pos: still holds the
+            // previous lap's value (full), otherwise another producer got
+            // here first
+            if (seq == pos)
+            {
+                if (enqueue_.compare_exchange_weak(pos, pos + 1,
+                    visa_compat::memory_order_relaxed))
+                {
+                    break;
+                }
+            }
+            else if (seq < pos)
+            {
+                return false;
+            }
+            else
+            {
+                pos = enqueue_.load(visa_compat::memory_order_relaxed);
+            }
+        }
+
+        cell->value = value;
+        cell->seq.store(pos + 1, visa_compat::memory_order_release);
+
+        return true;
+    }
+    /*------------------------------------------------------------------------*/
+    /**
+    * @return - false if the queue is empty
+    */
+    bool pop(T& value)
+    {
+        std::size_t pos = dequeue_.load(visa_compat::memory_order_relaxed);
+        Cell* cell;
+
+        while (true)
+        {
+            cell = &cells_[pos & mask_];
+            std::size_t seq = cell->seq.load(visa_compat::memory_order_acquire);
+
+            if (seq == pos + 1)
+            {
+                if (dequeue_.compare_exchange_weak(pos, pos + 1,
+                    visa_compat::memory_order_relaxed))
+                {
+                    break;
+                }
+            }
+            else if (seq < pos + 1)
+            {
+                return false;
+            }
+            else
+            {
+                pos = dequeue_.load(visa_compat::memory_order_relaxed);
+            }
+        }
+
+        value = cell->value;
+        cell->seq.store(pos + mask_ + 1, visa_compat::memory_order_release);
+
+        return true;
+    }
+    /*------------------------------------------------------------------------*/
+
+private:
+    // keeps the two positions (and the cells) on separate cache lines
+    static const std::size_t CacheLine = 64;
+
+    struct Cell
+    {
+        visa_compat::atomic<std::size_t> seq;
+        T value;
+    };
+
+    // not copyable
+    VISABoundedQueue(const VISABoundedQueue&);
+    VISABoundedQueue& operator=(const VISABoundedQueue&);
+
+private:
+    Cell* cells_;
+    std::size_t mask_;
+
+    char pad0_[CacheLine];
+    visa_compat::atomic<std::size_t> enqueue_;
+    char pad1_[CacheLine];
+    visa_compat::atomic<std::size_t> dequeue_;
+    char pad2_[CacheLine];
+};
+/*============================================================================*/
+class VISADispatcher : public VISAStrand
+{
+public:
+    // longest command (including any separators) that goes through the queue
+    static const std::size_t CommandLength = 256;
+
+    struct Stats
+    {
+        Stats() : commands(0), stalls(0), direct(0) {}
+
+        unsigned long commands; // run via the queue
+        unsigned long stalls;   // calls that found every request in use
+        unsigned long direct;   // too long for the queue, run by the caller
+    };
+
+public:
+    /*------------------------------------------------------------------------*/
+    /**
+    * @param dev - the device commands are run on (not owned)
+    * @param capacity - requests in flight before callers have to wait
+    */
+    VISADispatcher(VISADevice& dev, std::size_t capacity = 64) :
+        dev_(dev),
+        free_(capacity),
+        pending_(capacity),
+        requests_(0)
+    {
+        // both queues have the same (rounded) capacity, so pending_ can
+        // always take every request there is
+        requests_ = new Request[free_.capacity()];
+
+        for (std::size_t k = 0; k < free_.capacity(); ++k)
+        {
+            free_.push(k);
+        }
+
+        commands_.store(0);
+        stalls_.store(0);
+        direct_.store(0);
+    }
+    /*------------------------------------------------------------------------*/
+    ~VISADispatcher()
+    {
+        detach();
+        delete[] requests_;
+    }
+    /*------------------------------------------------------------------------*/
+    /**
+    * Queues <msg> and waits for it to be written
+    * @return - true on success (see VISADevice::write())
+    */
+    bool write(const std::string& msg)
+    {
+        std::string unused;
+        return call(false, msg, unused);
+    }
+    /*------------------------------------------------------------------------*/
+    /**
+    * Queues the query <msg> and waits for the reply
+    * @return - the reply, empty on failure (see VISADevice::query())
+    */
+    std::string query(const std::string& msg)
+    {
+        std::string reply;
+        call(true, msg, reply);
+        return reply;
+    }
+    /*------------------------------------------------------------------------*/
+    Stats getStats() const
+    {
+        Stats stats;
+        stats.commands = commands_.load();
+        stats.stalls = stalls_.load();
+        stats.direct = direct_.load();
+
+        return stats;
+    }
+    /*------------------------------------------------------------------------*/
+
+protected:
+    /*------------------------------------------------------------------------*/
+    void runOne()
+    {
+        // counted means queued, but a producer that claimed an earlier cell
+        // may not have published it yet
+        std::size_t index;
+        while (!pending_.pop(index))
+        {
+            visa_compat::this_thread::yield();
+        }
+
+        Request& req = requests_[index];
+
+        if (req.isQuery)
+        {
+            // into the request's own (reserved) reply, no allocation
+            req.success = dev_.query(req.command, req.reply);
+        }
+        else
+        {
+            req.success = dev_.write(req.command);
+        }
+
+        // only the request's own caller is woken: with one condition for
+        // every caller, each completion woke them all and many producers
+        // spent their time switching (see test_console bench queue)
+        {
+            visa_compat::lock_guard<visa_compat::mutex> lock(req.mutex);
+            req.done.store(true, visa_compat::memory_order_release);
+        }
+        req.cond.notify_one();
+
+        ++commands_;
+    }
+    /*------------------------------------------------------------------------*/
+
+private:
+    /*------------------------------------------------------------------------*/
+    struct Request
+    {
+        Request() : isQuery(false), success(false)
+        {
+            command.reserve(CommandLength);
+            reply.reserve(0x400);
+            done.store(false);
+        }
+
+        bool isQuery;
+        std::string command;
+        std::string reply;
+        bool success;
+        visa_compat::atomic<bool> done;
+
+        // the caller waits on these for <done>
+        visa_compat::mutex mutex;
+        visa_compat::condition_variable cond;
+    };
+    /*------------------------------------------------------------------------*/
+    bool call(bool isQuery, const std::string& msg, std::string& reply)
+    {
+        if (msg.length() > CommandLength)
+        {
+            ++direct_;
+
+            if (isQuery)
+            {
+                reply = dev_.query(msg);
+                return !reply.empty();
+            }
+
+            return dev_.write(msg);
+        }
+
+        std::size_t index;
+        if (!free_.pop(index))
+        {
+            // every request is in flight, i.e. the device is the bottleneck:
+            // wait for one to be freed rather than spin
+            ++stalls_;
+
+            visa_compat::unique_lock<visa_compat::mutex> lock(freeMutex_);
+            while (!free_.pop(index))
+            {
+                freeCond_.wait_for(lock, visa_compat::chrono::milliseconds(1));
+            }
+        }
+
+        Request& req = requests_[index];
+        req.isQuery = isQuery;
+        req.command.assign(msg);
+        req.done.store(false, visa_compat::memory_order_relaxed);
+
+        pending_.push(index);
+
+        // runs it right here if the strand is detached and idle
+        posted();
+
+        {
+            visa_compat::unique_lock<visa_compat::mutex> lock(req.mutex);
+            while (!req.done.load(visa_compat::memory_order_acquire))
+            {
+                req.cond.wait(lock);
+            }
+        }
+
+        bool success = req.success;
+        if (isQuery)
+        {
+            reply.assign(req.reply);
+        }
+
+        free_.push(index);
+
+        // one request was freed, so wake one waiter; an empty critical section
+        // orders the push before a waiter's check under the lock
+        {
+            visa_compat::lock_guard<visa_compat::mutex> lock(freeMutex_);
+        }
+        freeCond_.notify_one();
+
+        return success;
+    }
+    /*------------------------------------------------------------------------*/
+
+private:
+    VISADevice& dev_;
+
+    VISABoundedQueue<std::size_t> free_;
+    VISABoundedQueue<std::size_t> pending_;
+    Request* requests_;
+
+    visa_compat::mutex freeMutex_;
+    visa_compat::condition_variable freeCond_;
+
+    visa_compat::atomic<unsigned long> commands_;
+    visa_compat::atomic<unsigned long> stalls_;
+    visa_compat::atomic<unsigned long> direct_;
+};
+/*============================================================================*/
+#endif //_VISADISPATCH_H_
@@ -0,0 +1,316 @@
+////////////////////////////////////////////////////////////////////////////////
+// FILE:          VISAExposure.h
+// PROJECT:       Micro-Manager
+// SUBSYSTEM:     DeviceAdapters
+//-----------------------------------------------------------------------------
+// DESCRIPTION:   Output delay learned from readback, for exposure-locked
+//                illumination
+//
+// AUTHOR:        Scottie Alexander, scottiealexander11@gmail.com
+//
+// COPYRIGHT:     University of California, Davis, 2016
+//
+// LICENSE:       This file is distributed under the BSD license.
+//                License text is included with the source distribution.
+//
+//                This file is distributed in the hope that it will be useful,
+//                but WITHOUT ANY WARRANTY; without even the implied warranty
+//                of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+//
+//                IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+//                CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+//                INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES.
+
+/*GIST
+  VISAExposureLock keeps an estimate of how long after an output on / off
+  write completes the output actually changes, one for each edge. learn()
+  takes the readings (time, value) of one edge: the first is taken before the
+  write, the last once the output has settled. The edge is where the value
+  crosses halfway between the two, interpolated between the readings on
+  either side, so the estimate is only as fine as the readback rate, but it
+  is unbiased and averages out over repeated edges (exponentially weighted,
+  with the mean absolute deviation kept as the jitter). An edge whose two
+  readings are further apart than the delay they would give is not learned
+  (see getUnresolved()): the result would be the readback period, not the
+  output's.
+
+  compile() turns an exposure schedule (start of the first exposure, exposure
+  time, interval, count) into edge times for VISAScheduler: each on edge is
+  requested the on delay before its exposure starts and each off edge the
+  off delay before it ends. As the scheduler already issues every write
+  early by the write latency, the output changes on the exposure edges.
+
+  residual() compares the scheduler's records for those edges against the
+  requested times, i.e. the misalignment of the output edges and exposure
+  edges given the learned delays, the delay jitter adds to it.
+*/
+#pragma once
+#ifndef _VISAEXPOSURE_H_
+#define _VISAEXPOSURE_H_
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+#include "VISAScheduler.h"
+
+/*============================================================================*/
+class VISAExposureLock
+{
+public:
+    // one readback value at <t> us
+    struct Reading
+    {
+        Reading(double t = 0.0, double value = 0.0) : t(t), value(value) {}
+
+        double t;
+        double value;
+    };
+
+    // one output edge for the scheduler, <t> in ms on its clock
+    struct Edge
+    {
+        Edge(double t = 0.0, bool on = false) : t(t), on(on) {}
+
+        double t;
+        bool on;
+    };
+
+    struct Residual
+    {
+        Residual() : edges(0), mean(0.0), rms(0.0), maxAbs(0.0) {}
+
+        std::size_t edges;  // scheduled edges found in the records
+        double mean;        // mean (output edge - exposure edge) in us
+        double rms;         // rms of the same
+        double maxAbs;      // max |output edge - exposure edge| in us
+    };
+
+public:
+    /*------------------------------------------------------------------------*/
+    VISAExposureLock()
+    {
+        reset();
+    }
+    /*------------------------------------------------------------------------*/
+    void reset()
+    {
+        visa_compat::lock_guard<visa_compat::mutex> lock(mutex_);
+
+        for (int k = 0; k < 2; ++k)
+        {
+            delay_[k] = jitter_[k] = 0.0;
+            count_[k] = 0;
+        }
+
+        unresolved_ = 0;
+        edges_.clear();
+    }
+    /*------------------------------------------------------------------------*/
+    /**
+    * Learns from the readings of one edge written (completed) at <tWrite> us
+    * @param minStep - smallest |settled - initial| change that counts as an
+    *                  edge
+    * @return - false (and learns nothing) if the output did not change by
+    *           <minStep>, never crossed halfway, or the readings either side
+    *           of the crossing are further apart than the delay (counted by
+    *           getUnresolved())
+    */
+    bool learn(bool on, double tWrite, const std::vector<Reading>& readings,
+        double minStep)
+    {
+        if (readings.size() < 2)
+        {
+            return false;
+        }
+
+        double v0 = readings.front().value;
+        double v1 = readings.back().value;
+
+        if (fabs(v1 - v0) < minStep)
+        {
+            return false;
+        }
+
+        double mid = 0.5 * (v0 + v1);
+        bool rising = v1 > v0;
+
+        for (std::size_t k = 1; k < readings.size(); ++k)
+        {
+            const Reading& a = readings[k - 1];
+            const Reading& b = readings[k];
+
+            if ((rising && b.value >= mid) || (!rising && b.value <= mid))
+            {
+                // the previous reading is still on the near side
+                double frac = b.value != a.value ?
+                    (mid - a.value) / (b.value - a.value) : 1.0;
+                double t = a.t + frac * (b.t - a.t);
+                double delay = t > tWrite ? t - tWrite : 0.0;
+
+                if (b.t - a.t > delay)
+                {
+                    visa_compat::lock_guard<visa_compat::mutex> lock(mutex_);
+                    ++unresolved_;
+                    return false;
+                }
+
+                update(on, delay);
+                return true;
+            }
+        }
+
+        return false;
+    }
+    /*------------------------------------------------------------------------*/
+    /**
+    * @return - learned delay (us) from write completion to the output edge
+    */
+    double getDelay(bool on) const
+    {
+        visa_compat::lock_guard<visa_compat::mutex> lock(mutex_);
+        return delay_[on ? 1 : 0];
+    }
+    /*------------------------------------------------------------------------*/
+    /**
+    * @return - mean absolute deviation (us) of the edges learned from
+    */
+    double getJitter(bool on) const
+    {
+        visa_compat::lock_guard<visa_compat::mutex> lock(mutex_);
+        return jitter_[on ? 1 : 0];
+    }
+    /*------------------------------------------------------------------------*/
+    std::size_t getCount(bool on) const
+    {
+        visa_compat::lock_guard<visa_compat::mutex> lock(mutex_);
+        return count_[on ? 1 : 0];
+    }
+    /*------------------------------------------------------------------------*/
+    /**
+    * @return - edges (since reset()) that were not learned because the
+    * readback was too slow to resolve their delay
+    */
+    std::size_t getUnresolved() const
+    {
+        visa_compat::lock_guard<visa_compat::mutex> lock(mutex_);
+        return unresolved_;
+    }
+    /*------------------------------------------------------------------------*/
+    /**
+    * Edges (times in ms) that put the output on for <count> exposures of
+    * <exposure> ms every <interval> ms from <start>, given the learned
+    * delays, the edges are also kept for residual()
+    */
+    std::vector<Edge> compile(double start, double exposure, double interval,
+        long count)
+    {
+        visa_compat::lock_guard<visa_compat::mutex> lock(mutex_);
+
+        double onLead = delay_[1] / 1000.0;
+        double offLead = delay_[0] / 1000.0;
+
+        std::vector<Edge> edges;
+        edges.reserve(2 * count);
+
+        for (long k = 0; k < count; ++k)
+        {
+            double t = start + k * interval;
+
+            edges.push_back(Edge(t - onLead, true));
+            edges.push_back(Edge(t + exposure - offLead, false));
+        }
+
+        // the scheduler records them in time order, which an off lead longer
+        // than the exposure would not keep
+        edges_ = edges;
+        std::sort(edges_.begin(), edges_.end(), earlier);
+
+        return edges;
+    }
+    /*------------------------------------------------------------------------*/
+    /**
+    * Misalignment of the compiled edges that <records> (see
+    * VISAScheduler::getRecords()) show were issued
+    */
+    Residual residual(const std::vector<VISAScheduler::Record>& records) const
+    {
+        visa_compat::lock_guard<visa_compat::mutex> lock(mutex_);
+
+        Residual res;
+        double sum = 0.0, sumSq = 0.0;
+
+        // both are in time order, so one pass matches them up
+        std::size_t j = 0;
+        for (std::size_t k = 0; k < records.size() && j < edges_.size(); ++k)
+        {
+            while (j < edges_.size() && edges_[j].t < records[k].requested)
+            {
+                ++j;
+            }
+
+            if (j == edges_.size() || edges_[j].t != records[k].requested ||
+                !records[k].success)
+            {
+                continue;
+            }
+
+            double err = (records[k].actual - records[k].requested) * 1000.0;
+
+            sum += err;
+            sumSq += err * err;
+            res.maxAbs = fabs(err) > res.maxAbs ? fabs(err) : res.maxAbs;
+            ++res.edges;
+        }
+
+        if (res.edges > 0)
+        {
+            res.mean = sum / res.edges;
+            res.rms = sqrt(sumSq / res.edges);
+        }
+
+        return res;
+    }
+    /*------------------------------------------------------------------------*/
+
+private:
+    /*------------------------------------------------------------------------*/
+    static bool earlier(const Edge& a, const Edge& b)
+    {
+        return a.t < b.t;
+    }
+    /*------------------------------------------------------------------------*/
+    void update(bool on, double delay)
+    {
+        visa_compat::lock_guard<visa_compat::mutex> lock(mutex_);
+
+        int k = on ? 1 : 0;
+
+        if (count_[k] == 0)
+        {
+            delay_[k] = delay;
+            jitter_[k] = 0.0;
+        }
+        else
+        {
+            jitter_[k] = 0.75 * jitter_[k] + 0.25 * fabs(delay - delay_[k]);
+            delay_[k] = 0.75 * delay_[k] + 0.25 * delay;
+        }
+
+        ++count_[k];
+    }
+    /*------------------------------------------------------------------------*/
+
+private:
+    mutable visa_compat::mutex mutex_;
+
+    // [0] off edge, [1] on edge, in us
+    double delay_[2];
+    double jitter_[2];
+    std::size_t count_[2];
+    std::size_t unresolved_;
+
+    std::vector<Edge> edges_;
+};
+/*============================================================================*/
+#endif //_VISAEXPOSURE_H_
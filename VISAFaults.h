@@ -0,0 +1,510 @@
+////////////////////////////////////////////////////////////////////////////////
+// FILE:          VISAFaults.h
+// PROJECT:       Micro-Manager
+// SUBSYSTEM:     DeviceAdapters
+//-----------------------------------------------------------------------------
+// DESCRIPTION:   Scripted fault injection and recovery statistics for VISA I/O
+//
+// AUTHOR:        Scottie Alexander, scottiealexander11@gmail.com
+//
+// COPYRIGHT:     University of California, Davis, 2016
+//
+// LICENSE:       This file is distributed under the BSD license.
+//                License text is included with the source distribution.
+//
+//                This file is distributed in the hope that it will be useful,
+//                but WITHOUT ANY WARRANTY; without even the implied warranty
+//                of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+//
+//                IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+//                CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+//                INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES.
+
+/*GIST
+  VISAFaultInjector sits between VISADevice and the VISA library (see
+  VISADevice::setIOHook()) and, per operation, randomly injects the faults
+  described by a VISAFaultProfile:
+
+    spike=<p>:<ms>       extra latency of <ms> before the operation
+    drop=<p>             a reply is read but lost (the read times out)
+    truncate=<p>         a reply is cut in half
+    stale=<p>            the previous reply is returned again
+    timeout=<p>          the operation times out without reaching the device
+    disconnect=<p>:<ms>  the device is unreachable for <ms>
+    seed=<n>             random seed, the same seed replays the same faults
+
+  where <p> is the probability per operation. A profile is a whitespace
+  separated list of the above, or one of the named presets (see presets()).
+  Because the faults are injected at the VISA call boundary the adapter's
+  real recovery paths (viClear on timeout, reconnect, ...) are exercised.
+
+  Whether or not any faults are injected, the outcome and duration of every
+  operation is recorded: failed writes (lost commands), how long it takes to
+  get a successful operation after a failure (recovery time), and latency
+  percentiles over the most recent operations.
+*/
+#pragma once
+#ifndef _VISAFAULTS_H_
+#define _VISAFAULTS_H_
+
+#include <algorithm>
+#include <cstdlib>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "VISADevice.h"
+
+/*============================================================================*/
+struct VISAFaultProfile
+{
+    VISAFaultProfile() : spikeRate(0.0), spikeMs(0), dropRate(0.0),
+        truncateRate(0.0), staleRate(0.0), timeoutRate(0.0),
+        disconnectRate(0.0), disconnectMs(0), seed(1) {}
+
+    double spikeRate;
+    ViUInt32 spikeMs;
+    double dropRate;
+    double truncateRate;
+    double staleRate;
+    double timeoutRate;
+    double disconnectRate;
+    ViUInt32 disconnectMs;
+    unsigned long seed;
+
+    /*------------------------------------------------------------------------*/
+    /**
+    * @return - the names accepted by parse() in addition to explicit specs
+    */
+    static std::vector<std::string> presets()
+    {
+        std::vector<std::string> names;
+        names.push_back("None");
+        names.push_back("Latency spikes");
+        names.push_back("Dropped replies");
+        names.push_back("Truncated replies");
+        names.push_back("Stale data");
+        names.push_back("Timeouts");
+        names.push_back("Disconnect");
+        return names;
+    }
+    /*------------------------------------------------------------------------*/
+    /**
+    * Parses a preset name or a spec (see GIST above) into <profile>
+    * @return - false (and a description in <err>) if <spec> is malformed
+    */
+    static bool parse(const std::string& spec, VISAFaultProfile& profile,
+        std::string& err)
+    {
+        profile = VISAFaultProfile();
+
+        if (spec.empty() || spec == "None")
+        {
+            return true;
+        }
+        else if (spec == "Latency spikes")
+        {
+            return parse("spike=0.05:250", profile, err);
+        }
+        else if (spec == "Dropped replies")
+        {
+            return parse("drop=0.02", profile, err);
+        }
+        else if (spec == "Truncated replies")
+        {
+            return parse("truncate=0.02", profile, err);
+        }
+        else if (spec == "Stale data")
+        {
+            return parse("stale=0.05", profile, err);
+        }
+        else if (spec == "Timeouts")
+        {
+            return parse("timeout=0.02", profile, err);
+        }
+        else if (spec == "Disconnect")
+        {
+            return parse("disconnect=0.002:3000", profile, err);
+        }
+
+        std::istringstream in(spec);
+        std::string item;
+
+        while (in >> item)
+        {
+            std::string::size_type eq = item.find('=');
+            if (eq == std::string::npos)
+            {
+                err = "Expected <fault>=<value>: \"" + item + "\"";
+                return false;
+            }
+
+            std::string key = item.substr(0, eq);
+            std::string value = item.substr(eq + 1);
+
+            if (key == "seed")
+            {
+                char* end = 0;
+                profile.seed = strtoul(value.c_str(), &end, 10);
+
+                if (end == value.c_str() || *end != '\0')
+                {
+                    err = "Invalid seed: \"" + item + "\"";
+                    return false;
+                }
+
+                continue;
+            }
+
+            const char* str = value.c_str();
+            char* end = 0;
+            double rate = strtod(str, &end);
+            double ms = 0.0;
+
+            if (end == str || rate < 0.0 || rate > 1.0)
+            {
+                err = "Invalid probability: \"" + item + "\"";
+                return false;
+            }
+
+            if (*end == ':')
+            {
+                str = end + 1;
+                ms = strtod(str, &end);
+
+                if (end == str || ms < 0.0)
+                {
+                    err = "Invalid duration: \"" + item + "\"";
+                    return false;
+                }
+            }
+
+            if (*end != '\0')
+            {
+                err = "Unexpected characters: \"" + item + "\"";
+                return false;
+            }
+
+            if (key == "spike")
+            {
+                profile.spikeRate = rate;
+                profile.spikeMs = static_cast<ViUInt32>(ms);
+            }
+            else if (key == "drop")
+            {
+                profile.dropRate = rate;
+            }
+            else if (key == "truncate")
+            {
+                profile.truncateRate = rate;
+            }
+            else if (key == "stale")
+            {
+                profile.staleRate = rate;
+            }
+            else if (key == "timeout")
+            {
+                profile.timeoutRate = rate;
+            }
+            else if (key == "disconnect")
+            {
+                profile.disconnectRate = rate;
+                profile.disconnectMs = static_cast<ViUInt32>(ms);
+            }
+            else
+            {
+                err = "Unknown fault: \"" + key + "\"";
+                return false;
+            }
+        }
+
+        return true;
+    }
+    /*------------------------------------------------------------------------*/
+};
+/*============================================================================*/
+class VISAFaultInjector : public VISAIOHook
+{
+public:
+    struct Stats
+    {
+        Stats() : operations(0), failed(0), injected(0), lostCommands(0),
+            recoveries(0), meanRecovery(0.0), maxRecovery(0.0),
+            latencyP50(0.0), latencyP99(0.0), latencyP999(0.0),
+            latencyMax(0.0) {}
+
+        std::size_t operations;     // reads + writes
+        std::size_t failed;         // operations that failed
+        std::size_t injected;       // faults injected
+        std::size_t lostCommands;   // writes that failed
+        std::size_t recoveries;     // failure -> success transitions
+        double meanRecovery;        // ms from first failure to next success
+        double maxRecovery;         // ms
+        double latencyP50;          // operation latency percentiles in us,
+        double latencyP99;          // over the most recent operations
+        double latencyP999;
+        double latencyMax;
+    };
+
+public:
+    /*------------------------------------------------------------------------*/
+    VISAFaultInjector() :
+        clock_(&VISAClock::system()),
+        state_(1),
+        disconnected_(false),
+        reconnect_(0.0),
+        failing_(false),
+        failedAt_(0.0),
+        latencies_(4096, 0.0),
+        nextLatency_(0),
+        nLatency_(0),
+        operations_(0),
+        failed_(0),
+        injected_(0),
+        lostCommands_(0),
+        recoveries_(0),
+        sumRecovery_(0.0),
+        maxRecovery_(0.0)
+    {}
+    /*------------------------------------------------------------------------*/
+    /**
+    * Replaces the active profile (and restarts its random sequence)
+    */
+    void setProfile(const VISAFaultProfile& profile)
+    {
+        visa_compat::lock_guard<visa_compat::mutex> lock(mutex_);
+
+        profile_ = profile;
+        state_ = profile.seed != 0 ? profile.seed : 1;
+        disconnected_ = false;
+    }
+    /*------------------------------------------------------------------------*/
+    /**
+    * Sets the clock that spikes sleep on and that disconnects / recovery are
+    * timed on (0 for the system clock), normally the device's clock
+    */
+    void setClock(VISAClock* clock)
+    {
+        visa_compat::lock_guard<visa_compat::mutex> lock(mutex_);
+        clock_ = clock != 0 ? clock : &VISAClock::system();
+    }
+    /*------------------------------------------------------------------------*/
+    Stats getStats() const
+    {
+        visa_compat::lock_guard<visa_compat::mutex> lock(mutex_);
+
+        Stats stats;
+        stats.operations = operations_;
+        stats.failed = failed_;
+        stats.injected = injected_;
+        stats.lostCommands = lostCommands_;
+        stats.recoveries = recoveries_;
+        stats.maxRecovery = maxRecovery_;
+
+        if (recoveries_ > 0)
+        {
+            stats.meanRecovery = sumRecovery_ / recoveries_;
+        }
+
+        if (nLatency_ > 0)
+        {
+            std::vector<double> sorted(latencies_.begin(),
+                latencies_.begin() + nLatency_);
+            std::sort(sorted.begin(), sorted.end());
+
+            stats.latencyP50 = percentile(sorted, 0.5);
+            stats.latencyP99 = percentile(sorted, 0.99);
+            stats.latencyP999 = percentile(sorted, 0.999);
+            stats.latencyMax = sorted.back();
+        }
+
+        return stats;
+    }
+    /*------------------------------------------------------------------------*/
+    void resetStats()
+    {
+        visa_compat::lock_guard<visa_compat::mutex> lock(mutex_);
+
+        failing_ = false;
+        nextLatency_ = nLatency_ = 0;
+        operations_ = failed_ = injected_ = lostCommands_ = recoveries_ = 0;
+        sumRecovery_ = maxRecovery_ = 0.0;
+    }
+    /*------------------------------------------------------------------------*/
+
+public:
+    /*------------------------------------------------------------------------*/
+    ViStatus beforeIO(bool)
+    {
+        ViUInt32 delay = 0;
+        ViStatus status = VI_SUCCESS;
+        VISAClock* clock = 0;
+
+        {
+            visa_compat::lock_guard<visa_compat::mutex> lock(mutex_);
+
+            clock = clock_;
+            double now = clock_->now();
+
+            if (disconnected_ && now >= reconnect_)
+            {
+                disconnected_ = false;
+            }
+
+            if (!disconnected_ && hit(profile_.disconnectRate))
+            {
+                disconnected_ = true;
+                reconnect_ = now + profile_.disconnectMs * 1000.0;
+                ++injected_;
+            }
+
+            if (disconnected_)
+            {
+                return VI_ERROR_CONN_LOST;
+            }
+
+            if (hit(profile_.spikeRate))
+            {
+                delay = profile_.spikeMs;
+                ++injected_;
+            }
+
+            if (hit(profile_.timeoutRate))
+            {
+                status = VI_ERROR_TMO;
+                ++injected_;
+            }
+        }
+
+        if (delay > 0)
+        {
+            clock->sleepFor(delay * 1000.0);
+        }
+
+        return status;
+    }
+    /*------------------------------------------------------------------------*/
+    void afterRead(ViStatus& status, std::string& reply)
+    {
+        visa_compat::lock_guard<visa_compat::mutex> lock(mutex_);
+
+        if (status < VI_SUCCESS)
+        {
+            return;
+        }
+
+        if (hit(profile_.dropRate))
+        {
+            status = VI_ERROR_TMO;
+            reply.clear();
+            ++injected_;
+        }
+        else if (hit(profile_.truncateRate))
+        {
+            reply.resize(reply.size() / 2);
+            ++injected_;
+        }
+        else if (hit(profile_.staleRate) && !lastReply_.empty())
+        {
+            reply = lastReply_;
+            ++injected_;
+        }
+        else
+        {
+            lastReply_ = reply;
+        }
+    }
+    /*------------------------------------------------------------------------*/
+    void completed(bool isRead, bool success, double us)
+    {
+        visa_compat::lock_guard<visa_compat::mutex> lock(mutex_);
+
+        double now = clock_->now();
+
+        ++operations_;
+
+        latencies_[nextLatency_] = us;
+        nextLatency_ = (nextLatency_ + 1) % latencies_.size();
+        nLatency_ = nLatency_ < latencies_.size() ? nLatency_ + 1 : nLatency_;
+
+        if (!success)
+        {
+            ++failed_;
+
+            if (!isRead)
+            {
+                ++lostCommands_;
+            }
+
+            if (!failing_)
+            {
+                failing_ = true;
+                failedAt_ = now;
+            }
+        }
+        else if (failing_)
+        {
+            failing_ = false;
+
+            double ms = (now - failedAt_) / 1000.0;
+
+            ++recoveries_;
+            sumRecovery_ += ms;
+            maxRecovery_ = ms > maxRecovery_ ? ms : maxRecovery_;
+        }
+    }
+    /*------------------------------------------------------------------------*/
+
+private:
+    /*------------------------------------------------------------------------*/
+    // true with probability <rate> (xorshift, so a seed replays exactly)
+    bool hit(double rate)
+    {
+        if (rate <= 0.0)
+        {
+            return false;
+        }
+
+        state_ ^= state_ << 13;
+        state_ ^= state_ >> 7;
+        state_ ^= state_ << 17;
+
+        return (state_ >> 11) * (1.0 / 9007199254740992.0) < rate;
+    }
+    /*------------------------------------------------------------------------*/
+    static double percentile(const std::vector<double>& sorted, double p)
+    {
+        std::size_t k = static_cast<std::size_t>(p * (sorted.size() - 1) + 0.5);
+        return sorted[k];
+    }
+    /*------------------------------------------------------------------------*/
+
+private:
+    mutable visa_compat::mutex mutex_;
+
+    VISAClock* clock_;
+
+    VISAFaultProfile profile_;
+    unsigned long long state_;
+
+    bool disconnected_;
+    double reconnect_;      // us on clock_
+    std::string lastReply_;
+
+    bool failing_;
+    double failedAt_;
+
+    std::vector<double> latencies_;     // ring buffer of the most recent (us)
+    std::size_t nextLatency_;
+    std::size_t nLatency_;
+
+    std::size_t operations_;
+    std::size_t failed_;
+    std::size_t injected_;
+    std::size_t lostCommands_;
+    std::size_t recoveries_;
+    double sumRecovery_;
+    double maxRecovery_;
+};
+/*============================================================================*/
+#endif //_VISAFAULTS_H_
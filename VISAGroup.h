@@ -0,0 +1,362 @@
+////////////////////////////////////////////////////////////////////////////////
+// FILE:          VISAGroup.h
+// PROJECT:       Micro-Manager
+// SUBSYSTEM:     DeviceAdapters
+//-----------------------------------------------------------------------------
+// DESCRIPTION:   Drives several VISA devices concurrently on a pool of their own
+//
+// AUTHOR:        Scottie Alexander, scottiealexander11@gmail.com
+//
+// COPYRIGHT:     University of California, Davis, 2016
+//
+// LICENSE:       This file is distributed under the BSD license.
+//                License text is included with the source distribution.
+//
+//                This file is distributed in the hope that it will be useful,
+//                but WITHOUT ANY WARRANTY; without even the implied warranty
+//                of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+//
+//                IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+//                CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+//                INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES.
+
+/*GIST
+  Each member device is a strand on a VISAIOPool (see VISAPool.h) that the
+  group owns, with one worker per member: write() hands every member its
+  command at once and waits for all of them, so a group change costs one
+  round trip however many devices there are. The pool is not shared, so the
+  group is never queued behind other devices' I/O (or their query delays).
+  It is (re)built with the group's thread config at the first write() after
+  the membership changed. The spread of completion times (skew) of the last
+  write is recorded on the group's VISAClock (see setClock()), which every
+  member device also runs its I/O timing on.
+*/
+#pragma once
+#ifndef _VISAGROUP_H_
+#define _VISAGROUP_H_
+
+#include <string>
+#include <vector>
+
+#include "VISADevice.h"
+#include "VISAPool.h"
+
+/*============================================================================*/
+class VISAGroup
+{
+public:
+    /*------------------------------------------------------------------------*/
+    VISAGroup() :
+        pool_(0),
+        clock_(&VISAClock::system()),
+        remaining_(0),
+        lastSkew_(0.0),
+        lastDuration_(0.0)
+    {}
+    /*------------------------------------------------------------------------*/
+    ~VISAGroup()
+    {
+        clear();
+    }
+    /*------------------------------------------------------------------------*/
+    /**
+    * Sets the clock write() is timed on and the member devices run on, 0 for
+    * the system clock (the clock is not owned)
+    */
+    void setClock(VISAClock* clock)
+    {
+        clock_ = clock != 0 ? clock : &VISAClock::system();
+
+        for (std::vector<Member*>::size_type k = 0; k < members_.size(); ++k)
+        {
+            members_[k]->dev.setClock(clock_);
+        }
+    }
+    /*------------------------------------------------------------------------*/
+    /**
+    * Affinity / priority of the group's I/O threads, applies from the next
+    * write()
+    */
+    void setConfig(const VISAThreadConfig& config)
+    {
+        config_ = config;
+        dropPool();
+    }
+    /*------------------------------------------------------------------------*/
+    /**
+    * @return - why the config could not (all) be applied to the I/O threads
+    * of the most recent write(), empty if it was
+    */
+    std::string getConfigError() const
+    {
+        return configError_;
+    }
+    /*------------------------------------------------------------------------*/
+    /**
+    * Opens <rsrc> and adds it to the group
+    * @return - true on success, see getLastError() otherwise
+    */
+    bool add(const std::string& rsrc, ViAccessMode accessMode = VI_NO_LOCK,
+        ViUInt32 timeout = 2000)
+    {
+        Member* member = new Member(this);
+        member->dev.setClock(clock_);
+
+        if (!member->dev.open(rsrc, accessMode, timeout))
+        {
+            lastError_ = rsrc + ": " + member->dev.getLastError();
+            delete member;
+            return false;
+        }
+
+        // one more worker is needed, see write()
+        dropPool();
+        members_.push_back(member);
+
+        return true;
+    }
+    /*------------------------------------------------------------------------*/
+    /**
+    * Detaches all devices from the pool and closes them
+    */
+    void clear()
+    {
+        for (std::vector<Member*>::size_type k = 0; k < members_.size(); ++k)
+        {
+            delete members_[k];
+        }
+
+        members_.clear();
+        dropPool();
+    }
+    /*------------------------------------------------------------------------*/
+    std::size_t size() const
+    {
+        return members_.size();
+    }
+    /*------------------------------------------------------------------------*/
+    /**
+    * NOTE: do not use a member device directly while a write() is running
+    */
+    VISADevice& device(std::size_t k)
+    {
+        return members_[k]->dev;
+    }
+    /*------------------------------------------------------------------------*/
+    /**
+    * Writes <cmds>[k] to device k, all devices concurrently, and waits until
+    * every write has completed
+    * @return - true if every write succeeded
+    */
+    bool write(const std::vector<std::vector<std::string> >& cmds)
+    {
+        if (cmds.size() != members_.size())
+        {
+            lastError_ = "Command count does not match group size";
+            return false;
+        }
+
+        if (pool_ == 0 && !members_.empty())
+        {
+            createPool();
+        }
+
+        double t0 = clock_->now();
+
+        {
+            visa_compat::lock_guard<visa_compat::mutex> lock(mutex_);
+            remaining_ = members_.size();
+        }
+
+        for (std::vector<Member*>::size_type k = 0; k < members_.size(); ++k)
+        {
+            members_[k]->submit(cmds[k]);
+        }
+
+        {
+            visa_compat::unique_lock<visa_compat::mutex> lock(mutex_);
+            while (remaining_ > 0)
+            {
+                done_.wait(lock);
+            }
+        }
+
+        bool success = true;
+        lastError_.clear();
+
+        double first = 0.0, last = 0.0;
+
+        for (std::vector<Member*>::size_type k = 0; k < members_.size(); ++k)
+        {
+            const Member* m = members_[k];
+
+            if (!m->success)
+            {
+                success = false;
+                lastError_ += m->error + "\n";
+            }
+
+            if (k == 0 || m->finished < first)
+            {
+                first = m->finished;
+            }
+
+            if (k == 0 || m->finished > last)
+            {
+                last = m->finished;
+            }
+        }
+
+        lastSkew_ = last - first;
+        lastDuration_ = last - t0;
+
+        return success;
+    }
+    /*------------------------------------------------------------------------*/
+    /**
+    * Writes the same command(s) to every device, see write()
+    */
+    bool writeAll(const std::vector<std::string>& cmd)
+    {
+        return write(std::vector<std::vector<std::string> >(members_.size(),
+            cmd));
+    }
+    /*------------------------------------------------------------------------*/
+    /**
+    * @return - spread (in us) between the first and last device finishing
+    * the most recent write()
+    */
+    double getLastSkew() const
+    {
+        return lastSkew_;
+    }
+    /*------------------------------------------------------------------------*/
+    /**
+    * @return - time (in us) from the start of the most recent write() until
+    * the last device finished
+    */
+    double getLastDuration() const
+    {
+        return lastDuration_;
+    }
+    /*------------------------------------------------------------------------*/
+    std::string getLastError()
+    {
+        std::string tmp = lastError_;
+        lastError_ = "";
+        return tmp;
+    }
+    /*------------------------------------------------------------------------*/
+
+private:
+    /*------------------------------------------------------------------------*/
+    // one worker per member, so that every member's write starts at once
+    void createPool()
+    {
+        pool_ = new VISAIOPool(members_.size(), config_);
+        configError_ = pool_->getConfigError();
+
+        for (std::vector<Member*>::size_type k = 0; k < members_.size(); ++k)
+        {
+            members_[k]->attach(*pool_);
+        }
+    }
+    /*------------------------------------------------------------------------*/
+    void dropPool()
+    {
+        if (pool_ == 0)
+        {
+            return;
+        }
+
+        for (std::vector<Member*>::size_type k = 0; k < members_.size(); ++k)
+        {
+            members_[k]->detach();
+        }
+
+        delete pool_;
+        pool_ = 0;
+    }
+    /*------------------------------------------------------------------------*/
+    // called by a member (on a pool thread) when its write is done
+    void finished()
+    {
+        visa_compat::lock_guard<visa_compat::mutex> lock(mutex_);
+
+        if (--remaining_ == 0)
+        {
+            done_.notify_all();
+        }
+    }
+    /*------------------------------------------------------------------------*/
+    class Member : public VISAStrand
+    {
+    public:
+        Member(VISAGroup* group) : group_(group), success(true),
+            finished(0.0) {}
+
+        ~Member()
+        {
+            detach();
+            dev.close();
+        }
+
+        // NOTE: one command per member is in flight at a time (see write())
+        void submit(const std::vector<std::string>& cmd)
+        {
+            {
+                visa_compat::lock_guard<visa_compat::mutex> lock(mutex_);
+                cmd_ = cmd;
+            }
+
+            posted();
+        }
+
+    protected:
+        void runOne()
+        {
+            std::vector<std::string> cmd;
+
+            {
+                visa_compat::lock_guard<visa_compat::mutex> lock(mutex_);
+                cmd.swap(cmd_);
+            }
+
+            success = dev.write(cmd);
+            error = success ? "" : dev.getLastError();
+            finished = dev.getClock().now();
+
+            group_->finished();
+        }
+
+    private:
+        VISAGroup* group_;
+        visa_compat::mutex mutex_;
+        std::vector<std::string> cmd_;
+
+    public:
+        // NOTE: only touched by the pool while a write() is in flight
+        VISADevice dev;
+        bool success;
+        std::string error;
+        double finished;    // us on the group's clock
+    };
+    /*------------------------------------------------------------------------*/
+
+private:
+    VISAIOPool* pool_;
+    VISAThreadConfig config_;
+    VISAClock* clock_;
+    std::string configError_;
+    std::vector<Member*> members_;
+
+    visa_compat::mutex mutex_;
+    visa_compat::condition_variable done_;
+    std::size_t remaining_;
+
+    double lastSkew_;
+    double lastDuration_;
+    std::string lastError_;
+};
+/*============================================================================*/
+#endif //_VISAGROUP_H_
@@ -0,0 +1,453 @@
+////////////////////////////////////////////////////////////////////////////////
+// FILE:          VISAPool.h
+// PROJECT:       Micro-Manager
+// SUBSYSTEM:     DeviceAdapters
+//-----------------------------------------------------------------------------
+// DESCRIPTION:   Shared I/O thread pool running per-device serial strands
+//
+// AUTHOR:        Scottie Alexander, scottiealexander11@gmail.com
+//
+// COPYRIGHT:     University of California, Davis, 2016
+//
+// LICENSE:       This file is distributed under the BSD license.
+//                License text is included with the source distribution.
+//
+//                This file is distributed in the hope that it will be useful,
+//                but WITHOUT ANY WARRANTY; without even the implied warranty
+//                of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+//
+//                IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+//                CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+//                INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES.
+
+/*GIST
+  A VISAStrand is the I/O of one device: a subclass queues work items and
+  calls posted() once per item, and runOne() is later called exactly once per
+  item, in order, never on two threads at once. The strand keeps a count of
+  items not yet run; whoever takes it from 0 to 1 hands the strand to the
+  pool, which keeps running it until the count drops back to 0, so a strand
+  is queued on the pool at most once and nothing is ever left behind.
+
+  VISAIOPool runs strands on a few worker threads (by default one per core,
+  2 - 8). Each worker has its own queue of strands; a strand is run for up
+  to Batch items and then requeued at the back, so a busy device does not
+  starve the others. A worker with nothing queued steals from the back of
+  another worker's queue, so a burst on a few devices spreads over every
+  thread while each device's items stay in order.
+
+  A strand that is not attached to a pool (or has been detached) runs its
+  items on the thread that posted them. detach() waits for anything already
+  handed to the pool, so a strand must be detached before it is destroyed.
+
+  acquireShared() / releaseShared() give every device in the process the
+  same refcounted pool, created by the first caller with its thread config.
+*/
+#pragma once
+#ifndef _VISAPOOL_H_
+#define _VISAPOOL_H_
+
+#include <deque>
+#include <vector>
+
+#include "VISAThread.h"
+
+class VISAIOPool;
+
+/*============================================================================*/
+class VISAStrand
+{
+public:
+    /*------------------------------------------------------------------------*/
+    VISAStrand()
+    {
+        pool_.store(0);
+        pending_.store(0);
+    }
+    /*------------------------------------------------------------------------*/
+    // NOTE: subclasses must call detach() from their own destructor
+    virtual ~VISAStrand() {}
+    /*------------------------------------------------------------------------*/
+    /**
+    * Runs this strand's items on <pool> from now on
+    */
+    void attach(VISAIOPool& pool)
+    {
+        pool_.store(&pool);
+    }
+    /*------------------------------------------------------------------------*/
+    /**
+    * Runs items on the posting thread from now on, waiting for any the pool
+    * is still running
+    */
+    void detach()
+    {
+        pool_.store(0);
+
+        while (pending_.load() != 0)
+        {
+            visa_compat::this_thread::sleep_for(
+                visa_compat::chrono::milliseconds(1));
+        }
+    }
+    /*------------------------------------------------------------------------*/
+    bool isAttached() const
+    {
+        return pool_.load() != 0;
+    }
+    /*------------------------------------------------------------------------*/
+
+protected:
+    /*------------------------------------------------------------------------*/
+    // runs the oldest queued item
+    virtual void runOne() = 0;
+    /*------------------------------------------------------------------------*/
+    /**
+    * Call once for every item queued, after queueing it
+    */
+    void posted();
+    /*------------------------------------------------------------------------*/
+
+private:
+    friend class VISAIOPool;
+
+    /*------------------------------------------------------------------------*/
+    // runs up to <limit> items, returns true if more remain
+    bool runBatch(std::size_t limit)
+    {
+        for (std::size_t k = 0; k < limit; ++k)
+        {
+            runOne();
+
+            // the last access to the strand once the count reaches 0
+            if (pending_.fetch_sub(1) == 1)
+            {
+                return false;
+            }
+        }
+
+        return true;
+    }
+    /*------------------------------------------------------------------------*/
+
+private:
+    visa_compat::atomic<VISAIOPool*> pool_;
+    visa_compat::atomic<std::size_t> pending_;
+};
+/*============================================================================*/
+class VISAIOPool
+{
+public:
+    // items a strand runs before it goes to the back of the queue
+    static const std::size_t Batch = 16;
+
+    struct Stats
+    {
+        Stats() : batches(0), steals(0) {}
+
+        unsigned long batches;  // strand runs
+        unsigned long steals;   // runs taken from another worker's queue
+    };
+
+public:
+    /*------------------------------------------------------------------------*/
+    /**
+    * @param threads - worker count, 0 for defaultSize()
+    * @param config - affinity / priority of every worker
+    */
+    explicit VISAIOPool(std::size_t threads = 0,
+        const VISAThreadConfig& config = VISAThreadConfig())
+    {
+        next_.store(0);
+        batches_.store(0);
+        steals_.store(0);
+
+        threads = threads > 0 ? threads : defaultSize();
+
+        for (std::size_t k = 0; k < threads; ++k)
+        {
+            workers_.push_back(new Worker(this, k));
+        }
+
+        // started only once all exist, as any of them may steal from any
+        for (std::size_t k = 0; k < workers_.size(); ++k)
+        {
+            workers_[k]->setConfig(config);
+            workers_[k]->start();
+
+            std::string err = workers_[k]->getConfigError();
+            if (!err.empty() && configError_.empty())
+            {
+                configError_ = err;
+            }
+        }
+    }
+    /*------------------------------------------------------------------------*/
+    /**
+    * NOTE: every strand must be detached first
+    */
+    ~VISAIOPool()
+    {
+        for (std::size_t k = 0; k < workers_.size(); ++k)
+        {
+            workers_[k]->stop();
+        }
+
+        for (std::size_t k = 0; k < workers_.size(); ++k)
+        {
+            delete workers_[k];
+        }
+    }
+    /*------------------------------------------------------------------------*/
+    std::size_t size() const
+    {
+        return workers_.size();
+    }
+    /*------------------------------------------------------------------------*/
+    /**
+    * @return - first error applying the thread config, empty if none
+    */
+    std::string getConfigError() const
+    {
+        return configError_;
+    }
+    /*------------------------------------------------------------------------*/
+    Stats getStats() const
+    {
+        Stats stats;
+        stats.batches = batches_.load();
+        stats.steals = steals_.load();
+
+        return stats;
+    }
+    /*------------------------------------------------------------------------*/
+    /**
+    * @return - one worker per core, at least 2 and at most 8
+    */
+    static std::size_t defaultSize()
+    {
+        std::size_t cores = visa_compat::thread::hardware_concurrency();
+
+        return cores < 2 ? 2 : (cores > 8 ? 8 : cores);
+    }
+    /*------------------------------------------------------------------------*/
+    /**
+    * The process wide pool, created with <config> by the first caller, every
+    * call must be matched by releaseShared()
+    */
+    static VISAIOPool& acquireShared(
+        const VISAThreadConfig& config = VISAThreadConfig())
+    {
+        Shared& shared = getShared();
+
+        visa_compat::lock_guard<visa_compat::mutex> lock(shared.mutex);
+
+        if (shared.users++ == 0)
+        {
+            shared.pool = new VISAIOPool(0, config);
+        }
+
+        return *shared.pool;
+    }
+    /*------------------------------------------------------------------------*/
+    static void releaseShared()
+    {
+        Shared& shared = getShared();
+
+        visa_compat::lock_guard<visa_compat::mutex> lock(shared.mutex);
+
+        if (shared.users > 0 && --shared.users == 0)
+        {
+            delete shared.pool;
+            shared.pool = 0;
+        }
+    }
+    /*------------------------------------------------------------------------*/
+
+private:
+    friend class VISAStrand;
+
+    /*------------------------------------------------------------------------*/
+    class Worker : public VISAWorker
+    {
+    public:
+        Worker(VISAIOPool* pool, std::size_t index) :
+            pool_(pool), index_(index)
+        {
+            idle.store(false);
+        }
+
+        ~Worker()
+        {
+            stop();
+        }
+
+        // NOTE: guarded by mutex
+        visa_compat::mutex mutex;
+        std::deque<VISAStrand*> queue;
+
+        visa_compat::atomic<bool> idle;
+
+    protected:
+        void run()
+        {
+            while (true)
+            {
+                if (pool_->runNext(index_))
+                {
+                    continue;
+                }
+
+                // announce the sleep, then look once more: a submitter either
+                // sees the flag and wakes us or queued early enough to be seen
+                idle.store(true);
+                visa_compat::atomic_thread_fence(
+                    visa_compat::memory_order_seq_cst);
+
+                if (pool_->runNext(index_))
+                {
+                    idle.store(false);
+                    continue;
+                }
+
+                if (!waitFor(100))
+                {
+                    break;
+                }
+
+                idle.store(false);
+            }
+        }
+
+    private:
+        VISAIOPool* pool_;
+        std::size_t index_;
+    };
+    /*------------------------------------------------------------------------*/
+    struct Shared
+    {
+        Shared() : users(0), pool(0) {}
+
+        visa_compat::mutex mutex;
+        std::size_t users;
+        VISAIOPool* pool;
+    };
+    /*------------------------------------------------------------------------*/
+    static Shared& getShared()
+    {
+        static Shared shared;
+        return shared;
+    }
+    /*------------------------------------------------------------------------*/
+    // queues <strand> (round robin) and wakes a sleeping worker for it
+    void submit(VISAStrand* strand)
+    {
+        std::size_t n = workers_.size();
+        std::size_t target = next_.fetch_add(1) % n;
+
+        {
+            visa_compat::lock_guard<visa_compat::mutex> lock(
+                workers_[target]->mutex);
+            workers_[target]->queue.push_back(strand);
+        }
+
+        visa_compat::atomic_thread_fence(visa_compat::memory_order_seq_cst);
+
+        // the owner if it is asleep, otherwise anyone who can steal it
+        for (std::size_t k = 0; k < n; ++k)
+        {
+            Worker* w = workers_[(target + k) % n];
+
+            if (w->idle.exchange(false))
+            {
+                w->wake();
+                break;
+            }
+        }
+    }
+    /*------------------------------------------------------------------------*/
+    // runs one batch of the next strand for worker <index>: its own oldest,
+    // else the newest of another's, returns false if there was none
+    bool runNext(std::size_t index)
+    {
+        VISAStrand* strand = 0;
+        bool stolen = false;
+
+        {
+            Worker* own = workers_[index];
+            visa_compat::lock_guard<visa_compat::mutex> lock(own->mutex);
+
+            if (!own->queue.empty())
+            {
+                strand = own->queue.front();
+                own->queue.pop_front();
+            }
+        }
+
+        for (std::size_t k = 1; strand == 0 && k < workers_.size(); ++k)
+        {
+            Worker* victim = workers_[(index + k) % workers_.size()];
+            visa_compat::lock_guard<visa_compat::mutex> lock(victim->mutex);
+
+            if (!victim->queue.empty())
+            {
+                strand = victim->queue.back();
+                victim->queue.pop_back();
+                stolen = true;
+            }
+        }
+
+        if (strand == 0)
+        {
+            return false;
+        }
+
+        ++batches_;
+        if (stolen)
+        {
+            ++steals_;
+        }
+
+        if (strand->runBatch(Batch))
+        {
+            // still busy, to the back of our own queue
+            Worker* own = workers_[index];
+            visa_compat::lock_guard<visa_compat::mutex> lock(own->mutex);
+            own->queue.push_back(strand);
+        }
+
+        return true;
+    }
+    /*------------------------------------------------------------------------*/
+
+private:
+    std::vector<Worker*> workers_;
+    visa_compat::atomic<std::size_t> next_;
+    std::string configError_;
+
+    visa_compat::atomic<unsigned long> batches_;
+    visa_compat::atomic<unsigned long> steals_;
+};
+/*============================================================================*/
+inline void VISAStrand::posted()
+{
+    if (pending_.fetch_add(1) != 0)
+    {
+        // already queued on the pool or being run by another thread
+        return;
+    }
+
+    VISAIOPool* pool = pool_.load();
+
+    if (pool != 0)
+    {
+        pool->submit(this);
+    }
+    else
+    {
+        while (runBatch(VISAIOPool::Batch))
+        {
+        }
+    }
+}
+/*============================================================================*/
+#endif //_VISAPOOL_H_
@@ -0,0 +1,361 @@
+////////////////////////////////////////////////////////////////////////////////
+// FILE:          VISAPulse.h
+// PROJECT:       Micro-Manager
+// SUBSYSTEM:     DeviceAdapters
+//-----------------------------------------------------------------------------
+// DESCRIPTION:   Software-timed output pulses from a dedicated timer thread
+//
+// AUTHOR:        Scottie Alexander, scottiealexander11@gmail.com
+//
+// COPYRIGHT:     University of California, Davis, 2016
+//
+// LICENSE:       This file is distributed under the BSD license.
+//                License text is included with the source distribution.
+//
+//                This file is distributed in the hope that it will be useful,
+//                but WITHOUT ANY WARRANTY; without even the implied warranty
+//                of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+//
+//                IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+//                CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+//                INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES.
+
+/*GIST
+  For instruments without a hardware timer: the on and off commands of every
+  slot (e.g. one per output channel) are rendered once, up front (see
+  VISADevice::prepare()), and fire() hands a pulse to the pulser's own
+  thread, which is meant to run at real-time priority.
+
+  The pulse width is measured from the on write completing to the off write
+  completing. Once the on write is done the thread sleeps until shortly
+  before the off write is due, spins (yielding, and for at most the spin
+  margin plus a sleep granule) for the remainder, and issues the off
+  write early by the learned write latency (exponentially weighted, from
+  every write), so that it *completes* on time. The error of every pulse
+  (achieved - requested width) goes into the statistics.
+
+  If the thread is stopped mid-pulse the off write is issued at once, an
+  output is never left on. On a virtual clock the wait is skipped, as in
+  VISAScheduler.
+*/
+#pragma once
+#ifndef _VISAPULSE_H_
+#define _VISAPULSE_H_
+
+#include <cmath>
+#include <vector>
+
+#include "VISADevice.h"
+#include "VISAThread.h"
+
+/*============================================================================*/
+class VISAPulser : public VISAWorker
+{
+public:
+    struct Stats
+    {
+        Stats() : count(0), failed(0), meanError(0.0), rmsError(0.0),
+            maxAbsError(0.0), writeLatency(0.0) {}
+
+        std::size_t count;      // pulses completed
+        std::size_t failed;     // pulses whose on or off write failed
+        double meanError;       // mean (achieved - requested width) in us
+        double rmsError;        // rms of the same
+        double maxAbsError;     // max |achieved - requested width| in us
+        double writeLatency;    // current write latency estimate in us
+    };
+
+public:
+    /*------------------------------------------------------------------------*/
+    /**
+    * @param slots - number of on / off command pairs, see setCommands()
+    */
+    VISAPulser(VISADevice& dev, std::size_t slots = 1) :
+        dev_(dev),
+        on_(slots),
+        off_(slots),
+        slot_(0),
+        width_(0.0),
+        pending_(false),
+        busy_(false),
+        latency_(0.0),
+        writes_(0),
+        spinMargin_(2000),
+        sumErr_(0.0),
+        sumSqErr_(0.0),
+        maxAbsErr_(0.0),
+        count_(0),
+        failed_(0)
+    {}
+    /*------------------------------------------------------------------------*/
+    ~VISAPulser()
+    {
+        stop();
+    }
+    /*------------------------------------------------------------------------*/
+    /**
+    * Renders the commands that start / end a pulse on <slot>
+    * NOTE: call while no pulse is in flight (e.g. before start())
+    */
+    void setCommands(std::size_t slot, const std::string& on,
+        const std::string& off)
+    {
+        if (slot < on_.size())
+        {
+            dev_.prepare(on, on_[slot]);
+            dev_.prepare(off, off_[slot]);
+        }
+    }
+    /*------------------------------------------------------------------------*/
+    /**
+    * Queues a pulse of <ms> on <slot>
+    * @return - false if the thread isn't running or a pulse is in flight
+    */
+    bool fire(std::size_t slot, double ms)
+    {
+        if (slot >= on_.size() || !isRunning())
+        {
+            return false;
+        }
+
+        {
+            visa_compat::lock_guard<visa_compat::mutex> lock(mutex_);
+
+            if (busy_)
+            {
+                return false;
+            }
+
+            slot_ = slot;
+            width_ = ms > 0.0 ? ms : 0.0;
+            pending_ = busy_ = true;
+        }
+
+        wake();
+
+        return true;
+    }
+    /*------------------------------------------------------------------------*/
+    /**
+    * @return - true from fire() until the off write is done
+    */
+    bool isBusy() const
+    {
+        visa_compat::lock_guard<visa_compat::mutex> lock(mutex_);
+        return busy_;
+    }
+    /*------------------------------------------------------------------------*/
+    /**
+    * How long before the off write (in us) the thread stops sleeping and
+    * starts spinning, should cover the OS sleep granularity (clamped to
+    * 0 - 10 ms)
+    */
+    void setSpinMargin(long us)
+    {
+        visa_compat::lock_guard<visa_compat::mutex> lock(mutex_);
+        spinMargin_ = us < 0 ? 0 : (us > 10000 ? 10000 : us);
+    }
+    /*------------------------------------------------------------------------*/
+    Stats getStats() const
+    {
+        visa_compat::lock_guard<visa_compat::mutex> lock(mutex_);
+
+        Stats stats;
+        stats.count = count_;
+        stats.failed = failed_;
+        stats.writeLatency = latency_;
+
+        if (count_ > 0)
+        {
+            stats.meanError = sumErr_ / count_;
+            stats.rmsError = sqrt(sumSqErr_ / count_);
+            stats.maxAbsError = maxAbsErr_;
+        }
+
+        return stats;
+    }
+    /*------------------------------------------------------------------------*/
+    void resetStats()
+    {
+        visa_compat::lock_guard<visa_compat::mutex> lock(mutex_);
+
+        sumErr_ = sumSqErr_ = maxAbsErr_ = 0.0;
+        count_ = failed_ = 0;
+    }
+    /*------------------------------------------------------------------------*/
+
+protected:
+    /*------------------------------------------------------------------------*/
+    void run()
+    {
+        while (true)
+        {
+            std::size_t slot = 0;
+            double width = 0.0;
+            bool pending = false;
+
+            {
+                visa_compat::lock_guard<visa_compat::mutex> lock(mutex_);
+
+                if (pending_)
+                {
+                    pending = true;
+                    pending_ = false;
+                    slot = slot_;
+                    width = width_;
+                }
+            }
+
+            if (pending)
+            {
+                pulse(slot, width);
+            }
+            else if (!waitFor(1000))
+            {
+                break;
+            }
+        }
+
+        // a pulse queued as we were stopped never started
+        visa_compat::lock_guard<visa_compat::mutex> lock(mutex_);
+        pending_ = busy_ = false;
+    }
+    /*------------------------------------------------------------------------*/
+
+private:
+    /*------------------------------------------------------------------------*/
+    void pulse(std::size_t slot, double width)
+    {
+        double t0 = clock().now();
+        bool success = dev_.writePrepared(on_[slot]);
+        double onDone = clock().now();
+
+        learn(onDone - t0);
+
+        if (success)
+        {
+            double target = onDone + width * 1000.0 - latency();
+
+            // coarse sleep, cut short (and the pulse ended early) by stop()
+            bool running = true;
+            double wait = (target - clock().now() - spinMargin()) / 1000.0;
+
+            while (running && wait >= 1.0 && !clock().isVirtual())
+            {
+                running = waitFor(static_cast<ViUInt32>(wait));
+                wait = (target - clock().now() - spinMargin()) / 1000.0;
+            }
+
+            // fine wait
+            if (running && clock().isVirtual())
+            {
+                clock().sleepUntil(target);
+            }
+            else if (running)
+            {
+                spin(target);
+            }
+        }
+
+        // the off write goes out whatever happened to the on write, once
+        // more should it fail
+        double t1 = clock().now();
+        bool offSuccess = dev_.writePrepared(off_[slot]);
+        double offDone = clock().now();
+
+        if (!offSuccess)
+        {
+            offSuccess = dev_.writePrepared(off_[slot]);
+            offDone = clock().now();
+        }
+        else
+        {
+            learn(offDone - t1);
+        }
+
+        visa_compat::lock_guard<visa_compat::mutex> lock(mutex_);
+
+        if (success && offSuccess)
+        {
+            double err = (offDone - onDone) - width * 1000.0;
+
+            sumErr_ += err;
+            sumSqErr_ += err * err;
+            maxAbsErr_ = fabs(err) > maxAbsErr_ ? fabs(err) : maxAbsErr_;
+            ++count_;
+        }
+        else
+        {
+            ++failed_;
+        }
+
+        busy_ = false;
+    }
+    /*------------------------------------------------------------------------*/
+    // spins until <target>, yielding on every pass so that a real-time thread
+    // doesn't lock its CPU up, and for no longer than the spin margin plus a
+    // sleep granule, should the coarse sleep have left more than that
+    void spin(double target)
+    {
+        double now = clock().now();
+        double end = now + spinMargin() + 1000.0;
+
+        if (target < end)
+        {
+            end = target;
+        }
+
+        while (now < end)
+        {
+            visa_compat::this_thread::yield();
+            now = clock().now();
+        }
+    }
+    /*------------------------------------------------------------------------*/
+    // exponentially weighted estimate of the write latency
+    void learn(double elapsed)
+    {
+        visa_compat::lock_guard<visa_compat::mutex> lock(mutex_);
+
+        latency_ = writes_ == 0 ? elapsed : 0.8 * latency_ + 0.2 * elapsed;
+        ++writes_;
+    }
+    /*------------------------------------------------------------------------*/
+    double latency() const
+    {
+        visa_compat::lock_guard<visa_compat::mutex> lock(mutex_);
+        return latency_;
+    }
+    /*------------------------------------------------------------------------*/
+    long spinMargin() const
+    {
+        visa_compat::lock_guard<visa_compat::mutex> lock(mutex_);
+        return spinMargin_;
+    }
+    /*------------------------------------------------------------------------*/
+
+private:
+    VISADevice& dev_;
+
+    // rendered once, only read by the thread afterwards
+    std::vector<VISADevice::Prepared> on_;
+    std::vector<VISADevice::Prepared> off_;
+
+    mutable visa_compat::mutex mutex_;
+    std::size_t slot_;
+    double width_;          // ms
+    bool pending_;          // queued by fire(), not yet taken by the thread
+    bool busy_;             // queued or in flight
+
+    double latency_;        // write latency estimate (us)
+    std::size_t writes_;
+    long spinMargin_;       // us
+
+    double sumErr_;
+    double sumSqErr_;
+    double maxAbsErr_;
+    std::size_t count_;
+    std::size_t failed_;
+};
+/*============================================================================*/
+#endif //_VISAPULSE_H_
@@ -0,0 +1,1019 @@
+////////////////////////////////////////////////////////////////////////////////
+// FILE:          VISARegistry.h
+// PROJECT:       Micro-Manager
+// SUBSYSTEM:     DeviceAdapters
+//-----------------------------------------------------------------------------
+// DESCRIPTION:   Hot-plug aware registry of present VISA instruments
+//
+// AUTHOR:        Scottie Alexander, scottiealexander11@gmail.com
+//
+// COPYRIGHT:     University of California, Davis, 2016
+//
+// LICENSE:       This file is distributed under the BSD license.
+//                License text is included with the source distribution.
+//
+//                This file is distributed in the hope that it will be useful,
+//                but WITHOUT ANY WARRANTY; without even the implied warranty
+//                of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+//
+//                IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+//                CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+//                INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES.
+
+/*GIST
+  The registry does one full VISA scan up front and from then on only applies
+  arrival / removal events, so keeping the list current costs O(events)
+  rather than a bus scan. Events come from an EventSource running on the
+  registry's own thread: udev (netlink) on Linux, WM_DEVICECHANGE on Windows,
+  or a SimulatedEventSource that is fed by hand. Elsewhere (or should the
+  native source fail to start) the registry is just the initial scan, apart
+  from Linux without netlink access, which falls back to a ScanEventSource
+  that rescans VISA every second.
+*/
+#pragma once
+#ifndef _VISAREGISTRY_H_
+#define _VISAREGISTRY_H_
+
+#include <algorithm>
+#include <cctype>
+#include <cstdio>
+#include <deque>
+#include <string>
+#include <vector>
+
+#include "VISADevice.h"
+
+#if defined(__linux__)
+    #include <cstring>
+    #include <fstream>
+    #include <map>
+    #include <dirent.h>
+    #include <limits.h>
+    #include <poll.h>
+    #include <stdlib.h>
+    #include <sys/socket.h>
+    #include <unistd.h>
+    #include <linux/netlink.h>
+#elif defined(_WIN32)
+    #include <cstring>
+    #include <cstdlib>
+    #ifndef NOMINMAX
+        #define NOMINMAX
+    #endif
+    #include <windows.h>
+    #include <dbt.h>
+#endif
+
+/*============================================================================*/
+class VISARegistry
+{
+public:
+    enum EventType
+    {
+        RSRC_ARRIVED,
+        RSRC_REMOVED
+    };
+
+    struct Event
+    {
+        Event() : type(RSRC_ARRIVED), resource("") {}
+        Event(EventType t, const std::string& r) : type(t), resource(r) {}
+
+        EventType type;
+        std::string resource;
+    };
+    /*------------------------------------------------------------------------*/
+    class EventSource
+    {
+    public:
+        virtual ~EventSource() {}
+
+        /**
+        * Blocks for at most <timeout> ms waiting for events
+        * @param events - any events that arrived are appended here
+        * @param timeout - maximum time to block in ms
+        * @return - false if the source has failed and should not be polled
+        */
+        virtual bool wait(std::vector<Event>& events, ViUInt32 timeout) = 0;
+    };
+    /*------------------------------------------------------------------------*/
+    class Listener
+    {
+    public:
+        virtual ~Listener() {}
+
+        // NOTE: called from the registry thread (or whichever thread calls
+        // apply()), <present> is the list *after* the event was applied
+        virtual void onRegistryChange(const Event& evt,
+            const std::vector<std::string>& present) = 0;
+    };
+    /*------------------------------------------------------------------------*/
+    class SimulatedEventSource;
+    class ScanEventSource;
+    class UdevEventSource;
+    class DeviceNotifyEventSource;
+
+public:
+    /*------------------------------------------------------------------------*/
+    VISARegistry() : source_(0), thread_(0), running_(false) {}
+    /*------------------------------------------------------------------------*/
+    ~VISARegistry()
+    {
+        stop();
+    }
+    /*------------------------------------------------------------------------*/
+    /**
+    * Replaces the current list with a full scan, this should only be needed
+    * once (before start())
+    */
+    void scan(VISADevice& dev, const std::string& expr)
+    {
+        std::vector<std::string> found = dev.findInstruments(expr);
+
+        visa_compat::lock_guard<visa_compat::mutex> lock(mutex_);
+        resources_.swap(found);
+    }
+    /*------------------------------------------------------------------------*/
+    /**
+    * Starts applying events from <source> on a background thread
+    * @param source - event source, the registry takes ownership (0 is
+    * allowed and leaves the registry static)
+    * @return - true if a source thread is running
+    */
+    bool start(EventSource* source)
+    {
+        stop();
+
+        if (source != 0)
+        {
+            source_ = source;
+            running_ = true;
+            thread_ = new visa_compat::thread(&VISARegistry::run, this);
+        }
+
+        return thread_ != 0;
+    }
+    /*------------------------------------------------------------------------*/
+    void stop()
+    {
+        if (thread_ != 0)
+        {
+            {
+                visa_compat::lock_guard<visa_compat::mutex> lock(mutex_);
+                running_ = false;
+            }
+
+            thread_->join();
+            delete thread_;
+            thread_ = 0;
+        }
+
+        if (source_ != 0)
+        {
+            delete source_;
+            source_ = 0;
+        }
+    }
+    /*------------------------------------------------------------------------*/
+    void addListener(Listener* listener)
+    {
+        visa_compat::lock_guard<visa_compat::mutex> lock(mutex_);
+        listeners_.push_back(listener);
+    }
+    /*------------------------------------------------------------------------*/
+    /**
+    * Once this returns <listener> is not (and will not be) called, even if a
+    * notification was in flight on another thread
+    */
+    void removeListener(Listener* listener)
+    {
+        {
+            visa_compat::lock_guard<visa_compat::mutex> lock(mutex_);
+            listeners_.erase(std::remove(listeners_.begin(), listeners_.end(),
+                listener), listeners_.end());
+        }
+
+        // wait out any notification that copied the list before the removal
+        visa_compat::lock_guard<visa_compat::recursive_mutex> lock(notifyMutex_);
+    }
+    /*------------------------------------------------------------------------*/
+    std::vector<std::string> present() const
+    {
+        visa_compat::lock_guard<visa_compat::mutex> lock(mutex_);
+        return resources_;
+    }
+    /*------------------------------------------------------------------------*/
+    bool isPresent(const std::string& rsrc) const
+    {
+        visa_compat::lock_guard<visa_compat::mutex> lock(mutex_);
+        return find(rsrc) != resources_.end();
+    }
+    /*------------------------------------------------------------------------*/
+    /**
+    * Incrementally applies a single event and notifies listeners if the
+    * list actually changed
+    */
+    void apply(const Event& evt)
+    {
+        std::vector<std::string> present;
+        std::vector<Listener*> listeners;
+
+        visa_compat::lock_guard<visa_compat::recursive_mutex> notify(notifyMutex_);
+
+        {
+            visa_compat::lock_guard<visa_compat::mutex> lock(mutex_);
+
+            std::vector<std::string>::iterator it = find(evt.resource);
+
+            if (evt.type == RSRC_ARRIVED && it == resources_.end())
+            {
+                resources_.push_back(evt.resource);
+            }
+            else if (evt.type == RSRC_REMOVED && it != resources_.end())
+            {
+                resources_.erase(it);
+            }
+            else
+            {
+                // duplicate arrival or removal of something we never saw
+                return;
+            }
+
+            present = resources_;
+            listeners = listeners_;
+        }
+
+        // notify outside of the lock so listeners may call back into us
+        for (std::vector<Listener*>::size_type k = 0; k < listeners.size();
+            ++k)
+        {
+            listeners[k]->onRegistryChange(evt, present);
+        }
+    }
+    /*------------------------------------------------------------------------*/
+    /**
+    * Normalizes a resource string for comparison: VISA is case insensitive
+    * and the board number of a USB resource depends on enumeration order
+    * (e.g. "usb1::0xffff::0x9130::123::instr" == "USB0::0xFFFF::0x9130::123::INSTR")
+    */
+    static std::string key(const std::string& rsrc)
+    {
+        std::string out(rsrc);
+
+        for (std::string::size_type k = 0; k < out.size(); ++k)
+        {
+            out[k] = static_cast<char>(toupper(
+                static_cast<unsigned char>(out[k])));
+        }
+
+        if (out.compare(0, 3, "USB") == 0)
+        {
+            std::string::size_type sep = out.find("::");
+            if (sep != std::string::npos)
+            {
+                out = "USB" + out.substr(sep);
+            }
+        }
+
+        return out;
+    }
+    /*------------------------------------------------------------------------*/
+    /**
+    * @param expr - what the registry was scanned for
+    * @param present - the result of that scan
+    * @return - the native hot-plug source for this platform, 0 where there
+    * is none (the caller owns the returned object)
+    */
+    static EventSource* createPlatformSource(const std::string& expr,
+        const std::vector<std::string>& present);
+    /*------------------------------------------------------------------------*/
+    /**
+    * Process wide registry shared by every device, so that one scan and one
+    * hot-plug thread serve any number of instruments: the first acquire
+    * scans (using <dev>) and starts the platform source, the matching last
+    * releaseShared() stops it again
+    */
+    static VISARegistry& acquireShared(VISADevice& dev, const std::string& expr)
+    {
+        Shared& shared = getShared();
+
+        visa_compat::lock_guard<visa_compat::mutex> lock(shared.mutex);
+
+        if (shared.users++ == 0)
+        {
+            shared.registry = new VISARegistry();
+            shared.registry->scan(dev, expr);
+            shared.registry->start(createPlatformSource(expr,
+                shared.registry->present()));
+        }
+
+        return *shared.registry;
+    }
+    /*------------------------------------------------------------------------*/
+    static void releaseShared()
+    {
+        Shared& shared = getShared();
+
+        visa_compat::lock_guard<visa_compat::mutex> lock(shared.mutex);
+
+        if (shared.users > 0 && --shared.users == 0)
+        {
+            delete shared.registry;
+            shared.registry = 0;
+        }
+    }
+    /*------------------------------------------------------------------------*/
+
+private:
+    /*------------------------------------------------------------------------*/
+    std::vector<std::string>::iterator find(const std::string& rsrc)
+    {
+        std::string k = key(rsrc);
+
+        std::vector<std::string>::iterator it = resources_.begin();
+        for (; it != resources_.end(); ++it)
+        {
+            if (key(*it) == k)
+            {
+                break;
+            }
+        }
+
+        return it;
+    }
+    /*------------------------------------------------------------------------*/
+    std::vector<std::string>::const_iterator find(const std::string& rsrc) const
+    {
+        return const_cast<VISARegistry*>(this)->find(rsrc);
+    }
+    /*------------------------------------------------------------------------*/
+    void run()
+    {
+        std::vector<Event> events;
+
+        while (isRunning())
+        {
+            events.clear();
+
+            // wake up regularly so that stop() is never blocked for long
+            if (!source_->wait(events, 100))
+            {
+                break;
+            }
+
+            for (std::vector<Event>::size_type k = 0; k < events.size(); ++k)
+            {
+                apply(events[k]);
+            }
+        }
+    }
+    /*------------------------------------------------------------------------*/
+    bool isRunning()
+    {
+        visa_compat::lock_guard<visa_compat::mutex> lock(mutex_);
+        return running_;
+    }
+    /*------------------------------------------------------------------------*/
+    struct Shared
+    {
+        Shared() : users(0), registry(0) {}
+
+        visa_compat::mutex mutex;
+        std::size_t users;
+        VISARegistry* registry;
+    };
+    /*------------------------------------------------------------------------*/
+    static Shared& getShared()
+    {
+        static Shared shared;
+        return shared;
+    }
+    /*------------------------------------------------------------------------*/
+
+private:
+    mutable visa_compat::mutex mutex_;
+    std::vector<std::string> resources_;
+    std::vector<Listener*> listeners_;
+
+    // held while listeners are notified, see removeListener()
+    visa_compat::recursive_mutex notifyMutex_;
+
+    EventSource* source_;
+    visa_compat::thread* thread_;
+    bool running_;
+};
+/*============================================================================*/
+/**
+* Stand-in event source for simulation / testing: events are injected with
+* post() and delivered on the registry thread like real hot-plug events
+*/
+class VISARegistry::SimulatedEventSource : public VISARegistry::EventSource
+{
+public:
+    /*------------------------------------------------------------------------*/
+    void post(EventType type, const std::string& rsrc)
+    {
+        {
+            visa_compat::lock_guard<visa_compat::mutex> lock(mutex_);
+            queue_.push_back(Event(type, rsrc));
+        }
+
+        cond_.notify_one();
+    }
+    /*------------------------------------------------------------------------*/
+    bool wait(std::vector<Event>& events, ViUInt32 timeout)
+    {
+        visa_compat::unique_lock<visa_compat::mutex> lock(mutex_);
+
+        if (queue_.empty())
+        {
+            cond_.wait_for(lock, visa_compat::chrono::milliseconds(timeout));
+        }
+
+        events.insert(events.end(), queue_.begin(), queue_.end());
+        queue_.clear();
+
+        return true;
+    }
+    /*------------------------------------------------------------------------*/
+
+private:
+    visa_compat::mutex mutex_;
+    visa_compat::condition_variable cond_;
+    std::deque<Event> queue_;
+};
+/*============================================================================*/
+/**
+* Fallback for when the native hot-plug feed can't be opened: rescans <expr>
+* on a session of its own every <interval> ms and reports the difference to
+* the previous scan, starting from <present> (the registry's own scan), so
+* the registry (and reconnects) still work, at the cost of a bus scan per
+* interval
+*/
+class VISARegistry::ScanEventSource : public VISARegistry::EventSource
+{
+public:
+    /*------------------------------------------------------------------------*/
+    ScanEventSource(const std::string& expr,
+        const std::vector<std::string>& present, ViUInt32 interval = 1000) :
+        expr_(expr),
+        interval_(interval),
+        waited_(0),
+        last_(present)
+    {}
+    /*------------------------------------------------------------------------*/
+    bool wait(std::vector<Event>& events, ViUInt32 timeout)
+    {
+        visa_compat::this_thread::sleep_for(
+            visa_compat::chrono::milliseconds(timeout));
+
+        waited_ += timeout;
+        if (waited_ < interval_)
+        {
+            return dev_.isInitialized();
+        }
+
+        waited_ = 0;
+
+        std::vector<std::string> found = dev_.findInstruments(expr_);
+
+        diff(found, last_, RSRC_ARRIVED, events);
+        diff(last_, found, RSRC_REMOVED, events);
+
+        last_.swap(found);
+
+        return dev_.isInitialized();
+    }
+    /*------------------------------------------------------------------------*/
+
+private:
+    /*------------------------------------------------------------------------*/
+    // reports everything in <a> that isn't in <b> as <type>
+    static void diff(const std::vector<std::string>& a,
+        const std::vector<std::string>& b, EventType type,
+        std::vector<Event>& events)
+    {
+        for (std::vector<std::string>::size_type k = 0; k < a.size(); ++k)
+        {
+            bool found = false;
+
+            for (std::vector<std::string>::size_type j = 0; j < b.size() &&
+                !found; ++j)
+            {
+                found = key(a[k]) == key(b[j]);
+            }
+
+            if (!found)
+            {
+                events.push_back(Event(type, a[k]));
+            }
+        }
+    }
+    /*------------------------------------------------------------------------*/
+
+private:
+    VISADevice dev_;
+    std::string expr_;
+    ViUInt32 interval_;
+    ViUInt32 waited_;
+    std::vector<std::string> last_;
+};
+/*============================================================================*/
+#if defined(__linux__)
+/**
+* Listens for kernel uevents on a netlink socket (the same feed udev uses)
+* and reports USBTMC interfaces (class 254, subclass 3) coming and going as
+* VISA USB resource strings
+*/
+class VISARegistry::UdevEventSource : public VISARegistry::EventSource
+{
+public:
+    /*------------------------------------------------------------------------*/
+    UdevEventSource() : fd_(-1)
+    {
+        fd_ = socket(AF_NETLINK, SOCK_DGRAM, NETLINK_KOBJECT_UEVENT);
+
+        if (fd_ >= 0)
+        {
+            struct sockaddr_nl addr;
+            memset(&addr, 0, sizeof(addr));
+            addr.nl_family = AF_NETLINK;
+            addr.nl_groups = 1; // kernel uevent multicast group
+
+            if (bind(fd_, reinterpret_cast<struct sockaddr*>(&addr),
+                sizeof(addr)) < 0)
+            {
+                ::close(fd_);
+                fd_ = -1;
+            }
+        }
+
+        if (fd_ >= 0)
+        {
+            seed();
+        }
+    }
+    /*------------------------------------------------------------------------*/
+    ~UdevEventSource()
+    {
+        if (fd_ >= 0)
+        {
+            ::close(fd_);
+        }
+    }
+    /*------------------------------------------------------------------------*/
+    bool isValid() const
+    {
+        return fd_ >= 0;
+    }
+    /*------------------------------------------------------------------------*/
+    bool wait(std::vector<Event>& events, ViUInt32 timeout)
+    {
+        if (fd_ < 0)
+        {
+            return false;
+        }
+
+        struct pollfd pfd;
+        pfd.fd = fd_;
+        pfd.events = POLLIN;
+        pfd.revents = 0;
+
+        int ret = poll(&pfd, 1, static_cast<int>(timeout));
+
+        while (ret > 0 && (pfd.revents & POLLIN))
+        {
+            char buf[4096];
+            ssize_t len = recv(fd_, buf, sizeof(buf) - 1, MSG_DONTWAIT);
+
+            if (len <= 0)
+            {
+                break;
+            }
+
+            buf[len] = '\0';
+            parse(buf, static_cast<std::size_t>(len), events);
+        }
+
+        return ret >= 0;
+    }
+    /*------------------------------------------------------------------------*/
+
+private:
+    /*------------------------------------------------------------------------*/
+    // a uevent is "<action>@<devpath>\0KEY=VALUE\0KEY=VALUE\0..."
+    void parse(const char* buf, std::size_t len, std::vector<Event>& events)
+    {
+        std::string action, devpath, iface, devtype;
+
+        for (std::size_t k = strlen(buf) + 1; k < len; k += strlen(buf+k) + 1)
+        {
+            std::string field(buf + k);
+
+            if (field.compare(0, 7, "ACTION=") == 0)
+                action = field.substr(7);
+            else if (field.compare(0, 8, "DEVPATH=") == 0)
+                devpath = field.substr(8);
+            else if (field.compare(0, 10, "INTERFACE=") == 0)
+                iface = field.substr(10);
+            else if (field.compare(0, 8, "DEVTYPE=") == 0)
+                devtype = field.substr(8);
+        }
+
+        if (devtype != "usb_interface" || iface.compare(0, 6, "254/3/") != 0)
+        {
+            return;
+        }
+
+        if (action == "add")
+        {
+            std::string rsrc = resourceFor(devpath);
+
+            if (!rsrc.empty())
+            {
+                paths_[devpath] = rsrc;
+                events.push_back(Event(RSRC_ARRIVED, rsrc));
+            }
+        }
+        else if (action == "remove")
+        {
+            // sysfs is already gone, so use what we recorded on arrival
+            std::map<std::string, std::string>::iterator it =
+                paths_.find(devpath);
+
+            if (it != paths_.end())
+            {
+                events.push_back(Event(RSRC_REMOVED, it->second));
+                paths_.erase(it);
+            }
+        }
+    }
+    /*------------------------------------------------------------------------*/
+    // builds the VISA resource string for a USBTMC interface from the ids and
+    // serial number of its parent usb_device (sysfs must still exist)
+    std::string resourceFor(const std::string& devpath) const
+    {
+        std::string parent = "/sys" + devpath.substr(0, devpath.rfind('/'));
+        std::string vid = readLine(parent + "/idVendor");
+        std::string pid = readLine(parent + "/idProduct");
+        std::string serial = readLine(parent + "/serial");
+
+        if (vid.empty() || pid.empty())
+        {
+            return "";
+        }
+
+        char rsrc[VI_FIND_BUFLEN];
+        snprintf(rsrc, sizeof(rsrc), "USB0::0x%04lX::0x%04lX::%s::INSTR",
+            strtoul(vid.c_str(), NULL, 16), strtoul(pid.c_str(), NULL, 16),
+            serial.c_str());
+
+        return std::string(rsrc);
+    }
+    /*------------------------------------------------------------------------*/
+    // records the devpath of every USBTMC interface that is already present so
+    // that its removal can be reported (arrivals are covered by the VISA scan)
+    void seed()
+    {
+        const std::string root("/sys/bus/usb/devices/");
+
+        DIR* dir = opendir(root.c_str());
+        if (dir == NULL)
+        {
+            return;
+        }
+
+        struct dirent* ent;
+        while ((ent = readdir(dir)) != NULL)
+        {
+            std::string name(ent->d_name);
+
+            // interfaces are named <bus>-<port>:<config>.<iface>
+            if (name.find(':') == std::string::npos ||
+                readLine(root + name + "/bInterfaceClass") != "fe" ||
+                readLine(root + name + "/bInterfaceSubClass") != "03")
+            {
+                continue;
+            }
+
+            char real[PATH_MAX];
+            if (realpath((root + name).c_str(), real) != NULL &&
+                strncmp(real, "/sys", 4) == 0)
+            {
+                std::string devpath(real + 4);
+                std::string rsrc = resourceFor(devpath);
+
+                if (!rsrc.empty())
+                {
+                    paths_[devpath] = rsrc;
+                }
+            }
+        }
+
+        closedir(dir);
+    }
+    /*------------------------------------------------------------------------*/
+    static std::string readLine(const std::string& path)
+    {
+        std::string line;
+        std::ifstream in(path.c_str());
+        std::getline(in, line);
+        return line;
+    }
+    /*------------------------------------------------------------------------*/
+
+private:
+    int fd_;
+    std::map<std::string, std::string> paths_;
+};
+/*----------------------------------------------------------------------------*/
+inline VISARegistry::EventSource* VISARegistry::createPlatformSource(
+    const std::string& expr, const std::vector<std::string>& present)
+{
+    UdevEventSource* source = new UdevEventSource();
+
+    if (!source->isValid())
+    {
+        delete source;
+        return new ScanEventSource(expr, present);
+    }
+
+    return source;
+}
+#elif defined(_WIN32)
+/**
+* Receives WM_DEVICECHANGE for USB device interfaces (RegisterDeviceNotification)
+* on a message-only window of the registry thread. Windows reports every USB
+* device, so an arrival is only passed on once a VISA search for its vendor /
+* product id finds its serial number (retried for a few seconds, VISA may
+* enumerate it after the notification). Removals are passed on as they are,
+* the registry ignores anything it never listed.
+*/
+class VISARegistry::DeviceNotifyEventSource : public VISARegistry::EventSource
+{
+public:
+    /*------------------------------------------------------------------------*/
+    DeviceNotifyEventSource() : window_(0), notify_(0), created_(false) {}
+    /*------------------------------------------------------------------------*/
+    ~DeviceNotifyEventSource()
+    {
+        // the window itself went with the registry thread that created it
+        if (notify_ != 0)
+        {
+            UnregisterDeviceNotification(notify_);
+        }
+    }
+    /*------------------------------------------------------------------------*/
+    bool wait(std::vector<Event>& events, ViUInt32 timeout)
+    {
+        // a window's messages go to the thread that created it, i.e. it has
+        // to be created here, on the registry thread
+        if (!created_)
+        {
+            created_ = true;
+            create();
+        }
+
+        if (notify_ == 0)
+        {
+            return false;
+        }
+
+        MsgWaitForMultipleObjects(0, NULL, FALSE, timeout, QS_ALLINPUT);
+
+        // delivers the (sent) WM_DEVICECHANGE messages to proc()
+        MSG msg;
+        while (PeekMessageA(&msg, window_, 0, 0, PM_REMOVE))
+        {
+            DispatchMessageA(&msg);
+        }
+
+        for (std::vector<Event>::size_type k = 0; k < removed_.size(); ++k)
+        {
+            events.push_back(Event(RSRC_REMOVED, removed_[k]));
+        }
+
+        removed_.clear();
+
+        resolve(events);
+
+        return dev_.isInitialized();
+    }
+    /*------------------------------------------------------------------------*/
+
+private:
+    // an arrival VISA has not listed yet
+    struct Pending
+    {
+        std::string rsrc;
+        std::string expr;
+        int tries;
+        visa_compat::chrono::steady_clock::time_point next;
+    };
+    /*------------------------------------------------------------------------*/
+    bool create()
+    {
+        static const char* name = "VISARegistryDeviceNotify";
+
+        WNDCLASSEXA wc;
+        memset(&wc, 0, sizeof(wc));
+        wc.cbSize = sizeof(wc);
+        wc.lpfnWndProc = &DeviceNotifyEventSource::proc;
+        wc.hInstance = GetModuleHandleA(NULL);
+        wc.lpszClassName = name;
+
+        // fails harmlessly if an earlier registry already registered it
+        RegisterClassExA(&wc);
+
+        window_ = CreateWindowExA(0, name, "", 0, 0, 0, 0, 0, HWND_MESSAGE,
+            NULL, wc.hInstance, NULL);
+
+        if (window_ == 0)
+        {
+            return false;
+        }
+
+        SetWindowLongPtrA(window_, GWLP_USERDATA,
+            reinterpret_cast<LONG_PTR>(this));
+
+        // GUID_DEVINTERFACE_USB_DEVICE (usbiodef.h)
+        static const GUID usbDevice = {0xA5DCBF10, 0x6530, 0x11D2,
+            {0x90, 0x1F, 0x00, 0xC0, 0x4F, 0xB9, 0x51, 0xED}};
+
+        DEV_BROADCAST_DEVICEINTERFACE_A filter;
+        memset(&filter, 0, sizeof(filter));
+        filter.dbcc_size = sizeof(filter);
+        filter.dbcc_devicetype = DBT_DEVTYP_DEVICEINTERFACE;
+        filter.dbcc_classguid = usbDevice;
+
+        notify_ = RegisterDeviceNotificationA(window_, &filter,
+            DEVICE_NOTIFY_WINDOW_HANDLE);
+
+        return notify_ != 0;
+    }
+    /*------------------------------------------------------------------------*/
+    static LRESULT CALLBACK proc(HWND hwnd, UINT msg, WPARAM wp, LPARAM lp)
+    {
+        if (msg == WM_DEVICECHANGE && lp != 0 &&
+            (wp == DBT_DEVICEARRIVAL || wp == DBT_DEVICEREMOVECOMPLETE))
+        {
+            const DEV_BROADCAST_HDR* hdr =
+                reinterpret_cast<const DEV_BROADCAST_HDR*>(lp);
+
+            DeviceNotifyEventSource* self =
+                reinterpret_cast<DeviceNotifyEventSource*>(
+                GetWindowLongPtrA(hwnd, GWLP_USERDATA));
+
+            if (self != 0 && hdr->dbch_devicetype == DBT_DEVTYP_DEVICEINTERFACE)
+            {
+                const DEV_BROADCAST_DEVICEINTERFACE_A* iface =
+                    reinterpret_cast<const DEV_BROADCAST_DEVICEINTERFACE_A*>(hdr);
+
+                self->changed(wp == DBT_DEVICEARRIVAL, iface->dbcc_name);
+            }
+
+            return TRUE;
+        }
+
+        return DefWindowProcA(hwnd, msg, wp, lp);
+    }
+    /*------------------------------------------------------------------------*/
+    // <path> is "\\?\USB#VID_<vid>&PID_<pid>#<serial>#{<guid>}"
+    void changed(bool arrived, const char* path)
+    {
+        std::string upper(path);
+        for (std::string::size_type k = 0; k < upper.size(); ++k)
+        {
+            upper[k] = static_cast<char>(toupper(
+                static_cast<unsigned char>(upper[k])));
+        }
+
+        std::string::size_type vid = upper.find("VID_");
+        std::string::size_type pid = upper.find("PID_");
+        std::string::size_type first = upper.find('#');
+        std::string::size_type second = first == std::string::npos ?
+            first : upper.find('#', first + 1);
+        std::string::size_type third = second == std::string::npos ?
+            second : upper.find('#', second + 1);
+
+        if (vid == std::string::npos || pid == std::string::npos ||
+            third == std::string::npos)
+        {
+            return;
+        }
+
+        unsigned long v = strtoul(upper.c_str() + vid + 4, NULL, 16);
+        unsigned long p = strtoul(upper.c_str() + pid + 4, NULL, 16);
+        std::string serial(path + second + 1, third - second - 1);
+
+        char rsrc[VI_FIND_BUFLEN];
+        snprintf(rsrc, sizeof(rsrc), "USB0::0x%04lX::0x%04lX::%s::INSTR",
+            v, p, serial.c_str());
+
+        // anything still waiting to be listed is stale either way
+        for (std::vector<Pending>::size_type k = 0; k < pending_.size(); ++k)
+        {
+            if (key(pending_[k].rsrc) == key(rsrc))
+            {
+                pending_.erase(pending_.begin() + k);
+                break;
+            }
+        }
+
+        if (!arrived)
+        {
+            removed_.push_back(rsrc);
+            return;
+        }
+
+        // the serial number is matched on our side, VISA search expressions
+        // would treat some of its characters as patterns
+        char expr[VI_FIND_BUFLEN];
+        snprintf(expr, sizeof(expr), "USB?*::0x%04lX::0x%04lX::?*::INSTR",
+            v, p);
+
+        Pending entry;
+        entry.rsrc = rsrc;
+        entry.expr = expr;
+        entry.tries = 10;
+        entry.next = visa_compat::chrono::steady_clock::now();
+
+        pending_.push_back(entry);
+    }
+    /*------------------------------------------------------------------------*/
+    // looks for pending arrivals that are due (every 500 ms, 10 times at
+    // most), reporting the resource string VISA lists them under
+    void resolve(std::vector<Event>& events)
+    {
+        visa_compat::chrono::steady_clock::time_point now =
+            visa_compat::chrono::steady_clock::now();
+
+        for (std::vector<Pending>::size_type k = 0; k < pending_.size(); )
+        {
+            Pending& entry = pending_[k];
+
+            if (now < entry.next)
+            {
+                ++k;
+                continue;
+            }
+
+            std::vector<std::string> found = dev_.findInstruments(entry.expr);
+            std::string listed;
+
+            for (std::vector<std::string>::size_type j = 0; j < found.size() &&
+                listed.empty(); ++j)
+            {
+                if (key(found[j]) == key(entry.rsrc))
+                {
+                    listed = found[j];
+                }
+            }
+
+            if (!listed.empty())
+            {
+                events.push_back(Event(RSRC_ARRIVED, listed));
+            }
+
+            if (!listed.empty() || --entry.tries <= 0)
+            {
+                pending_.erase(pending_.begin() + k);
+                continue;
+            }
+
+            entry.next = now + visa_compat::chrono::milliseconds(500);
+            ++k;
+        }
+    }
+    /*------------------------------------------------------------------------*/
+
+private:
+    VISADevice dev_;
+    HWND window_;
+    HDEVNOTIFY notify_;
+    bool created_;
+
+    // filled by proc() while wait() pumps messages
+    std::vector<std::string> removed_;
+    std::vector<Pending> pending_;
+};
+/*----------------------------------------------------------------------------*/
+inline VISARegistry::EventSource* VISARegistry::createPlatformSource(
+    const std::string&, const std::vector<std::string>&)
+{
+    // should the window fail, wait() reports it and the registry stays at
+    // the initial scan
+    return new DeviceNotifyEventSource();
+}
+#else
+/*----------------------------------------------------------------------------*/
+// no native hot-plug feed here, the initial scan is all there is (a supply
+// that was unplugged is reopened by hand, re-initializing it)
+inline VISARegistry::EventSource* VISARegistry::createPlatformSource(
+    const std::string&, const std::vector<std::string>&)
+{
+    return 0;
+}
+#endif
+/*============================================================================*/
+#endif //_VISAREGISTRY_H_
@@ -0,0 +1,366 @@
+////////////////////////////////////////////////////////////////////////////////
+// FILE:          VISAScheduler.h
+// PROJECT:       Micro-Manager
+// SUBSYSTEM:     DeviceAdapters
+//-----------------------------------------------------------------------------
+// DESCRIPTION:   Issues command batches to a VISA device at scheduled times
+//
+// AUTHOR:        Scottie Alexander, scottiealexander11@gmail.com
+//
+// COPYRIGHT:     University of California, Davis, 2016
+//
+// LICENSE:       This file is distributed under the BSD license.
+//                License text is included with the source distribution.
+//
+//                This file is distributed in the hope that it will be useful,
+//                but WITHOUT ANY WARRANTY; without even the implied warranty
+//                of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+//
+//                IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+//                CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+//                INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES.
+
+/*GIST
+  Entries are (time, commands) pairs, times are in ms relative to an epoch
+  (the "experiment clock", see resetClock()). The scheduler thread sleeps
+  until shortly before an entry is due, spins for the remainder, and issues
+  the write early by the learned write latency so that the write *completes*
+  at the requested time. Requested vs. actual completion time is recorded
+  for every entry.
+
+  All timing uses the worker's VISAClock (see VISAWorker::setClock()). On a
+  virtual clock the scheduler jumps straight to each entry instead of
+  sleeping / spinning, so a long schedule runs faster than real time with
+  the same accounting; call resetClock() after changing the clock.
+*/
+#pragma once
+#ifndef _VISASCHEDULER_H_
+#define _VISASCHEDULER_H_
+
+#include <cmath>
+#include <deque>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "VISADevice.h"
+#include "VISAThread.h"
+
+/*============================================================================*/
+class VISAScheduler : public VISAWorker
+{
+public:
+    // requested vs. actual (write completed) time of one entry, in ms since
+    // the epoch
+    struct Record
+    {
+        double requested;
+        double actual;
+        bool success;
+    };
+
+    struct Stats
+    {
+        Stats() : count(0), failed(0), meanError(0.0), meanAbsError(0.0),
+            rmsError(0.0), maxAbsError(0.0), writeLatency(0.0) {}
+
+        std::size_t count;      // entries issued
+        std::size_t failed;     // entries whose write failed
+        double meanError;       // mean (actual - requested) in us
+        double meanAbsError;    // mean |actual - requested| in us
+        double rmsError;        // rms (actual - requested) in us
+        double maxAbsError;     // max |actual - requested| in us
+        double writeLatency;    // current write latency estimate in us
+    };
+
+    class Listener
+    {
+    public:
+        virtual ~Listener() {}
+
+        // NOTE: called on the scheduler thread once an entry was written
+        virtual void onScheduleIssued(const Record& rec) = 0;
+    };
+
+public:
+    /*------------------------------------------------------------------------*/
+    VISAScheduler(VISADevice& dev) :
+        dev_(dev),
+        listener_(0),
+        epoch_(clock().now()),
+        latency_(0.0),
+        spinMargin_(2000),
+        maxRecords_(1000),
+        sumErr_(0.0),
+        sumAbsErr_(0.0),
+        sumSqErr_(0.0),
+        maxAbsErr_(0.0),
+        count_(0),
+        failed_(0)
+    {}
+    /*------------------------------------------------------------------------*/
+    ~VISAScheduler()
+    {
+        stop();
+    }
+    /*------------------------------------------------------------------------*/
+    /**
+    * Sets the experiment clock to 0 *now*, entries already queued keep their
+    * times (i.e. they are now relative to the new epoch)
+    */
+    void resetClock()
+    {
+        {
+            visa_compat::lock_guard<visa_compat::mutex> lock(mutex_);
+            epoch_ = clock().now();
+        }
+
+        wake();
+    }
+    /*------------------------------------------------------------------------*/
+    /**
+    * @return - current time of the experiment clock in ms
+    */
+    double now() const
+    {
+        visa_compat::lock_guard<visa_compat::mutex> lock(mutex_);
+        return (clock().now() - epoch_) / 1000.0;
+    }
+    /*------------------------------------------------------------------------*/
+    /**
+    * Queues <cmds> to be written (as a single write) at <t> ms on the
+    * experiment clock, entries that are already late are issued immediately
+    */
+    void schedule(double t, const std::vector<std::string>& cmds)
+    {
+        {
+            visa_compat::lock_guard<visa_compat::mutex> lock(mutex_);
+            entries_.insert(std::make_pair(t, cmds));
+        }
+
+        // the new entry may be due before the one we are sleeping on
+        wake();
+    }
+    /*------------------------------------------------------------------------*/
+    /**
+    * Sets who is told about every issued entry (0 for nobody), set before
+    * start(), the listener is not owned
+    */
+    void setListener(Listener* listener)
+    {
+        visa_compat::lock_guard<visa_compat::mutex> lock(mutex_);
+        listener_ = listener;
+    }
+    /*------------------------------------------------------------------------*/
+    /**
+    * Drops all queued entries (the recorded timing is kept)
+    */
+    void clear()
+    {
+        visa_compat::lock_guard<visa_compat::mutex> lock(mutex_);
+        entries_.clear();
+    }
+    /*------------------------------------------------------------------------*/
+    std::size_t pending() const
+    {
+        visa_compat::lock_guard<visa_compat::mutex> lock(mutex_);
+        return entries_.size();
+    }
+    /*------------------------------------------------------------------------*/
+    /**
+    * How long before the target time (in us) the thread stops sleeping and
+    * starts spinning, should cover the OS sleep granularity
+    */
+    void setSpinMargin(long us)
+    {
+        visa_compat::lock_guard<visa_compat::mutex> lock(mutex_);
+        spinMargin_ = us;
+    }
+    /*------------------------------------------------------------------------*/
+    Stats getStats() const
+    {
+        visa_compat::lock_guard<visa_compat::mutex> lock(mutex_);
+
+        Stats stats;
+        stats.count = count_;
+        stats.failed = failed_;
+        stats.writeLatency = latency_;
+
+        if (count_ > 0)
+        {
+            stats.meanError = sumErr_ / count_;
+            stats.meanAbsError = sumAbsErr_ / count_;
+            stats.rmsError = sqrt(sumSqErr_ / count_);
+            stats.maxAbsError = maxAbsErr_;
+        }
+
+        return stats;
+    }
+    /*------------------------------------------------------------------------*/
+    /**
+    * @return - the most recent records (at most 1000), oldest first
+    */
+    std::vector<Record> getRecords() const
+    {
+        visa_compat::lock_guard<visa_compat::mutex> lock(mutex_);
+        return std::vector<Record>(records_.begin(), records_.end());
+    }
+    /*------------------------------------------------------------------------*/
+    void resetStats()
+    {
+        visa_compat::lock_guard<visa_compat::mutex> lock(mutex_);
+
+        records_.clear();
+        sumErr_ = sumAbsErr_ = sumSqErr_ = maxAbsErr_ = 0.0;
+        count_ = failed_ = 0;
+    }
+    /*------------------------------------------------------------------------*/
+
+protected:
+    /*------------------------------------------------------------------------*/
+    void run()
+    {
+        while (isRunning())
+        {
+            double target = 0.0;
+            std::vector<std::string> cmds;
+            double requested = 0.0;
+            bool due = false;
+
+            {
+                visa_compat::lock_guard<visa_compat::mutex> lock(mutex_);
+
+                if (!entries_.empty())
+                {
+                    due = true;
+                    requested = entries_.begin()->first;
+
+                    // issue early by the expected write latency
+                    target = epoch_ + requested * 1000.0 - latency_;
+                }
+            }
+
+            if (!due)
+            {
+                // nothing to do, sleep until something is scheduled
+                waitFor(1000);
+                continue;
+            }
+
+            // coarse sleep, re-evaluate if woken (new entry / clock reset)
+            double wait = (target - clock().now() - spinMargin_) / 1000.0;
+            if (wait >= 1.0 && !clock().isVirtual())
+            {
+                waitFor(static_cast<ViUInt32>(wait));
+                continue;
+            }
+
+            {
+                visa_compat::lock_guard<visa_compat::mutex> lock(mutex_);
+
+                // make sure the entry is still there (clear() may have run)
+                if (entries_.empty() || entries_.begin()->first != requested)
+                {
+                    continue;
+                }
+
+                cmds.swap(entries_.begin()->second);
+                entries_.erase(entries_.begin());
+            }
+
+            // fine wait
+            if (clock().isVirtual())
+            {
+                clock().sleepUntil(target);
+            }
+            else
+            {
+                while (clock().now() < target)
+                {
+                }
+            }
+
+            issue(requested, cmds);
+        }
+    }
+    /*------------------------------------------------------------------------*/
+
+private:
+    /*------------------------------------------------------------------------*/
+    void issue(double requested, const std::vector<std::string>& cmds)
+    {
+        double t0 = clock().now();
+        bool success = dev_.write(cmds);
+        double t1 = clock().now();
+
+        Record rec;
+        Listener* listener = 0;
+
+        {
+            visa_compat::lock_guard<visa_compat::mutex> lock(mutex_);
+            record(requested, success, t1 - t0, (t1 - epoch_) / 1000.0, rec);
+            listener = listener_;
+        }
+
+        // outside of the lock, the listener may call back into us
+        if (listener != 0)
+        {
+            listener->onScheduleIssued(rec);
+        }
+    }
+    /*------------------------------------------------------------------------*/
+    // accounts for an issued entry, with the lock held
+    void record(double requested, bool success, double elapsed, double actual,
+        Record& rec)
+    {
+        // exponentially weighted estimate of the write latency
+        latency_ = count_ == 0 ? elapsed : 0.8 * latency_ + 0.2 * elapsed;
+
+        rec.requested = requested;
+        rec.actual = actual;
+        rec.success = success;
+
+        records_.push_back(rec);
+        if (records_.size() > maxRecords_)
+        {
+            records_.pop_front();
+        }
+
+        double err = (rec.actual - rec.requested) * 1000.0;
+
+        sumErr_ += err;
+        sumAbsErr_ += fabs(err);
+        sumSqErr_ += err * err;
+        maxAbsErr_ = fabs(err) > maxAbsErr_ ? fabs(err) : maxAbsErr_;
+
+        ++count_;
+        if (!success)
+        {
+            ++failed_;
+        }
+    }
+    /*------------------------------------------------------------------------*/
+
+private:
+    VISADevice& dev_;
+    Listener* listener_;
+
+    mutable visa_compat::mutex mutex_;
+    std::multimap<double, std::vector<std::string> > entries_;
+    double epoch_;          // us on clock()
+
+    double latency_;        // write latency estimate (us)
+    long spinMargin_;       // us
+
+    std::deque<Record> records_;
+    std::size_t maxRecords_;
+
+    double sumErr_;
+    double sumAbsErr_;
+    double sumSqErr_;
+    double maxAbsErr_;
+    std::size_t count_;
+    std::size_t failed_;
+};
+/*============================================================================*/
+#endif //_VISASCHEDULER_H_
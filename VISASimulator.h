@@ -0,0 +1,1010 @@
+////////////////////////////////////////////////////////////////////////////////
+// FILE:          VISASimulator.h
+// PROJECT:       Micro-Manager
+// SUBSYSTEM:     DeviceAdapters
+//-----------------------------------------------------------------------------
+// DESCRIPTION:   Simulated 9130B supplies behind the NI-VISA C interface
+//
+// AUTHOR:        Scottie Alexander, scottiealexander11@gmail.com
+//
+// COPYRIGHT:     University of California, Davis, 2016
+//
+// LICENSE:       This file is distributed under the BSD license.
+//                License text is included with the source distribution.
+//
+//                This file is distributed in the hope that it will be useful,
+//                but WITHOUT ANY WARRANTY; without even the implied warranty
+//                of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+//
+//                IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+//                CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+//                INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES.
+
+/*GIST
+  Defines the vi* functions VISADevice uses, so a program built with
+  -DVISA_SIMULATOR (and without linking visa64) talks to any number of
+  simulated 9130B supplies instead of hardware (visa.h is still needed for
+  the types). The functions are defined here, so include this header in one
+  translation unit only (the test console).
+
+  Instrument k is USB0::0xFFFF::0x9130::SIM<k>::INSTR, see
+  VISASimulator::setInstruments(). Sessions to the same resource share one
+  instrument, as they do with real hardware.
+
+  Each instrument has a finite input buffer that its parser drains at a
+  fixed rate: a write lands after the transfer time, each command then takes
+  the parse time in turn, and the reply to a query can be read once the query
+  has been parsed. Commands that arrive while the buffer is full are lost and
+  set the command error bit of *ESR?, like an overrun of the real supply.
+  Effects on the state are applied at once, only the buffer and the replies
+  follow the parser's timing, so nothing runs in the background.
+
+  The default timing is a round number guess at a USB-TMC supply, not a
+  measurement of the 9130B.
+*/
+#pragma once
+#ifndef _VISASIMULATOR_H_
+#define _VISASIMULATOR_H_
+
+#include <algorithm>
+#include <cctype>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <map>
+#include <regex>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "VISACompat.h"
+#include "VISAClock.h"
+
+#include "visa.h"
+
+/*============================================================================*/
+class VISASimInstrument
+{
+public:
+    struct Timing
+    {
+        Timing() : transfer(250.0), parse(500.0), inputBuffer(256) {}
+
+        double transfer;            // us per viWrite() / viRead()
+        double parse;               // us per command
+        std::size_t inputBuffer;    // bytes
+    };
+
+    static const long CommandError = 0x20;
+    static const std::size_t Channels = 3;
+
+public:
+    /*------------------------------------------------------------------------*/
+    VISASimInstrument(const std::string& rsrc, const std::string& serial) :
+        rsrc_(rsrc),
+        serial_(serial),
+        parsed_(0.0),
+        used_(0),
+        esr_(0),
+        ese_(0),
+        sre_(0),
+        channel_(0),
+        noise_(static_cast<unsigned>(serial.length() * 2654435761u))
+    {
+        reset();
+    }
+    /*------------------------------------------------------------------------*/
+    const std::string& resource() const
+    {
+        return rsrc_;
+    }
+    /*------------------------------------------------------------------------*/
+    void setTiming(const Timing& timing)
+    {
+        visa_compat::lock_guard<visa_compat::mutex> lock(mutex_);
+        timing_ = timing;
+    }
+    /*------------------------------------------------------------------------*/
+    /**
+    * One viWrite(): <n> bytes, commands separated by ';' and / or newlines
+    */
+    void write(const char* msg, std::size_t n)
+    {
+        VISAClock& clock = VISAClock::system();
+        clock.sleepFor(transfer());
+
+        visa_compat::lock_guard<visa_compat::mutex> lock(mutex_);
+
+        double now = clock.now();
+        drain(now);
+
+        std::string cmd;
+        for (std::size_t k = 0; k <= n; ++k)
+        {
+            if (k < n && msg[k] != ';' && msg[k] != '\n')
+            {
+                cmd += msg[k];
+                continue;
+            }
+
+            trim(cmd);
+
+            if (!cmd.empty())
+            {
+                receive(cmd, now);
+            }
+
+            cmd.clear();
+        }
+    }
+    /*------------------------------------------------------------------------*/
+    /**
+    * One viRead(): waits (up to <timeout> ms) for the oldest reply
+    */
+    ViStatus read(std::string& reply, ViUInt32 timeout)
+    {
+        VISAClock& clock = VISAClock::system();
+
+        double now = clock.now();
+        double deadline = now + timeout * 1000.0;
+        double ready = 0.0;
+        bool found = false;
+
+        {
+            visa_compat::lock_guard<visa_compat::mutex> lock(mutex_);
+
+            if (!output_.empty() &&
+                output_.front().ready + timing_.transfer <= deadline)
+            {
+                ready = std::max(output_.front().ready, now) +
+                    timing_.transfer;
+                reply = output_.front().text + "\n";
+                output_.pop_front();
+                found = true;
+            }
+        }
+
+        if (!found)
+        {
+            clock.sleepUntil(deadline);
+            return VI_ERROR_TMO;
+        }
+
+        clock.sleepUntil(ready);
+
+        return VI_SUCCESS_TERM_CHAR;
+    }
+    /*------------------------------------------------------------------------*/
+    ViUInt16 statusByte()
+    {
+        visa_compat::lock_guard<visa_compat::mutex> lock(mutex_);
+
+        ViUInt16 stb = (esr_ & ese_) != 0 ? 0x20 : 0;
+        if ((stb & sre_) != 0)
+        {
+            stb |= 0x40;
+        }
+
+        return stb;
+    }
+    /*------------------------------------------------------------------------*/
+    /**
+    * viClear(): drops unparsed input and unread replies
+    */
+    void clear()
+    {
+        visa_compat::lock_guard<visa_compat::mutex> lock(mutex_);
+
+        input_.clear();
+        output_.clear();
+        used_ = 0;
+        parsed_ = VISAClock::system().now();
+    }
+    /*------------------------------------------------------------------------*/
+
+private:
+    struct Input
+    {
+        double done;    // parsed at (us)
+        std::size_t bytes;
+    };
+
+    struct Reply
+    {
+        double ready;   // us
+        std::string text;
+    };
+
+    /*------------------------------------------------------------------------*/
+    double transfer() const
+    {
+        visa_compat::lock_guard<visa_compat::mutex> lock(mutex_);
+        return timing_.transfer;
+    }
+    /*------------------------------------------------------------------------*/
+    // frees the buffer space of everything parsed by <now>
+    void drain(double now)
+    {
+        while (!input_.empty() && input_.front().done <= now)
+        {
+            used_ -= input_.front().bytes;
+            input_.pop_front();
+        }
+    }
+    /*------------------------------------------------------------------------*/
+    // one command arriving at <now>, with the lock held
+    void receive(const std::string& cmd, double now)
+    {
+        Input in;
+        in.bytes = cmd.length() + 1;
+
+        if (used_ + in.bytes > timing_.inputBuffer)
+        {
+            esr_ |= CommandError;
+            return;
+        }
+
+        parsed_ = std::max(parsed_, now) + timing_.parse;
+
+        in.done = parsed_;
+        input_.push_back(in);
+        used_ += in.bytes;
+
+        Reply reply;
+        reply.ready = parsed_;
+
+        if (!execute(cmd, reply.text))
+        {
+            esr_ |= CommandError;
+        }
+        else if (!reply.text.empty())
+        {
+            output_.push_back(reply);
+        }
+    }
+    /*------------------------------------------------------------------------*/
+    // applies <cmd>, <reply> is left empty for anything but a query
+    bool execute(const std::string& cmd, std::string& reply)
+    {
+        std::string::size_type space = cmd.find(' ');
+
+        std::string header = cmd.substr(0, space);
+        std::string arg = space == std::string::npos ? "" : cmd.substr(space);
+        trim(arg);
+
+        for (std::string::size_type k = 0; k < header.length(); ++k)
+        {
+            header[k] = static_cast<char>(toupper(header[k]));
+        }
+
+        if (!header.empty() && header[0] == ':')
+        {
+            header.erase(0, 1);
+        }
+
+        // the SOUR: root and :LEV are optional
+        if (header.compare(0, 5, "SOUR:") == 0)
+        {
+            header.erase(0, 5);
+        }
+
+        std::string::size_type lev = header.find(":LEV");
+        if (lev != std::string::npos)
+        {
+            header.erase(lev, 4);
+        }
+
+        std::ostringstream out;
+        out.setf(std::ios::fixed);
+        out.precision(3);
+
+        if (header == "*IDN?")
+        {
+            out << "B&K Precision, 9130B, " << serial_ << ", 1.00 (simulated)";
+        }
+        else if (header == "*ESR?")
+        {
+            out << esr_;
+            esr_ = 0;
+        }
+        else if (header == "*OPC?")
+        {
+            out << 1;
+        }
+        else if (header == "*OPC")
+        {
+            esr_ |= 1;
+        }
+        else if (header == "*CLS")
+        {
+            esr_ = 0;
+        }
+        else if (header == "*RST")
+        {
+            reset();
+        }
+        else if (header == "*ESE" || header == "*SRE")
+        {
+            (header == "*ESE" ? ese_ : sre_) = std::atol(arg.c_str());
+        }
+        else if (header == "*ESE?" || header == "*SRE?")
+        {
+            out << (header == "*ESE?" ? ese_ : sre_);
+        }
+        else if (header == "INST:SEL" || header == "INST" ||
+            header == "INST:NSEL")
+        {
+            std::size_t k = std::atol(arg.c_str() +
+                (toupper(arg.c_str()[0]) == 'C' ? 2 : 0));
+
+            if (k < 1 || k > Channels)
+            {
+                return false;
+            }
+
+            channel_ = k - 1;
+        }
+        else if (header == "INST:SEL?" || header == "INST?")
+        {
+            out << "CH" << (channel_ + 1);
+        }
+        else if (header == "INST:NSEL?")
+        {
+            out << (channel_ + 1);
+        }
+        else if (header == "VOLT" || header == "CURR")
+        {
+            (header == "VOLT" ? volt_ : curr_)[channel_] =
+                std::atof(arg.c_str());
+        }
+        else if (header == "VOLT?" || header == "CURR?")
+        {
+            bool voltage = header == "VOLT?";
+
+            // MIN / MAX ask for the range: 30 V (5 V on CH3) and 3 A
+            if (arg == "MIN" || arg == "MAX")
+            {
+                out << (arg == "MIN" ? 0.0 : maximum(channel_, voltage));
+            }
+            else
+            {
+                out << (voltage ? volt_ : curr_)[channel_];
+            }
+        }
+        else if (header == "VOLT:PROT")
+        {
+            ovp_[channel_] = std::atof(arg.c_str());
+        }
+        else if (header == "VOLT:PROT?")
+        {
+            out << ovp_[channel_];
+        }
+        else if (header == "CHAN:OUTP:STAT" || header == "OUTP")
+        {
+            out_[channel_] = arg == "ON" || arg == "1";
+        }
+        else if (header == "CHAN:OUTP:STAT?" || header == "OUTP?")
+        {
+            out << (out_[channel_] ? 1 : 0);
+        }
+        else if (header == "APP:VOLT?" || header == "APP:CURR?" ||
+            header == "APP:OUT?")
+        {
+            for (std::size_t k = 0; k < Channels; ++k)
+            {
+                out << (k > 0 ? ", " : "");
+
+                if (header == "APP:OUT?")
+                {
+                    out << (out_[k] ? 1 : 0);
+                }
+                else
+                {
+                    out << (header == "APP:VOLT?" ? volt_ : curr_)[k];
+                }
+            }
+        }
+        else if (header.compare(0, 5, "MEAS:") == 0)
+        {
+            bool voltage = header.compare(5, 4, "VOLT") == 0;
+            bool all = header.find(":ALL") != std::string::npos;
+
+            for (std::size_t k = all ? 0 : channel_;
+                k < (all ? Channels : channel_ + 1); ++k)
+            {
+                out << (k > (all ? 0 : channel_) ? ", " : "")
+                    << measure(k, voltage);
+            }
+        }
+        else if (header.compare(0, 5, "STAT:") == 0 ||
+            header.compare(0, 5, "SYST:") == 0)
+        {
+            // accepted, registers read as 0
+            if (header[header.length() - 1] == '?')
+            {
+                out << 0;
+            }
+        }
+        else
+        {
+            return false;
+        }
+
+        reply = out.str();
+
+        return true;
+    }
+    /*------------------------------------------------------------------------*/
+    // a reading of channel <k>, the setpoint (or half the current limit)
+    // plus about a mV / mA of noise when the output is on
+    double measure(std::size_t k, bool voltage)
+    {
+        if (!out_[k])
+        {
+            return 0.0;
+        }
+
+        noise_ = noise_ * 1664525u + 1013904223u;
+        double noise = ((noise_ >> 8) / 16777216.0 - 0.5) * 0.002;
+
+        return (voltage ? volt_[k] : 0.5 * curr_[k]) + noise;
+    }
+    /*------------------------------------------------------------------------*/
+    static double maximum(std::size_t k, bool voltage)
+    {
+        return voltage ? (k == 2 ? 5.0 : 30.0) : 3.0;
+    }
+    /*------------------------------------------------------------------------*/
+    void reset()
+    {
+        for (std::size_t k = 0; k < Channels; ++k)
+        {
+            volt_[k] = 0.0;
+            curr_[k] = 0.0;
+            ovp_[k] = maximum(k, true);
+            out_[k] = false;
+        }
+
+        channel_ = 0;
+    }
+    /*------------------------------------------------------------------------*/
+    static void trim(std::string& s)
+    {
+        std::string::size_type last = s.find_last_not_of(" \t\r\n");
+        s.erase(last == std::string::npos ? 0 : last + 1);
+        s.erase(0, s.find_first_not_of(" \t\r\n"));
+    }
+    /*------------------------------------------------------------------------*/
+
+private:
+    std::string rsrc_;
+    std::string serial_;
+
+    mutable visa_compat::mutex mutex_;
+    Timing timing_;
+
+    std::deque<Input> input_;
+    std::deque<Reply> output_;
+    double parsed_;         // parser busy until (us)
+    std::size_t used_;      // bytes in the input buffer
+
+    long esr_;
+    long ese_;
+    long sre_;
+
+    std::size_t channel_;
+    double volt_[Channels];
+    double curr_[Channels];
+    double ovp_[Channels];
+    bool out_[Channels];
+
+    unsigned noise_;
+};
+/*============================================================================*/
+class VISASimulator
+{
+public:
+    typedef VISASimInstrument::Timing Timing;
+
+public:
+    /*------------------------------------------------------------------------*/
+    static VISASimulator& instance()
+    {
+        static VISASimulator sim;
+        return sim;
+    }
+    /*------------------------------------------------------------------------*/
+    /**
+    * Makes the first <n> instruments visible (creating any that do not exist
+    * yet) and gives them all <timing>. Instruments are never destroyed, so
+    * sessions to one that is hidden keep working.
+    */
+    void setInstruments(std::size_t n, const Timing& timing = Timing())
+    {
+        visa_compat::lock_guard<visa_compat::mutex> lock(mutex_);
+
+        while (instruments_.size() < n)
+        {
+            std::ostringstream serial;
+            serial << "SIM" << (instruments_.size() + 1);
+
+            instruments_.push_back(new VISASimInstrument(
+                "USB0::0xFFFF::0x9130::" + serial.str() + "::INSTR",
+                serial.str()));
+        }
+
+        for (std::size_t k = 0; k < instruments_.size(); ++k)
+        {
+            instruments_[k]->setTiming(timing);
+        }
+
+        visible_ = n;
+    }
+    /*------------------------------------------------------------------------*/
+    std::size_t instruments() const
+    {
+        visa_compat::lock_guard<visa_compat::mutex> lock(mutex_);
+        return visible_;
+    }
+    /*------------------------------------------------------------------------*/
+    // the VISA calls, see the functions at the end of the file
+
+    ViStatus openDefaultRM(ViPSession vi)
+    {
+        visa_compat::lock_guard<visa_compat::mutex> lock(mutex_);
+
+        *vi = nextId_++;
+        sessions_[*vi] = Session();
+
+        return VI_SUCCESS;
+    }
+    /*------------------------------------------------------------------------*/
+    ViStatus findRsrc(ViConstString expr, ViPFindList vi, ViPUInt32 retCnt,
+        ViChar desc[])
+    {
+        // VISA expressions: '?' is any character, '*' repeats the previous
+        std::string pattern;
+        for (const char* c = expr; *c != '\0'; ++c)
+        {
+            if (*c == '?')
+            {
+                pattern += '.';
+            }
+            else if (*c == '*')
+            {
+                pattern += '*';
+            }
+            else
+            {
+                if (strchr("\\^$.|+()[]{}", *c) != 0)
+                {
+                    pattern += '\\';
+                }
+
+                pattern += *c;
+            }
+        }
+
+        std::regex re(pattern, std::regex::icase);
+
+        visa_compat::lock_guard<visa_compat::mutex> lock(mutex_);
+
+        FindList list;
+        for (std::size_t k = 0; k < visible_; ++k)
+        {
+            if (std::regex_match(instruments_[k]->resource(), re))
+            {
+                list.found.push_back(instruments_[k]->resource());
+            }
+        }
+
+        *vi = VI_NULL;
+        *retCnt = static_cast<ViUInt32>(list.found.size());
+
+        if (list.found.empty())
+        {
+            return VI_ERROR_RSRC_NFOUND;
+        }
+
+        copy(list.found[0], desc);
+        list.next = 1;
+
+        *vi = nextId_++;
+        finds_[*vi] = list;
+
+        return VI_SUCCESS;
+    }
+    /*------------------------------------------------------------------------*/
+    ViStatus findNext(ViFindList vi, ViChar desc[])
+    {
+        visa_compat::lock_guard<visa_compat::mutex> lock(mutex_);
+
+        std::map<ViObject, FindList>::iterator it = finds_.find(vi);
+        if (it == finds_.end())
+        {
+            return VI_ERROR_INV_OBJECT;
+        }
+
+        if (it->second.next >= it->second.found.size())
+        {
+            return VI_ERROR_RSRC_NFOUND;
+        }
+
+        copy(it->second.found[it->second.next++], desc);
+
+        return VI_SUCCESS;
+    }
+    /*------------------------------------------------------------------------*/
+    ViStatus open(ViConstRsrc name, ViUInt32 timeout, ViPSession vi)
+    {
+        visa_compat::lock_guard<visa_compat::mutex> lock(mutex_);
+
+        for (std::size_t k = 0; k < visible_; ++k)
+        {
+            if (equal(instruments_[k]->resource(), name))
+            {
+                Session s;
+                s.instrument = instruments_[k];
+                s.timeout = timeout;
+
+                *vi = nextId_++;
+                sessions_[*vi] = s;
+
+                return VI_SUCCESS;
+            }
+        }
+
+        return VI_ERROR_RSRC_NFOUND;
+    }
+    /*------------------------------------------------------------------------*/
+    ViStatus close(ViObject vi)
+    {
+        visa_compat::lock_guard<visa_compat::mutex> lock(mutex_);
+
+        if (sessions_.erase(vi) == 0 && finds_.erase(vi) == 0)
+        {
+            return VI_ERROR_INV_OBJECT;
+        }
+
+        return VI_SUCCESS;
+    }
+    /*------------------------------------------------------------------------*/
+    ViStatus setAttribute(ViObject vi, ViAttr attr, ViAttrState value)
+    {
+        visa_compat::lock_guard<visa_compat::mutex> lock(mutex_);
+
+        std::map<ViObject, Session>::iterator it = sessions_.find(vi);
+        if (it == sessions_.end())
+        {
+            return VI_ERROR_INV_OBJECT;
+        }
+
+        if (attr == VI_ATTR_TMO_VALUE)
+        {
+            it->second.timeout = static_cast<ViUInt32>(value);
+        }
+
+        return VI_SUCCESS;
+    }
+    /*------------------------------------------------------------------------*/
+    ViStatus getAttribute(ViObject vi, ViAttr attr, void* value)
+    {
+        visa_compat::lock_guard<visa_compat::mutex> lock(mutex_);
+
+        std::map<ViObject, Session>::iterator it = sessions_.find(vi);
+        if (it == sessions_.end() || it->second.instrument == 0)
+        {
+            return VI_ERROR_INV_OBJECT;
+        }
+
+        switch (attr)
+        {
+            case VI_ATTR_TERMCHAR:
+                *static_cast<ViUInt8*>(value) = '\n';
+                break;
+            case VI_ATTR_TMO_VALUE:
+                *static_cast<ViUInt32*>(value) = it->second.timeout;
+                break;
+            case VI_ATTR_MANF_NAME:
+                copy("B&K Precision (simulated)", static_cast<ViChar*>(value));
+                break;
+            case VI_ATTR_MODEL_NAME:
+                copy("9130B", static_cast<ViChar*>(value));
+                break;
+            case VI_ATTR_INTF_INST_NAME:
+                copy(it->second.instrument->resource(),
+                    static_cast<ViChar*>(value));
+                break;
+            default:
+                return VI_ERROR_NSUP_ATTR;
+        }
+
+        return VI_SUCCESS;
+    }
+    /*------------------------------------------------------------------------*/
+    ViStatus write(ViSession vi, ViConstBuf buf, ViUInt32 cnt,
+        ViPUInt32 retCnt)
+    {
+        Session s;
+        if (!lookup(vi, s))
+        {
+            return VI_ERROR_INV_OBJECT;
+        }
+
+        s.instrument->write(reinterpret_cast<const char*>(buf), cnt);
+
+        if (retCnt != VI_NULL)
+        {
+            *retCnt = cnt;
+        }
+
+        return VI_SUCCESS;
+    }
+    /*------------------------------------------------------------------------*/
+    ViStatus read(ViSession vi, ViPBuf buf, ViUInt32 cnt, ViPUInt32 retCnt)
+    {
+        Session s;
+        if (!lookup(vi, s))
+        {
+            return VI_ERROR_INV_OBJECT;
+        }
+
+        std::string reply;
+        ViStatus status = s.instrument->read(reply, s.timeout);
+
+        ViUInt32 n = static_cast<ViUInt32>(reply.length()) < cnt ?
+            static_cast<ViUInt32>(reply.length()) : cnt;
+
+        std::memcpy(buf, reply.data(), n);
+
+        if (retCnt != VI_NULL)
+        {
+            *retCnt = n;
+        }
+
+        return status;
+    }
+    /*------------------------------------------------------------------------*/
+    ViStatus readSTB(ViSession vi, ViPUInt16 status)
+    {
+        Session s;
+        if (!lookup(vi, s))
+        {
+            return VI_ERROR_INV_OBJECT;
+        }
+
+        *status = s.instrument->statusByte();
+
+        return VI_SUCCESS;
+    }
+    /*------------------------------------------------------------------------*/
+    ViStatus clear(ViSession vi)
+    {
+        Session s;
+        if (!lookup(vi, s))
+        {
+            return VI_ERROR_INV_OBJECT;
+        }
+
+        s.instrument->clear();
+
+        return VI_SUCCESS;
+    }
+    /*------------------------------------------------------------------------*/
+    /**
+    * Service requests are accepted but never raised, a wait times out
+    */
+    ViStatus waitOnEvent(ViSession vi, ViUInt32 timeout)
+    {
+        Session s;
+        if (!lookup(vi, s))
+        {
+            return VI_ERROR_INV_OBJECT;
+        }
+
+        VISAClock::system().sleepFor(timeout * 1000.0);
+
+        return VI_ERROR_TMO;
+    }
+    /*------------------------------------------------------------------------*/
+    ViStatus statusDesc(ViStatus status, ViChar desc[])
+    {
+        const char* text = "Unknown status code (simulator)";
+
+        switch (status)
+        {
+            case VI_SUCCESS:
+                text = "Operation completed successfully";
+                break;
+            case VI_ERROR_TMO:
+                text = "Timeout expired before operation completed";
+                break;
+            case VI_ERROR_RSRC_NFOUND:
+                text = "Insufficient location information or resource not present";
+                break;
+            case VI_ERROR_INV_OBJECT:
+                text = "Invalid session or object reference";
+                break;
+            case VI_ERROR_NSUP_ATTR:
+                text = "Attribute is not supported by the resource";
+                break;
+        }
+
+        copy(text, desc);
+
+        return VI_SUCCESS;
+    }
+    /*------------------------------------------------------------------------*/
+
+private:
+    struct Session
+    {
+        Session() : instrument(0), timeout(2000) {}
+
+        VISASimInstrument* instrument;  // 0 for a resource manager session
+        ViUInt32 timeout;               // ms
+    };
+
+    struct FindList
+    {
+        std::vector<std::string> found;
+        std::size_t next;
+    };
+
+    /*------------------------------------------------------------------------*/
+    VISASimulator() : visible_(0), nextId_(1)
+    {
+        setInstruments(1);
+    }
+    /*------------------------------------------------------------------------*/
+    bool lookup(ViObject vi, Session& s)
+    {
+        visa_compat::lock_guard<visa_compat::mutex> lock(mutex_);
+
+        std::map<ViObject, Session>::iterator it = sessions_.find(vi);
+        if (it == sessions_.end() || it->second.instrument == 0)
+        {
+            return false;
+        }
+
+        s = it->second;
+
+        return true;
+    }
+    /*------------------------------------------------------------------------*/
+    // into a VISA sized (VI_FIND_BUFLEN) buffer
+    static void copy(const std::string& s, ViChar* buf)
+    {
+        std::size_t n = std::min<std::size_t>(s.length(), VI_FIND_BUFLEN - 1);
+
+        std::memcpy(buf, s.data(), n);
+        buf[n] = '\0';
+    }
+    /*------------------------------------------------------------------------*/
+    static bool equal(const std::string& a, const char* b)
+    {
+        std::size_t k = 0;
+        for (; k < a.length() && b[k] != '\0'; ++k)
+        {
+            if (toupper(a[k]) != toupper(b[k]))
+            {
+                return false;
+            }
+        }
+
+        return k == a.length() && b[k] == '\0';
+    }
+    /*------------------------------------------------------------------------*/
+    VISASimulator(const VISASimulator&);
+    VISASimulator& operator=(const VISASimulator&);
+
+private:
+    mutable visa_compat::mutex mutex_;
+
+    std::vector<VISASimInstrument*> instruments_;
+    std::size_t visible_;
+
+    std::map<ViObject, Session> sessions_;
+    std::map<ViObject, FindList> finds_;
+    ViObject nextId_;
+};
+/*============================================================================*/
+extern "C"
+{
+
+ViStatus _VI_FUNC viOpenDefaultRM(ViPSession vi)
+{
+    return VISASimulator::instance().openDefaultRM(vi);
+}
+
+ViStatus _VI_FUNC viFindRsrc(ViSession, ViConstString expr, ViPFindList vi,
+    ViPUInt32 retCnt, ViChar _VI_FAR desc[])
+{
+    return VISASimulator::instance().findRsrc(expr, vi, retCnt, desc);
+}
+
+ViStatus _VI_FUNC viFindNext(ViFindList vi, ViChar _VI_FAR desc[])
+{
+    return VISASimulator::instance().findNext(vi, desc);
+}
+
+ViStatus _VI_FUNC viOpen(ViSession, ViConstRsrc name, ViAccessMode,
+    ViUInt32 timeout, ViPSession vi)
+{
+    return VISASimulator::instance().open(name, timeout, vi);
+}
+
+ViStatus _VI_FUNC viClose(ViObject vi)
+{
+    return VISASimulator::instance().close(vi);
+}
+
+ViStatus _VI_FUNC viSetAttribute(ViObject vi, ViAttr attr, ViAttrState value)
+{
+    return VISASimulator::instance().setAttribute(vi, attr, value);
+}
+
+ViStatus _VI_FUNC viGetAttribute(ViObject vi, ViAttr attr,
+    void _VI_PTR value)
+{
+    return VISASimulator::instance().getAttribute(vi, attr, value);
+}
+
+ViStatus _VI_FUNC viStatusDesc(ViObject, ViStatus status,
+    ViChar _VI_FAR desc[])
+{
+    return VISASimulator::instance().statusDesc(status, desc);
+}
+
+ViStatus _VI_FUNC viWrite(ViSession vi, ViConstBuf buf, ViUInt32 cnt,
+    ViPUInt32 retCnt)
+{
+    return VISASimulator::instance().write(vi, buf, cnt, retCnt);
+}
+
+ViStatus _VI_FUNC viRead(ViSession vi, ViPBuf buf, ViUInt32 cnt,
+    ViPUInt32 retCnt)
+{
+    return VISASimulator::instance().read(vi, buf, cnt, retCnt);
+}
+
+ViStatus _VI_FUNC viReadSTB(ViSession vi, ViPUInt16 status)
+{
+    return VISASimulator::instance().readSTB(vi, status);
+}
+
+ViStatus _VI_FUNC viClear(ViSession vi)
+{
+    return VISASimulator::instance().clear(vi);
+}
+
+ViStatus _VI_FUNC viFlush(ViSession, ViUInt16)
+{
+    return VI_SUCCESS;
+}
+
+ViStatus _VI_FUNC viEnableEvent(ViSession, ViEventType, ViUInt16,
+    ViEventFilter)
+{
+    return VI_SUCCESS;
+}
+
+ViStatus _VI_FUNC viDisableEvent(ViSession, ViEventType, ViUInt16)
+{
+    return VI_SUCCESS;
+}
+
+ViStatus _VI_FUNC viDiscardEvents(ViSession, ViEventType, ViUInt16)
+{
+    return VI_SUCCESS;
+}
+
+ViStatus _VI_FUNC viWaitOnEvent(ViSession vi, ViEventType, ViUInt32 timeout,
+    ViPEventType, ViPEvent)
+{
+    return VISASimulator::instance().waitOnEvent(vi, timeout);
+}
+
+}
+/*============================================================================*/
+#endif //_VISASIMULATOR_H_
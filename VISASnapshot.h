@@ -0,0 +1,86 @@
+////////////////////////////////////////////////////////////////////////////////
+// FILE:          VISASnapshot.h
+// PROJECT:       Micro-Manager
+// SUBSYSTEM:     DeviceAdapters
+//-----------------------------------------------------------------------------
+// DESCRIPTION:   Lock-free (for readers) published copy of a small POD value
+//
+// AUTHOR:        Scottie Alexander, scottiealexander11@gmail.com
+//
+// COPYRIGHT:     University of California, Davis, 2016
+//
+// LICENSE:       This file is distributed under the BSD license.
+//                License text is included with the source distribution.
+//
+//                This file is distributed in the hope that it will be useful,
+//                but WITHOUT ANY WARRANTY; without even the implied warranty
+//                of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+//
+//                IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+//                CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+//                INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES.
+
+/*GIST
+  A sequence lock: the writer bumps the sequence number to odd, copies the
+  value in, and bumps it back to even. Readers copy the value out and retry
+  if the sequence changed (or was odd) meanwhile, so a read never blocks and
+  never takes a lock. T must be plain data (no pointers / std::string) and
+  writers must be serialized by the caller.
+*/
+#pragma once
+#ifndef _VISASNAPSHOT_H_
+#define _VISASNAPSHOT_H_
+
+#include "VISADevice.h"
+
+/*============================================================================*/
+template <typename T>
+class VISASnapshot
+{
+public:
+    /*------------------------------------------------------------------------*/
+    VISASnapshot() : seq_(0), value_() {}
+    /*------------------------------------------------------------------------*/
+    /**
+    * Publishes <value>
+    * NOTE: only one thread may call store() at a time
+    */
+    void store(const T& value)
+    {
+        unsigned seq = seq_.load(visa_compat::memory_order_relaxed);
+
+        seq_.store(seq + 1, visa_compat::memory_order_relaxed);
+        visa_compat::atomic_thread_fence(visa_compat::memory_order_release);
+
+        value_ = value;
+
+        seq_.store(seq + 2, visa_compat::memory_order_release);
+    }
+    /*------------------------------------------------------------------------*/
+    /**
+    * Copies the most recently published value into <value>, safe to call
+    * from any thread at any time
+    */
+    void load(T& value) const
+    {
+        unsigned before, after;
+
+        do
+        {
+            before = seq_.load(visa_compat::memory_order_acquire);
+
+            value = value_;
+
+            visa_compat::atomic_thread_fence(visa_compat::memory_order_acquire);
+            after = seq_.load(visa_compat::memory_order_relaxed);
+        }
+        while ((before & 1) != 0 || before != after);
+    }
+    /*------------------------------------------------------------------------*/
+
+private:
+    visa_compat::atomic<unsigned> seq_;
+    T value_;
+};
+/*============================================================================*/
+#endif //_VISASNAPSHOT_H_
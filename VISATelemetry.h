@@ -0,0 +1,1136 @@
+////////////////////////////////////////////////////////////////////////////////
+// FILE:          VISATelemetry.h
+// PROJECT:       Micro-Manager
+// SUBSYSTEM:     DeviceAdapters
+//-----------------------------------------------------------------------------
+// DESCRIPTION:   Compressed columnar store for instrument telemetry
+//
+// AUTHOR:        Scottie Alexander, scottiealexander11@gmail.com
+//
+// COPYRIGHT:     University of California, Davis, 2016
+//
+// LICENSE:       This file is distributed under the BSD license.
+//                License text is included with the source distribution.
+//
+//                This file is distributed in the hope that it will be useful,
+//                but WITHOUT ANY WARRANTY; without even the implied warranty
+//                of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+//
+//                IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+//                CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+//                INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES.
+
+/*GIST
+  A sample is a timestamp (us) plus one value per column (e.g. voltage and
+  current of every channel). Samples are appended to fixed size blocks, and
+  within a block every column is its own bit stream:
+
+    timestamps - delta-of-delta, so a steady sample rate costs ~1 bit
+    values     - XOR with the previous value, storing only the meaningful
+                 bits (values that do not change cost 1 bit)
+
+  Every block keeps its time range and the min / max of every column, so
+  range queries skip blocks outside the range and answer min / max for
+  blocks that lie entirely inside it without decoding them.
+
+  save() / load() write / read the encoded blocks as they are, load()
+  followed by query() is the decoder.
+
+  VISATelemetryPyramid keeps min / max / mean per column at several fixed
+  resolutions (by default 1 s, 1 min and 1 h buckets), updated as samples
+  arrive. A range query is answered from the finest level that covers the
+  range in at most the requested number of buckets, so its cost depends on
+  that number and not on how much history there is.
+
+  VISATelemetryWindow holds the most recent N samples raw, one contiguous
+  array per column (structure of arrays), and computes mean, variance,
+  min / max, peak-to-peak and linear drift (least squares slope against
+  time) of a column over them. Order does not matter to any of these, so
+  the kernels run straight over the array regardless of where the ring
+  wraps, with independent accumulators per lane so they vectorize without
+  relaxed floating point.
+*/
+#pragma once
+#ifndef _VISATELEMETRY_H_
+#define _VISATELEMETRY_H_
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <deque>
+#include <istream>
+#include <ostream>
+#include <string>
+#include <vector>
+
+#include "VISACompat.h"
+
+/*============================================================================*/
+class VISABitStream
+{
+public:
+    typedef unsigned long long Bits;
+
+    /*------------------------------------------------------------------------*/
+    VISABitStream() : nBits_(0) {}
+    /*------------------------------------------------------------------------*/
+    // appends the low <n> bits of <value>, most significant first
+    void write(Bits value, int n)
+    {
+        for (int k = n - 1; k >= 0; --k)
+        {
+            if ((nBits_ & 7) == 0)
+            {
+                bytes_.push_back(0);
+            }
+
+            if ((value >> k) & 1)
+            {
+                bytes_.back() |= static_cast<unsigned char>(0x80 >> (nBits_ & 7));
+            }
+
+            ++nBits_;
+        }
+    }
+    /*------------------------------------------------------------------------*/
+    // reads <n> bits starting at bit <pos>, advances <pos>
+    Bits read(std::size_t& pos, int n) const
+    {
+        Bits value = 0;
+
+        for (int k = 0; k < n; ++k, ++pos)
+        {
+            value = (value << 1) |
+                ((bytes_[pos >> 3] >> (7 - (pos & 7))) & 1);
+        }
+
+        return value;
+    }
+    /*------------------------------------------------------------------------*/
+    std::size_t size() const
+    {
+        return nBits_;
+    }
+    /*------------------------------------------------------------------------*/
+    std::size_t bytes() const
+    {
+        return bytes_.size();
+    }
+    /*------------------------------------------------------------------------*/
+    void save(std::ostream& out) const
+    {
+        Bits n = nBits_;
+        out.write(reinterpret_cast<const char*>(&n), sizeof(n));
+
+        if (!bytes_.empty())
+        {
+            out.write(reinterpret_cast<const char*>(&bytes_[0]),
+                static_cast<std::streamsize>(bytes_.size()));
+        }
+    }
+    /*------------------------------------------------------------------------*/
+    bool load(std::istream& in)
+    {
+        Bits n = 0;
+        in.read(reinterpret_cast<char*>(&n), sizeof(n));
+
+        nBits_ = static_cast<std::size_t>(n);
+        bytes_.assign((nBits_ + 7) / 8, 0);
+
+        if (!bytes_.empty())
+        {
+            in.read(reinterpret_cast<char*>(&bytes_[0]),
+                static_cast<std::streamsize>(bytes_.size()));
+        }
+
+        return in.good();
+    }
+    /*------------------------------------------------------------------------*/
+
+private:
+    std::vector<unsigned char> bytes_;
+    std::size_t nBits_;
+};
+/*============================================================================*/
+class VISATelemetryStore
+{
+public:
+    typedef long long Time;     // us
+    typedef VISABitStream::Bits Bits;
+
+    struct Sample
+    {
+        Time t;
+        double value;
+    };
+
+    // summary of one block, as kept uncompressed next to the encoded data
+    struct BlockInfo
+    {
+        std::size_t count;
+        Time first;
+        Time last;
+        std::vector<double> min;    // per column
+        std::vector<double> max;
+    };
+
+public:
+    /*------------------------------------------------------------------------*/
+    /**
+    * @param columns - values per sample
+    * @param blockSize - samples per block
+    * @param maxBlocks - oldest blocks are dropped beyond this, 0 for no limit
+    */
+    VISATelemetryStore(std::size_t columns, std::size_t blockSize = 1024,
+        std::size_t maxBlocks = 0) :
+        columns_(columns),
+        blockSize_(blockSize > 1 ? blockSize : 2),
+        maxBlocks_(maxBlocks),
+        samples_(0)
+    {}
+    /*------------------------------------------------------------------------*/
+    std::size_t columns() const
+    {
+        return columns_;
+    }
+    /*------------------------------------------------------------------------*/
+    /**
+    * Appends one sample, <values> holds one value per column. Timestamps are
+    * expected to be non-decreasing.
+    */
+    void append(Time t, const double* values)
+    {
+        visa_compat::lock_guard<visa_compat::mutex> lock(mutex_);
+
+        if (blocks_.empty() || blocks_.back().info.count >= blockSize_)
+        {
+            blocks_.push_back(Block(columns_));
+
+            if (maxBlocks_ > 0 && blocks_.size() > maxBlocks_)
+            {
+                samples_ -= blocks_.front().info.count;
+                blocks_.pop_front();
+            }
+        }
+
+        blocks_.back().append(t, values);
+        ++samples_;
+    }
+    /*------------------------------------------------------------------------*/
+    std::size_t samples() const
+    {
+        visa_compat::lock_guard<visa_compat::mutex> lock(mutex_);
+        return samples_;
+    }
+    /*------------------------------------------------------------------------*/
+    /**
+    * @return - size of the encoded data in bytes (block summaries excluded)
+    */
+    std::size_t compressedBytes() const
+    {
+        visa_compat::lock_guard<visa_compat::mutex> lock(mutex_);
+
+        std::size_t n = 0;
+        for (std::size_t b = 0; b < blocks_.size(); ++b)
+        {
+            n += blocks_[b].bytes();
+        }
+
+        return n;
+    }
+    /*------------------------------------------------------------------------*/
+    /**
+    * @return - size the same samples take as plain (time, values...) records
+    */
+    std::size_t rawBytes() const
+    {
+        visa_compat::lock_guard<visa_compat::mutex> lock(mutex_);
+        return samples_ * (sizeof(Time) + columns_ * sizeof(double));
+    }
+    /*------------------------------------------------------------------------*/
+    std::vector<BlockInfo> blocks() const
+    {
+        visa_compat::lock_guard<visa_compat::mutex> lock(mutex_);
+
+        std::vector<BlockInfo> info;
+        for (std::size_t b = 0; b < blocks_.size(); ++b)
+        {
+            info.push_back(blocks_[b].info);
+        }
+
+        return info;
+    }
+    /*------------------------------------------------------------------------*/
+    /**
+    * Appends every sample of <column> with <t0> <= t <= <t1> to <out>,
+    * blocks outside the range are not decoded
+    */
+    void query(std::size_t column, Time t0, Time t1,
+        std::vector<Sample>& out) const
+    {
+        visa_compat::lock_guard<visa_compat::mutex> lock(mutex_);
+
+        std::vector<Time> times;
+        std::vector<double> values;
+
+        for (std::size_t b = 0; b < blocks_.size(); ++b)
+        {
+            const Block& block = blocks_[b];
+
+            if (block.info.last < t0 || block.info.first > t1)
+            {
+                continue;
+            }
+
+            block.decode(column, times, values);
+
+            for (std::size_t k = 0; k < times.size(); ++k)
+            {
+                if (times[k] >= t0 && times[k] <= t1)
+                {
+                    Sample s;
+                    s.t = times[k];
+                    s.value = values[k];
+                    out.push_back(s);
+                }
+            }
+        }
+    }
+    /*------------------------------------------------------------------------*/
+    /**
+    * Min / max of <column> over [<t0>, <t1>], only blocks that straddle an
+    * end of the range are decoded
+    * @return - false if there are no samples in the range
+    */
+    bool range(std::size_t column, Time t0, Time t1, double& min,
+        double& max) const
+    {
+        visa_compat::lock_guard<visa_compat::mutex> lock(mutex_);
+
+        bool found = false;
+
+        std::vector<Time> times;
+        std::vector<double> values;
+
+        for (std::size_t b = 0; b < blocks_.size(); ++b)
+        {
+            const Block& block = blocks_[b];
+
+            if (block.info.last < t0 || block.info.first > t1 ||
+                block.info.count == 0)
+            {
+                continue;
+            }
+
+            if (block.info.first >= t0 && block.info.last <= t1)
+            {
+                merge(block.info.min[column], block.info.max[column], found,
+                    min, max);
+                continue;
+            }
+
+            block.decode(column, times, values);
+
+            for (std::size_t k = 0; k < times.size(); ++k)
+            {
+                if (times[k] >= t0 && times[k] <= t1)
+                {
+                    merge(values[k], values[k], found, min, max);
+                }
+            }
+        }
+
+        return found;
+    }
+    /*------------------------------------------------------------------------*/
+    void clear()
+    {
+        visa_compat::lock_guard<visa_compat::mutex> lock(mutex_);
+        blocks_.clear();
+        samples_ = 0;
+    }
+    /*------------------------------------------------------------------------*/
+    /**
+    * Writes every block, as encoded, to <out>
+    */
+    bool save(std::ostream& out) const
+    {
+        visa_compat::lock_guard<visa_compat::mutex> lock(mutex_);
+
+        Bits header[3] = {columns_, blockSize_, blocks_.size()};
+
+        out.write(magic(), 4);
+        out.write(reinterpret_cast<const char*>(header), sizeof(header));
+
+        for (std::size_t b = 0; b < blocks_.size(); ++b)
+        {
+            blocks_[b].save(out);
+        }
+
+        return out.good();
+    }
+    /*------------------------------------------------------------------------*/
+    /**
+    * Replaces the contents with blocks written by save(), the column count
+    * must match
+    */
+    bool load(std::istream& in)
+    {
+        char tag[4];
+        Bits header[3];
+
+        in.read(tag, 4);
+        in.read(reinterpret_cast<char*>(header), sizeof(header));
+
+        if (!in.good() || std::memcmp(tag, magic(), 4) != 0 ||
+            header[0] != columns_)
+        {
+            return false;
+        }
+
+        std::deque<Block> blocks(static_cast<std::size_t>(header[2]),
+            Block(columns_));
+        std::size_t samples = 0;
+
+        for (std::size_t b = 0; b < blocks.size(); ++b)
+        {
+            if (!blocks[b].load(in))
+            {
+                return false;
+            }
+
+            samples += blocks[b].info.count;
+        }
+
+        visa_compat::lock_guard<visa_compat::mutex> lock(mutex_);
+
+        blockSize_ = static_cast<std::size_t>(header[1]);
+        blocks_.swap(blocks);
+        samples_ = samples;
+
+        return true;
+    }
+    /*------------------------------------------------------------------------*/
+
+private:
+    /*------------------------------------------------------------------------*/
+    static const char* magic()
+    {
+        return "VTS1";
+    }
+    /*------------------------------------------------------------------------*/
+    static void merge(double lo, double hi, bool& found, double& min,
+        double& max)
+    {
+        min = !found || lo < min ? lo : min;
+        max = !found || hi > max ? hi : max;
+        found = true;
+    }
+    /*------------------------------------------------------------------------*/
+    static Bits toBits(double value)
+    {
+        Bits bits;
+        std::memcpy(&bits, &value, sizeof(bits));
+        return bits;
+    }
+    /*------------------------------------------------------------------------*/
+    static double fromBits(Bits bits)
+    {
+        double value;
+        std::memcpy(&value, &bits, sizeof(value));
+        return value;
+    }
+    /*------------------------------------------------------------------------*/
+    static int leadingZeros(Bits x)
+    {
+        int n = 0;
+        for (Bits mask = 1ULL << 63; mask != 0 && (x & mask) == 0; mask >>= 1)
+        {
+            ++n;
+        }
+        return n;
+    }
+    /*------------------------------------------------------------------------*/
+    static int trailingZeros(Bits x)
+    {
+        int n = 0;
+        for (; n < 64 && (x & 1) == 0; x >>= 1)
+        {
+            ++n;
+        }
+        return n;
+    }
+    /*------------------------------------------------------------------------*/
+    // XOR encoder / decoder state of one value column
+    struct Column
+    {
+        Column() : prev(0), leading(-1), trailing(0) {}
+
+        VISABitStream bits;
+        Bits prev;
+        int leading;    // window of the previous value, -1 before the first
+        int trailing;
+    };
+    /*------------------------------------------------------------------------*/
+    class Block
+    {
+    public:
+        /*--------------------------------------------------------------------*/
+        Block(std::size_t columns) : prevTime_(0), prevDelta_(0),
+            columns_(columns)
+        {
+            info.count = 0;
+            info.first = info.last = 0;
+            info.min.assign(columns, 0.0);
+            info.max.assign(columns, 0.0);
+        }
+        /*--------------------------------------------------------------------*/
+        void append(Time t, const double* values)
+        {
+            if (info.count == 0)
+            {
+                time_.write(static_cast<Bits>(t), 64);
+                info.first = t;
+            }
+            else
+            {
+                Time delta = t - prevTime_;
+                writeDelta(delta - prevDelta_);
+                prevDelta_ = delta;
+            }
+
+            prevTime_ = t;
+            info.last = t;
+
+            for (std::size_t c = 0; c < columns_.size(); ++c)
+            {
+                writeValue(columns_[c], toBits(values[c]), info.count == 0);
+
+                info.min[c] = info.count == 0 || values[c] < info.min[c] ?
+                    values[c] : info.min[c];
+                info.max[c] = info.count == 0 || values[c] > info.max[c] ?
+                    values[c] : info.max[c];
+            }
+
+            ++info.count;
+        }
+        /*--------------------------------------------------------------------*/
+        void decode(std::size_t column, std::vector<Time>& times,
+            std::vector<double>& values) const
+        {
+            times.resize(info.count);
+            values.resize(info.count);
+
+            std::size_t tPos = 0, vPos = 0;
+            Time t = 0, delta = 0;
+            Bits prev = 0;
+            int leading = 0, trailing = 0;
+
+            const VISABitStream& vBits = columns_[column].bits;
+
+            for (std::size_t k = 0; k < info.count; ++k)
+            {
+                if (k == 0)
+                {
+                    t = static_cast<Time>(time_.read(tPos, 64));
+                    prev = vBits.read(vPos, 64);
+                }
+                else
+                {
+                    delta += readDelta(tPos);
+                    t += delta;
+
+                    if (vBits.read(vPos, 1) == 1)
+                    {
+                        if (vBits.read(vPos, 1) == 1)
+                        {
+                            leading = static_cast<int>(vBits.read(vPos, 6));
+                            int length = static_cast<int>(vBits.read(vPos, 6)) + 1;
+                            trailing = 64 - leading - length;
+                        }
+
+                        int length = 64 - leading - trailing;
+                        prev ^= vBits.read(vPos, length) << trailing;
+                    }
+                }
+
+                times[k] = t;
+                values[k] = fromBits(prev);
+            }
+        }
+        /*--------------------------------------------------------------------*/
+        std::size_t bytes() const
+        {
+            std::size_t n = time_.bytes();
+            for (std::size_t c = 0; c < columns_.size(); ++c)
+            {
+                n += columns_[c].bits.bytes();
+            }
+            return n;
+        }
+        /*--------------------------------------------------------------------*/
+        void save(std::ostream& out) const
+        {
+            Bits header[3] = {info.count, static_cast<Bits>(info.first),
+                static_cast<Bits>(info.last)};
+            out.write(reinterpret_cast<const char*>(header), sizeof(header));
+
+            for (std::size_t c = 0; c < columns_.size(); ++c)
+            {
+                out.write(reinterpret_cast<const char*>(&info.min[c]), sizeof(double));
+                out.write(reinterpret_cast<const char*>(&info.max[c]), sizeof(double));
+            }
+
+            time_.save(out);
+            for (std::size_t c = 0; c < columns_.size(); ++c)
+            {
+                columns_[c].bits.save(out);
+            }
+        }
+        /*--------------------------------------------------------------------*/
+        // NOTE: a loaded block can be queried but not appended to
+        bool load(std::istream& in)
+        {
+            Bits header[3];
+            in.read(reinterpret_cast<char*>(header), sizeof(header));
+
+            info.count = static_cast<std::size_t>(header[0]);
+            info.first = static_cast<Time>(header[1]);
+            info.last = static_cast<Time>(header[2]);
+
+            for (std::size_t c = 0; c < columns_.size(); ++c)
+            {
+                in.read(reinterpret_cast<char*>(&info.min[c]), sizeof(double));
+                in.read(reinterpret_cast<char*>(&info.max[c]), sizeof(double));
+            }
+
+            bool success = time_.load(in);
+            for (std::size_t c = 0; c < columns_.size() && success; ++c)
+            {
+                success = columns_[c].bits.load(in);
+            }
+
+            return success;
+        }
+        /*--------------------------------------------------------------------*/
+
+    public:
+        BlockInfo info;
+
+    private:
+        /*--------------------------------------------------------------------*/
+        // delta-of-delta in buckets: 0 | 7 | 9 | 12 bits | full 64 bits
+        void writeDelta(Time dod)
+        {
+            if (dod == 0)
+            {
+                time_.write(0, 1);
+            }
+            else if (dod >= -63 && dod <= 64)
+            {
+                time_.write(2, 2);
+                time_.write(static_cast<Bits>(dod + 63), 7);
+            }
+            else if (dod >= -255 && dod <= 256)
+            {
+                time_.write(6, 3);
+                time_.write(static_cast<Bits>(dod + 255), 9);
+            }
+            else if (dod >= -2047 && dod <= 2048)
+            {
+                time_.write(14, 4);
+                time_.write(static_cast<Bits>(dod + 2047), 12);
+            }
+            else
+            {
+                time_.write(15, 4);
+                time_.write(static_cast<Bits>(dod), 64);
+            }
+        }
+        /*--------------------------------------------------------------------*/
+        Time readDelta(std::size_t& pos) const
+        {
+            if (time_.read(pos, 1) == 0)
+            {
+                return 0;
+            }
+            else if (time_.read(pos, 1) == 0)
+            {
+                return static_cast<Time>(time_.read(pos, 7)) - 63;
+            }
+            else if (time_.read(pos, 1) == 0)
+            {
+                return static_cast<Time>(time_.read(pos, 9)) - 255;
+            }
+            else if (time_.read(pos, 1) == 0)
+            {
+                return static_cast<Time>(time_.read(pos, 12)) - 2047;
+            }
+
+            return static_cast<Time>(time_.read(pos, 64));
+        }
+        /*--------------------------------------------------------------------*/
+        // '0' same value | '10' bits in the previous window | '11' new window
+        static void writeValue(Column& col, Bits bits, bool first)
+        {
+            if (first)
+            {
+                col.bits.write(bits, 64);
+                col.prev = bits;
+                col.leading = -1;
+                return;
+            }
+
+            Bits x = bits ^ col.prev;
+            col.prev = bits;
+
+            if (x == 0)
+            {
+                col.bits.write(0, 1);
+                return;
+            }
+
+            int leading = leadingZeros(x);
+            int trailing = trailingZeros(x);
+
+            if (col.leading >= 0 && leading >= col.leading &&
+                trailing >= col.trailing)
+            {
+                col.bits.write(2, 2);
+                col.bits.write(x >> col.trailing,
+                    64 - col.leading - col.trailing);
+            }
+            else
+            {
+                int length = 64 - leading - trailing;
+
+                col.bits.write(3, 2);
+                col.bits.write(static_cast<Bits>(leading), 6);
+                col.bits.write(static_cast<Bits>(length - 1), 6);
+                col.bits.write(x >> trailing, length);
+
+                col.leading = leading;
+                col.trailing = trailing;
+            }
+        }
+        /*--------------------------------------------------------------------*/
+
+    private:
+        VISABitStream time_;
+        Time prevTime_;
+        Time prevDelta_;
+        std::vector<Column> columns_;
+    };
+    /*------------------------------------------------------------------------*/
+
+private:
+    mutable visa_compat::mutex mutex_;
+
+    std::size_t columns_;
+    std::size_t blockSize_;
+    std::size_t maxBlocks_;
+
+    std::deque<Block> blocks_;
+    std::size_t samples_;
+};
+/*============================================================================*/
+class VISATelemetryPyramid
+{
+public:
+    typedef VISATelemetryStore::Time Time;
+
+    struct Bucket
+    {
+        Bucket() : start(0), count(0), min(0.0), max(0.0), mean(0.0) {}
+
+        Time start;     // us, the bucket covers [start, start + width)
+        std::size_t count;
+        double min;
+        double max;
+        double mean;
+    };
+
+public:
+    /*------------------------------------------------------------------------*/
+    /**
+    * @param columns - values per sample
+    * @param defaultLevels - add 1 s (kept 1 day), 1 min (30 days) and 1 h
+    * (1 year) levels
+    */
+    VISATelemetryPyramid(std::size_t columns, bool defaultLevels = true) :
+        columns_(columns)
+    {
+        if (defaultLevels)
+        {
+            addLevel(1000000LL, 86400);
+            addLevel(60000000LL, 43200);
+            addLevel(3600000000LL, 8760);
+        }
+    }
+    /*------------------------------------------------------------------------*/
+    /**
+    * Adds a level of <width> us buckets keeping the most recent <retain>,
+    * levels must be added finest first
+    */
+    void addLevel(Time width, std::size_t retain)
+    {
+        visa_compat::lock_guard<visa_compat::mutex> lock(mutex_);
+
+        Level level;
+        level.width = width > 0 ? width : 1;
+        level.retain = retain > 0 ? retain : 1;
+
+        levels_.push_back(level);
+    }
+    /*------------------------------------------------------------------------*/
+    std::size_t levels() const
+    {
+        visa_compat::lock_guard<visa_compat::mutex> lock(mutex_);
+        return levels_.size();
+    }
+    /*------------------------------------------------------------------------*/
+    /**
+    * Folds one sample into every level, constant time per level
+    */
+    void append(Time t, const double* values)
+    {
+        visa_compat::lock_guard<visa_compat::mutex> lock(mutex_);
+
+        for (std::size_t l = 0; l < levels_.size(); ++l)
+        {
+            Level& level = levels_[l];
+            Time start = floor(t, level.width);
+
+            if (level.slots.empty() || level.slots.back().start < start)
+            {
+                level.slots.push_back(Slot(start, columns_));
+
+                if (level.slots.size() > level.retain)
+                {
+                    level.slots.pop_front();
+                }
+            }
+
+            Slot& slot = level.slots.back();
+
+            for (std::size_t c = 0; c < columns_; ++c)
+            {
+                slot.min[c] = slot.count == 0 || values[c] < slot.min[c] ?
+                    values[c] : slot.min[c];
+                slot.max[c] = slot.count == 0 || values[c] > slot.max[c] ?
+                    values[c] : slot.max[c];
+                slot.sum[c] += values[c];
+            }
+
+            ++slot.count;
+        }
+    }
+    /*------------------------------------------------------------------------*/
+    /**
+    * Appends the buckets of <column> overlapping [<t0>, <t1>] to <out>, from
+    * the finest level that still holds <t0> and needs at most <maxBuckets>
+    * buckets for the range (the coarsest level otherwise)
+    * @return - width (us) of the buckets returned, 0 if there are no levels
+    */
+    Time query(std::size_t column, Time t0, Time t1, std::size_t maxBuckets,
+        std::vector<Bucket>& out) const
+    {
+        visa_compat::lock_guard<visa_compat::mutex> lock(mutex_);
+
+        if (levels_.empty() || t1 < t0)
+        {
+            return 0;
+        }
+
+        std::size_t l = 0;
+        for (; l + 1 < levels_.size(); ++l)
+        {
+            const Level& level = levels_[l];
+
+            Time needed = (floor(t1, level.width) - floor(t0, level.width)) /
+                level.width + 1;
+            bool covers = !level.slots.empty() &&
+                level.slots.front().start <= t0;
+
+            if (covers && needed <= static_cast<Time>(maxBuckets))
+            {
+                break;
+            }
+        }
+
+        const Level& level = levels_[l];
+
+        // slots are in time order, find the first that ends after t0
+        std::deque<Slot>::const_iterator it = std::lower_bound(
+            level.slots.begin(), level.slots.end(), floor(t0, level.width),
+            startsBefore);
+
+        for (; it != level.slots.end() && it->start <= t1; ++it)
+        {
+            Bucket bucket;
+            bucket.start = it->start;
+            bucket.count = it->count;
+            bucket.min = it->min[column];
+            bucket.max = it->max[column];
+            bucket.mean = it->sum[column] / it->count;
+
+            out.push_back(bucket);
+        }
+
+        return level.width;
+    }
+    /*------------------------------------------------------------------------*/
+    void clear()
+    {
+        visa_compat::lock_guard<visa_compat::mutex> lock(mutex_);
+
+        for (std::size_t l = 0; l < levels_.size(); ++l)
+        {
+            levels_[l].slots.clear();
+        }
+    }
+    /*------------------------------------------------------------------------*/
+
+private:
+    /*------------------------------------------------------------------------*/
+    struct Slot
+    {
+        Slot(Time t, std::size_t columns) : start(t), count(0),
+            min(columns, 0.0), max(columns, 0.0), sum(columns, 0.0) {}
+
+        Time start;
+        std::size_t count;
+        std::vector<double> min;
+        std::vector<double> max;
+        std::vector<double> sum;
+    };
+    /*------------------------------------------------------------------------*/
+    struct Level
+    {
+        Time width;
+        std::size_t retain;
+        std::deque<Slot> slots;
+    };
+    /*------------------------------------------------------------------------*/
+    static bool startsBefore(const Slot& slot, Time t)
+    {
+        return slot.start < t;
+    }
+    /*------------------------------------------------------------------------*/
+    // largest multiple of <width> <= <t>
+    static Time floor(Time t, Time width)
+    {
+        Time q = t / width;
+        return (t % width < 0 ? q - 1 : q) * width;
+    }
+    /*------------------------------------------------------------------------*/
+
+private:
+    mutable visa_compat::mutex mutex_;
+
+    std::size_t columns_;
+    std::vector<Level> levels_;
+};
+/*============================================================================*/
+class VISATelemetryWindow
+{
+public:
+    typedef VISATelemetryStore::Time Time;
+
+    struct Stats
+    {
+        Stats() : count(0), mean(0.0), variance(0.0), min(0.0), max(0.0),
+            peakToPeak(0.0), drift(0.0) {}
+
+        std::size_t count;
+        double mean;
+        double variance;    // population, sqrt() is the RMS noise
+        double min;
+        double max;
+        double peakToPeak;
+        double drift;       // slope, units per s
+    };
+
+public:
+    /*------------------------------------------------------------------------*/
+    VISATelemetryWindow(std::size_t columns, std::size_t capacity) :
+        columns_(columns),
+        capacity_(0),
+        next_(0),
+        size_(0),
+        origin_(0)
+    {
+        setCapacity(capacity);
+    }
+    /*------------------------------------------------------------------------*/
+    /**
+    * Resizes the window to the most recent <capacity> samples, discarding
+    * what it holds
+    */
+    void setCapacity(std::size_t capacity)
+    {
+        visa_compat::lock_guard<visa_compat::mutex> lock(mutex_);
+
+        capacity_ = capacity > 1 ? capacity : 2;
+        time_.assign(capacity_, 0.0);
+        values_.assign(capacity_ * columns_, 0.0);
+        next_ = 0;
+        size_ = 0;
+    }
+    /*------------------------------------------------------------------------*/
+    std::size_t capacity() const
+    {
+        visa_compat::lock_guard<visa_compat::mutex> lock(mutex_);
+        return capacity_;
+    }
+    /*------------------------------------------------------------------------*/
+    std::size_t size() const
+    {
+        visa_compat::lock_guard<visa_compat::mutex> lock(mutex_);
+        return size_;
+    }
+    /*------------------------------------------------------------------------*/
+    void append(Time t, const double* values)
+    {
+        visa_compat::lock_guard<visa_compat::mutex> lock(mutex_);
+
+        if (size_ == 0)
+        {
+            // times are kept in s from the first sample, which keeps the
+            // regression sums well conditioned
+            origin_ = t;
+        }
+
+        time_[next_] = (t - origin_) / 1e6;
+
+        for (std::size_t c = 0; c < columns_; ++c)
+        {
+            values_[c * capacity_ + next_] = values[c];
+        }
+
+        next_ = (next_ + 1) % capacity_;
+        size_ = size_ < capacity_ ? size_ + 1 : capacity_;
+    }
+    /*------------------------------------------------------------------------*/
+    /**
+    * Statistics of <column> over the samples in the window
+    * @return - false if the window is empty or <column> is out of range
+    */
+    bool stats(std::size_t column, Stats& out) const
+    {
+        visa_compat::lock_guard<visa_compat::mutex> lock(mutex_);
+
+        out = Stats();
+
+        if (size_ == 0 || column >= columns_)
+        {
+            return false;
+        }
+
+        // while filling the samples are [0, size_), once full the whole
+        // array, either way one contiguous run
+        const double* v = &values_[column * capacity_];
+        const double* t = &time_[0];
+        const std::size_t n = size_;
+
+        double sv[Lanes] = {0.0}, st[Lanes] = {0.0};
+        double lo[Lanes], hi[Lanes];
+
+        for (std::size_t k = 0; k < Lanes; ++k)
+        {
+            lo[k] = hi[k] = v[0];
+        }
+
+        std::size_t k = 0;
+        for (; k + Lanes <= n; k += Lanes)
+        {
+            for (std::size_t j = 0; j < Lanes; ++j)
+            {
+                sv[j] += v[k + j];
+                st[j] += t[k + j];
+                lo[j] = v[k + j] < lo[j] ? v[k + j] : lo[j];
+                hi[j] = v[k + j] > hi[j] ? v[k + j] : hi[j];
+            }
+        }
+        for (; k < n; ++k)
+        {
+            sv[0] += v[k];
+            st[0] += t[k];
+            lo[0] = v[k] < lo[0] ? v[k] : lo[0];
+            hi[0] = v[k] > hi[0] ? v[k] : hi[0];
+        }
+
+        double meanV = sum(sv) / n;
+        double meanT = sum(st) / n;
+
+        // second pass on centred values, numerically safer than sums of
+        // squares
+        double vv[Lanes] = {0.0}, tv[Lanes] = {0.0}, tt[Lanes] = {0.0};
+
+        for (k = 0; k + Lanes <= n; k += Lanes)
+        {
+            for (std::size_t j = 0; j < Lanes; ++j)
+            {
+                double dv = v[k + j] - meanV;
+                double dt = t[k + j] - meanT;
+
+                vv[j] += dv * dv;
+                tv[j] += dt * dv;
+                tt[j] += dt * dt;
+            }
+        }
+        for (; k < n; ++k)
+        {
+            double dv = v[k] - meanV;
+            double dt = t[k] - meanT;
+
+            vv[0] += dv * dv;
+            tv[0] += dt * dv;
+            tt[0] += dt * dt;
+        }
+
+        out.count = n;
+        out.mean = meanV;
+        out.variance = sum(vv) / n;
+        out.min = *std::min_element(lo, lo + Lanes);
+        out.max = *std::max_element(hi, hi + Lanes);
+        out.peakToPeak = out.max - out.min;
+        out.drift = sum(tt) > 0.0 ? sum(tv) / sum(tt) : 0.0;
+
+        return true;
+    }
+    /*------------------------------------------------------------------------*/
+    void clear()
+    {
+        visa_compat::lock_guard<visa_compat::mutex> lock(mutex_);
+
+        next_ = 0;
+        size_ = 0;
+    }
+    /*------------------------------------------------------------------------*/
+
+private:
+    // independent accumulators per kernel, enough for 256 bit registers
+    static const std::size_t Lanes = 4;
+
+    /*------------------------------------------------------------------------*/
+    static double sum(const double* lanes)
+    {
+        return (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]);
+    }
+    /*------------------------------------------------------------------------*/
+
+private:
+    mutable visa_compat::mutex mutex_;
+
+    std::size_t columns_;
+    std::size_t capacity_;
+    std::size_t next_;
+    std::size_t size_;
+    Time origin_;
+
+    std::vector<double> time_;
+    std::vector<double> values_;    // column c at [c * capacity_, ...)
+};
+/*============================================================================*/
+#endif //_VISATELEMETRY_H_
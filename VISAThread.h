@@ -0,0 +1,381 @@
+////////////////////////////////////////////////////////////////////////////////
+// FILE:          VISAThread.h
+// PROJECT:       Micro-Manager
+// SUBSYSTEM:     DeviceAdapters
+//-----------------------------------------------------------------------------
+// DESCRIPTION:   Minimal stoppable background thread for VISA device helpers
+//
+// AUTHOR:        Scottie Alexander, scottiealexander11@gmail.com
+//
+// COPYRIGHT:     University of California, Davis, 2016
+//
+// LICENSE:       This file is distributed under the BSD license.
+//                License text is included with the source distribution.
+//
+//                This file is distributed in the hope that it will be useful,
+//                but WITHOUT ANY WARRANTY; without even the implied warranty
+//                of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+//
+//                IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+//                CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+//                INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES.
+
+/*GIST
+  Subclasses implement run() and use waitFor() for any sleeping so that
+  stop() takes effect immediately. run() is virtual, so a subclass *must* call
+  stop() from its own destructor.
+
+  A VISAThreadConfig set before start() is applied by the thread itself before
+  run() is entered: CPU affinity, and real-time priority (SCHED_FIFO on POSIX,
+  the time-critical class on Windows). Both usually need privileges, failures
+  are reported via getConfigError() and the thread runs untuned.
+*/
+#pragma once
+#ifndef _VISATHREAD_H_
+#define _VISATHREAD_H_
+
+#include <cerrno>
+#include <cstring>
+#include <sstream>
+#include <string>
+
+#ifdef _WIN32
+    #ifndef NOMINMAX
+        #define NOMINMAX
+    #endif
+    #include <windows.h>
+#else
+    #include <pthread.h>
+    #include <sched.h>
+    #include <sys/mman.h>
+#endif
+
+#include "VISADevice.h"
+
+/*============================================================================*/
+struct VISAThreadConfig
+{
+    VISAThreadConfig() : cpu(-1), priority(0) {}
+
+    int cpu;        // CPU to pin the thread to, -1 for any
+    int priority;   // real-time priority (1-99), 0 for normal scheduling
+};
+
+/*============================================================================*/
+class VISAWorker
+{
+public:
+    /*------------------------------------------------------------------------*/
+    VISAWorker() : thread_(0), running_(false), woken_(false),
+        configured_(false), clock_(&VISAClock::system()), place_(0.0),
+        placed_(false) {}
+    /*------------------------------------------------------------------------*/
+    virtual ~VISAWorker()
+    {
+        stop();
+    }
+    /*------------------------------------------------------------------------*/
+    /**
+    * Starts the thread (no-op if already running)
+    * @return - true if the thread is running
+    */
+    bool start()
+    {
+        if (thread_ == 0)
+        {
+            {
+                visa_compat::lock_guard<visa_compat::mutex> lock(mutex_);
+                running_ = true;
+                configured_ = false;
+            }
+
+            thread_ = new visa_compat::thread(&VISAWorker::entry, this);
+
+            // wait for the thread to configure itself so that
+            // getConfigError() is meaningful on return
+            visa_compat::unique_lock<visa_compat::mutex> lock(mutex_);
+            while (!configured_)
+            {
+                cond_.wait(lock);
+            }
+        }
+
+        return thread_ != 0;
+    }
+    /*------------------------------------------------------------------------*/
+    /**
+    * Asks run() to return and waits for it to do so
+    */
+    void stop()
+    {
+        if (thread_ != 0)
+        {
+            {
+                visa_compat::lock_guard<visa_compat::mutex> lock(mutex_);
+                running_ = false;
+            }
+
+            cond_.notify_all();
+
+            thread_->join();
+            delete thread_;
+            thread_ = 0;
+        }
+    }
+    /*------------------------------------------------------------------------*/
+    bool isRunning() const
+    {
+        visa_compat::lock_guard<visa_compat::mutex> lock(mutex_);
+        return running_;
+    }
+    /*------------------------------------------------------------------------*/
+    /**
+    * Cuts the current (or next) waitFor() short without stopping the thread
+    */
+    void wake()
+    {
+        {
+            visa_compat::lock_guard<visa_compat::mutex> lock(mutex_);
+            woken_ = true;
+        }
+
+        cond_.notify_all();
+    }
+    /*------------------------------------------------------------------------*/
+    /**
+    * Sets the clock waitFor() (and subclasses) measure time on, 0 for the
+    * system clock (set before start(), the clock is not owned)
+    */
+    void setClock(VISAClock* clock)
+    {
+        visa_compat::lock_guard<visa_compat::mutex> lock(mutex_);
+        clock_ = clock != 0 ? clock : &VISAClock::system();
+    }
+    /*------------------------------------------------------------------------*/
+    /**
+    * Sets the affinity / priority the thread applies to itself when it is
+    * next started
+    */
+    void setConfig(const VISAThreadConfig& config)
+    {
+        visa_compat::lock_guard<visa_compat::mutex> lock(mutex_);
+        config_ = config;
+    }
+    /*------------------------------------------------------------------------*/
+    /**
+    * @return - why the configuration could not be applied when the thread
+    * was last started, empty if it was
+    */
+    std::string getConfigError() const
+    {
+        visa_compat::lock_guard<visa_compat::mutex> lock(mutex_);
+        return configError_;
+    }
+    /*------------------------------------------------------------------------*/
+    /**
+    * Locks the current and future pages of the process in RAM so that the
+    * I/O path never takes a page fault (process wide, POSIX only)
+    * @return - true on success
+    */
+    static bool lockMemory(std::string& error)
+    {
+#ifdef _WIN32
+        error = "Memory locking is not supported on Windows";
+        return false;
+#else
+        if (mlockall(MCL_CURRENT | MCL_FUTURE) != 0)
+        {
+            error = std::string("mlockall failed: ") + strerror(errno);
+            return false;
+        }
+
+        return true;
+#endif
+    }
+    /*------------------------------------------------------------------------*/
+
+protected:
+    /*------------------------------------------------------------------------*/
+    virtual void run() = 0;
+    /*------------------------------------------------------------------------*/
+    /**
+    * Sleeps for <ms>, waking early if stop() is called (on a virtual clock,
+    * the worker then holds the clock where it woke up until its next wait,
+    * see VISAClock.h)
+    * @return - false if the thread should exit
+    */
+    bool waitFor(ViUInt32 ms)
+    {
+        if (clock_->isVirtual())
+        {
+            return waitForVirtual(ms);
+        }
+
+        visa_compat::chrono::steady_clock::time_point deadline =
+            visa_compat::chrono::steady_clock::now() +
+            visa_compat::chrono::milliseconds(ms);
+
+        visa_compat::unique_lock<visa_compat::mutex> lock(mutex_);
+
+        while (running_ && !woken_ &&
+            visa_compat::chrono::steady_clock::now() < deadline)
+        {
+            cond_.wait_until(lock, deadline);
+        }
+
+        woken_ = false;
+
+        return running_;
+    }
+    /*------------------------------------------------------------------------*/
+    VISAClock& clock() const
+    {
+        return *clock_;
+    }
+    /*------------------------------------------------------------------------*/
+
+private:
+    /*------------------------------------------------------------------------*/
+    // a virtual clock is moved by others, so wait in short real slices until
+    // it passes the deadline (an idle worker must not advance it itself, but
+    // the deadline is registered so that sleepers don't skip past it)
+    bool waitForVirtual(ViUInt32 ms)
+    {
+        double deadline = clock_->now() + ms * 1000.0;
+        clock_->addWaiter(deadline);
+
+        // the place held since the last wait
+        releasePlace();
+
+        bool running;
+        {
+            visa_compat::unique_lock<visa_compat::mutex> lock(mutex_);
+
+            while (running_ && !woken_ && clock_->now() < deadline)
+            {
+                cond_.wait_for(lock, visa_compat::chrono::milliseconds(1));
+            }
+
+            woken_ = false;
+            running = running_;
+        }
+
+        // hold the clock where we woke up while we work, until the next wait
+        if (running)
+        {
+            place_ = clock_->now();
+            placed_ = true;
+            clock_->addWaiter(place_);
+        }
+
+        clock_->removeWaiter(deadline);
+
+        return running;
+    }
+    /*------------------------------------------------------------------------*/
+    void releasePlace()
+    {
+        if (placed_)
+        {
+            clock_->removeWaiter(place_);
+            placed_ = false;
+        }
+    }
+    /*------------------------------------------------------------------------*/
+    void entry()
+    {
+        VISAThreadConfig config;
+        {
+            visa_compat::lock_guard<visa_compat::mutex> lock(mutex_);
+            config = config_;
+        }
+
+        std::string error = applyConfig(config);
+        {
+            visa_compat::lock_guard<visa_compat::mutex> lock(mutex_);
+            configError_ = error;
+            configured_ = true;
+        }
+
+        cond_.notify_all();
+
+        run();
+
+        releasePlace();
+    }
+    /*------------------------------------------------------------------------*/
+    // applies <config> to the calling thread, returns an error message
+    static std::string applyConfig(const VISAThreadConfig& config)
+    {
+        std::ostringstream error;
+
+#ifdef _WIN32
+        if (config.cpu >= 0 && SetThreadAffinityMask(GetCurrentThread(),
+            static_cast<DWORD_PTR>(1) << config.cpu) == 0)
+        {
+            error << "Failed to pin thread to CPU " << config.cpu
+                << " (error " << GetLastError() << ") ";
+        }
+
+        if (config.priority > 0 && !SetThreadPriority(GetCurrentThread(),
+            THREAD_PRIORITY_TIME_CRITICAL))
+        {
+            error << "Failed to raise thread priority (error "
+                << GetLastError() << ") ";
+        }
+#else
+    #ifdef __linux__
+        if (config.cpu >= 0)
+        {
+            cpu_set_t set;
+            CPU_ZERO(&set);
+            CPU_SET(config.cpu, &set);
+
+            int ret = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+            if (ret != 0)
+            {
+                error << "Failed to pin thread to CPU " << config.cpu << ": "
+                    << strerror(ret) << " ";
+            }
+        }
+    #else
+        if (config.cpu >= 0)
+        {
+            error << "CPU affinity is not supported on this platform ";
+        }
+    #endif
+        if (config.priority > 0)
+        {
+            sched_param param;
+            std::memset(&param, 0, sizeof(param));
+            param.sched_priority = config.priority;
+
+            int ret = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+            if (ret != 0)
+            {
+                error << "Failed to set SCHED_FIFO priority "
+                    << config.priority << ": " << strerror(ret) << " ";
+            }
+        }
+#endif
+        return error.str();
+    }
+    /*------------------------------------------------------------------------*/
+
+private:
+    visa_compat::thread* thread_;
+    mutable visa_compat::mutex mutex_;
+    visa_compat::condition_variable cond_;
+    bool running_;
+    bool woken_;
+
+    VISAThreadConfig config_;
+    bool configured_;
+
+    VISAClock* clock_;
+    double place_;      // where the worker holds a virtual clock (see waitFor())
+    bool placed_;
+    std::string configError_;
+};
+/*============================================================================*/
+#endif //_VISATHREAD_H_
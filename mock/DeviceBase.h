@@ -0,0 +1,524 @@
+////////////////////////////////////////////////////////////////////////////////
+// FILE:          DeviceBase.h
+// PROJECT:       Micro-Manager
+// SUBSYSTEM:     DeviceAdapters
+//-----------------------------------------------------------------------------
+// DESCRIPTION:   Stand-in for MMDevice's DeviceBase.h (properties and the
+//                device base classes), see mock/MMDevice.h
+//
+// AUTHOR:        Scottie Alexander, scottiealexander11@gmail.com
+//
+// COPYRIGHT:     University of California, Davis, 2016
+//
+// LICENSE:       This file is distributed under the BSD license.
+//                License text is included with the source distribution.
+//
+//                This file is distributed in the hope that it will be useful,
+//                but WITHOUT ANY WARRANTY; without even the implied warranty
+//                of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+//
+//                IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+//                CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+//                INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES.
+
+#pragma once
+#ifndef _DEVICEBASE_H_
+#define _DEVICEBASE_H_
+
+#include <algorithm>
+#include <cassert>
+#include <cstdio>
+#include <cstdlib>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "MMDevice.h"
+#include "DeviceUtils.h"
+
+/*============================================================================*/
+class ActionFunctor
+{
+public:
+    virtual ~ActionFunctor() {}
+    virtual int Execute(MM::PropertyBase* pProp, MM::ActionType eAct) = 0;
+};
+/*============================================================================*/
+class CPropertyAction : public ActionFunctor
+{
+public:
+    template <class T>
+    CPropertyAction(T* obj, int (T::*fn)(MM::PropertyBase*, MM::ActionType)) :
+        call_(new Call<T>(obj, fn)) {}
+
+    ~CPropertyAction() { delete call_; }
+
+    int Execute(MM::PropertyBase* pProp, MM::ActionType eAct)
+    {
+        return call_->Execute(pProp, eAct);
+    }
+
+private:
+    template <class T>
+    struct Call : public ActionFunctor
+    {
+        Call(T* obj, int (T::*fn)(MM::PropertyBase*, MM::ActionType)) :
+            obj_(obj), fn_(fn) {}
+
+        int Execute(MM::PropertyBase* pProp, MM::ActionType eAct)
+        {
+            return (obj_->*fn_)(pProp, eAct);
+        }
+
+        T* obj_;
+        int (T::*fn_)(MM::PropertyBase*, MM::ActionType);
+    };
+
+    ActionFunctor* call_;
+};
+/*============================================================================*/
+class CPropertyActionEx : public ActionFunctor
+{
+public:
+    template <class T>
+    CPropertyActionEx(T* obj,
+        int (T::*fn)(MM::PropertyBase*, MM::ActionType, long), long data) :
+        call_(new Call<T>(obj, fn, data)) {}
+
+    ~CPropertyActionEx() { delete call_; }
+
+    int Execute(MM::PropertyBase* pProp, MM::ActionType eAct)
+    {
+        return call_->Execute(pProp, eAct);
+    }
+
+private:
+    template <class T>
+    struct Call : public ActionFunctor
+    {
+        Call(T* obj, int (T::*fn)(MM::PropertyBase*, MM::ActionType, long),
+            long data) :
+            obj_(obj), fn_(fn), data_(data) {}
+
+        int Execute(MM::PropertyBase* pProp, MM::ActionType eAct)
+        {
+            return (obj_->*fn_)(pProp, eAct, data_);
+        }
+
+        T* obj_;
+        int (T::*fn_)(MM::PropertyBase*, MM::ActionType, long);
+        long data_;
+    };
+
+    ActionFunctor* call_;
+};
+/*============================================================================*/
+// one property: a typed value (string, float or integer) with optional
+// limits / allowed values and the action that backs it (owned)
+class CMockProperty : public MM::PropertyBase
+{
+public:
+    CMockProperty(MM::PropertyType type, bool readOnly, ActionFunctor* action) :
+        type_(type),
+        readOnly_(readOnly),
+        action_(action),
+        number_(0.0),
+        hasLimits_(false),
+        lower_(0.0),
+        upper_(0.0),
+        sequenceMax_(0)
+    {}
+
+    ~CMockProperty()
+    {
+        delete action_;
+    }
+    /*------------------------------------------------------------------------*/
+    bool Set(const char* value)
+    {
+        if (type_ == MM::String)
+        {
+            text_ = value;
+            return true;
+        }
+
+        return type_ == MM::Integer ? Set(std::atol(value)) :
+            Set(std::atof(value));
+    }
+    /*------------------------------------------------------------------------*/
+    bool Set(long value)
+    {
+        if (type_ == MM::Float)
+        {
+            return Set(static_cast<double>(value));
+        }
+
+        return setNumber(static_cast<double>(value));
+    }
+    /*------------------------------------------------------------------------*/
+    bool Set(double value)
+    {
+        if (type_ == MM::Integer)
+        {
+            return Set(static_cast<long>(value));
+        }
+
+        return setNumber(value);
+    }
+    /*------------------------------------------------------------------------*/
+    bool Get(std::string& value) const
+    {
+        if (type_ == MM::String)
+        {
+            value = text_;
+            return true;
+        }
+
+        // formatted on every get, floats to 4 decimals as MMDevice does
+        char buf[64];
+        if (type_ == MM::Integer)
+        {
+            std::snprintf(buf, sizeof(buf), "%ld", static_cast<long>(number_));
+        }
+        else
+        {
+            std::snprintf(buf, sizeof(buf), "%.4f", number_);
+        }
+
+        value = buf;
+        return true;
+    }
+    /*------------------------------------------------------------------------*/
+    bool Get(long& value) const
+    {
+        value = type_ == MM::String ? std::atol(text_.c_str()) :
+            static_cast<long>(number_);
+        return true;
+    }
+    /*------------------------------------------------------------------------*/
+    bool Get(double& value) const
+    {
+        value = type_ == MM::String ? std::atof(text_.c_str()) : number_;
+        return true;
+    }
+    /*------------------------------------------------------------------------*/
+    void SetSequenceable(long maxSize) { sequenceMax_ = maxSize; }
+    std::vector<std::string> GetSequence() const { return sequence_; }
+    /*------------------------------------------------------------------------*/
+    MM::PropertyType GetType() const { return type_; }
+    bool GetReadOnly() const { return readOnly_; }
+    /*------------------------------------------------------------------------*/
+    bool SetLimits(double lower, double upper)
+    {
+        if (type_ == MM::String)
+        {
+            return false;
+        }
+
+        hasLimits_ = true;
+        lower_ = lower;
+        upper_ = upper;
+
+        return true;
+    }
+    /*------------------------------------------------------------------------*/
+    std::vector<std::string>& AllowedValues() { return allowed_; }
+
+    bool IsAllowed(const char* value) const
+    {
+        return allowed_.empty() ||
+            std::find(allowed_.begin(), allowed_.end(), value) != allowed_.end();
+    }
+    /*------------------------------------------------------------------------*/
+    // the action's BeforeGet, run before every get
+    int Update()
+    {
+        return action_ != 0 ? action_->Execute(this, MM::BeforeGet) : DEVICE_OK;
+    }
+    /*------------------------------------------------------------------------*/
+    // the action's AfterSet, run after every set
+    int Apply()
+    {
+        return action_ != 0 ? action_->Execute(this, MM::AfterSet) : DEVICE_OK;
+    }
+
+private:
+    bool setNumber(double value)
+    {
+        if (hasLimits_ && (value < lower_ || value > upper_))
+        {
+            return false;
+        }
+
+        number_ = value;
+        return true;
+    }
+
+    MM::PropertyType type_;
+    bool readOnly_;
+    ActionFunctor* action_;
+
+    std::string text_;
+    double number_;
+
+    bool hasLimits_;
+    double lower_;
+    double upper_;
+    std::vector<std::string> allowed_;
+
+    long sequenceMax_;
+    std::vector<std::string> sequence_;
+};
+/*============================================================================*/
+template <class T, class U>
+class CDeviceBase : public T
+{
+public:
+    CDeviceBase() : callback_(0) {}
+
+    virtual ~CDeviceBase()
+    {
+        std::map<std::string, CMockProperty*>::iterator it;
+        for (it = properties_.begin(); it != properties_.end(); ++it)
+        {
+            delete it->second;
+        }
+    }
+    /*------------------------------------------------------------------------*/
+    virtual MM::DeviceType GetType() const { return MM::UnknownType; }
+    virtual void SetCallback(MM::Core* core) { callback_ = core; }
+    /*------------------------------------------------------------------------*/
+    virtual bool HasProperty(const char* name) const
+    {
+        return properties_.find(name) != properties_.end();
+    }
+    /*------------------------------------------------------------------------*/
+    virtual int SetProperty(const char* name, const char* value)
+    {
+        CMockProperty* pProp = find(name);
+
+        if (pProp == 0)
+        {
+            return DEVICE_INVALID_PROPERTY;
+        }
+        else if (pProp->GetReadOnly())
+        {
+            return DEVICE_PROPERTY_READ_ONLY;
+        }
+        else if (!pProp->IsAllowed(value) || !pProp->Set(value))
+        {
+            return DEVICE_INVALID_PROPERTY_VALUE;
+        }
+
+        return pProp->Apply();
+    }
+    /*------------------------------------------------------------------------*/
+    virtual int GetProperty(const char* name, char* value) const
+    {
+        std::string str;
+
+        int ret = getProperty(name, str);
+        if (ret == DEVICE_OK)
+        {
+            CDeviceUtils::CopyLimitedString(value, str.c_str());
+        }
+
+        return ret;
+    }
+    /*------------------------------------------------------------------------*/
+    int GetProperty(const char* name, long& value) const
+    {
+        std::string str;
+
+        int ret = getProperty(name, str);
+        value = std::atol(str.c_str());
+
+        return ret;
+    }
+    /*------------------------------------------------------------------------*/
+    int GetProperty(const char* name, double& value) const
+    {
+        std::string str;
+
+        int ret = getProperty(name, str);
+        value = std::atof(str.c_str());
+
+        return ret;
+    }
+    /*------------------------------------------------------------------------*/
+    virtual unsigned GetNumberOfPropertyValues(const char* name) const
+    {
+        CMockProperty* pProp = find(name);
+        return pProp != 0 ? static_cast<unsigned>(pProp->AllowedValues().size()) : 0;
+    }
+
+protected:
+    int CreateProperty(const char* name, const char* value,
+        MM::PropertyType type, bool readOnly, ActionFunctor* action = 0,
+        bool /*preInit*/ = false)
+    {
+        if (HasProperty(name))
+        {
+            delete action;
+            return DEVICE_DUPLICATE_PROPERTY;
+        }
+
+        CMockProperty* pProp = new CMockProperty(type, readOnly, action);
+        pProp->Set(value);
+        properties_[name] = pProp;
+
+        return DEVICE_OK;
+    }
+    /*------------------------------------------------------------------------*/
+    int CreateStringProperty(const char* name, const char* value,
+        bool readOnly, ActionFunctor* action = 0, bool preInit = false)
+    {
+        return CreateProperty(name, value, MM::String, readOnly, action, preInit);
+    }
+    /*------------------------------------------------------------------------*/
+    int CreateIntegerProperty(const char* name, long value, bool readOnly,
+        ActionFunctor* action = 0, bool preInit = false)
+    {
+        char buf[64];
+        std::snprintf(buf, sizeof(buf), "%ld", value);
+
+        return CreateProperty(name, buf, MM::Integer, readOnly, action, preInit);
+    }
+    /*------------------------------------------------------------------------*/
+    int CreateFloatProperty(const char* name, double value, bool readOnly,
+        ActionFunctor* action = 0, bool preInit = false)
+    {
+        char buf[64];
+        std::snprintf(buf, sizeof(buf), "%.4f", value);
+
+        return CreateProperty(name, buf, MM::Float, readOnly, action, preInit);
+    }
+    /*------------------------------------------------------------------------*/
+    int SetPropertyLimits(const char* name, double lower, double upper)
+    {
+        CMockProperty* pProp = find(name);
+
+        if (pProp == 0)
+        {
+            return DEVICE_INVALID_PROPERTY;
+        }
+
+        return pProp->SetLimits(lower, upper) ? DEVICE_OK :
+            DEVICE_INVALID_PROPERTY_TYPE;
+    }
+    /*------------------------------------------------------------------------*/
+    int SetAllowedValues(const char* name, std::vector<std::string>& values)
+    {
+        CMockProperty* pProp = find(name);
+
+        if (pProp == 0)
+        {
+            return DEVICE_INVALID_PROPERTY;
+        }
+
+        pProp->AllowedValues() = values;
+        return DEVICE_OK;
+    }
+    /*------------------------------------------------------------------------*/
+    int AddAllowedValue(const char* name, const char* value)
+    {
+        CMockProperty* pProp = find(name);
+
+        if (pProp == 0)
+        {
+            return DEVICE_INVALID_PROPERTY;
+        }
+
+        pProp->AllowedValues().push_back(value);
+        return DEVICE_OK;
+    }
+    /*------------------------------------------------------------------------*/
+    int ClearAllowedValues(const char* name)
+    {
+        CMockProperty* pProp = find(name);
+
+        if (pProp == 0)
+        {
+            return DEVICE_INVALID_PROPERTY;
+        }
+
+        pProp->AllowedValues().clear();
+        return DEVICE_OK;
+    }
+    /*------------------------------------------------------------------------*/
+    void SetErrorText(int code, const char* text)
+    {
+        errorText_[code] = text;
+    }
+    /*------------------------------------------------------------------------*/
+    void InitializeDefaultErrorMessages()
+    {
+        SetErrorText(DEVICE_ERR, "Unknown error in the device");
+        SetErrorText(DEVICE_INVALID_PROPERTY, "Invalid property name encountered");
+        SetErrorText(DEVICE_INVALID_PROPERTY_VALUE, "Invalid property value");
+        SetErrorText(DEVICE_PROPERTY_READ_ONLY, "Property is read-only");
+        SetErrorText(DEVICE_NOT_CONNECTED, "Device is not connected");
+    }
+    /*------------------------------------------------------------------------*/
+    int LogMessage(const std::string& msg, bool debugOnly = false) const
+    {
+        return LogMessage(msg.c_str(), debugOnly);
+    }
+    /*------------------------------------------------------------------------*/
+    int LogMessage(const char* msg, bool debugOnly = false) const
+    {
+        return callback_ != 0 ? callback_->LogMessage(this, msg, debugOnly) :
+            DEVICE_OK;
+    }
+    /*------------------------------------------------------------------------*/
+    int OnPropertyChanged(const char* name, const char* value)
+    {
+        return callback_ != 0 ? callback_->OnPropertyChanged(this, name, value) :
+            DEVICE_OK;
+    }
+    /*------------------------------------------------------------------------*/
+    MM::MMTime GetCurrentMMTime()
+    {
+        return callback_ != 0 ? callback_->GetCurrentMMTime() : MM::MMTime();
+    }
+
+private:
+    CMockProperty* find(const char* name) const
+    {
+        std::map<std::string, CMockProperty*>::const_iterator it =
+            properties_.find(name);
+        return it != properties_.end() ? it->second : 0;
+    }
+    /*------------------------------------------------------------------------*/
+    // a get runs the property's BeforeGet first, as the core's does
+    int getProperty(const char* name, std::string& value) const
+    {
+        CMockProperty* pProp = find(name);
+
+        if (pProp == 0)
+        {
+            return DEVICE_INVALID_PROPERTY;
+        }
+
+        int ret = pProp->Update();
+        if (ret == DEVICE_OK)
+        {
+            pProp->Get(value);
+        }
+
+        return ret;
+    }
+
+    std::map<std::string, CMockProperty*> properties_;
+    std::map<int, std::string> errorText_;
+    MM::Core* callback_;
+};
+/*============================================================================*/
+template <class U>
+class CShutterBase : public CDeviceBase<MM::Shutter, U>
+{
+public:
+    virtual MM::DeviceType GetType() const { return MM::ShutterDevice; }
+};
+
+#endif
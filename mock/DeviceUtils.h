@@ -0,0 +1,45 @@
+////////////////////////////////////////////////////////////////////////////////
+// FILE:          DeviceUtils.h
+// PROJECT:       Micro-Manager
+// SUBSYSTEM:     DeviceAdapters
+//-----------------------------------------------------------------------------
+// DESCRIPTION:   Stand-in for MMDevice's DeviceUtils.h, see mock/MMDevice.h
+//
+// AUTHOR:        Scottie Alexander, scottiealexander11@gmail.com
+//
+// COPYRIGHT:     University of California, Davis, 2016
+//
+// LICENSE:       This file is distributed under the BSD license.
+//                License text is included with the source distribution.
+//
+//                This file is distributed in the hope that it will be useful,
+//                but WITHOUT ANY WARRANTY; without even the implied warranty
+//                of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+//
+//                IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+//                CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+//                INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES.
+
+#pragma once
+#ifndef _DEVICEUTILS_H_
+#define _DEVICEUTILS_H_
+
+#include <cstring>
+
+#include "MMDevice.h"
+
+/*============================================================================*/
+class CDeviceUtils
+{
+public:
+    // copies at most MM::MaxStrLength - 1 characters, always terminated
+    static bool CopyLimitedString(char* dest, const char* src)
+    {
+        std::strncpy(dest, src, MM::MaxStrLength - 1);
+        dest[MM::MaxStrLength - 1] = '\0';
+
+        return std::strlen(src) < static_cast<std::size_t>(MM::MaxStrLength);
+    }
+};
+
+#endif
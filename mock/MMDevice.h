@@ -0,0 +1,149 @@
+////////////////////////////////////////////////////////////////////////////////
+// FILE:          MMDevice.h
+// PROJECT:       Micro-Manager
+// SUBSYSTEM:     DeviceAdapters
+//-----------------------------------------------------------------------------
+// DESCRIPTION:   Minimal stand-in for the Micro-Manager device interface, so
+//                the test console can host the adapter without the core
+//
+// AUTHOR:        Scottie Alexander, scottiealexander11@gmail.com
+//
+// COPYRIGHT:     University of California, Davis, 2016
+//
+// LICENSE:       This file is distributed under the BSD license.
+//                License text is included with the source distribution.
+//
+//                This file is distributed in the hope that it will be useful,
+//                but WITHOUT ANY WARRANTY; without even the implied warranty
+//                of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+//
+//                IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+//                CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+//                INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES.
+
+/*GIST
+  The headers in mock/ replace MMDevice's DeviceBase.h, DeviceUtils.h and
+  ModuleInterface.h for the test console's property benchmark (build with
+  -DBK9130B_MOCK_CORE -Imock, see test_console.cpp). They only cover what
+  BK9130B.cpp uses, and do it the way MMDevice does: every property holds its
+  value as a string, numbers are formatted / parsed on every set / get, a set
+  checks read-only, allowed values and limits before the action's AfterSet,
+  and a get runs the action's BeforeGet first. Log messages, property change
+  notifications and the time go to an MM::Core the host provides.
+
+  Nothing here is used by the adapter proper, which builds against the real
+  MMDevice.
+*/
+#pragma once
+#ifndef _MMDEVICE_H_
+#define _MMDEVICE_H_
+
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+
+/*------------------------------------------------------------------------------
+  Error codes (the subset BK9130B.cpp uses, same values as MMDevice)
+------------------------------------------------------------------------------*/
+#define DEVICE_OK                      0
+#define DEVICE_ERR                     1
+#define DEVICE_INVALID_PROPERTY        2
+#define DEVICE_INVALID_PROPERTY_VALUE  3
+#define DEVICE_DUPLICATE_PROPERTY      4
+#define DEVICE_INVALID_PROPERTY_TYPE   5
+#define DEVICE_UNSUPPORTED_COMMAND     11
+#define DEVICE_NOT_CONNECTED           27
+#define DEVICE_PROPERTY_READ_ONLY      34
+
+namespace MM {
+
+const int MaxStrLength = 1024;
+const char* const g_Keyword_Description = "Description";
+
+enum DeviceType { UnknownType, ShutterDevice };
+enum PropertyType { Undef, String, Float, Integer };
+enum ActionType
+{
+    NoAction, BeforeGet, AfterSet, IsSequenceable, AfterLoadSequence,
+    StartSequence, StopSequence
+};
+
+/*============================================================================*/
+struct MMTime
+{
+    explicit MMTime(double us = 0.0) : us_(us) {}
+
+    double getMsec() const { return us_ / 1000.0; }
+    double getUsec() const { return us_; }
+
+private:
+    double us_;
+};
+
+/*============================================================================*/
+class PropertyBase
+{
+public:
+    virtual ~PropertyBase() {}
+
+    virtual bool Set(const char* value) = 0;
+    virtual bool Set(long value) = 0;
+    virtual bool Set(double value) = 0;
+
+    virtual bool Get(std::string& value) const = 0;
+    virtual bool Get(long& value) const = 0;
+    virtual bool Get(double& value) const = 0;
+
+    virtual void SetSequenceable(long maxSize) = 0;
+    virtual std::vector<std::string> GetSequence() const = 0;
+};
+
+class Device;
+
+/*============================================================================*/
+// what the device calls back into, implemented by the host
+class Core
+{
+public:
+    virtual ~Core() {}
+
+    virtual int LogMessage(const Device* caller, const char* msg,
+        bool debugOnly) = 0;
+    virtual int OnPropertyChanged(const Device* caller, const char* name,
+        const char* value) = 0;
+    virtual MMTime GetCurrentMMTime() = 0;
+};
+
+/*============================================================================*/
+class Device
+{
+public:
+    virtual ~Device() {}
+
+    virtual int Initialize() = 0;
+    virtual int Shutdown() = 0;
+    virtual void GetName(char* name) const = 0;
+    virtual bool Busy() = 0;
+    virtual DeviceType GetType() const = 0;
+
+    virtual bool HasProperty(const char* name) const = 0;
+    virtual int SetProperty(const char* name, const char* value) = 0;
+    virtual int GetProperty(const char* name, char* value) const = 0;
+    virtual unsigned GetNumberOfPropertyValues(const char* name) const = 0;
+
+    virtual void SetCallback(Core* core) = 0;
+};
+
+/*============================================================================*/
+class Shutter : public Device
+{
+public:
+    virtual int SetOpen(bool open = true) = 0;
+    virtual int GetOpen(bool& open) = 0;
+    virtual int Fire(double deltaT) = 0;
+};
+
+} // namespace MM
+
+#endif
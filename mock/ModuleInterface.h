@@ -0,0 +1,43 @@
+////////////////////////////////////////////////////////////////////////////////
+// FILE:          ModuleInterface.h
+// PROJECT:       Micro-Manager
+// SUBSYSTEM:     DeviceAdapters
+//-----------------------------------------------------------------------------
+// DESCRIPTION:   Stand-in for MMDevice's ModuleInterface.h, see
+//                mock/MMDevice.h
+//
+// AUTHOR:        Scottie Alexander, scottiealexander11@gmail.com
+//
+// COPYRIGHT:     University of California, Davis, 2016
+//
+// LICENSE:       This file is distributed under the BSD license.
+//                License text is included with the source distribution.
+//
+//                This file is distributed in the hope that it will be useful,
+//                but WITHOUT ANY WARRANTY; without even the implied warranty
+//                of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+//
+//                IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+//                CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+//                INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES.
+
+#pragma once
+#ifndef _MODULEINTERFACE_H_
+#define _MODULEINTERFACE_H_
+
+#include "DeviceBase.h"
+
+// the adapter is linked into the host, nothing to export
+#define MODULE_API
+
+MODULE_API void InitializeModuleData();
+MODULE_API MM::Device* CreateDevice(const char* name);
+MODULE_API void DeleteDevice(MM::Device* device);
+
+// the host has nothing to list the devices in
+inline void RegisterDevice(const char* /*name*/, MM::DeviceType /*type*/,
+    const char* /*description*/)
+{
+}
+
+#endif
@@ -6,6 +6,22 @@
     <VISA_LIB> = path to NI-VISA library directory
     g++ -std=c++11 -I. -I${VISA_INCLUDE} -L${VISA_LIB} -o \
     test_console test_console.cpp -lvisa64
+    (add -lpsapi on Windows, for the soak test's memory counters, and
+    -pthread on Linux)
+
+  Build against simulated instruments (see VISASimulator.h), which needs
+  visa.h but not the library:
+    g++ -std=c++11 -DVISA_SIMULATOR -I. -I${VISA_INCLUDE} -o \
+    test_console test_console.cpp
+
+  Add the property benchmark, which hosts the adapter itself on a mock of
+  the Micro-Manager device API (see mock/MMDevice.h):
+    g++ -std=c++11 -DVISA_SIMULATOR -DBK9130B_MOCK_CORE -Imock -I. \
+    -I${VISA_INCLUDE} -o test_console test_console.cpp BK9130B.cpp
+
+  Usage:
+    test_console - interactive console on the first USB instrument
+    test_console bench <mode> [<args>] - benchmarks, see benchUsage()
 
   Updated: 2016-07-08
 
@@ -24,15 +40,137 @@
            CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
            INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES.
 ------------------------------------------------------------------------------*/
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <cstdlib>
+#include <deque>
+#include <fstream>
 #include <iostream>
 #include <istream>
+#include <mutex>
+#include <new>
+#include <sstream>
+#include <thread>
 #include <vector>
 #include <string>
 
 // requires c++11 (or linking with boost)
 #include <regex>
 
+#ifdef _WIN32
+    #include <windows.h>
+    #include <psapi.h>
+#else
+    #include <dirent.h>
+    #include <sys/resource.h>
+    #include <unistd.h>
+#endif
+
 #include "VISADevice.h"
+#include "VISADispatch.h"
+#include "VISAFaults.h"
+#include "VISAGroup.h"
+#include "VISAScheduler.h"
+#include "VISATelemetry.h"
+
+#ifdef VISA_SIMULATOR
+    #include "VISASimulator.h"
+#endif
+
+#ifdef BK9130B_MOCK_CORE
+    #include "ModuleInterface.h"
+#endif
+
+/*----------------------------------------------------------------------------*/
+// every heap allocation in the process, for the soak test: every form of
+// the global operator new / delete is replaced, so that all of them are
+// counted and all of them pair malloc() with free(). They are kept out of
+// line: GCC otherwise inlines free() into a delete expression and warns that
+// it does not match the new (-Wmismatched-new-delete).
+#ifdef _MSC_VER
+    #define ALLOC_NOINLINE __declspec(noinline)
+#else
+    #define ALLOC_NOINLINE __attribute__((noinline))
+#endif
+
+static std::atomic<unsigned long long> g_allocations(0);
+
+// and those of the calling thread, for the property test
+static thread_local unsigned long long t_allocations = 0;
+
+static void* countedAlloc(std::size_t size) noexcept
+{
+    ++g_allocations;
+    ++t_allocations;
+    return std::malloc(size > 0 ? size : 1);
+}
+
+ALLOC_NOINLINE void* operator new(std::size_t size)
+{
+    void* p = countedAlloc(size);
+    if (p == 0)
+    {
+        throw std::bad_alloc();
+    }
+
+    return p;
+}
+
+ALLOC_NOINLINE void* operator new[](std::size_t size)
+{
+    void* p = countedAlloc(size);
+    if (p == 0)
+    {
+        throw std::bad_alloc();
+    }
+
+    return p;
+}
+
+ALLOC_NOINLINE void* operator new(std::size_t size, const std::nothrow_t&) noexcept
+{
+    return countedAlloc(size);
+}
+
+ALLOC_NOINLINE void* operator new[](std::size_t size, const std::nothrow_t&) noexcept
+{
+    return countedAlloc(size);
+}
+
+ALLOC_NOINLINE void operator delete(void* p) noexcept
+{
+    std::free(p);
+}
+
+ALLOC_NOINLINE void operator delete[](void* p) noexcept
+{
+    std::free(p);
+}
+
+ALLOC_NOINLINE void operator delete(void* p, const std::nothrow_t&) noexcept
+{
+    std::free(p);
+}
+
+ALLOC_NOINLINE void operator delete[](void* p, const std::nothrow_t&) noexcept
+{
+    std::free(p);
+}
+
+#if defined(__cpp_sized_deallocation) || (defined(_MSC_VER) && _MSC_VER >= 1900)
+ALLOC_NOINLINE void operator delete(void* p, std::size_t) noexcept
+{
+    std::free(p);
+}
+
+ALLOC_NOINLINE void operator delete[](void* p, std::size_t) noexcept
+{
+    std::free(p);
+}
+#endif
 
 /*----------------------------------------------------------------------------*/
 void logMessage(const std::string& msg, const std::string& prefix = "[REC]: ",
@@ -49,6 +187,7 @@ void usage()
     "r - read from device\n\t"
     "w <msg> - write <msg> to device\n\t"
     "q <msg> - write <msg> to device and read reply\n\t"
+    "s <ops> [<report>] - soak test: <ops> query batches, a report every <report>\n\t"
     "h - print this help message\n\t"
     "exit - exit console\n"
     "------------------------------------------------------\n";
@@ -77,11 +216,223 @@ char parseMessage(const std::string& imsg, std::string& omsg)
     return cmd;
 }
 /*----------------------------------------------------------------------------*/
-int main()
+// resident set size of this process in KB, 0 if unknown
+unsigned long residentKB()
 {
+#ifdef _WIN32
+    PROCESS_MEMORY_COUNTERS pmc;
+    if (GetProcessMemoryInfo(GetCurrentProcess(), &pmc, sizeof(pmc)))
+    {
+        return static_cast<unsigned long>(pmc.WorkingSetSize / 1024);
+    }
 
-    VISADevice dev;
+    return 0;
+#else
+    unsigned long size = 0, resident = 0;
+    std::ifstream statm("/proc/self/statm");
+
+    if (statm >> size >> resident)
+    {
+        return resident * (sysconf(_SC_PAGESIZE) / 1024);
+    }
+
+    return 0;
+#endif
+}
+/*----------------------------------------------------------------------------*/
+// open handles (file descriptors on POSIX) of this process, 0 if unknown
+unsigned long handleCount()
+{
+#ifdef _WIN32
+    DWORD count = 0;
+    GetProcessHandleCount(GetCurrentProcess(), &count);
+
+    return count;
+#else
+    unsigned long count = 0;
+    DIR* dir = opendir("/proc/self/fd");
+
+    if (dir != 0)
+    {
+        while (readdir(dir) != 0)
+        {
+            ++count;
+        }
 
+        closedir(dir);
+    }
+
+    // ".", ".." and the one opendir() itself used
+    return count > 3 ? count - 3 : 0;
+#endif
+}
+/*----------------------------------------------------------------------------*/
+// user + system CPU time used by this process so far, in s
+double cpuSeconds()
+{
+#ifdef _WIN32
+    FILETIME created, exited, kernel, user;
+    if (GetProcessTimes(GetCurrentProcess(), &created, &exited, &kernel, &user))
+    {
+        ULARGE_INTEGER k, u;
+        k.LowPart = kernel.dwLowDateTime;
+        k.HighPart = kernel.dwHighDateTime;
+        u.LowPart = user.dwLowDateTime;
+        u.HighPart = user.dwHighDateTime;
+
+        // 100 ns units
+        return (k.QuadPart + u.QuadPart) / 1e7;
+    }
+
+    return 0.0;
+#else
+    rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) == 0)
+    {
+        return usage.ru_utime.tv_sec + usage.ru_stime.tv_sec +
+            (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
+    }
+
+    return 0.0;
+#endif
+}
+/*----------------------------------------------------------------------------*/
+// the <p> (0 - 1) quantile of <v>, which is sorted in place, 0 if empty
+double percentile(std::vector<double>& v, double p)
+{
+    if (v.empty())
+    {
+        return 0.0;
+    }
+
+    std::sort(v.begin(), v.end());
+
+    return v[std::min(v.size() - 1, static_cast<std::size_t>(p * v.size()))];
+}
+/*----------------------------------------------------------------------------*/
+double elapsedUs(std::chrono::steady_clock::time_point t0,
+    std::chrono::steady_clock::time_point t1)
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        t1 - t0).count() / 1000.0;
+}
+/*----------------------------------------------------------------------------*/
+// true if each of the last <n> values is larger than the one before
+bool growing(const std::vector<double>& history, std::size_t n = 5)
+{
+    if (history.size() <= n)
+    {
+        return false;
+    }
+
+    for (std::size_t k = history.size() - n; k < history.size(); ++k)
+    {
+        if (history[k] <= history[k - 1])
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
+/*----------------------------------------------------------------------------*/
+/**
+* Soak test: runs <ops> batches of read-only queries (the path the adapter
+* polls on, see VISADevice::queryBatch()) plus an instrument search every
+* <report> ops, to catch VISA handle leaks. Every <report> ops it prints the
+* RSS, open handles, heap allocations per op and the latency percentiles of
+* that stretch, and flags any of RSS, handles or p99 latency that grew in
+* each of the last 5 reports.
+*/
+void soak(VISADevice& dev, unsigned long long ops, unsigned long long report)
+{
+    typedef std::chrono::steady_clock Clock;
+
+    const char* queries[] = {"MEAS:VOLT:ALL?", "MEAS:CURR:ALL?", "APP:OUT?"};
+    const std::size_t nQuery = sizeof(queries) / sizeof(queries[0]);
+
+    std::vector<std::string> msgs(queries, queries + nQuery);
+    std::vector<std::string> replies;
+
+    std::vector<double> latency;
+    latency.reserve(report);
+
+    std::vector<double> rssHistory, handleHistory, p99History;
+    unsigned long long failed = 0;
+
+    unsigned long long allocs = g_allocations.load();
+
+    for (unsigned long long k = 1; k <= ops; ++k)
+    {
+        Clock::time_point t0 = Clock::now();
+        dev.queryBatch(msgs, replies);
+        Clock::time_point t1 = Clock::now();
+
+        latency.push_back(std::chrono::duration_cast<
+            std::chrono::nanoseconds>(t1 - t0).count() / 1000.0);
+
+        for (std::size_t j = 0; j < replies.size(); ++j)
+        {
+            if (replies[j].empty())
+            {
+                ++failed;
+                break;
+            }
+        }
+
+        if (k % report != 0 && k != ops)
+        {
+            continue;
+        }
+
+        dev.findInstruments("USB?*");
+
+        unsigned long long now = g_allocations.load();
+        double perOp = static_cast<double>(now - allocs) / latency.size();
+
+        std::sort(latency.begin(), latency.end());
+        std::size_t n = latency.size();
+
+        double p50 = latency[n / 2];
+        double p99 = latency[std::min(n - 1, n * 99 / 100)];
+        double p999 = latency[std::min(n - 1, n * 999 / 1000)];
+
+        rssHistory.push_back(static_cast<double>(residentKB()));
+        handleHistory.push_back(static_cast<double>(handleCount()));
+        p99History.push_back(p99);
+
+        std::ostringstream msg;
+        msg << k << " ops, " << failed << " failed, RSS "
+            << rssHistory.back() << " KB, " << handleHistory.back()
+            << " handles, " << perOp << " allocs/op, latency (us) p50 "
+            << p50 << " p99 " << p99 << " p99.9 " << p999 << " max "
+            << latency.back();
+
+        logMessage(msg.str(), "[SOAK]: ");
+
+        if (growing(rssHistory))
+        {
+            logMessage("RSS has grown in each of the last 5 reports", "[WARN]: ");
+        }
+
+        if (growing(handleHistory))
+        {
+            logMessage("open handles have grown in each of the last 5 reports", "[WARN]: ");
+        }
+
+        if (growing(p99History))
+        {
+            logMessage("p99 latency has grown in each of the last 5 reports", "[WARN]: ");
+        }
+
+        latency.clear();
+        allocs = g_allocations.load();
+    }
+}
+/*----------------------------------------------------------------------------*/
+// opens the first USB instrument, returns 0 or the exit code for main()
+int openFirst(VISADevice& dev)
+{
     // only look for USB devices
     std::vector<std::string> inst = dev.findInstruments("USB?*");
 
@@ -100,55 +451,1654 @@ int main()
     logMessage("Connected to device - " + dev.getDeviceDescription(),
         "[IFO]: ");
 
-    dev.onClose({
-        "INST:SEL CH1",
-        "SOUR:CHAN:OUTP:STAT OFF",
-        "INST:SEL CH2",
-        "SOUR:CHAN:OUTP:STAT OFF",
-        "INST:SEL CH3",
-        "SOUR:CHAN:OUTP:STAT OFF"
-    });
+    return 0;
+}
+/*----------------------------------------------------------------------------*/
+/**
+* One run of the jitter test (see jitter()), <load> busy threads compete
+* with the scheduler thread, which is set up with <config>
+*/
+void jitterRun(VISADevice& dev, const std::string& name,
+    const VISAThreadConfig& config, std::size_t load, std::size_t entries,
+    double period)
+{
+    std::atomic<bool> running(true);
+    std::vector<std::thread> threads;
 
-    // print console usage
-    usage();
+    for (std::size_t k = 0; k < load; ++k)
+    {
+        threads.push_back(std::thread([&running]() {
+            volatile unsigned long long spins = 0;
+            while (running)
+            {
+                ++spins;
+            }
+        }));
+    }
 
-    std::string msg;
+    VISAScheduler sched(dev);
+    sched.setConfig(config);
+    sched.start();
 
-    while (std::cin)
+    // *CLS changes nothing that matters to a supply's outputs
+    const std::vector<std::string> cmd(1, "*CLS");
+
+    sched.resetClock();
+    for (std::size_t k = 0; k < entries; ++k)
     {
-		std::cout << ">>> ";
+        sched.schedule(10.0 + k * period, cmd);
+    }
 
-        std::getline(std::cin, msg);
+    while (sched.getStats().count < entries)
+    {
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
 
-		if (msg == "exit")
-		{
-			break;
-		}
-		else
-		{
-            std::string omsg;
-            char cmd = parseMessage(msg, omsg);
+    std::string error = sched.getConfigError();
+    sched.stop();
 
-			switch (cmd)
+    running = false;
+    for (std::size_t k = 0; k < threads.size(); ++k)
+    {
+        threads[k].join();
+    }
+
+    VISAScheduler::Stats stats = sched.getStats();
+    std::vector<VISAScheduler::Record> records = sched.getRecords();
+
+    std::vector<double> err;
+    for (std::size_t k = 0; k < records.size(); ++k)
+    {
+        err.push_back(fabs(records[k].actual - records[k].requested) * 1000.0);
+    }
+
+    std::ostringstream msg;
+    msg.setf(std::ios::fixed);
+    msg.precision(1);
+    msg << name << ": " << stats.count << " entries, " << stats.failed
+        << " failed, error (us) mean " << stats.meanError << " rms "
+        << stats.rmsError << " max " << stats.maxAbsError << ", |error| (us) p50 "
+        << percentile(err, 0.5) << " p99 " << percentile(err, 0.99)
+        << ", write latency " << stats.writeLatency << " us";
+
+    logMessage(msg.str(), "[JITTER]: ");
+
+    if (!error.empty())
+    {
+        logMessage(name + ": " + error, "[WARN]: ");
+    }
+}
+/*----------------------------------------------------------------------------*/
+/**
+* Jitter test: schedules <entries> writes <period> ms apart on a
+* VISAScheduler (the thread the adapter's schedule and pulse timing run on)
+* and reports how far from the requested time each write completed, three
+* times: idle, with a busy thread per core, and with the busy threads but
+* the scheduler pinned to <cpu>, at real-time <priority> and with the
+* process memory locked (the tuned run goes last, memory stays locked).
+* Real-time priority and memory locking usually need privileges, failures
+* are reported and the run goes ahead untuned.
+*/
+void jitter(VISADevice& dev, std::size_t entries, double period, int cpu,
+    int priority)
+{
+    std::size_t cores = std::thread::hardware_concurrency();
+    cores = cores > 0 ? cores : 1;
+
+    VISAThreadConfig untuned;
+    jitterRun(dev, "untuned, idle", untuned, 0, entries, period);
+    jitterRun(dev, "untuned, loaded", untuned, cores, entries, period);
+
+    std::string error;
+    if (!VISAWorker::lockMemory(error))
+    {
+        logMessage(error, "[WARN]: ");
+    }
+
+    VISAThreadConfig tuned;
+    tuned.cpu = cpu;
+    tuned.priority = priority;
+
+    jitterRun(dev, "tuned, loaded", tuned, cores, entries, period);
+}
+/*----------------------------------------------------------------------------*/
+// the state watcher's poll batch, see BK9130B::pollState()
+const char* g_pollQueries[] = {"APP:VOLT?", "APP:CURR?", "APP:OUT?",
+    "MEAS:VOLT:ALL?", "MEAS:CURR:ALL?", "INST:SEL?"};
+
+// one instrument of the scale test, driven the way BK9130B drives it
+struct ScaleDevice
+{
+    ScaleDevice() : dispatcher(dev), failed(0) {}
+
+    VISADevice dev;
+    VISADispatcher dispatcher;
+
+    std::vector<double> control;    // latency (us) of each control op
+    std::vector<double> poll;       // latency (us) of each poll batch
+    unsigned long long failed;
+};
+/*----------------------------------------------------------------------------*/
+/**
+* Scale test: for 1, 2, 4, ... <max> instruments (simulated ones when built
+* with VISA_SIMULATOR), runs the adapter's two workloads on every instrument
+* at once for <seconds>:
+*   control   - a setpoint write then an INST:SEL? query, back to back,
+*               through the instrument's VISADispatcher on the shared I/O
+*               pool (the property handler path)
+*   telemetry - the state watcher's poll batch every <interval> ms (the
+*               burst interval it polls at while commands keep coming), from
+*               a thread per instrument
+* Flow control is on (window 16), as with the adapter's flow control
+* property set, so queries read as soon as the reply arrives.
+*
+* Reports the aggregate commands per second, the p50 / p99 latency of
+* control ops and poll batches over every instrument and the p99 of the
+* worst instrument, and the process CPU time per second of wall time. Then
+* times 20 VISAGroup writes to all of them (the group device's path): the
+* duration until the last instrument finished and the skew between the first
+* and the last.
+*/
+void scale(std::size_t max, double seconds, long interval)
+{
+    typedef std::chrono::steady_clock Clock;
+
+#ifdef VISA_SIMULATOR
+    VISASimulator::instance().setInstruments(max);
+#endif
+
+    std::vector<std::string> rsrc = VISADevice().findInstruments("USB?*");
+
+    if (rsrc.size() < max)
+    {
+        std::ostringstream msg;
+        msg << "only " << rsrc.size() << " instruments found";
+        logMessage(msg.str(), "[WARN]: ");
+
+        max = rsrc.size();
+    }
+
+    std::vector<std::size_t> steps;
+    for (std::size_t n = 1; n < max; n *= 2)
+    {
+        steps.push_back(n);
+    }
+
+    if (max > 0)
+    {
+        steps.push_back(max);
+    }
+
+    const std::size_t nPoll = sizeof(g_pollQueries) / sizeof(g_pollQueries[0]);
+    const std::vector<std::string> polls(g_pollQueries, g_pollQueries + nPoll);
+
+    VISAIOPool& pool = VISAIOPool::acquireShared();
+
+    for (std::size_t s = 0; s < steps.size(); ++s)
+    {
+        const std::size_t n = steps[s];
+
+        std::vector<ScaleDevice*> devs;
+        for (std::size_t k = 0; k < n; ++k)
+        {
+            ScaleDevice* d = new ScaleDevice;
+
+            if (!d->dev.open(rsrc[k]))
             {
-                case 'r':
-                case 'R':
-                    logMessage("...", "[READ]");
-                    logMessage(dev.read());
-                    break;
-                case 'w':
-                case 'W':
-                    logMessage(omsg, "[WRITE]: ");
-                    if (!dev.write(omsg))
+                logMessage(rsrc[k] + ": " + d->dev.getLastError(), "[ERROR]: ",
+                    std::cerr);
+                delete d;
+                continue;
+            }
+
+            d->dev.setFlowControl(16);
+            d->dispatcher.attach(pool);
+            devs.push_back(d);
+        }
+
+        std::atomic<bool> running(true);
+        std::vector<std::thread> threads;
+
+        double cpu0 = cpuSeconds();
+        Clock::time_point start = Clock::now();
+
+        for (std::size_t k = 0; k < devs.size(); ++k)
+        {
+            ScaleDevice* d = devs[k];
+
+            threads.push_back(std::thread([d, &running]() {
+                const char* setpoints[] = {"SOUR:VOLT 1.000", "SOUR:VOLT 2.000"};
+
+                for (unsigned long j = 0; running; ++j)
+                {
+                    Clock::time_point t0 = Clock::now();
+                    bool success = d->dispatcher.write(setpoints[j & 1]);
+                    Clock::time_point t1 = Clock::now();
+                    success = !d->dispatcher.query("INST:SEL?").empty() &&
+                        success;
+                    Clock::time_point t2 = Clock::now();
+
+                    d->control.push_back(elapsedUs(t0, t1));
+                    d->control.push_back(elapsedUs(t1, t2));
+
+                    if (!success)
                     {
-                        logMessage(dev.getLastError(), "[ERROR]: ", std::cerr);
+                        ++d->failed;
                     }
+                }
+            }));
+
+            threads.push_back(std::thread([d, &running, &polls, interval]() {
+                std::vector<std::string> replies;
+                Clock::time_point next = Clock::now();
+
+                while (running)
+                {
+                    Clock::time_point t0 = Clock::now();
+                    d->dev.queryBatch(polls, replies);
+                    d->poll.push_back(elapsedUs(t0, Clock::now()));
+
+                    next += std::chrono::milliseconds(interval);
+                    std::this_thread::sleep_until(next);
+
+                    for (std::size_t j = 0; j < replies.size(); ++j)
+                    {
+                        if (replies[j].empty())
+                        {
+                            ++d->failed;
+                            break;
+                        }
+                    }
+                }
+            }));
+        }
+
+        std::this_thread::sleep_for(std::chrono::milliseconds(
+            static_cast<long long>(seconds * 1000.0)));
+        running = false;
+
+        for (std::size_t k = 0; k < threads.size(); ++k)
+        {
+            threads[k].join();
+        }
+
+        double wall = elapsedUs(start, Clock::now()) / 1e6;
+        double cpu = cpuSeconds() - cpu0;
+
+        std::vector<double> control, poll;
+        double worstControl = 0.0, worstPoll = 0.0;
+        unsigned long long failed = 0;
+
+        for (std::size_t k = 0; k < devs.size(); ++k)
+        {
+            ScaleDevice* d = devs[k];
+
+            control.insert(control.end(), d->control.begin(), d->control.end());
+            poll.insert(poll.end(), d->poll.begin(), d->poll.end());
+            failed += d->failed;
+
+            worstControl = std::max(worstControl, percentile(d->control, 0.99));
+            worstPoll = std::max(worstPoll, percentile(d->poll, 0.99));
+
+            delete d;
+        }
+
+        double commands = control.size() + nPoll * poll.size();
+
+        std::ostringstream msg;
+        msg.setf(std::ios::fixed);
+        msg.precision(0);
+        msg << devs.size() << " devices: " << commands / wall
+            << " cmds/s, control (us) p50 " << percentile(control, 0.5)
+            << " p99 " << percentile(control, 0.99) << " worst device p99 "
+            << worstControl << ", poll (us) p50 " << percentile(poll, 0.5)
+            << " p99 " << percentile(poll, 0.99) << " worst device p99 "
+            << worstPoll;
+        msg.precision(3);
+        msg << ", CPU " << cpu / wall << " s/s, " << failed << " failed";
+
+        logMessage(msg.str(), "[SCALE]: ");
+
+        VISAGroup group;
+        for (std::size_t k = 0; k < devs.size(); ++k)
+        {
+            if (!group.add(rsrc[k]))
+            {
+                logMessage(group.getLastError(), "[ERROR]: ", std::cerr);
+            }
+        }
+
+        std::vector<double> duration, skew;
+        const std::vector<std::string> cmd(1, "SOUR:VOLT 1.000");
+
+        for (int k = 0; k < 20 && group.size() > 0; ++k)
+        {
+            if (group.writeAll(cmd))
+            {
+                duration.push_back(group.getLastDuration());
+                skew.push_back(group.getLastSkew());
+            }
+
+            // a shutter does not toggle back to back, and the instruments
+            // need to keep up
+            std::this_thread::sleep_for(std::chrono::milliseconds(2));
+        }
+
+        std::ostringstream gmsg;
+        gmsg.setf(std::ios::fixed);
+        gmsg.precision(0);
+        gmsg << group.size() << " devices: group write (us) p50 "
+            << percentile(duration, 0.5) << " max " << percentile(duration, 1.0)
+            << ", skew (us) p50 " << percentile(skew, 0.5) << " max "
+            << percentile(skew, 1.0) << ", " << 20 - duration.size()
+            << " failed";
+
+        logMessage(gmsg.str(), "[SCALE]: ");
+    }
+
+    VISAIOPool::releaseShared();
+}
+/*----------------------------------------------------------------------------*/
+/**
+* One run of the telemetry store test (see store()), with <noise> counts of
+* noise on every measurement that is not 0
+*/
+void storeRun(const std::string& name, std::size_t samples,
+    std::size_t blockSize, int noise)
+{
+    typedef std::chrono::steady_clock Clock;
+
+    // CH1 V, CH1 I, CH2 V, ... as the adapter records them: CH1 and CH2 on,
+    // CH3 off, at the replies' resolution of 1 mV / 0.1 mA
+    const std::size_t nCol = 6;
+    const long level[nCol] = {5000, 2500, 12000, 5000, 0, 0};
+    const double scale[nCol] = {1e3, 1e4, 1e3, 1e4, 1e3, 1e4};
+
+    // generated up front, so that only append() is timed
+    std::vector<VISATelemetryStore::Time> times(samples);
+    std::vector<double> values(samples * nCol);
+
+    unsigned rng = 12345;
+    VISATelemetryStore::Time now = 0;
+
+    for (std::size_t k = 0; k < samples; ++k)
+    {
+        // the 50 ms burst interval, give or take 2 ms of scheduling
+        rng = rng * 1664525u + 1013904223u;
+        now += 50000 + static_cast<long>((rng >> 8) % 4001) - 2000;
+        times[k] = now;
+
+        for (std::size_t c = 0; c < nCol; ++c)
+        {
+            long counts = level[c];
+
+            if (noise > 0 && counts != 0)
+            {
+                rng = rng * 1664525u + 1013904223u;
+                counts += static_cast<long>((rng >> 8) % (2 * noise + 1)) - noise;
+            }
+
+            // as strtod() parses the reply
+            values[k * nCol + c] = counts / scale[c];
+        }
+    }
+
+    VISATelemetryStore store(nCol, blockSize);
+
+    Clock::time_point t0 = Clock::now();
+    for (std::size_t k = 0; k < samples; ++k)
+    {
+        store.append(times[k], &values[k * nCol]);
+    }
+    double encode = elapsedUs(t0, Clock::now()) / 1e6;
+
+    std::vector<VISATelemetryStore::Sample> decoded;
+    decoded.reserve(samples);
+
+    std::size_t mismatched = 0;
+    double decode = 0.0;
+
+    for (std::size_t c = 0; c < nCol; ++c)
+    {
+        decoded.clear();
+
+        t0 = Clock::now();
+        store.query(c, times.front(), times.back(), decoded);
+        decode += elapsedUs(t0, Clock::now()) / 1e6;
+
+        for (std::size_t k = 0; k < samples; ++k)
+        {
+            if (k >= decoded.size() || decoded[k].t != times[k] ||
+                decoded[k].value != values[k * nCol + c])
+            {
+                ++mismatched;
+            }
+        }
+    }
+
+    double raw = static_cast<double>(store.rawBytes());
+    double compressed = static_cast<double>(store.compressedBytes());
+
+    std::ostringstream msg;
+    msg.setf(std::ios::fixed);
+    msg.precision(2);
+    msg << name << ": " << samples << " samples, encode "
+        << samples / encode / 1e6 << " M samples/s (" << raw / encode / 1e6
+        << " MB/s raw), " << raw / 1e6 << " MB raw -> " << compressed / 1e6
+        << " MB (ratio " << raw / compressed << ", "
+        << compressed * 8.0 / samples / nCol << " bits/value), decode "
+        << samples * nCol / decode / 1e6 << " M values/s, " << mismatched
+        << " mismatched";
+
+    logMessage(msg.str(), "[STORE]: ");
+}
+/*----------------------------------------------------------------------------*/
+/**
+* Telemetry store test: encodes <samples> synthetic polls (the adapter's 6
+* columns, every ~50 ms) into a VISATelemetryStore with <blockSize> samples
+* per block, then decodes every column and checks it against the input.
+* Reports the encode rate, the compression ratio and the decode rate, once
+* for steady readings and once with +/- 2 counts of noise (1 count is 1 mV /
+* 0.1 mA).
+*/
+void store(std::size_t samples, std::size_t blockSize)
+{
+    storeRun("steady", samples, blockSize, 0);
+    storeRun("noisy", samples, blockSize, 2);
+}
+/*----------------------------------------------------------------------------*/
+// mean and population variance of <v> with one accumulator per sum, the
+// straightforward loop the ripple test compares against
+void scalarStats(const double* v, std::size_t n, double& mean,
+    double& variance)
+{
+    double sum = 0.0;
+    for (std::size_t k = 0; k < n; ++k)
+    {
+        sum += v[k];
+    }
+
+    mean = sum / n;
+
+    double sq = 0.0;
+    for (std::size_t k = 0; k < n; ++k)
+    {
+        sq += (v[k] - mean) * (v[k] - mean);
+    }
+
+    variance = sq / n;
+}
+/*----------------------------------------------------------------------------*/
+/**
+* Ripple statistics test: for a window of 256 (the default), 4096 and 65536
+* (the largest allowed) polls of the adapter's 6 columns, runs stats() over
+* every column for ~<seconds> and reports the samples per second it
+* processes. For comparison, the same for a one-accumulator mean / variance
+* loop (which computes less: no min / max or drift), and the largest
+* relative difference between the two.
+*/
+void ripple(double seconds)
+{
+    typedef std::chrono::steady_clock Clock;
+
+    const std::size_t nCol = 6;
+    const std::size_t capacities[] = {256, 4096, 65536};
+
+    for (std::size_t s = 0; s < sizeof(capacities) / sizeof(capacities[0]); ++s)
+    {
+        const std::size_t n = capacities[s];
+
+        VISATelemetryWindow window(nCol, n);
+        std::vector<double> columns(nCol * n);
+
+        unsigned rng = 12345;
+        double record[nCol];
+
+        for (std::size_t k = 0; k < n; ++k)
+        {
+            for (std::size_t c = 0; c < nCol; ++c)
+            {
+                rng = rng * 1664525u + 1013904223u;
+                record[c] = 5.0 + ((rng >> 8) % 5) / 1000.0 + 1e-6 * k;
+                columns[c * n + k] = record[c];
+            }
+
+            window.append(static_cast<VISATelemetryWindow::Time>(k) * 50000,
+                record);
+        }
+
+        VISATelemetryWindow::Stats stats;
+        double error = 0.0;
+        volatile double sink = 0.0;    // keeps the results alive
+
+        unsigned long long passes = 0;
+        Clock::time_point t0 = Clock::now();
+        double elapsed = 0.0;
+
+        while (elapsed < seconds * 1e6)
+        {
+            for (std::size_t c = 0; c < nCol; ++c)
+            {
+                window.stats(c, stats);
+                sink += stats.variance;
+            }
+
+            ++passes;
+            elapsed = elapsedUs(t0, Clock::now());
+        }
+
+        double rate = passes * nCol * n / (elapsed / 1e6);
+
+        unsigned long long scalarPasses = 0;
+        t0 = Clock::now();
+        elapsed = 0.0;
+
+        while (elapsed < seconds * 1e6)
+        {
+            for (std::size_t c = 0; c < nCol; ++c)
+            {
+                double mean, variance;
+                scalarStats(&columns[c * n], n, mean, variance);
+                sink += variance;
+
+                if (scalarPasses == 0)
+                {
+                    window.stats(c, stats);
+                    error = std::max(error, fabs(stats.mean - mean) / mean);
+                    error = std::max(error,
+                        fabs(stats.variance - variance) / variance);
+                }
+            }
+
+            ++scalarPasses;
+            elapsed = elapsedUs(t0, Clock::now());
+        }
+
+        double scalarRate = scalarPasses * nCol * n / (elapsed / 1e6);
+
+        std::ostringstream msg;
+        msg.setf(std::ios::fixed);
+        msg.precision(0);
+        msg << n << " samples: stats() " << rate / 1e6
+            << " M samples/s, one accumulator mean / variance "
+            << scalarRate / 1e6 << " M samples/s, largest relative difference ";
+        msg.setf(std::ios::scientific, std::ios::floatfield);
+        msg.precision(1);
+        msg << error;
+
+        logMessage(msg.str(), "[RIPPLE]: ");
+    }
+}
+/*----------------------------------------------------------------------------*/
+/**
+* The command queue VISADispatcher replaced, as a baseline for the queue
+* test: heap allocated requests in a mutex guarded deque, run by one thread,
+* callers wait on a condition variable
+*/
+class MutexQueue
+{
+public:
+    MutexQueue(VISADevice& dev) : dev_(dev), running_(true),
+        thread_(&MutexQueue::run, this) {}
+
+    ~MutexQueue()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            running_ = false;
+        }
+
+        pending_.notify_all();
+        thread_.join();
+    }
+
+    bool write(const std::string& msg)
+    {
+        Request* req = new Request(msg);
+
+        std::unique_lock<std::mutex> lock(mutex_);
+
+        queue_.push_back(req);
+        pending_.notify_one();
+
+        while (!req->done)
+        {
+            done_.wait(lock);
+        }
+
+        bool success = req->success;
+        delete req;
+
+        return success;
+    }
+
+private:
+    struct Request
+    {
+        Request(const std::string& msg) : command(msg), success(false),
+            done(false) {}
+
+        std::string command;
+        bool success;
+        bool done;
+    };
+
+    void run()
+    {
+        std::unique_lock<std::mutex> lock(mutex_);
+
+        while (running_)
+        {
+            if (queue_.empty())
+            {
+                pending_.wait(lock);
+                continue;
+            }
+
+            Request* req = queue_.front();
+            queue_.pop_front();
+
+            lock.unlock();
+            bool success = dev_.write(req->command);
+            lock.lock();
+
+            req->success = success;
+            req->done = true;
+            done_.notify_all();
+        }
+    }
+
+    VISADevice& dev_;
+
+    std::mutex mutex_;
+    std::condition_variable pending_;
+    std::condition_variable done_;
+    std::deque<Request*> queue_;
+    bool running_;
+
+    std::thread thread_;
+};
+/*----------------------------------------------------------------------------*/
+/**
+* One run of the queue test (see queue()): <producers> threads each make
+* <ops> calls of <call>
+*/
+template <typename Call>
+void queueRun(const std::string& name, std::size_t producers,
+    unsigned long ops, Call call)
+{
+    typedef std::chrono::steady_clock Clock;
+
+    std::vector<std::vector<double> > latency(producers);
+    for (std::size_t k = 0; k < producers; ++k)
+    {
+        latency[k].reserve(ops);
+    }
+
+    std::vector<std::thread> threads;
+    std::atomic<bool> go(false);
+
+    unsigned long long allocs = g_allocations.load();
+    Clock::time_point start = Clock::now();
+
+    for (std::size_t k = 0; k < producers; ++k)
+    {
+        std::vector<double>* lat = &latency[k];
+
+        threads.push_back(std::thread([lat, ops, &go, &call]() {
+            while (!go)
+            {
+                std::this_thread::yield();
+            }
+
+            for (unsigned long j = 0; j < ops; ++j)
+            {
+                Clock::time_point t0 = Clock::now();
+                call();
+                lat->push_back(elapsedUs(t0, Clock::now()));
+            }
+        }));
+    }
+
+    // the thread objects themselves allocate, don't count them
+    allocs = g_allocations.load() - allocs;
+    unsigned long long before = g_allocations.load();
+    start = Clock::now();
+    go = true;
+
+    for (std::size_t k = 0; k < threads.size(); ++k)
+    {
+        threads[k].join();
+    }
+
+    double wall = elapsedUs(start, Clock::now()) / 1e6;
+    double perOp = static_cast<double>(g_allocations.load() - before) /
+        (producers * ops);
+
+    std::vector<double> all;
+    for (std::size_t k = 0; k < producers; ++k)
+    {
+        all.insert(all.end(), latency[k].begin(), latency[k].end());
+    }
+
+    std::ostringstream msg;
+    msg.setf(std::ios::fixed);
+    msg.precision(1);
+    msg << name << ", " << producers << " producers: " << producers * ops / wall
+        << " cmds/s, latency (us) p50 " << percentile(all, 0.5) << " p99 "
+        << percentile(all, 0.99) << " max " << percentile(all, 1.0) << ", "
+        << perOp << " allocs/cmd";
+
+    logMessage(msg.str(), "[QUEUE]: ");
+}
+/*----------------------------------------------------------------------------*/
+/**
+* Queue test: 1, 2, 4, ... <max> producer threads each make <ops> writes
+* through a VISADispatcher on a one-worker VISAIOPool, then through
+* MutexQueue (above). The device is not open, so a write fails at once and
+* the queues are all that is measured. Reports commands/s, the latency of a
+* call (queueing, handing over and waking the caller) and heap allocations
+* per command.
+*/
+void queue(std::size_t max, unsigned long ops)
+{
+    VISADevice dev;
+    const std::string cmd("SOUR:VOLT 1.000");
+
+    for (std::size_t n = 1; n <= max; n *= 2)
+    {
+        {
+            VISAIOPool pool(1);
+            VISADispatcher dispatcher(dev);
+            dispatcher.attach(pool);
+
+            queueRun("lock-free", n, ops, [&dispatcher, &cmd]() {
+                dispatcher.write(cmd);
+            });
+        }
+
+        {
+            MutexQueue mutexQueue(dev);
+
+            queueRun("mutex", n, ops, [&mutexQueue, &cmd]() {
+                mutexQueue.write(cmd);
+            });
+        }
+    }
+}
+/*----------------------------------------------------------------------------*/
+/**
+* One run of the flow control test (see flow()), <window> 0 runs with flow
+* control off
+*/
+void flowRun(VISADevice& dev, const std::string& name, std::size_t window,
+    std::size_t commands)
+{
+    typedef std::chrono::steady_clock Clock;
+
+    dev.setFlowControl(window);
+
+    // start from a clear *ESR? and empty flow control counts
+    long bits = 0;
+    dev.readSyncRegister(bits);
+    dev.resetFlowStats();
+
+    // INST:SEL only picks the channel later commands address, and unlike
+    // *CLS it does not clear the error bits we look for
+    const std::string cmd = "INST:SEL CH1";
+
+    std::size_t failed = 0;
+    Clock::time_point t0 = Clock::now();
+
+    for (std::size_t k = 0; k < commands; ++k)
+    {
+        if (!dev.write(cmd))
+        {
+            ++failed;
+        }
+    }
+
+    // the supply has parsed everything once *ESR? is answered, the query
+    // itself may be lost to a full input buffer so try a few times
+    bits = 0;
+    bool synced = false;
+    for (int k = 0; k < 10 && !synced; ++k)
+    {
+        long more = 0;
+        synced = dev.readSyncRegister(more);
+        bits |= more;
+    }
+
+    double elapsed = elapsedUs(t0, Clock::now());
+
+    VISADevice::FlowStats stats = dev.getFlowStats();
+    dev.setFlowControl(0);
+
+    std::ostringstream msg;
+    msg.setf(std::ios::fixed);
+    msg.precision(1);
+    msg << name << ": " << commands * 1e6 / elapsed << " cmds/s, "
+        << failed << " failed writes, input lost: "
+        << ((bits & 0x24) != 0 ? "yes" : "no");
+
+    if (!synced)
+    {
+        msg << " (no reply to *ESR?)";
+    }
+
+    if (window > 0)
+    {
+        msg << ", " << stats.syncs << " syncs, " << stats.overruns
+            << " overruns, final window " << stats.window
+            << ", sustained rate " << stats.rate << " cmds/s";
+    }
+
+    logMessage(msg.str(), "[FLOW]: ");
+}
+/*----------------------------------------------------------------------------*/
+/**
+* Flow control test: streams <commands> writes to the supply back to back,
+* first with flow control off, then with a window of at most 8, 16, ...
+* <max> commands. Reports the rate the supply actually parsed them at,
+* whether any input was lost (*ESR? command / query error) and, with flow
+* control on, the syncs, overruns, final window and sustained rate.
+*/
+void flow(VISADevice& dev, std::size_t commands, std::size_t max)
+{
+    flowRun(dev, "off", 0, commands);
+
+    for (std::size_t window = 8; window <= max; window *= 2)
+    {
+        std::ostringstream name;
+        name << "window " << window;
+
+        flowRun(dev, name.str(), window, commands);
+    }
+}
+/*----------------------------------------------------------------------------*/
+/**
+* One run of the fault test (see faults()) under <profile>
+*/
+void faultsRun(VISADevice& dev, VISAFaultInjector& injector,
+    const std::string& profile, double seconds, long period)
+{
+    typedef std::chrono::steady_clock Clock;
+
+    VISAFaultProfile spec;
+    std::string error;
+    VISAFaultProfile::parse(profile, spec, error);
+
+    injector.setProfile(spec);
+    injector.resetStats();
+
+    const std::size_t nPoll = sizeof(g_pollQueries) / sizeof(g_pollQueries[0]);
+    const std::vector<std::string> polls(g_pollQueries, g_pollQueries + nPoll);
+    std::vector<std::string> replies;
+
+    std::vector<double> us;
+    unsigned long cycles = 0, corrupt = 0;
+
+    Clock::time_point start = Clock::now();
+    Clock::time_point next = start;
+
+    while (elapsedUs(start, Clock::now()) < seconds * 1e6)
+    {
+        // paced like the watcher, a cycle that overran starts the next at once
+        std::this_thread::sleep_until(next);
+
+        Clock::time_point t0 = Clock::now();
+        next = std::max(next + std::chrono::milliseconds(period), t0);
+
+        dev.write(cycles % 2 == 0 ? "VOLT 1.5" : "VOLT 1.0");
+        dev.queryBatch(polls, replies);
+
+        us.push_back(elapsedUs(t0, Clock::now()));
+        ++cycles;
+
+        // every reply but INST:SEL? lists the 3 channels
+        for (std::size_t k = 0; k < nPoll; ++k)
+        {
+            if (replies[k].empty())
+            {
+                continue;
+            }
+
+            std::size_t commas = std::count(replies[k].begin(), replies[k].end(), ',');
+            if (commas != (k + 1 < nPoll ? 2u : 0u))
+            {
+                ++corrupt;
+            }
+        }
+    }
+
+    VISAFaultInjector::Stats stats = injector.getStats();
+
+    std::ostringstream msg;
+    msg.setf(std::ios::fixed);
+    msg.precision(1);
+    msg << profile << ": " << cycles << " cycles, " << stats.operations
+        << " operations, " << stats.injected << " faults, " << stats.failed
+        << " failed, " << stats.lostCommands << " lost commands, " << corrupt
+        << " corrupt replies, recovery (ms) mean " << stats.meanRecovery
+        << " max " << stats.maxRecovery << " over " << stats.recoveries
+        << ", cycle latency (ms) p50 " << percentile(us, 0.5) / 1000.0
+        << " p99 " << percentile(us, 0.99) / 1000.0 << " p99.9 "
+        << percentile(us, 0.999) / 1000.0 << " max "
+        << percentile(us, 1.0) / 1000.0;
+
+    logMessage(msg.str(), "[FAULTS]: ");
+}
+/*----------------------------------------------------------------------------*/
+/**
+* Fault test: for every preset of VISAFaultProfile, writes a setpoint and
+* reads the state watcher's poll batch every <period> ms for <seconds>, with
+* the faults injected at the VISA call boundary (see VISAFaults.h) and every
+* operation's deadline <timeout> ms. Reports the lost commands (failed
+* writes), the replies that came back mangled, the recovery time (from a
+* failure to the next success) and the latency of a write + poll cycle.
+*/
+void faults(VISADevice& dev, double seconds, long timeout, long period)
+{
+    VISAFaultInjector injector;
+    injector.setClock(&dev.getClock());
+
+    dev.setTimeout(static_cast<ViUInt32>(timeout));
+    dev.setIOHook(&injector);
+
+    std::vector<std::string> presets = VISAFaultProfile::presets();
+    for (std::size_t k = 0; k < presets.size(); ++k)
+    {
+        faultsRun(dev, injector, presets[k], seconds, period);
+    }
+
+    dev.setIOHook(0);
+}
+/*----------------------------------------------------------------------------*/
+// the state watcher's loop without the adapter: reads the poll batch every
+// <interval> ms on the worker's clock and keeps the time of each poll
+class ClockPoller : public VISAWorker
+{
+public:
+    ClockPoller(VISADevice& dev, long interval) :
+        dev_(dev),
+        interval_(interval),
+        queries_(g_pollQueries, g_pollQueries +
+            sizeof(g_pollQueries) / sizeof(g_pollQueries[0]))
+    {}
+
+    ~ClockPoller()
+    {
+        stop();
+    }
+
+    std::vector<double> times() const
+    {
+        std::lock_guard<std::mutex> lock(timesMutex_);
+        return times_;
+    }
+
+protected:
+    void run()
+    {
+        while (waitFor(static_cast<ViUInt32>(interval_)))
+        {
+            dev_.queryBatch(queries_, replies_);
+
+            std::lock_guard<std::mutex> lock(timesMutex_);
+            times_.push_back(clock().now());
+        }
+    }
+
+private:
+    VISADevice& dev_;
+    long interval_;
+    std::vector<std::string> queries_;
+    std::vector<std::string> replies_;
+
+    mutable std::mutex timesMutex_;
+    std::vector<double> times_;
+};
+/*----------------------------------------------------------------------------*/
+/**
+* Virtual clock test: runs <seconds> of scheduler entries <period> ms apart
+* plus a poll batch every <interval> ms, with the device, the scheduler and
+* the poller all on one VISAVirtualClock, and compares the virtual time that
+* passed with the real time it took. The scheduler moves the clock, the
+* poller follows it, as the state watcher does in the adapter.
+*/
+void virtualTime(VISADevice& dev, double seconds, double period, long interval)
+{
+    typedef std::chrono::steady_clock Clock;
+
+    VISAVirtualClock virtualClock;
+    dev.setClock(&virtualClock);
+
+    // without flow control query() sleeps the whole timeout, which on the
+    // virtual clock would be skipped time the polls didn't wait for
+    dev.setFlowControl(16);
+
+    VISAScheduler sched(dev);
+    sched.setClock(&virtualClock);
+
+    ClockPoller poller(dev, interval);
+    poller.setClock(&virtualClock);
+
+    // *CLS changes nothing that matters to a supply's outputs
+    const std::vector<std::string> cmd(1, "*CLS");
+
+    std::size_t entries = static_cast<std::size_t>(seconds * 1000.0 / period);
+
+    // the experiment clock starts here, the entries are relative to it
+    Clock::time_point t0 = Clock::now();
+    double v0 = virtualClock.now();
+    double skipped0 = virtualClock.skipped();
+
+    sched.resetClock();
+    for (std::size_t k = 1; k <= entries; ++k)
+    {
+        sched.schedule(k * period, cmd);
+    }
+
+    sched.start();
+    poller.start();
+
+    while (sched.getStats().count < entries)
+    {
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+
+    poller.stop();
+    sched.stop();
+
+    double real = elapsedUs(t0, Clock::now()) / 1e6;
+    double virt = (virtualClock.now() - v0) / 1e6;
+    double skipped = (virtualClock.skipped() - skipped0) / 1e6;
+
+    dev.setFlowControl(0);
+    dev.setClock(0);
+
+    VISAScheduler::Stats stats = sched.getStats();
+    std::vector<double> times = poller.times();
+
+    // poll spacing on the virtual clock, should be the interval plus the
+    // (real) time a poll takes
+    std::vector<double> spacing;
+    for (std::size_t k = 1; k < times.size(); ++k)
+    {
+        spacing.push_back((times[k] - times[k - 1]) / 1000.0);
+    }
+
+    double expected = virt * 1000.0 / interval;
+
+    std::ostringstream msg;
+    msg.setf(std::ios::fixed);
+    msg.precision(2);
+    msg << seconds << " s of entries every " << period << " ms, polls every "
+        << interval << " ms: " << virt << " s virtual in " << real
+        << " s real (" << (real > 0.0 ? virt / real : 0.0) << "x, "
+        << skipped << " s skipped)";
+
+    logMessage(msg.str(), "[CLOCK]: ");
+
+    msg.str("");
+    msg << "scheduler: " << stats.count << " entries, " << stats.failed
+        << " failed, error (us) mean " << stats.meanError << " max "
+        << stats.maxAbsError << "; poller: " << times.size() << " polls of "
+        << expected << " expected, spacing (ms) p50 " << percentile(spacing, 0.5)
+        << " p99 " << percentile(spacing, 0.99) << " max "
+        << percentile(spacing, 1.0);
+
+    logMessage(msg.str(), "[CLOCK]: ");
+
+    // the virtual time must cover the whole schedule and be exactly the
+    // real time plus what was skipped
+    bool covered = virt * 1000.0 >= entries * period;
+    bool consistent = fabs(virt - real - skipped) < 0.001;
+
+    if (!covered || !consistent)
+    {
+        msg.str("");
+        msg << "virtual time " << virt << " s does not match: schedule "
+            << entries * period / 1000.0 << " s, real + skipped "
+            << real + skipped << " s";
+
+        logMessage(msg.str(), "[WARN]: ");
+    }
+}
+#ifdef BK9130B_MOCK_CORE
+/*----------------------------------------------------------------------------*/
+/**
+* The core side of the mock device API (see mock/MMDevice.h): counts log
+* messages and property change notifications, and keeps the time
+*/
+class MockCore : public MM::Core
+{
+public:
+    MockCore() : t0_(std::chrono::steady_clock::now()), logs_(0), changes_(0) {}
+
+    int LogMessage(const MM::Device*, const char*, bool)
+    {
+        ++logs_;
+        return DEVICE_OK;
+    }
+
+    int OnPropertyChanged(const MM::Device*, const char*, const char*)
+    {
+        ++changes_;
+        return DEVICE_OK;
+    }
+
+    MM::MMTime GetCurrentMMTime()
+    {
+        return MM::MMTime(elapsedUs(t0_, std::chrono::steady_clock::now()));
+    }
+
+    unsigned long long logs() const { return logs_.load(); }
+    unsigned long long changes() const { return changes_.load(); }
+
+private:
+    std::chrono::steady_clock::time_point t0_;
+    std::atomic<unsigned long long> logs_;
+    std::atomic<unsigned long long> changes_;
+};
+/*----------------------------------------------------------------------------*/
+/**
+* Times <ops> calls of <call>(k) on this thread, each after an untimed
+* <setup>(k), and reports their latency and the heap allocations they made
+* (on this thread only, the adapter's own threads keep running meanwhile)
+*/
+template <typename Setup, typename Call>
+void propertyRun(const std::string& name, unsigned long ops, Setup setup,
+    Call call)
+{
+    typedef std::chrono::steady_clock Clock;
+
+    std::vector<double> us;
+    us.reserve(ops);
+
+    unsigned long failed = 0;
+    int error = DEVICE_OK;
+    unsigned long long allocs = 0;
+
+    for (unsigned long k = 0; k < ops; ++k)
+    {
+        setup(k);
+
+        unsigned long long a0 = t_allocations;
+        Clock::time_point t0 = Clock::now();
+
+        int ret = call(k);
+
+        allocs += t_allocations - a0;
+        if (ret != DEVICE_OK)
+        {
+            error = failed++ == 0 ? ret : error;
+        }
+
+        us.push_back(elapsedUs(t0, Clock::now()));
+    }
+
+    double perCall = static_cast<double>(allocs) / ops;
+
+    std::ostringstream msg;
+    msg.setf(std::ios::fixed);
+    msg.precision(1);
+    msg << name << ": " << ops << " calls, " << failed << " failed";
+
+    if (failed > 0)
+    {
+        msg << " (first error " << error << ")";
+    }
+
+    msg << ", latency (us) p50 "
+        << percentile(us, 0.5) << " p99 " << percentile(us, 0.99) << " max "
+        << percentile(us, 1.0) << ", " << perCall << " allocs/call";
+
+    logMessage(msg.str(), "[PROPERTY]: ");
+}
+
+template <typename Call>
+void propertyRun(const std::string& name, unsigned long ops, Call call)
+{
+    propertyRun(name, ops, [](unsigned long) {}, call);
+}
+/*----------------------------------------------------------------------------*/
+/**
+* Property path test: hosts the adapter (CreateDevice("BK9130B")) on the mock
+* device API and times what the core would call: Initialize() (the first
+* time, which creates the properties, then <cycles> times after a
+* Shutdown()), Shutdown(),
+* <ops> sets and gets of the output voltage, the active channel and the
+* state, and SetOpen(). Everything runs through the real adapter code down
+* to the (simulated) supply, with the watcher polling in the background.
+* Without flow control query() sleeps the whole timeout before reading, so
+* Initialize() runs with a <timeout> ms timeout and the rest with a flow
+* control window of <window> commands (0 keeps the query delay).
+*/
+void property(unsigned long ops, unsigned long cycles, long timeout,
+    long window)
+{
+    MockCore core;
+
+    InitializeModuleData();
+    MM::Device* dev = CreateDevice("BK9130B");
+    MM::Shutter* shutter = static_cast<MM::Shutter*>(dev);
+
+    dev->SetCallback(&core);
+
+    char id[MM::MaxStrLength];
+    dev->GetProperty("Device ID", id);
+    logMessage(id, "[IFO]: Hosting BK9130B on ");
+
+    std::ostringstream value;
+    value << timeout;
+    dev->SetProperty("Timeout (ms)", value.str().c_str());
+
+    propertyRun("Initialize, first", 1, [dev](unsigned long) {
+        return dev->Initialize();
+    });
+
+    propertyRun("Shutdown", cycles, [dev](unsigned long k) {
+        if (k > 0)
+        {
+            dev->Initialize();
+        }
+    }, [dev](unsigned long) {
+        return dev->Shutdown();
+    });
+
+    propertyRun("Initialize, again", cycles, [dev](unsigned long k) {
+        if (k > 0)
+        {
+            dev->Shutdown();
+        }
+    }, [dev](unsigned long) {
+        return dev->Initialize();
+    });
+
+    value.str("");
+    value << window;
+    dev->SetProperty("Flow control window (commands)", value.str().c_str());
+
+    char buf[MM::MaxStrLength];
+
+    propertyRun("SetProperty output voltage", ops, [dev](unsigned long k) {
+        return dev->SetProperty("Output voltage (V)", k % 2 == 0 ? "1.5000" : "1.0000");
+    });
+
+    propertyRun("GetProperty output voltage", ops, [dev, &buf](unsigned long) {
+        return dev->GetProperty("Output voltage (V)", buf);
+    });
+
+    propertyRun("SetProperty active channel", ops, [dev](unsigned long k) {
+        return dev->SetProperty("Active Channel", k % 2 == 0 ? "CH2" : "CH1");
+    });
+
+    propertyRun("GetProperty active channel", ops, [dev, &buf](unsigned long) {
+        return dev->GetProperty("Active Channel", buf);
+    });
+
+    propertyRun("SetOpen", ops, [shutter](unsigned long k) {
+        return shutter->SetOpen(k % 2 == 0);
+    });
+
+    propertyRun("GetProperty state", ops, [dev, &buf](unsigned long) {
+        return dev->GetProperty("State", buf);
+    });
+
+    shutter->SetOpen(false);
+    dev->Shutdown();
+    DeleteDevice(dev);
+
+    std::ostringstream msg;
+    msg << core.logs() << " log messages, " << core.changes()
+        << " property change notifications";
+
+    logMessage(msg.str(), "[PROPERTY]: ");
+}
+/*----------------------------------------------------------------------------*/
+/**
+* As virtualTime(), but through the adapter with its **Clock** set to
+* Virtual: <seconds> of **Schedule** entries <period> ms apart drive the
+* clock while the state watcher polls every <interval> ms (and bursts after
+* each entry). Reports the real time it took, the polls the watcher made
+* and the schedule's timing error.
+*/
+void virtualTimeAdapter(double seconds, double period, long interval)
+{
+    typedef std::chrono::steady_clock Clock;
+
+    MockCore core;
+
+    InitializeModuleData();
+    MM::Device* dev = CreateDevice("BK9130B");
+
+    dev->SetCallback(&core);
+    dev->SetProperty("Clock", "Virtual");
+    dev->SetProperty("Timeout (ms)", "50");
+
+    int ret = dev->Initialize();
+    if (ret != DEVICE_OK)
+    {
+        std::ostringstream msg;
+        msg << "Initialize() failed: " << ret;
+        logMessage(msg.str(), "[ERR]: ");
+
+        DeleteDevice(dev);
+        return;
+    }
+
+    std::ostringstream value;
+    value << interval;
+
+    dev->SetProperty("Flow control window (commands)", "16");
+    dev->SetProperty("State poll interval (ms)", value.str().c_str());
+
+    std::size_t entries = static_cast<std::size_t>(seconds * 1000.0 / period);
+
+    std::ostringstream schedule;
+    for (std::size_t k = 1; k <= entries; ++k)
+    {
+        schedule << (k > 1 ? "|" : "") << k * period << " *CLS";
+    }
+
+    char buf[MM::MaxStrLength];
+    dev->GetProperty("State polls", buf);
+    long polls0 = std::atol(buf);
+
+    ret = dev->SetProperty("Schedule", schedule.str().c_str());
+    if (ret == DEVICE_OK)
+    {
+        ret = dev->SetProperty("Schedule state", "Running");
+    }
+
+    Clock::time_point t0 = Clock::now();
+
+    while (ret == DEVICE_OK)
+    {
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+
+        dev->GetProperty("Schedule pending", buf);
+        if (std::atof(buf) == 0.0)
+        {
+            break;
+        }
+    }
+
+    double real = elapsedUs(t0, Clock::now()) / 1e6;
+
+    std::ostringstream msg;
+    msg.setf(std::ios::fixed);
+    msg.precision(2);
+
+    if (ret != DEVICE_OK)
+    {
+        msg << "schedule failed: " << ret;
+        logMessage(msg.str(), "[ERR]: ");
+    }
+    else
+    {
+        dev->GetProperty("State polls", buf);
+        long polls = std::atol(buf) - polls0;
+
+        msg << "adapter: " << entries * period / 1000.0 << " s virtual in "
+            << real << " s real (" << (real > 0.0 ? entries * period / 1000.0 / real : 0.0)
+            << "x), " << polls << " polls";
+
+        dev->GetProperty("State polls saved (%)", buf);
+        msg << " (" << buf << " % saved)";
+
+        dev->GetProperty("Schedule mean timing error (us)", buf);
+        msg << ", schedule error (us) mean " << buf;
+
+        dev->GetProperty("Schedule max timing error (us)", buf);
+        msg << " max " << buf;
+
+        logMessage(msg.str(), "[CLOCK]: ");
+    }
+
+    dev->SetProperty("Schedule state", "Stopped");
+    dev->Shutdown();
+    DeleteDevice(dev);
+}
+#endif
+/*----------------------------------------------------------------------------*/
+void benchUsage()
+{
+    const std::string  msg =
+    "\n------------------------------------------------------\n"
+    "usage: test_console bench <mode> [<args>]\n\t"
+    "jitter [<entries>] [<period ms>] [<cpu>] [<priority>] - scheduling jitter under CPU load\n\t"
+    "scale [<max devices>] [<s per step>] [<poll ms>] - many-instrument scale test\n\t"
+    "store [<samples>] [<block size>] - telemetry store encode / decode rate and compression\n\t"
+    "ripple [<s per size>] - ripple / noise statistics rate\n\t"
+    "queue [<max producers>] [<ops per producer>] - lock-free vs mutex command queue\n\t"
+    "flow [<commands>] [<max window>] - sustained command rate with and without flow control\n\t"
+    "faults [<s per profile>] [<timeout ms>] [<period ms>] - recovery, lost commands and latency per fault profile\n\t"
+    "clock [<virtual s>] [<entry period ms>] [<poll ms>] - scheduler and polling on a virtual clock\n"
+#ifdef BK9130B_MOCK_CORE
+    "\tproperty [<ops>] [<cycles>] [<timeout ms>] [<window>] - adapter property path latency and allocations\n"
+#endif
+    "------------------------------------------------------\n";
+
+    logMessage(msg, "");
+}
+/*----------------------------------------------------------------------------*/
+// test_console bench <mode> [<args>], returns the exit code
+int bench(const std::vector<std::string>& args)
+{
+    if (args.size() < 2 || args[0] != "bench")
+    {
+        benchUsage();
+        return -1;
+    }
+
+    const std::string& mode = args[1];
+
+    if (mode == "jitter")
+    {
+        std::size_t entries = args.size() > 2 ? std::strtoul(args[2].c_str(), NULL, 10) : 500;
+        double period = args.size() > 3 ? std::atof(args[3].c_str()) : 10.0;
+        int cpu = args.size() > 4 ? std::atoi(args[4].c_str()) : 0;
+        int priority = args.size() > 5 ? std::atoi(args[5].c_str()) : 80;
+
+        VISADevice dev;
+
+        int ret = openFirst(dev);
+        if (ret != 0)
+        {
+            return ret;
+        }
+
+        jitter(dev, entries > 0 ? entries : 500, period > 0.0 ? period : 10.0,
+            cpu, priority);
+    }
+    else if (mode == "scale")
+    {
+        std::size_t max = args.size() > 2 ? std::strtoul(args[2].c_str(), NULL, 10) : 32;
+        double seconds = args.size() > 3 ? std::atof(args[3].c_str()) : 2.0;
+        long interval = args.size() > 4 ? std::atol(args[4].c_str()) : 50;
+
+        scale(max, seconds > 0.0 ? seconds : 2.0, interval > 0 ? interval : 50);
+    }
+    else if (mode == "store")
+    {
+        std::size_t samples = args.size() > 2 ? std::strtoul(args[2].c_str(), NULL, 10) : 1000000;
+        std::size_t blockSize = args.size() > 3 ? std::strtoul(args[3].c_str(), NULL, 10) : 1024;
+
+        store(samples > 0 ? samples : 1000000, blockSize);
+    }
+    else if (mode == "ripple")
+    {
+        double seconds = args.size() > 2 ? std::atof(args[2].c_str()) : 1.0;
+
+        ripple(seconds > 0.0 ? seconds : 1.0);
+    }
+    else if (mode == "queue")
+    {
+        std::size_t max = args.size() > 2 ? std::strtoul(args[2].c_str(), NULL, 10) : 16;
+        unsigned long ops = args.size() > 3 ? std::strtoul(args[3].c_str(), NULL, 10) : 20000;
+
+        queue(max > 0 ? max : 16, ops > 0 ? ops : 20000);
+    }
+    else if (mode == "flow")
+    {
+        std::size_t commands = args.size() > 2 ? std::strtoul(args[2].c_str(), NULL, 10) : 2000;
+        std::size_t max = args.size() > 3 ? std::strtoul(args[3].c_str(), NULL, 10) : 64;
+
+        VISADevice dev;
+
+        int ret = openFirst(dev);
+        if (ret != 0)
+        {
+            return ret;
+        }
+
+        flow(dev, commands > 0 ? commands : 2000, max);
+    }
+    else if (mode == "faults")
+    {
+        double seconds = args.size() > 2 ? std::atof(args[2].c_str()) : 10.0;
+        long timeout = args.size() > 3 ? std::atol(args[3].c_str()) : 100;
+        long period = args.size() > 4 ? std::atol(args[4].c_str()) : 20;
+
+        VISADevice dev;
+
+        int ret = openFirst(dev);
+        if (ret != 0)
+        {
+            return ret;
+        }
+
+        faults(dev, seconds > 0.0 ? seconds : 10.0, timeout > 0 ? timeout : 100,
+            period > 0 ? period : 20);
+    }
+    else if (mode == "clock")
+    {
+        double seconds = args.size() > 2 ? std::atof(args[2].c_str()) : 3600.0;
+        double period = args.size() > 3 ? std::atof(args[3].c_str()) : 1000.0;
+        long interval = args.size() > 4 ? std::atol(args[4].c_str()) : 1000;
+
+        seconds = seconds > 0.0 ? seconds : 3600.0;
+        period = period > 0.0 ? period : 1000.0;
+        interval = interval > 0 ? interval : 1000;
+
+        {
+            VISADevice dev;
+
+            int ret = openFirst(dev);
+            if (ret != 0)
+            {
+                return ret;
+            }
+
+            virtualTime(dev, seconds, period, interval);
+        }
+#ifdef BK9130B_MOCK_CORE
+        virtualTimeAdapter(seconds, period, interval);
+#endif
+    }
+#ifdef BK9130B_MOCK_CORE
+    else if (mode == "property")
+    {
+        unsigned long ops = args.size() > 2 ? std::strtoul(args[2].c_str(), NULL, 10) : 1000;
+        unsigned long cycles = args.size() > 3 ? std::strtoul(args[3].c_str(), NULL, 10) : 5;
+        long timeout = args.size() > 4 ? std::atol(args[4].c_str()) : 50;
+        long window = args.size() > 5 ? std::atol(args[5].c_str()) : 16;
+
+        property(ops > 0 ? ops : 1000, cycles > 0 ? cycles : 5,
+            timeout > 0 ? timeout : 50, window >= 0 ? window : 16);
+    }
+#endif
+    else
+    {
+        benchUsage();
+        return -1;
+    }
+
+    return 0;
+}
+/*----------------------------------------------------------------------------*/
+int main(int argc, char* argv[])
+{
+    if (argc > 1)
+    {
+        return bench(std::vector<std::string>(argv + 1, argv + argc));
+    }
+
+    VISADevice dev;
+
+    int ret = openFirst(dev);
+    if (ret != 0)
+    {
+        return ret;
+    }
+
+    dev.onClose({
+        "INST:SEL CH1",
+        "SOUR:CHAN:OUTP:STAT OFF",
+        "INST:SEL CH2",
+        "SOUR:CHAN:OUTP:STAT OFF",
+        "INST:SEL CH3",
+        "SOUR:CHAN:OUTP:STAT OFF"
+    });
+
+    // print console usage
+    usage();
+
+    std::string msg;
+
+    while (std::cin)
+    {
+		std::cout << ">>> ";
+
+        std::getline(std::cin, msg);
+
+		if (msg == "exit")
+		{
+			break;
+		}
+		else
+		{
+            std::string omsg;
+            char cmd = parseMessage(msg, omsg);
+
+			switch (cmd)
+            {
+                case 'r':
+                case 'R':
+                    logMessage("...", "[READ]");
+                    logMessage(dev.read());
+                    break;
+                case 'w':
+                case 'W':
+                    logMessage(omsg, "[WRITE]: ");
+                    if (!dev.write(omsg))
+                    {
+                        logMessage(dev.getLastError(), "[ERROR]: ", std::cerr);
+                    }
+                    break;
+                case 'q':
+                case 'Q':
+                    logMessage(omsg, "[QUERY]: ");
+                    logMessage(dev.query(omsg));
+                    break;
+                case 's':
+                case 'S':
+                {
+                    std::istringstream in(omsg);
+                    unsigned long long ops = 0, report = 10000;
+                    in >> ops >> report;
+
+                    if (ops == 0 || report == 0)
+                    {
+                        logMessage("usage: s <ops> [<report>]", "[ERROR]: ", std::cerr);
+                        break;
+                    }
+
+                    soak(dev, ops, report);
                     break;
-                case 'q':
-                case 'Q':
-                    logMessage(omsg, "[QUERY]: ");
-                    logMessage(dev.query(omsg));
-                    break;
+                }
                 case 'h':
                 case 'H':
                     usage();